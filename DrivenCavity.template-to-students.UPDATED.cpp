@@ -7,13 +7,54 @@
 #include <cmath>
 #include <cstdlib>
 #include <cstring>
+#include <cstddef>
+#include <cstdint>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <new>
+#ifdef HAVE_ZLIB
+#include <zlib.h>       /* Compressed VTK field output: build with -DHAVE_ZLIB -lz */
+#endif
+#if defined(_GLIBCXX_HAS_GTHREADS) || !defined(__GLIBCXX__)
+#define ASYNC_OUTPUT    /* std::thread available (not on MinGW builds with the win32 thread model) */
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#endif
+#ifdef _OPENMP
+#include <omp.h>        /* Threaded kernels: build with -fopenmp */
+#endif
+#ifdef USE_MPI
+#include <mpi.h>        /* Domain decomposition: build with mpicxx -DUSE_MPI */
+#endif
+#if defined(INSTRUMENT) && defined(__linux__)
+#define HAVE_PERF_EVENT /* Hardware counters for the instrumentation (-DINSTRUMENT) */
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+#ifdef _WIN32
+#include <malloc.h>     /* _aligned_malloc */
+#include <direct.h>     /* _mkdir for the verification levels */
+#else
+#include <fcntl.h>      /* open, mmap and fsync for the binary restart file */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>   /* waitpid for the parameter sweep */
+#include <unistd.h>
+#endif
 
 using namespace std;
 
 /************* Following are fixed parameters for array sizes **************/
-#define imax 65     /* Number of points in the x-direction (use odd numbers only) */
-#define jmax 65     /* Number of points in the y-direction (use odd numbers only) */
+/* Grid size (imax, jmax) is a run-time input, see 'SolverParams' below      */
 #define neq 3       /* Number of equation to be solved ( = 3: mass, x-mtm, y-mtm) */
+#define MAXKTILE 64 /* Largest ktile (PJ iterations per temporally tiled pass) */
+#define EXIT_FAILED 1   /* Exit status of a run stopped by an input, file or setup error */
+#define EXIT_DIVERGED 2 /* Exit status of a run stopped by the divergence check (see check_divergence) */
+#define MAXVERIFYLEVELS 10  /* Most grids in a verification study (iverify = 1) */
+#define MAXTHREADS 4096     /* Most OpenMP threads (nthreads); the runtime's own thread limit may be lower */
 
 /**********************************************/
 /****** All Global variables declared here. ***/
@@ -38,36 +79,284 @@ using namespace std;
   const double four   = 4.0;
   const double six    = 6.0;
   
-/*--------- User sets inputs here  --------*/
-
-  const int nmax = 500000;             /* Maximum number of iterations */
-  const int iterout = 5000;             /* Number of time steps between solution output */
-  const int imms = 0;                   /* Manufactured solution flag: = 1 for manuf. sol., = 0 otherwise */
-  const int isgs = 0;                   /* Symmetric Gauss-Seidel  flag: = 1 for SGS, = 0 for point Jacobi */
-  const int irstr = 0;                  /* Restart flag: = 1 for restart (file 'restart.in', = 0 for initial run */
-  const int ipgorder = 0;               /* Order of pressure gradient: 0 = 2nd, 1 = 3rd (not needed) */
-  const int lim = 0;                    /* variable to be used as the limiter sensor (= 0 for pressure) */
-  const int residualOut = 10;           /* Number of timesteps between residual output */
-
-  const double cfl  = 0.9;              /* CFL number used to determine time step */
-  const double Cx = 0.01;               /* Parameter for 4th order artificial viscosity in x */
-  const double Cy = 0.01;               /* Parameter for 4th order artificial viscosity in y */
-  const double toler = 1.e-10;          /* Tolerance for iterative residual convergence */
-  const double rkappa = 0.1;            /* Time derivative preconditioning constant */
-  const double Re = 100.0;              /* Reynolds number = rho*Uinf*L/rmu */
-  const double pinf = 0.801333844662;   /* Initial pressure (N/m^2) -> from MMS value at cavity center */
-  const double uinf = 1.0;              /* Lid velocity (m/s) */
-  const double rho = 1.0;               /* Density (kg/m^3) */
-  const double xmin = 0.0;              /* Cavity dimensions...: minimum x location (m) */
-  const double xmax = 0.05;             /* maximum x location (m) */
-  const double ymin = 0.0;              /* maximum y location (m) */
-  const double ymax = 0.05;             /*  maximum y location (m) */
-  const double Cx2 = 0.0;               /* Coefficient for 2nd order damping (not required) */
-  const double Cy2 = 0.0;               /* Coefficient for 2nd order damping (not required) */
-  const double fsmall = 1.e-20;         /* small parameter */
+/*--------- User inputs --------*/
+/* Defaults are set here. They can be changed at run time with a keyword input file  */
+/* ('-i file', one "keyword value" pair per line) and then with "keyword=value"      */
+/* command line overrides, see 'read_inputs'.                                        */
+
+struct SolverParams
+{
+    int imax = 65;                  /* Number of points in the x-direction (use odd numbers only) */
+    int jmax = 65;                  /* Number of points in the y-direction (use odd numbers only) */
+    int nmax = 500000;              /* Maximum number of iterations */
+    int iterout = 5000;             /* Number of time steps between solution output */
+    int imms = 0;                   /* Manufactured solution flag: = 1 for manuf. sol., = 0 otherwise */
+    int isgs = 0;                   /* Symmetric Gauss-Seidel  flag: = 1 for SGS, = 2 for red-black SGS, = 3 for implicit line relaxation, = 0 for point Jacobi */
+    int irstr = 0;                  /* Restart flag: = 1 for restart (file 'restart.in', = 0 for initial run */
+    int ipgorder = 0;               /* Order of pressure gradient: 0 = 2nd, 1 = 3rd (not needed) */
+    int lim = 0;                    /* variable to be used as the limiter sensor (= 0 for pressure) */
+    int residualOut = 10;           /* Number of timesteps between residual output */
+    int ispec = 1;                  /* Specialized kernel flag: = 1 to use them when the grid size has one, = 0 for generic */
+    int nthreads = 0;               /* Number of OpenMP threads (= 0 for the OpenMP default, e.g. OMP_NUM_THREADS) */
+    int img = 0;                    /* Multigrid flag: = 1 for FAS multigrid (PJ/SGS as smoother), = 0 for single grid */
+    int mgcycle = 1;                /* Multigrid cycle: = 1 for V-cycle, = 2 for W-cycle */
+    int mglevels = 0;               /* Maximum number of multigrid levels (= 0 to coarsen down to mgnmin) */
+    int mgnmin = 17;                /* Smallest number of points in x or y on the coarsest level (at least 17) */
+    int mgpre = 2;                  /* Smoothing iterations before coarse-grid correction */
+    int mgpost = 2;                 /* Smoothing iterations after coarse-grid correction */
+    int mgcoarse = 10;              /* Smoothing iterations on the coarsest level */
+    int ifmg = 0;                   /* Full multigrid start: = 1 to start from coarse-grid solutions, = 0 otherwise */
+    int mgfmgcycles = 4;            /* Cycles per level during the full multigrid start */
+    int ifused = 0;                 /* Fused PJ kernel: = 1 single-pass iteration, = 2 run both paths and compare, = 0 off */
+    int ktile = 1;                  /* Temporal tiling (ifused = 1): PJ iterations per pass over the grid, residuals checked once per pass */
+    int irstrfmt = 1;               /* Restart file written: = 1 binary (checksummed), = 0 legacy ASCII (read detects either) */
+    int ifieldfmt = 0;              /* Field output: = 0 Tecplot ASCII 'cavity.dat', = 1 binary VTK 'cavity_<n>.vtr' + 'cavity.pvd' */
+    int ifield32 = 1;               /* VTK field values: = 1 Float32, = 0 Float64 */
+    int ifieldzlib = 1;             /* VTK field output: = 1 zlib compressed (needs -DHAVE_ZLIB -lz), = 0 raw */
+    int iasync = 1;                 /* Solution/restart output: = 1 background writer thread, = 0 in the main loop */
+    int outqueue = 2;               /* Snapshots the background writer can hold (2 = double buffering) */
+    int ibench = 0;                 /* Benchmark mode (also '--bench'): = 1 time the kernels and write 'bench.json', no solve */
+    int benchiters = 100;           /* Benchmark iterations per grid and scheme */
+    int benchmax = 513;             /* Largest benchmark grid (grids 65, 129, 257, ... up to this) */
+    int isimd = 0;                  /* Vector PJ update: = 1 best ISA of the CPU, = 2 compile flags, = 3 AVX2, = 4 AVX-512, = 0 scalar */
+    int inewton = 0;                /* Newton-Krylov flag: = 1 for JFNK steps preconditioned by the isgs iteration, = 0 otherwise */
+    int nkrylov = 30;               /* Krylov vectors per FGMRES cycle */
+    int nkcycles = 2;               /* FGMRES cycles (restarts + 1) per Newton step */
+    int nkprec = 4;                 /* Preconditioner iterations per Krylov vector (0 = no preconditioner) */
+    int iresmon = 0;                /* Residual monitor: = 1 true steady residual (always for inewton = 1), = 0 (u - uold)/dt */
+    int nmonitor = 1;               /* Iterations between residual, convergence and divergence checks (also on residualOut iterations) */
+    int sweepthreads = 0;           /* Parameter sweep: cores shared by the concurrent cases (= 0 for all cores) */
+    int mpipx = 0;                  /* MPI builds: ranks in the x (i) direction (= 0 to choose with mpipy) */
+    int mpipy = 0;                  /* MPI builds: ranks in the y (j) direction (= 0 to choose) */
+    int igpu = 0;                   /* Device point Jacobi: = 1 on the OpenMP offload device (GPU), = 0 on the host */
+    int imixed = 0;                 /* Mixed precision: = 1 for float point Jacobi iterations until the residual stalls, = 0 all double */
+    int nmixstall = 500;            /* Mixed precision: iterations without a MIXED_DROP residual drop before switching to double */
+    int iverify = 0;                /* Grid convergence verification (also '--verify'): = 1 run the MMS case on verifylevels grids */
+    int verifymin = 17;             /* Verification: points in x and y on the coarsest grid (then 2*n - 1 per level) */
+    int verifylevels = 5;           /* Verification: number of grids */
+    int iverifywarm = 1;            /* Verification: = 1 each level started from the coarser solution, = 0 flat start */
+    int igridseq = 0;               /* Grid sequencing: = 1 start from the solutions of coarser grids (to seqtoler), = 0 flat start */
+    int seqnmin = 33;               /* Grid sequencing: smallest number of points in x or y on the coarsest grid */
+    int imetrics = 0;               /* Instrumentation (-DINSTRUMENT builds): = 1 stage timers and counters to 'metrics.csv', = 0 off */
+    int nmetrics = 1;               /* Instrumentation: iterations per metrics record */
+    int ilazyp = 0;                 /* Lazy pressure: = 1 rescale only for output, wall velocities set once (PJ/SGS), = 0 every iteration */
+    int istretch = 0;               /* Stretched grid: = 1 tanh, = 2 geometric clustering toward the walls, = 0 uniform */
+    int irsmooth = 0;               /* Implicit residual smoothing of each update (PJ/SGS/line): = 1 on (allows cfl > 0.9), = 0 off */
+    int iaa = 0;                    /* Anderson acceleration of the iteration (any scheme): = 1 on, = 0 off */
+    int aadepth = 5;                /* Anderson acceleration: previous iterates combined (1 to MAXAADEPTH) */
+    int aasteps = 1;                /* Anderson acceleration: iterations of the scheme per accelerated step */
+    int ilive = 0;                  /* Live monitor: = 1 residuals and a downsampled field in the shared file 'live.bin', = 0 off */
+    int liveevery = 100;            /* Live monitor: iterations between snapshots */
+    int livesize = 64;              /* Live monitor: points of the downsampled field in x and y (at most imax, jmax) */
+    int idual = 0;                  /* Dual time stepping: = 1 time-accurate BDF2 physical steps (pseudo-time sub-iterations), = 0 steady */
+    int nphys = 100;                /* Dual time stepping: number of physical time steps */
+    int subiters = 2000;            /* Dual time stepping: largest number of sub-iterations per physical step */
+    int iextrap = 0;                /* Dual time stepping: first guess = 0 the last level, = 1 velocities extrapolated from the last two, = 2 also the pressure (img = 1) */
+    int dualout = 0;                /* Dual time stepping: physical steps between solution outputs (= 0 every iterout iterations) */
+
+    double cfl  = 0.9;              /* CFL number used to determine time step */
+    double Cx = 0.01;               /* Parameter for 4th order artificial viscosity in x */
+    double Cy = 0.01;               /* Parameter for 4th order artificial viscosity in y */
+    double toler = 1.e-10;          /* Tolerance for iterative residual convergence */
+    double rkappa = 0.1;            /* Time derivative preconditioning constant */
+    double Re = 100.0;              /* Reynolds number = rho*Uinf*L/rmu */
+    double pinf = 0.801333844662;   /* Initial pressure (N/m^2) -> from MMS value at cavity center */
+    double uinf = 1.0;              /* Lid velocity (m/s) */
+    double rho = 1.0;               /* Density (kg/m^3) */
+    double xmin = 0.0;              /* Cavity dimensions...: minimum x location (m) */
+    double xmax = 0.05;             /* maximum x location (m) */
+    double ymin = 0.0;              /* maximum y location (m) */
+    double ymax = 0.05;             /*  maximum y location (m) */
+    double Cx2 = 0.0;               /* Coefficient for 2nd order damping (not required) */
+    double Cy2 = 0.0;               /* Coefficient for 2nd order damping (not required) */
+    double fsmall = 1.e-20;         /* small parameter */
+    double fusedtol = 1.e-10;       /* Largest allowed fused/unfused difference when ifused = 2 */
+    double stretchx = 0.0;          /* Stretched grid: clustering in x (tanh: delta, geometric: growth per cell), 0 = uniform in x */
+    double stretchy = 0.0;          /* Stretched grid: clustering in y */
+    double nketa = 1.e-2;           /* Newton-Krylov: largest relative tolerance of the linear solve */
+    double divgrowth = 1.e4;        /* Divergence: stop when the residual grows by this factor over its smallest value (= 0 off) */
+    double seqtoler = 1.e-5;        /* Grid sequencing: residual tolerance on the coarser grids */
+    double rseps = 0.0;             /* Residual smoothing coefficient (= 0 to set it from cfl, see 'rs_setup') */
+    double aamix = 1.0;             /* Anderson acceleration: mixing (damping) of the extrapolated step, 0 < aamix <= 1 */
+    double aagrow = 2.0;            /* Anderson acceleration: restart when ||G(u) - u|| grows by this over its minimum */
+    double dtphys = 1.e-3;          /* Dual time stepping: physical time step (s) */
+    double subtol = 1.e-3;          /* Dual time stepping: sub-iteration tolerance, relative to the first residual of the step */
+    double lidomega = 0.0;          /* Dual time stepping: lid velocity uinf*cos(lidomega*t) (rad/s), = 0 impulsive start (spin-up) */
+};
+
+  SolverParams params;              /* Filled once by 'read_inputs' (called from main), then per case by 'run_sweep' */
+  const char *sweepfile = NULL;     /* Parameter sweep case file ('--sweep casefile'), NULL for a single run */
+  const char *warmfile = NULL;      /* Restart file of a coarser grid to interpolate for the initial solution, NULL for none */
+  int warmni = 0;                   /* Grid of 'warmfile' */
+  int warmnj = 0;
+
+/*--- Read-only names for the inputs, used by all the functions below ---*/
+
+  const int& nmax        = params.nmax;
+  const int& iterout     = params.iterout;
+  const int& imms        = params.imms;
+  const int& isgs        = params.isgs;
+  const int& irstr       = params.irstr;
+  const int& ipgorder    = params.ipgorder;
+  const int& lim         = params.lim;
+  const int& residualOut = params.residualOut;
+  const int& ispec       = params.ispec;
+  const int& nthreads    = params.nthreads;
+  const int& img         = params.img;
+  const int& mgcycle     = params.mgcycle;
+  const int& mglevels    = params.mglevels;
+  const int& mgnmin      = params.mgnmin;
+  const int& mgpre       = params.mgpre;
+  const int& mgpost      = params.mgpost;
+  const int& mgcoarse    = params.mgcoarse;
+  const int& ifmg        = params.ifmg;
+  const int& mgfmgcycles = params.mgfmgcycles;
+  const int& ifused      = params.ifused;
+  const int& ktile       = params.ktile;
+  const int& isimd       = params.isimd;
+  const int& irstrfmt    = params.irstrfmt;
+  const int& iasync      = params.iasync;
+  const int& ibench      = params.ibench;
+  const int& benchiters  = params.benchiters;
+  const int& benchmax    = params.benchmax;
+  const int& ifieldfmt   = params.ifieldfmt;
+  const int& ifield32    = params.ifield32;
+  const int& ifieldzlib  = params.ifieldzlib;
+  const int& outqueue    = params.outqueue;
+  const int& inewton     = params.inewton;
+  const int& nkrylov     = params.nkrylov;
+  const int& nkcycles    = params.nkcycles;
+  const int& nkprec      = params.nkprec;
+  const int& iresmon     = params.iresmon;
+  const int& nmonitor    = params.nmonitor;
+  const int& sweepthreads = params.sweepthreads;
+  const int& mpipx       = params.mpipx;
+  const int& mpipy       = params.mpipy;
+  const int& igpu        = params.igpu;
+  const int& imixed      = params.imixed;
+  const int& nmixstall   = params.nmixstall;
+  const int& iverify     = params.iverify;
+  const int& verifymin   = params.verifymin;
+  const int& verifylevels = params.verifylevels;
+  const int& iverifywarm = params.iverifywarm;
+  const int& igridseq    = params.igridseq;
+  const int& seqnmin     = params.seqnmin;
+  const int& imetrics    = params.imetrics;
+  const int& nmetrics    = params.nmetrics;
+  const int& ilazyp      = params.ilazyp;
+  const int& istretch    = params.istretch;
+  const int& irsmooth    = params.irsmooth;
+  const int& iaa         = params.iaa;
+  const int& aadepth     = params.aadepth;
+  const int& aasteps     = params.aasteps;
+  const int& ilive       = params.ilive;
+  const int& liveevery   = params.liveevery;
+  const int& livesize    = params.livesize;
+  const int& idual       = params.idual;
+  const int& nphys       = params.nphys;
+  const int& subiters    = params.subiters;
+  const int& iextrap     = params.iextrap;
+  const int& dualout     = params.dualout;
+
+  const double& cfl    = params.cfl;
+  const double& Cx     = params.Cx;
+  const double& Cy     = params.Cy;
+  const double& toler  = params.toler;
+  const double& rkappa = params.rkappa;
+  const double& Re     = params.Re;
+  const double& pinf   = params.pinf;
+  const double& uinf   = params.uinf;
+  const double& rho    = params.rho;
+  const double& xmin   = params.xmin;
+  const double& xmax   = params.xmax;
+  const double& ymin   = params.ymin;
+  const double& ymax   = params.ymax;
+  const double& Cx2    = params.Cx2;
+  const double& Cy2    = params.Cy2;
+  const double& fsmall = params.fsmall;
+  const double& fusedtol = params.fusedtol;
+  const double& stretchx = params.stretchx;
+  const double& stretchy = params.stretchy;
+  const double& nketa  = params.nketa;
+  const double& divgrowth = params.divgrowth;
+  const double& seqtoler = params.seqtoler;
+  const double& rseps  = params.rseps;
+  const double& aamix  = params.aamix;
+  const double& aagrow = params.aagrow;
+  const double& dtphys = params.dtphys;
+  const double& subtol = params.subtol;
+  const double& lidomega = params.lidomega;
+
+/*--- Keyword table for the input file and command line (see 'set_input_value') ---*/
+
+struct InputKeyword
+{
+    const char *name;
+    int SolverParams::*ival;        /* Set for integer inputs, NULL otherwise */
+    double SolverParams::*dval;     /* Set for real inputs, NULL otherwise */
+};
+
+const InputKeyword input_keywords[] =
+{
+    {"imax", &SolverParams::imax, NULL},            {"jmax", &SolverParams::jmax, NULL},
+    {"nmax", &SolverParams::nmax, NULL},            {"iterout", &SolverParams::iterout, NULL},
+    {"imms", &SolverParams::imms, NULL},            {"isgs", &SolverParams::isgs, NULL},
+    {"irstr", &SolverParams::irstr, NULL},          {"ipgorder", &SolverParams::ipgorder, NULL},
+    {"irstrfmt", &SolverParams::irstrfmt, NULL},
+    {"iasync", &SolverParams::iasync, NULL},        {"outqueue", &SolverParams::outqueue, NULL},
+    {"ifieldfmt", &SolverParams::ifieldfmt, NULL},  {"ifield32", &SolverParams::ifield32, NULL},
+    {"ifieldzlib", &SolverParams::ifieldzlib, NULL},
+    {"ibench", &SolverParams::ibench, NULL},        {"benchiters", &SolverParams::benchiters, NULL},
+    {"benchmax", &SolverParams::benchmax, NULL},
+    {"lim", &SolverParams::lim, NULL},              {"residualOut", &SolverParams::residualOut, NULL},
+    {"ispec", &SolverParams::ispec, NULL},          {"nthreads", &SolverParams::nthreads, NULL},
+    {"img", &SolverParams::img, NULL},
+    {"mgcycle", &SolverParams::mgcycle, NULL},      {"mglevels", &SolverParams::mglevels, NULL},
+    {"mgnmin", &SolverParams::mgnmin, NULL},        {"mgpre", &SolverParams::mgpre, NULL},
+    {"mgpost", &SolverParams::mgpost, NULL},        {"mgcoarse", &SolverParams::mgcoarse, NULL},
+    {"ifmg", &SolverParams::ifmg, NULL},            {"mgfmgcycles", &SolverParams::mgfmgcycles, NULL},
+    {"ifused", &SolverParams::ifused, NULL},        {"isimd", &SolverParams::isimd, NULL},
+    {"ktile", &SolverParams::ktile, NULL},
+    {"inewton", &SolverParams::inewton, NULL},      {"nkrylov", &SolverParams::nkrylov, NULL},
+    {"nkcycles", &SolverParams::nkcycles, NULL},    {"nkprec", &SolverParams::nkprec, NULL},
+    {"iresmon", &SolverParams::iresmon, NULL},      {"nmonitor", &SolverParams::nmonitor, NULL},
+    {"sweepthreads", &SolverParams::sweepthreads, NULL},
+    {"mpipx", &SolverParams::mpipx, NULL},          {"mpipy", &SolverParams::mpipy, NULL},
+    {"igpu", &SolverParams::igpu, NULL},            {"imixed", &SolverParams::imixed, NULL},
+    {"nmixstall", &SolverParams::nmixstall, NULL},
+    {"iverify", &SolverParams::iverify, NULL},      {"verifymin", &SolverParams::verifymin, NULL},
+    {"verifylevels", &SolverParams::verifylevels, NULL}, {"iverifywarm", &SolverParams::iverifywarm, NULL},
+    {"igridseq", &SolverParams::igridseq, NULL},    {"seqnmin", &SolverParams::seqnmin, NULL},
+    {"imetrics", &SolverParams::imetrics, NULL},    {"nmetrics", &SolverParams::nmetrics, NULL},
+    {"ilazyp", &SolverParams::ilazyp, NULL},        {"istretch", &SolverParams::istretch, NULL},
+    {"irsmooth", &SolverParams::irsmooth, NULL},    {"iaa", &SolverParams::iaa, NULL},
+    {"aadepth", &SolverParams::aadepth, NULL},      {"aasteps", &SolverParams::aasteps, NULL},
+    {"ilive", &SolverParams::ilive, NULL},          {"liveevery", &SolverParams::liveevery, NULL},
+    {"livesize", &SolverParams::livesize, NULL},    {"idual", &SolverParams::idual, NULL},
+    {"nphys", &SolverParams::nphys, NULL},          {"subiters", &SolverParams::subiters, NULL},
+    {"iextrap", &SolverParams::iextrap, NULL},      {"dualout", &SolverParams::dualout, NULL},
+    {"cfl", NULL, &SolverParams::cfl},              {"Cx", NULL, &SolverParams::Cx},
+    {"Cy", NULL, &SolverParams::Cy},                {"toler", NULL, &SolverParams::toler},
+    {"rkappa", NULL, &SolverParams::rkappa},        {"Re", NULL, &SolverParams::Re},
+    {"pinf", NULL, &SolverParams::pinf},            {"uinf", NULL, &SolverParams::uinf},
+    {"rho", NULL, &SolverParams::rho},              {"xmin", NULL, &SolverParams::xmin},
+    {"xmax", NULL, &SolverParams::xmax},            {"ymin", NULL, &SolverParams::ymin},
+    {"ymax", NULL, &SolverParams::ymax},            {"Cx2", NULL, &SolverParams::Cx2},
+    {"Cy2", NULL, &SolverParams::Cy2},              {"fsmall", NULL, &SolverParams::fsmall},
+    {"fusedtol", NULL, &SolverParams::fusedtol},    {"nketa", NULL, &SolverParams::nketa},
+    {"divgrowth", NULL, &SolverParams::divgrowth},  {"seqtoler", NULL, &SolverParams::seqtoler},
+    {"stretchx", NULL, &SolverParams::stretchx},    {"stretchy", NULL, &SolverParams::stretchy},
+    {"rseps", NULL, &SolverParams::rseps},          {"aamix", NULL, &SolverParams::aamix},
+    {"aagrow", NULL, &SolverParams::aagrow},        {"dtphys", NULL, &SolverParams::dtphys},
+    {"subtol", NULL, &SolverParams::subtol},        {"lidomega", NULL, &SolverParams::lidomega}
+};
+
+const int ninput_keywords = sizeof(input_keywords)/sizeof(input_keywords[0]);
 
 /*-- Derived input quantities (set by function 'set_derived_inputs' called from main)----*/
  
+  int imax;         /* Number of points in the x-direction (from params.imax) */
+  int jmax;         /* Number of points in the y-direction (from params.jmax) */
   double rhoinv;    /* Inverse density, 1/rho (m^3/kg) */
   double rlength;   /* Characteristic length (m) [cavity width] */
   double rmu;       /* Viscosity (N*s/m^2) */
@@ -76,6 +365,37 @@ using namespace std;
   double dy;        /* Delta y (m) */
   double rpi;       /* Pi = 3.14159... (defined below) */
 
+struct ResidualCoefficients         /* Grid and fluid factors of the node kernels (set by 'set_grid') */
+{
+    double r2dx, r2dy;              /* 1/(2 dx), 1/(2 dy) */
+    double rdx2, rdy2;              /* 1/dx^2, 1/dy^2 */
+    double beta2min;                /* rkappa*vel2ref: lower limit of beta^2 */
+    double rho, rhoinv, rmu;
+    double dxmin, dtvisc, nu;       /* min(dx,dy), viscous time step, rmu/rho */
+    double cfl, fsmall;
+    double Cx, Cy;                  /* Artificial viscosity */
+    double dx3, dy3, dx4, dy4;      /* dx^3, dy^3, dx^4, dy^4 */
+    double sdx2, sdy2;              /* Asymmetric part of the second differences (stretched grids only) */
+    double rdtphys;                 /* Dual time stepping: BDF coefficient of u over dtphys (0 when steady) */
+};
+
+  ResidualCoefficients rcoef;
+
+struct LineMetrics                  /* Stretched grids: factors of one grid line, h-, h+ the spacings either side */
+{
+    double r2d;                     /* 1/(h- + h+): central first difference */
+    double rd2;                     /* 1/(h- h+): symmetric part of the second difference */
+    double sd2;                     /* (h- - h+)/(h- h+ (h- + h+)): its asymmetric part */
+    double h3, h4;                  /* Cube and 4th power of the mean spacing (h- + h+)/2: artificial viscosity */
+    double hmin;                    /* min(h-, h+): time step */
+    double rh2;                     /* 1/hmin^2: viscous time step */
+};
+
+  vector<double> xgrid;             /* Node coordinates of the current grid (set by 'set_grid') */
+  vector<double> ygrid;
+  vector<LineMetrics> xmetric;      /* Stretched grids: factors of the lines i = 1 .. imax-2 (x) */
+  vector<LineMetrics> ymetric;      /* and j = 1 .. jmax-2 (y) */
+
 /*-- Constants for manufactured solutions ----*/
   const double phi0[neq] = {0.25, 0.3, 0.2};            /* MMS constant */
   const double phix[neq] = {0.5, 0.15, 1.0/6.0};        /* MMS amplitude constant */
@@ -95,70 +415,450 @@ using namespace std;
 /*****************************************************************************
 *                              Array3 Class
 *
+* Storage layout is a compile-time policy:
+*   LayoutAoS (default)   p, u, v of a node are adjacent (original layout)
+*   LayoutSoA             one plane per variable, unit stride in j   (-DARRAY3_SOA)
+* Rows in j are padded so every row starts on an ARRAY3_ALIGN byte boundary,
+* and -DARRAY3_GHOST=n adds n ghost layers on each side (index -n .. dim-1+n).
 *****************************************************************************/
 
-class Array3
+#ifndef ARRAY3_GHOST
+#define ARRAY3_GHOST 0              /* Ghost layers around each Array3 (none of the kernels need them) */
+#endif
+#define ARRAY3_ALIGN 64             /* Byte alignment of the data and of every row */
+
+template <class Real>
+Real* aligned_alloc_scalars( size_t n )
+{
+    /* ARRAY3_ALIGN-aligned block of n Reals, not touched (free with 'aligned_free_scalars') */
+    void *p = NULL;
+    size_t bytes = (n>0) ? n*sizeof(Real) : ARRAY3_ALIGN;
+#ifdef _WIN32
+    p = _aligned_malloc(bytes, ARRAY3_ALIGN);
+#else
+    if(posix_memalign(&p, ARRAY3_ALIGN, bytes)!=0) p = NULL;
+#endif
+    if(p==NULL)
+    {
+        printf("ERROR: could not allocate %lu bytes!\n", (unsigned long)bytes);
+        exit (EXIT_FAILED);
+    }
+    return (Real*)p;
+}
+
+void aligned_free_scalars( void *p )
+{
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+template <class Real>
+void first_touch_rows( Real* p, int nrows, ptrdiff_t rowlen, int nplanes, ptrdiff_t planelen )
+{
+    /* 
+    Zeroes nplanes planes of nrows rows of rowlen Reals (plane q, row i at p + q*planelen + i*rowlen).
+    The rows are split over the threads as the kernels split their i loops (static), so on a
+    NUMA machine each page is first touched, and placed, by the thread that works on it.
+    */
+    #pragma omp parallel for schedule(static)
+    for(int i=0; i<nrows; i++)
+    {
+        for(int q=0; q<nplanes; q++)
+        {
+            memset(p + q*planelen + i*rowlen, 0, rowlen*sizeof(Real));
+        }
+    }
+}
+
+/*--- Workspace: the fields of a case are carved from one ARRAY3_ALIGN-aligned block,  ---*/
+/*--- in stack order. A WorkspaceScope marks the top and releases everything carved    ---*/
+/*--- after it when it goes out of scope, so the next grid level, benchmark grid or     ---*/
+/*--- case reuses the same memory. run_solver reserves the block for the whole case     ---*/
+/*--- up front ('case_workspace_bytes'). A carving that does not fit adds a block, and  ---*/
+/*--- the blocks are merged into one the next time everything is released, so a        ---*/
+/*--- second pass over the same work never allocates.                                  ---*/
+
+struct WorkspaceMark
+{
+    size_t block;                   /* Index of the current block */
+    size_t used;                    /* Bytes carved from it */
+};
+
+class Workspace
+{
+    private:
+        struct Block { char* base; size_t capacity; };
+        vector<Block> blocks;
+        WorkspaceMark top;          /* Next carving */
+        size_t inuse, peak;         /* Bytes carved now, and at most */
+
+        void free_blocks();
+
+    public:
+        Workspace();
+        ~Workspace();
+        Workspace(const Workspace&) = delete;
+        Workspace& operator=(const Workspace&) = delete;
+
+        void reserve(size_t);               /* One block of at least this many bytes (when nothing is carved) */
+        void* carve(size_t);                /* ARRAY3_ALIGN-aligned, not zeroed */
+        WorkspaceMark mark() const;
+        void release(const WorkspaceMark&); /* Frees everything carved after the mark */
+        size_t peak_bytes() const;
+        int nblocks() const;
+};
+
+Workspace::Workspace()
+{
+    top.block = 0;
+    top.used = 0;
+    inuse = 0;
+    peak = 0;
+}
+
+Workspace::~Workspace()
+{
+    free_blocks();
+}
+
+void Workspace::free_blocks()
+{
+    for(size_t b=0; b<blocks.size(); b++)
+    {
+        aligned_free_scalars(blocks[b].base);
+    }
+    blocks.clear();
+}
+
+void Workspace::reserve( size_t bytes )
+{
+    size_t total = 0;
+
+    if(inuse>0) return;
+    for(size_t b=0; b<blocks.size(); b++)
+    {
+        total += blocks[b].capacity;
+    }
+    if(blocks.size()==1 && total>=bytes) return;
+    free_blocks();
+    bytes = max(bytes, total);
+    blocks.push_back( Block{ aligned_alloc_scalars<char>(bytes), bytes } );
+}
+
+void* Workspace::carve( size_t bytes )
+{
+    bytes = (bytes + ARRAY3_ALIGN - 1)/ARRAY3_ALIGN*ARRAY3_ALIGN;
+
+    /* The current block, the next spare one, or a new block as large as all the others */
+    while( top.block<blocks.size() && top.used + bytes>blocks[top.block].capacity )
+    {
+        top.block++;
+        top.used = 0;
+    }
+    if(top.block==blocks.size())
+    {
+        size_t total = 0;
+        for(size_t b=0; b<blocks.size(); b++)
+        {
+            total += blocks[b].capacity;
+        }
+        const size_t capacity = max(bytes, total);
+        blocks.push_back( Block{ aligned_alloc_scalars<char>(capacity), capacity } );
+    }
+
+    void* p = blocks[top.block].base + top.used;
+    top.used += bytes;
+    inuse += bytes;
+    peak = max(peak, inuse);
+    return p;
+}
+
+WorkspaceMark Workspace::mark() const
+{
+    return top;
+}
+
+void Workspace::release( const WorkspaceMark& m )
+{
+    size_t freed = top.used;
+    for(size_t b=m.block; b<top.block; b++)
+    {
+        freed += blocks[b].capacity;
+    }
+    inuse -= freed - m.used;        /* Spare bytes at the ends of skipped blocks count as freed too */
+    top = m;
+    if(top.block==0 && top.used==0)
+    {
+        inuse = 0;
+        if(blocks.size()>1) reserve(0);     /* Merge the blocks for the next case */
+    }
+}
+
+size_t Workspace::peak_bytes() const
+{
+    return peak;
+}
+
+int Workspace::nblocks() const
+{
+    return (int)blocks.size();
+}
+
+  Workspace workspace;              /* Fields of the current case (see 'run_solver') */
+
+class WorkspaceScope                /* Releases what was carved from 'workspace' during its lifetime */
+{
+    private:
+        WorkspaceMark m;
+
+    public:
+        WorkspaceScope() : m(workspace.mark()) {}
+        ~WorkspaceScope() { workspace.release(m); }
+        WorkspaceScope(const WorkspaceScope&) = delete;
+        WorkspaceScope& operator=(const WorkspaceScope&) = delete;
+};
+
+/* Each layout sets the element strides for padded rows of 'jpad' nodes, and   */
+/* keeps its unit-stride index as a literal so the compiler can see it.        */
+/* 'lanes' is the number of elements in ARRAY3_ALIGN bytes.                    */
+
+struct LayoutAoS
+{
+    enum { jstep = neq };           /* j stride of a neq-variable array */
+    static const char* name() { return "AoS"; }
+    static void strides( int itot, int jtot, int kdim, int lanes, ptrdiff_t& istride, ptrdiff_t& kstride, size_t& size )
+    {
+        /* i*istride + j*kstride + k: kstride is the node size, one row padded to whole lines */
+        ptrdiff_t row = (ptrdiff_t)jtot*kdim;
+        row = (row + lanes - 1)/lanes*lanes;
+        istride = row;
+        kstride = kdim;
+        size = (size_t)itot*row;
+    }
+    static ptrdiff_t offset( int i, int j, int k, ptrdiff_t istride, ptrdiff_t kstride )
+    {
+        return i*istride + j*kstride + k;
+    }
+};
+
+struct LayoutSoA
+{
+    enum { jstep = 1 };             /* j stride of a neq-variable array */
+    static const char* name() { return "SoA"; }
+    static void strides( int itot, int jtot, int kdim, int lanes, ptrdiff_t& istride, ptrdiff_t& kstride, size_t& size )
+    {
+        /* k*kstride + i*istride + j: kstride is one padded plane per variable */
+        ptrdiff_t row = ((ptrdiff_t)jtot + lanes - 1)/lanes*lanes;
+        istride = row;
+        kstride = itot*row;
+        size = (size_t)kstride*kdim;
+    }
+    static ptrdiff_t offset( int i, int j, int k, ptrdiff_t istride, ptrdiff_t kstride )
+    {
+        return k*kstride + i*istride + j;
+    }
+};
+
+#ifdef ARRAY3_SOA
+typedef LayoutSoA Array3Layout;
+#else
+typedef LayoutAoS Array3Layout;
+#endif
+
+/* Real is the stored scalar: double, or float for the mixed-precision start (imixed = 1). */
+/* An Array3T owns its data (heap) or borrows it from a Workspace; either way it is        */
+/* move-only, so no two arrays ever free the same block.                                   */
+
+template <class Layout, class Real = double>
+class Array3T
 {
     private:
         int idim, jdim, kdim;
-        double *data;
+        ptrdiff_t istride, kstride; /* Element strides set by the layout */
+        size_t size;                /* Allocated Reals, including padding and ghost layers */
+        Real *base;                 /* Start of the allocation */
+        Real *data;                 /* Element (0,0,0), inside the ghost layers */
+        bool owner;                 /* base is a heap block to free (not carved from a Workspace) */
+
+        void set_shape(int, int, int);
+        void first_touch();
 
     public:
     
-        Array3(int, int, int);
-        ~Array3();
-
-        void copyData(Array3&);
-        void swapData(Array3&);     
+        Array3T(int, int, int);
+        Array3T(int, int, int, Workspace&);
+        ~Array3T();
+        Array3T(const Array3T&) = delete;
+        Array3T& operator=(const Array3T&) = delete;
+        Array3T(Array3T&&);
+        Array3T& operator=(Array3T&&);
+        static size_t bytes(int, int, int);             /* Workspace bytes of an array of this size */
+
+        void copyData(Array3T&);
+        void swapData(Array3T&);     
     
-        double& operator() (int, int, int);
-        double operator() (int, int, int) const;
+        Real& operator() (int, int, int);
+        Real operator() (int, int, int) const;
+        const Real* address(int, int, int) const;       /* For stencils on raw pointers */
+        Real* address(int, int, int);
+        Real* block() const;                            /* Whole allocation (device copies) */
+        size_t block_size() const;
 };
 
-Array3::Array3 (int i, int j, int k)
+template <class Layout, class Real>
+void Array3T<Layout,Real>::set_shape (int i, int j, int k)
 {
     idim = i;
     jdim = j;
     kdim = k;
-    data = new double[i*j*k];
+    Layout::strides(i + 2*ARRAY3_GHOST, j + 2*ARRAY3_GHOST, k, ARRAY3_ALIGN/sizeof(Real), istride, kstride, size);
+}
+
+template <class Layout, class Real>
+void Array3T<Layout,Real>::first_touch ()
+{
+    /* Zeroed (not every kernel writes every node), rows i split over the threads. The */
+    /* rows of all variables are consecutive (AoS), or there is one plane per variable  */
+    const int itot = idim + 2*ARRAY3_GHOST;
+    data = base + Layout::offset(ARRAY3_GHOST, ARRAY3_GHOST, 0, istride, kstride);
+    if(size==0) return;
+    const int nplanes = (int)(size/((size_t)itot*istride));
+    first_touch_rows(base, itot, istride, nplanes, (ptrdiff_t)itot*istride);
+}
+
+template <class Layout, class Real>
+Array3T<Layout,Real>::Array3T (int i, int j, int k)
+{
+    set_shape(i, j, k);
+    base = aligned_alloc_scalars<Real>(size);
+    owner = true;
+    first_touch();
+}
+
+template <class Layout, class Real>
+Array3T<Layout,Real>::Array3T (int i, int j, int k, Workspace& ws)
+{
+    set_shape(i, j, k);
+    base = (Real*)ws.carve(size*sizeof(Real));
+    owner = false;
+    first_touch();
+}
+
+template <class Layout, class Real>
+Array3T<Layout,Real>::~Array3T ()
+{
+    if(owner) aligned_free_scalars(base);
+}
+
+template <class Layout, class Real>
+Array3T<Layout,Real>::Array3T (Array3T&& A)
+{
+    idim = A.idim;  jdim = A.jdim;  kdim = A.kdim;
+    istride = A.istride;  kstride = A.kstride;  size = A.size;
+    base = A.base;  data = A.data;  owner = A.owner;
+    A.base = NULL;  A.data = NULL;  A.owner = false;  A.size = 0;
+}
+
+template <class Layout, class Real>
+Array3T<Layout,Real>& Array3T<Layout,Real>::operator= (Array3T&& A)
+{
+    if(this!=&A)
+    {
+        if(owner) aligned_free_scalars(base);
+        idim = A.idim;  jdim = A.jdim;  kdim = A.kdim;
+        istride = A.istride;  kstride = A.kstride;  size = A.size;
+        base = A.base;  data = A.data;  owner = A.owner;
+        A.base = NULL;  A.data = NULL;  A.owner = false;  A.size = 0;
+    }
+    return *this;
 }
 
-Array3::~Array3 ()
+template <class Layout, class Real>
+size_t Array3T<Layout,Real>::bytes (int i, int j, int k)
 {
-    delete [] data;
+    ptrdiff_t is, ks;
+    size_t n;
+    Layout::strides(i + 2*ARRAY3_GHOST, j + 2*ARRAY3_GHOST, k, ARRAY3_ALIGN/sizeof(Real), is, ks, n);
+    return (n*sizeof(Real) + ARRAY3_ALIGN - 1)/ARRAY3_ALIGN*ARRAY3_ALIGN;
 }
 
 //Copies data from (Array3& A) into the calling Array3 class.   Both Array3's now contain identical data arrays
-void Array3::copyData (Array3& A) 
+template <class Layout, class Real>
+void Array3T<Layout,Real>::copyData (Array3T& A) 
 {
-    memcpy( data, A.data, idim*jdim*kdim*sizeof(double) );
+    memcpy( base, A.base, size*sizeof(Real) );
 }
 
 
 //Swaps pointers to data--thus U.swapData(U2) exchanges data arrays between U and U2
-void Array3::swapData (Array3& A)                  
+template <class Layout, class Real>
+void Array3T<Layout,Real>::swapData (Array3T& A)                  
 {
-    double *temp;
+    Real *temp;
+    bool otemp;
+
+    temp = base;
+    base = A.base;
+    A.base = temp;
 
     temp = data;
     data = A.data;
     A.data = temp;
+
+    otemp = owner;
+    owner = A.owner;
+    A.owner = otemp;
 }
 
+template <class Layout, class Real>
 inline
-double& Array3::operator() (int i, int j, int k)
+Real& Array3T<Layout,Real>::operator() (int i, int j, int k)
+{
+    return data[Layout::offset(i, j, k, istride, kstride)];
+}
+
+template <class Layout, class Real>
+inline      
+Real Array3T<Layout,Real>::operator() (int i, int j, int k) const
+{
+    return data[Layout::offset(i, j, k, istride, kstride)];
+}
+
+template <class Layout, class Real>
+inline      
+const Real* Array3T<Layout,Real>::address (int i, int j, int k) const
+{
+    return data + Layout::offset(i, j, k, istride, kstride);
+}
+
+template <class Layout, class Real>
+inline      
+Real* Array3T<Layout,Real>::address (int i, int j, int k)
+{
+    return data + Layout::offset(i, j, k, istride, kstride);
+}
+
+template <class Layout, class Real>
+inline      
+Real* Array3T<Layout,Real>::block () const
 {
-    return data[i*jdim*kdim + j*kdim + k];
-    //return data[k*idim*jdim + i*jdim + j];
+    return base;
 }
 
+template <class Layout, class Real>
 inline      
-double Array3::operator() (int i, int j, int k) const
+size_t Array3T<Layout,Real>::block_size () const
 {
-    return data[i*jdim*kdim + j*kdim + k];
-    //return data[k*idim*jdim + i*jdim + j];
+    return size;
 }
 
+template <class Real> using Array3R = Array3T<Array3Layout,Real>;
+typedef Array3R<double> Array3;
+typedef Array3R<float> Array3f;
+
 /*****************************************************************************
 *                              End Array3 Class
 *****************************************************************************/
@@ -170,101 +870,465 @@ double Array3::operator() (int i, int j, int k) const
 *
 *****************************************************************************/
 
-class Array2
+template <class Real = double>
+class Array2T
 {
     private:
         int idim, jdim;
-        double *data;
+        Real *data;
+        bool owner;                 /* data is a heap block to free (not carved from a Workspace) */
 
     public:
     
-        Array2(int, int);
-        ~Array2();
-
-        void copyData(Array2&);
-        void swapData(Array2&);     
+        Array2T(int, int);
+        Array2T(int, int, Workspace&);
+        ~Array2T();
+        Array2T(const Array2T&) = delete;
+        Array2T& operator=(const Array2T&) = delete;
+        Array2T(Array2T&&);
+        Array2T& operator=(Array2T&&);
+        static size_t bytes(int, int);                  /* Workspace bytes of an array of this size */
+
+        void copyData(Array2T&);
+        void swapData(Array2T&);     
     
-        double& operator() (int, int);
-        double operator() (int, int) const;
+        Real& operator() (int, int);
+        Real operator() (int, int) const;
+        Real* block() const;        /* Whole allocation, row stride jdim (device copies) */
+        size_t block_size() const;
 };
 
-Array2::Array2 (int i, int j)
+template <class Real>
+Array2T<Real>::Array2T (int i, int j)
+{
+    idim = i;
+    jdim = j;
+    data = aligned_alloc_scalars<Real>((size_t)i*j);
+    owner = true;
+    first_touch_rows(data, i, j, 1, 0);     /* Zeroed: not every kernel writes every node */
+}
+
+template <class Real>
+Array2T<Real>::Array2T (int i, int j, Workspace& ws)
 {
     idim = i;
     jdim = j;
-    data = new double[i*j];
+    data = (Real*)ws.carve((size_t)i*j*sizeof(Real));
+    owner = false;
+    first_touch_rows(data, i, j, 1, 0);
+}
+
+template <class Real>
+Array2T<Real>::~Array2T ()
+{
+    if(owner) aligned_free_scalars(data);
+}
+
+template <class Real>
+Array2T<Real>::Array2T (Array2T&& A)
+{
+    idim = A.idim;  jdim = A.jdim;  data = A.data;  owner = A.owner;
+    A.data = NULL;  A.owner = false;  A.idim = 0;  A.jdim = 0;
 }
 
-Array2::~Array2 ()
+template <class Real>
+Array2T<Real>& Array2T<Real>::operator= (Array2T&& A)
 {
-    delete [] data;
+    if(this!=&A)
+    {
+        if(owner) aligned_free_scalars(data);
+        idim = A.idim;  jdim = A.jdim;  data = A.data;  owner = A.owner;
+        A.data = NULL;  A.owner = false;  A.idim = 0;  A.jdim = 0;
+    }
+    return *this;
+}
+
+template <class Real>
+size_t Array2T<Real>::bytes (int i, int j)
+{
+    return ((size_t)i*j*sizeof(Real) + ARRAY3_ALIGN - 1)/ARRAY3_ALIGN*ARRAY3_ALIGN;
 }
 
-void Array2::copyData (Array2& A)                   //Copies data from (Array2& A) into the calling Array2 class.   
+template <class Real>
+void Array2T<Real>::copyData (Array2T& A)           //Copies data from (Array2& A) into the calling Array2 class.   
 {                                                   //    Both Array2's now contain identical data arrays
-    memcpy( data, A.data, idim*jdim*sizeof(double) );
+    memcpy( data, A.data, idim*jdim*sizeof(Real) );
 }
 
-void Array2::swapData (Array2& A)                   //Swaps pointers to data--
+template <class Real>
+void Array2T<Real>::swapData (Array2T& A)           //Swaps pointers to data--
 {                                                   //   thus U.swapData(U2) exchanges data arrays between U and U2
-    double *temp;
+    Real *temp;
+    bool otemp;
 
     temp = data;
     data = A.data;
     A.data = temp;
+
+    otemp = owner;
+    owner = A.owner;
+    A.owner = otemp;
 }
 
+template <class Real>
 inline
-double& Array2::operator() (int i, int j)
+Real& Array2T<Real>::operator() (int i, int j)
 {
     return data[i*jdim + j];
 }
 
+template <class Real>
 inline      
-double Array2::operator() (int i, int j) const
+Real Array2T<Real>::operator() (int i, int j) const
 {
     return data[i*jdim + j];
 }
 
+template <class Real>
+inline      
+Real* Array2T<Real>::block () const
+{
+    return data;
+}
+
+template <class Real>
+inline      
+size_t Array2T<Real>::block_size () const
+{
+    return (size_t)idim*jdim;
+}
+
+typedef Array2T<double> Array2;
+typedef Array2T<float> Array2f;
+
 /*****************************************************************************
 *                              End Array2 Class
 *****************************************************************************/
 
 
 
+/*****************Kernel Policies *****************************************/
+
+/* The iteration kernels take a policy as well as the grid size, so each case compiles */
+/* to its own loops: source = 0 drops the reads of src (zero for the standard cavity), */
+/* mms selects the walls the iteration calls directly (see 'policy_boundary_conditions'), */
+/* dual = 0 drops the physical time term of the momentum residuals (idual = 0).          */
+/* The layout is the compile-time Array3Layout, the smoother the selected step itself.  */
+
+template <bool SRC, bool MMS, bool DUAL = false>
+struct KernelPolicy
+{
+    enum { source = SRC };          /* src may be nonzero: MMS source, multigrid or Newton-Krylov forcing */
+    enum { mms = MMS };             /* Walls: bndrymms (= 1) or bndry (= 0) */
+    enum { dual = DUAL };           /* Dual time stepping: rho c0 u/dtphys in the momentum residuals (rcoef.rdtphys) */
+};
+
+typedef KernelPolicy<false,false> CavityPolicy;     /* Standard cavity (imms = 0), src = 0 */
+typedef KernelPolicy<true,true>   MMSPolicy;        /* Manufactured solution (imms = 1) */
+typedef KernelPolicy<true,false>  ForcedPolicy;     /* Cavity walls and a forcing in src; the default */
+typedef KernelPolicy<true,false,true> DualPolicy;   /* Dual time stepping (idual = 1), the BDF part in src */
+typedef KernelPolicy<true,true,true>  DualMMSPolicy; /* Dual time stepping with the MMS walls and source */
+
 /*****************Function Pointer Typedefs *********************************/
 
-typedef void (*boundaryConditionPointer)( Array3& );
+template <class Real> using boundaryConditionPointerR = void (*)( Array3R<Real>& );
+typedef boundaryConditionPointerR<double> boundaryConditionPointer;
+
+typedef void (*boundaryRowPointer)( Array3&, int, int, int );
 
 typedef void (*iterationStepPointer)( boundaryConditionPointer, Array3&, Array3&, Array3&, Array2&, Array2&, Array2& );
 
+typedef void (*timeStepPointer)( Array3&, Array2&, double& );
+
+typedef void (*fusedStepPointer)( boundaryConditionPointer, Array3&, Array3&, Array3&, double [neq], double& );
+
+typedef void (*tiledStepPointer)( boundaryRowPointer, Array3&, Array3&, Array3&, Array2&, int, double [neq], double [] );
+
+typedef void (*pointJacobiPointer)( Array3&, Array3&, Array2&, Array2&, Array2&, Array3& );
+
+  pointJacobiPointer pointJacobiVector = NULL;  /* Vector PJ update for isimd > 0 (set once in main), NULL = scalar */
+  pointJacobiPointer pointJacobiVectorNoSource = NULL;  /* The same without the source term (policy source = 0) */
+  pointJacobiPointer pointJacobiVectorDual = NULL;  /* The same with the physical time term (policy dual = 1, idual = 1) */
+
+template <class P>
+inline bool point_Jacobi_vector_update( Array3& u, Array3& uold, Array2& viscx, Array2& viscy, Array2& dt, Array3& s )
+{
+    /* Runs the vector PJ update when one is selected; returns false for the scalar point_Jacobi */
+    pointJacobiPointer update = P::dual ? pointJacobiVectorDual : (P::source ? pointJacobiVector : pointJacobiVectorNoSource);
+    if(update==NULL) return false;
+    update(u, uold, viscx, viscy, dt, s);
+    return true;
+}
+
+template <class P, class Real>
+inline bool point_Jacobi_vector_update( Array3R<Real>&, Array3R<Real>&, Array2T<Real>&, Array2T<Real>&, Array2T<Real>&, Array3R<Real>& )
+{
+    return false;                   /* The vector PJ update is double only */
+}
+
+/*****************Multigrid Level Data *************************************/
+
+#define MAXLEVELS 16                /* Enough levels for any grid that fits in memory */
+
+struct MGLevel
+{
+    int ni, nj;                     /* Number of points in x and y on this level */
+    Array3 *u, *uold;               /* Solution (level 0: the arrays from main) */
+    Array3 *src;                    /* Source terms: physical on level 0, FAS forcing on coarse levels */
+    Array3 *srcphys;                /* Physical (MMS) source on this level, used by the full multigrid start */
+    Array3 *u0;                     /* Solution restricted from the finer level (level 0: solution at cycle start) */
+    Array3 *res;                    /* Steady residual R(u) - src */
+    Array2 *viscx, *viscy, *dt;
+    double dtmin;                   /* Running minimum time step on this level */
+    iterationStepPointer iterationStep;    /* Smoother (PJ or SGS) for this grid size */
+    timeStepPointer timeStep;
+};
+
+  MGLevel mglevel[MAXLEVELS];       /* Multigrid hierarchy, level 0 is the fine grid */
+  int nlevels = 1;                  /* Number of multigrid levels in use */
+  double mgwork = 0.0;              /* Work units spent: one unit = one fine-grid smoothing iteration */
+
+/*****************MMS Exact Solution Cache *********************************/
+
+#define MAXMMSGRIDS 32              /* Grids with a cached exact solution (multigrid levels, benchmark grids) */
+
+struct MMSExact                     /* umms on one grid, evaluated once (see 'mms_exact') */
+{
+    int ni, nj;
+    Array3 *u;                      /* At the nodes of the ni x nj grid (see 'grid_coordinates') */
+    Array3 *iwall;                  /* (0 or 1, j, k): side walls as bndrymms sets them, x = xmin or xmax */
+    Array3 *jwall;                  /* (0 or 1, i, k): bottom and top walls, y = ymin or ymax */
+};
+
+  MMSExact mmsgrid[MAXMMSGRIDS];
+  std::atomic<int> nmmsgrids(0);    /* Complete entries (the output thread reads them) */
+  const MMSExact *mmsexact = NULL;  /* Entry of the current grid (imms = 1, set by 'set_grid') */
+
+struct OutputGrid                   /* The grid an output was taken on (see 'current_output_grid') */
+{
+    int ni, nj;                     /* Grid size */
+    const double *x, *y;            /* Node coordinates (ni and nj values) */
+    const MMSExact *mms;            /* Exact solution on the grid (imms = 1), NULL otherwise */
+};
+
+/*****************Newton-Krylov Data ***************************************/
+
+struct NKData
+{
+    int n;                          /* Unknowns: neq per interior node */
+    Array3 *w, *wold;               /* Trial state of the residual evaluations and preconditioner sweeps */
+    Array3 *res;                    /* Steady residual R(w) - src */
+    Array3 *srcp;                   /* Shifted source of the preconditioner sweeps */
+    Array3 *rbase;                  /* R(u) - src at the start of the Newton step */
+    vector<double> x, xp;           /* Interior u at the start of the Newton step, perturbed x */
+    vector<double> f;               /* G at the start of the Newton step */
+    vector<double> p;               /* Diagonal of P: beta2, 1/rho, 1/rho */
+    vector<double> dtinv;           /* Pseudo-transient term 1/(ptc*dt) */
+    vector<double> du, r;           /* Newton correction, linear residual */
+    vector<double> v, z;            /* FGMRES bases: nkrylov+1 vectors, nkrylov preconditioned vectors */
+    vector<double> h;               /* Hessenberg matrix, (nkrylov+1) x nkrylov, column major */
+    double fnorm0;                  /* ||G|| at the first Newton step (< 0 before it) */
+    double fnormold;                /* ||G|| at the previous Newton step */
+    double eta;                     /* Linear tolerance of the previous Newton step */
+};
+
+  NKData nk;
+  iterationStepPointer nkPreconditioner = NULL;  /* PJ, SGS or AF iteration used as preconditioner (isgs) */
+  int nkiters = 0;                  /* Krylov iterations in total */
+  int nksweeps = 0;                 /* Preconditioner iterations in total */
+
+/*****************Convergence Acceleration Data ****************************/
+
+#define MAXAADEPTH 16               /* Largest aadepth */
+
+struct AAData
+{
+    int n;                          /* Unknowns: neq per interior node */
+    int depth;                      /* Differences in the window (0 after a restart) */
+    int newest;                     /* Slot of the newest difference */
+    bool started;                   /* fold, gold hold the previous iterate */
+    double *f, *g;                  /* Scaled G(u) - u and G(u) of this step */
+    double *fold, *gold;            /* The same at the previous step */
+    double *df[MAXAADEPTH];         /* Differences of f (slots, newest at 'newest') */
+    double *dg[MAXAADEPTH];         /* Differences of G(u) */
+    double gram[MAXAADEPTH][MAXAADEPTH];    /* df[a] . df[b] */
+    double fmin;                    /* Smallest ||f|| since the last restart */
+};
+
+  AAData aa;
+  iterationStepPointer aaInner = NULL;  /* Iteration accelerated by AA_iteration */
+  int aarestarts = 0;               /* Safeguard restarts of the Anderson window */
+  iterationStepPointer rsInner = NULL;  /* Iteration whose update RS_iteration smooths */
+  double rsepsilon = 0.0;           /* Residual smoothing coefficient in use */
+  vector<double> rsinvx, rsinvy;    /* Inverse pivots of the constant smoothing operators, interior i and j */
+
+/*****************Dual Time Stepping Data *********************************/
+
+struct DualData
+{
+    int step;                       /* Physical step being solved (1 .. nphys) */
+    int order;                      /* BDF order of the step: 1 for the first, 2 after */
+    int subit;                      /* Sub-iterations of the step so far */
+    int finished;                   /* Physical steps finished */
+    int subtotal;                   /* Sub-iterations of the finished steps */
+    int ncapped;                    /* Steps that stopped at subiters */
+    double time;                    /* Physical time of the step, t^n+1 = step*dtphys */
+    double rdt;                     /* BDF coefficient of u^n+1 over dtphys (0 when steady, picked up by 'set_grid') */
+    double resref;                  /* Residual of the first sub-iteration of the step (subtol is relative to it) */
+    Array3 *un, *unm1;              /* Time levels u^n, u^n-1 (swapped by pointer) */
+    Array3 *srcphys;                /* Physical source (MMS) without the time derivative */
+};
+
+  DualData dual;
+  double ulid = 1.0;                /* Lid velocity of the current time (uinf when steady, set by 'set_derived_inputs') */
+
 /**********************Function Prototypes**********************************/
 
+/* Kernels templated on <IMAX, JMAX> take the grid size as a compile-time constant; */
+/* <0, 0> is the generic version that uses the run-time imax, jmax. The policy P of */
+/* the iteration kernels defaults to ForcedPolicy, which is right for any src       */
+
+void read_inputs( int, char*[] );
+void check_inputs();
+void read_input_file( const char* );
+void set_input_assignment( const char* );
+void set_input_value( const char*, const char* );
+void print_inputs();
 void set_derived_inputs();
-void GS_iteration( boundaryConditionPointer, Array3&, Array3&, Array3&, Array2&, Array2&, Array2& );
-void PJ_iteration( boundaryConditionPointer, Array3&, Array3&, Array3&, Array2&, Array2&, Array2& );
+void set_grid( int, int );
+iterationStepPointer select_iteration_step( bool );
+timeStepPointer select_time_step( bool );
+fusedStepPointer select_fused_step();
+tiledStepPointer select_tiled_step();
+pointJacobiPointer select_point_Jacobi( bool, bool );
+template <int IMAX, int JMAX, class P = ForcedPolicy> void GS_iteration( boundaryConditionPointer, Array3&, Array3&, Array3&, Array2&, Array2&, Array2& );
+template <int IMAX, int JMAX, class Real = double, class P = ForcedPolicy> void PJ_iteration( boundaryConditionPointerR<Real>, Array3R<Real>&, Array3R<Real>&, Array3R<Real>&, Array2T<Real>&, Array2T<Real>&, Array2T<Real>& );
+template <int IMAX, int JMAX, class P = ForcedPolicy> void RBGS_iteration( boundaryConditionPointer, Array3&, Array3&, Array3&, Array2&, Array2&, Array2& );
+template <int IMAX, int JMAX, class P = ForcedPolicy> void AF_iteration( boundaryConditionPointer, Array3&, Array3&, Array3&, Array2&, Array2&, Array2& );
+template <int IMAX, int JMAX, class P = ForcedPolicy> void PJ_fused_iteration( boundaryConditionPointer, Array3&, Array3&, Array3&, double [neq], double& );
+template <int IMAX, int JMAX, class P = ForcedPolicy> void PJ_tiled_iterations( boundaryRowPointer, Array3&, Array3&, Array3&, Array2&, int, double [neq], double [] );
 void output_file_headers();
-void initial( int&, double&, double [neq], Array3&, Array3& );
-void bndry( Array3& );
-void bndrymms( Array3& );
-void write_output( int, Array3&, Array2&, double [neq], double );
+void initial( int&, double&, double&, double [neq], Array3&, Array3& );
+template <class Real> void bndry( Array3R<Real>& );
+template <class Real> void bndry_row( Array3R<Real>&, int, int, int );
+template <class Real> void bndrymms( Array3R<Real>& );
+template <class Real> void bndrymms_row( Array3R<Real>&, int, int, int );
+template <class Real> void bndry_pressure( Array3R<Real>& );
+void write_output( int, Array3&, double [neq], double, double );
+void write_output_now( const OutputGrid&, int, Array3&, double [neq], double, double );
+void write_field_vtk( const OutputGrid&, int, Array3&, double );
+void start_output_writer();
+void finish_output_writer();
+size_t live_stage_bytes();
+void start_live_monitor();
+void live_publish( int, Array3&, double [neq], double, double, bool );
+void end_live_monitor( int );
+void finish_live_monitor();
+size_t restart_buffer_bytes( int, int );
+void restart_buffer_setup( int, int );
+void write_restart( const char*, const OutputGrid&, int, Array3&, double [neq], double, double );
+bool save_restart( const char*, const OutputGrid&, int, Array3&, double [neq], double, double );
+void write_restart_ascii( const char*, const OutputGrid&, int, Array3&, double [neq], double );
+OutputGrid current_output_grid();
+void read_restart( const char*, int, int, int&, double&, double&, double [neq], Array3& );
+void read_restart_ascii( const char*, int, int, int&, double&, double [neq], Array3& );
 double umms( double, double, int ); 
+const MMSExact* mms_exact( int, int );
 void compute_source_terms( Array3& ); 
 double srcmms_mass( double, double );
 double srcmms_xmtm( double, double );
 double srcmms_ymtm( double, double );
-void compute_time_step( Array3&, Array2&, double& );
-void Compute_Artificial_Viscosity( Array3&, Array2&, Array2& );
-void SGS_forward_sweep( Array3&, Array2&, Array2&, Array2&, Array3& );
-void SGS_backward_sweep( Array3&, Array2&, Array2&, Array2&, Array3& );
-void point_Jacobi( Array3&, Array3&, Array2&, Array2&, Array2&, Array3& );
-void pressure_rescaling( Array3& );
-void check_iterative_convergence( int, Array3&, Array3&, Array2&, double [neq], double [neq], int, double, double, double& );
-void Discretization_Error_Norms( Array3& );
+template <int IMAX, int JMAX, bool COMBINED = false, class Real = double> void compute_time_step( Array3R<Real>&, Array2T<Real>&, double& );
+template <int IMAX, int JMAX, class Real = double> void Compute_Artificial_Viscosity( Array3R<Real>&, Array2T<Real>&, Array2T<Real>& );
+template <int IMAX, int JMAX, class P = ForcedPolicy> void SGS_forward_sweep( Array3&, Array2&, Array2&, Array2&, Array3& );
+template <int IMAX, int JMAX, class P = ForcedPolicy> void SGS_backward_sweep( Array3&, Array2&, Array2&, Array2&, Array3& );
+template <int IMAX, int JMAX, class P = ForcedPolicy> void SGS_color_sweep( Array3&, Array2&, Array2&, Array2&, Array3&, int );
+template <int IMAX, int JMAX, class Real = double, class P = ForcedPolicy> void point_Jacobi( Array3R<Real>&, Array3R<Real>&, Array2T<Real>&, Array2T<Real>&, Array2T<Real>&, Array3R<Real>& );
+template <int IMAX, int JMAX, class P = ForcedPolicy> void AF_line_relaxation( Array3&, Array2&, Array2&, Array2&, Array3& );
+void block_tridiagonal_lines( double*, int, int );
+void block_tridiagonal_batch( double*, int, int, int, int );
+double reference_pressure();
+template <class Real> void pressure_rescaling( Array3R<Real>& );
+template <int IMAX, int JMAX> void compute_residual( const Array3&, const Array2&, const Array2&, const Array3&, Array3& );
+void mg_setup( Array3&, Array3&, Array3&, Array2&, Array2&, Array2& );
+void mg_smooth( int, int, boundaryConditionPointer );
+void mg_restrict( int, boundaryConditionPointer );
+void mg_prolong_correction( int, boundaryConditionPointer );
+void mg_prolong_solution( int, boundaryConditionPointer );
+void mg_cycle( int, boundaryConditionPointer );
+void MG_iteration( boundaryConditionPointer, Array3&, Array3&, Array3&, Array2&, Array2&, Array2& );
+void mg_full_multigrid_start( boundaryConditionPointer );
+void nk_setup();
+void nk_gather( Array3&, double* );
+void nk_scatter( const double*, Array3& );
+double nk_dot( const double*, const double* );
+void nk_residual( boundaryConditionPointer, const double*, Array3&, Array2&, Array2&, Array2&, double* );
+void nk_matvec( boundaryConditionPointer, Array3&, Array2&, Array2&, Array2&, const double*, double* );
+void nk_scaling( Array3& );
+void nk_precondition( boundaryConditionPointer, Array3&, Array2&, Array2&, Array2&, const double*, double* );
+void NK_iteration( boundaryConditionPointer, Array3&, Array3&, Array3&, Array2&, Array2&, Array2& );
+void dual_start( Array3&, Array3&, boundaryConditionPointer, double& );
+void dual_next_step( Array3&, Array3&, boundaryConditionPointer, double& );
+bool dual_step_converged( double );
+void dual_end_step( int, Array3&, double );
+void dual_finish( int );
+void rs_setup();
+void RS_iteration( boundaryConditionPointer, Array3&, Array3&, Array3&, Array2&, Array2&, Array2& );
+size_t aa_workspace_bytes();
+void aa_setup();
+void aa_gather( Array3&, double* );
+void AA_iteration( boundaryConditionPointer, Array3&, Array3&, Array3&, Array2&, Array2&, Array2& );
+void aa_residual_sums( Array2&, double [neq] );
+template <class Real> void check_iterative_convergence( int, Array3R<Real>&, Array3R<Real>&, Array2T<Real>&, double [neq], double [neq], int, double, double, double& );
+template <class Real> void iterative_residual_sums( Array3R<Real>&, Array3R<Real>&, Array2T<Real>&, double, double [neq] );
+void steady_residual_sums( Array3&, Array2&, Array2&, Array2&, Array3&, Array3&, double [neq] );
+void report_iterative_convergence( int, double [neq], double [neq], int, double, double, double& );
+void check_divergence( int, double [neq], int, double, double, double& );
+void run_benchmark();
+int run_solver();
+size_t case_workspace_bytes();
+int run_sweep();
+int run_verification();
+void grid_sequencing_start( boundaryConditionPointer );
+int solve_grid_level( int, int, double, const char*, boundaryConditionPointer, int&, double& );
+void grid_coordinates( int, double, double, vector<double>& );
+void line_metrics( const vector<double>&, vector<LineMetrics>& );
+template <bool COMBINED, class Real> void stretched_time_step( Array3R<Real>&, Array2T<Real>&, double& );
+template <class Real> void stretched_artificial_viscosity( Array3R<Real>&, Array2T<Real>&, Array2T<Real>& );
+template <bool DUAL, class Real> void stretched_point_Jacobi( Array3R<Real>&, Array3R<Real>&, Array2T<Real>&, Array2T<Real>&, Array2T<Real>&, Array3R<Real>& );
+template <bool DUAL> void stretched_SGS_sweep( Array3&, Array2&, Array2&, Array2&, Array3&, bool );
+template <bool DUAL> void stretched_SGS_color_sweep( Array3&, Array2&, Array2&, Array2&, Array3&, int );
+void prolong_solution( const Array3&, int, int, Array3& );
+int mixed_precision_start( int, double&, double&, double [neq], double&, Array3&, Array3& );
+void device_start( Array3&, Array3&, Array3&, Array2& );
+void device_finish( Array3&, Array3&, Array3&, Array2& );
+void device_update_host( Array3& );
+void PJ_device_iteration( Array3&, Array3&, Array3&, Array2&, bool, double [neq], double& );
+#ifdef USE_MPI
+int mpi_start( int*, char*** );
+int run_mpi_solver();
+#endif
+void compare_fused_step( Array3&, Array3&, double [neq], double [neq], double [neq], double [3] );
+void Discretization_Error_Norms( Array3&, double [neq], double [neq], double [neq] );
+void write_error_norms( double [neq], double [neq], double [neq] );
+#ifdef INSTRUMENT
+void metrics_start();
+void metrics_end_iteration( int );
+void metrics_close_record();
+void metrics_flush();
+void metrics_finish( int );
+#endif
  
 
 /****************** Inline Function Declarations ***************************/
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PJ_SIMD_X86                 /* Build the AVX2 and AVX-512 versions of the vector PJ update */
+#define ALWAYS_INLINE __attribute__((always_inline)) inline
+#else
+#define ALWAYS_INLINE inline
+#endif
+
 
 inline double pow2(double x)                      /* Returns x^2 ... Duplicates pow(x,2)*/
 {
@@ -284,1185 +1348,8097 @@ inline double pow4(double x)                      /* Returns x^4 ... Duplicates
     return x4;
 }
 
+inline double wall_time()                         /* Wall-clock time in seconds (for timings only) */
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
-/******************* End Inline Function Declarations ************************/
-
-
-/*--- Variables for file handling ---*/
-/*--- All files are globally accessible ---*/
-  
-  FILE *fp1; /* For output of iterative residual history */
-  FILE *fp2; /* For output of field data (solution) */
-  FILE *fp3; /* For writing the restart file */
-  FILE *fp4; /* For reading the restart file */  
-  FILE *fp5; /* For output of final DE norms (only for MMS)*/  
-//$$$$$$   FILE *fp6; /* For debug: Uncomment for debugging. */  
 
-/***********************************************************************************************************/
-/*      NOTE: The Main routine for this C++ code is found at the end                                       */
-/***********************************************************************************************************/
+/*--- Node-level pieces of the iterations. The loop kernels (compute_time_step,     ---*/
+/*--- Compute_Artificial_Viscosity, point_Jacobi, the SGS sweeps, compute_residual) ---*/
+/*--- and the fused, vector, implicit and Newton-Krylov paths all call these, so    ---*/
+/*--- the discretization (residual_stencil) exists once. The ALWAYS_INLINE ones    ---*/
+/*--- are called from vectorized row loops.                                        ---*/
 
+/*--- The raw-pointer pieces (time_step_node, artificial_viscosity_node, residual_stencil) ---*/
+/*--- read only their arguments and rcoef-style coefficients, so they also compile for    ---*/
+/*--- an OpenMP offload device (see 'Device Point Jacobi').                                ---*/
 
-/*************************************************************************************************************/
-/*                                                                                                           */
-/*                                                Functions                                                  */
-/*                                                                                                           */
-/**********************************************************************************************************  */
+#pragma omp declare target
+template <bool COMBINED = false>
+ALWAYS_INLINE double time_step_node( double uc, double vc, const ResidualCoefficients& c )
+{
+    /* 
+    Returns: local time step at a node with velocity (uc, vc)
+    COMBINED (the multigrid levels) takes dtconv*dtvisc/(dtconv + dtvisc) instead of the
+    smaller of the two. Where the two limits are close, as on the 17x17 and 33x33 levels
+    of the cavity, the smaller one alone leaves PJ and SGS unstable.
+    */
+    double uvel2;           //Local velocity squared
+    double beta2;           //Beta squared parameter for time derivative preconditioning
+    double lambda_x;        //Max absolute value eigenvalue in (x,t)
+    double lambda_y;        //Max absolute value eigenvalue in (y,t)
+    double lambda_max;      //Max absolute value eigenvalue (used in convective time step computation)
+    double dtconv;          //Local convective time step restriction
+    double dtcd;            //Local convection-diffusion (cell Reynolds number) restriction
+
+    uvel2 = (uc*uc) + vc*vc;
+    beta2 = (uvel2 < c.beta2min) ? c.beta2min : uvel2;
+    lambda_x = (1.0/2.0)*(fabs(uc) + sqrt(uc*uc + 4*beta2));
+    lambda_y = (1.0/2.0)*(fabs(vc) + sqrt(vc*vc + 4*beta2));
+    lambda_max = (lambda_x < lambda_y) ? lambda_y : lambda_x;
+    dtconv = c.dxmin/fabs(lambda_max);          /* Convective stability limit */
+    dtcd = 2.0*c.nu/(uvel2 + c.fsmall);         /* Central convection + explicit diffusion (von Neumann): */
+                                                /* binds only at large cell Reynolds numbers, not on 65x65 */
+
+    const double dtlim = COMBINED ? dtconv*c.dtvisc/(dtconv + c.dtvisc) : ((dtconv < c.dtvisc) ? dtconv : c.dtvisc);
+    const double dtau = c.cfl*((dtcd < dtlim) ? dtcd : dtlim);
+
+    /* Dual time stepping: point-implicit in the physical time term (dtau itself when steady) */
+    return dtau/(1.0 + c.rdtphys*dtau);
+}
+
+template <class Real>
+ALWAYS_INLINE void artificial_viscosity_node( const Real* px, ptrdiff_t sx, const Real* py, ptrdiff_t sy,
+                                              double uc, double vc, const ResidualCoefficients& c,
+                                              double& viscx, double& viscy )
+{
+    /* 
+    To modify: viscx, viscy (4th-difference pressure dissipation at a node with velocity (uc, vc))
+    px, py point at the pressure in the centers of the x and y differences, sx, sy are
+    the node strides in x and y. (The template's (1/2) in lambda was integer division,
+    which left the scheme with no dissipation at all; see README.)
+    */
+    double uvel2;       //Local velocity squared
+    double beta2;       //Beta squared parameter for time derivative preconditioning
+    double lambda_x;    //Max absolute value e-value in (x,t)
+    double lambda_y;    //Max absolute value e-value in (y,t)
+    double d4pdx4;      //4th derivative of pressure w.r.t. x
+    double d4pdy4;      //4th derivative of pressure w.r.t. y
+
+    d4pdx4 = (px[2*sx] - 4*px[sx] + 6*px[0] - 4*px[-sx] + px[-2*sx])/c.dx4;
+    d4pdy4 = (py[2*sy] - 4*py[sy] + 6*py[0] - 4*py[-sy] + py[-2*sy])/c.dy4;
+
+    uvel2 = uc*uc + vc*vc;
+    beta2 = (uvel2 < c.beta2min) ? c.beta2min : uvel2;
+    lambda_x = 0.5*(fabs(uc) + sqrt(uc*uc + 4*beta2)); 
+    lambda_y = 0.5*(fabs(vc) + sqrt(vc*vc + 4*beta2));
+
+    viscx = (d4pdx4)*(-fabs(lambda_x)*c.Cx*c.dx3)/beta2;
+    viscy = (d4pdy4)*(-fabs(lambda_y)*c.Cy*c.dy3)/beta2;
+}
+
+template <int JS, bool STRETCHED, bool SRC, bool DUAL, class Real>
+ALWAYS_INLINE double y_momentum_stencil( const Real* o, const Real* sp, ptrdiff_t is, ptrdiff_t ks, double uc,
+                                         const ResidualCoefficients& c )
+{
+    /* 
+    Returns: the y-momentum residual of 'residual_stencil' at the node, for the u velocity
+    uc there (the node's own, or the new one of the sequential Gauss-Seidel update)
+    */
+    const double vc = o[2*ks];
+
+    const double dpdy = (o[JS] - o[-JS])*c.r2dy;
+    const double dvdx = (o[is+2*ks] - o[2*ks-is])*c.r2dx;
+    const double dvdy = (o[2*ks+JS] - o[2*ks-JS])*c.r2dy;
+    double d2vdx2 = (o[is+2*ks] - 2*vc + o[2*ks-is])*c.rdx2;
+    double d2vdy2 = (o[2*ks+JS] - 2*vc + o[2*ks-JS])*c.rdy2;
+
+    if(STRETCHED)
+    {
+        d2vdx2 += (o[is+2*ks] - o[2*ks-is])*c.sdx2;
+        d2vdy2 += (o[2*ks+JS] - o[2*ks-JS])*c.sdy2;
+    }
+
+    double r2 = (c.rho*uc*dvdx) + (c.rho*vc*dvdy) + dpdy - c.rmu*d2vdx2 - c.rmu*d2vdy2;
+
+    if(DUAL) r2 += c.rho*c.rdtphys*vc;
+    if(SRC) r2 -= sp[2*ks];
+    return r2;
+}
+
+template <int JS, bool STRETCHED = false, bool SRC = true, bool DUAL = false, class Real>
+ALWAYS_INLINE void residual_stencil( const Real* o, const Real* sp, ptrdiff_t is, ptrdiff_t ks,
+                                     double viscx, double viscy, const ResidualCoefficients& c,
+                                     double& r0, double& r1, double& r2 )
+{
+    /* 
+    The discretization: steady residual R(u) - s at one interior node, used by every solver.
+    o, sp point at the node in u and s (same layout: j stride JS, variable stride ks,
+    row stride is); viscx, viscy are the dissipation terms at the node. The three
+    results are scalars, not an array, so the vector PJ row keeps them in registers.
+    STRETCHED adds the asymmetric part of the second differences (c of the node, see
+    'stretched_coefficients'); uniform grids compile without it. SRC = false leaves
+    out the source term, and sp is not read. DUAL = true (dual time stepping) adds the
+    implicit part rho c0 u/dtphys of the time derivative to the momentum residuals;
+    steady kernels compile without it.
+    */
+    const double uc = o[ks];
+    const double vc = o[2*ks];
+
+    const double dpdx = (o[is] - o[-is])*c.r2dx;
+    const double dudx = (o[is+ks] - o[ks-is])*c.r2dx;
+    const double dudy = (o[ks+JS] - o[ks-JS])*c.r2dy;
+    const double dvdy = (o[2*ks+JS] - o[2*ks-JS])*c.r2dy;
+    double d2udx2 = (o[is+ks] - 2*uc + o[ks-is])*c.rdx2;
+    double d2udy2 = (o[ks+JS] - 2*uc + o[ks-JS])*c.rdy2;
+
+    if(STRETCHED)
+    {
+        d2udx2 += (o[is+ks] - o[ks-is])*c.sdx2;
+        d2udy2 += (o[ks+JS] - o[ks-JS])*c.sdy2;
+    }
+
+    r0 = (c.rho*dudx) + (c.rho*dvdy) - viscx - viscy;
+    r1 = (c.rho*uc*dudx) + (c.rho*vc*dudy) + dpdx - c.rmu*d2udx2 - c.rmu*d2udy2;
+    r2 = y_momentum_stencil<JS, STRETCHED, SRC, DUAL>(o, sp, is, ks, uc, c);
+
+    if(DUAL) r1 += c.rho*c.rdtphys*uc;
+    if(SRC)
+    {
+        r0 -= sp[0];
+        r1 -= sp[ks];
+    }
+}
+#pragma omp end declare target
+
+template <bool COMBINED = false, class Real>
+ALWAYS_INLINE double local_time_step( const Array3R<Real>& u, int i, int j )
+{
+    /* 
+    Uses global variable(s): rcoef
+    Returns: local time step at interior node (i,j)
+    */
+    return time_step_node<COMBINED>(u(i,j,1), u(i,j,2), rcoef);
+}
+
+template <class Real>
+ALWAYS_INLINE void local_artificial_viscosity( const Array3R<Real>& u, int i, int j, int imax, int jmax, Real& viscx, Real& viscy )
+{
+    /* 
+    Uses global variable(s): rcoef
+    To modify: viscx, viscy (4th-difference pressure dissipation at interior node (i,j))
+    Nodes next to a wall (i = 1, imax-2 and j = 1, jmax-2) use the same 5-point
+    difference shifted one node inwards, so no stencil reaches past the boundary.
+    The shift is a clamped center rather than a branch, so row loops over j vectorize.
+    */
+    const int ic = min(max(i,2),imax-3);   /* Center of the x and y differences */
+    const int jc = min(max(j,2),jmax-3);
+    double vx, vy;
+
+    artificial_viscosity_node( u.address(ic,j,0), u.address(1,0,0) - u.address(0,0,0),
+                               u.address(i,jc,0), u.address(0,1,0) - u.address(0,0,0),
+                               u(i,j,1), u(i,j,2), rcoef, vx, vy );
+    viscx = vx;
+    viscy = vy;
+}
+
+template <bool SRC = true, bool DUAL = false, class Real>
+inline void steady_residual_node( const Array3R<Real>& u, int i, int j, double viscx, double viscy, const Array3R<Real>& s, double r[neq] )
+{
+    /* 
+    Uses global variable(s): rcoef
+    To modify: r (steady residual R(u) - s at interior node (i,j); u and s have the same size;
+               R(u) alone for SRC = false, with the physical time term for DUAL = true)
+    */
+    const Real* o = u.address(i,j,0);
+
+    residual_stencil<Array3Layout::jstep, false, SRC, DUAL>( o, s.address(i,j,0), u.address(i+1,j,0) - o, u.address(i,j,1) - o,
+                                           viscx, viscy, rcoef, r[0], r[1], r[2] );
+}
+
+template <class Real>
+inline double local_beta2( const Array3R<Real>& u, int i, int j )
+{
+    /* Beta squared parameter for time derivative preconditioning at node (i,j) */
+    double uvel2 = u(i,j,1)*u(i,j,1) + u(i,j,2)*u(i,j,2);
+    return max(uvel2,rcoef.beta2min);
+}
+
+template <bool SRC = true, bool DUAL = false, class Real>
+inline void point_Jacobi_node( Array3R<Real>& u, const Array3R<Real>& uold, int i, int j, double viscx, double viscy, double dt, const Array3R<Real>& s )
+{
+    /* 
+    Uses global variable(s): rcoef
+    To modify: u at interior node (i,j) (point Jacobi update from uold)
+    */
+    double r[neq];      //Steady residual at the node
+    double beta2 = local_beta2(uold, i, j);
+
+    steady_residual_node<SRC, DUAL>(uold, i, j, viscx, viscy, s, r);
+
+    u(i,j,0) = uold(i,j,0) - beta2*dt*r[0];
+    u(i,j,1) = uold(i,j,1) - dt*rcoef.rhoinv*r[1];
+    u(i,j,2) = uold(i,j,2) - dt*rcoef.rhoinv*r[2];
+}
+
+template <bool SRC = true, bool DUAL = false>
+inline void Gauss_Seidel_node( Array3& u, int i, int j, double viscx, double viscy, double dt, const Array3& s )
+{
+    /* 
+    Uses global variable(s): rcoef
+    To modify: u at interior node (i,j) (in-place update, used by the SGS sweeps; the
+    three variables are updated in turn, so the y-momentum residual sees the new u)
+    */
+    double r[neq];      //Steady residual at the node
+    double beta2 = local_beta2(u, i, j);
+
+    steady_residual_node<SRC, DUAL>(u, i, j, viscx, viscy, s, r);
+
+    u(i,j,0) = u(i,j,0) - beta2*dt*r[0];
+    u(i,j,1) = u(i,j,1) - dt*rcoef.rhoinv*r[1];
+
+    const double* o = u.address(i,j,0);
+    r[2] = y_momentum_stencil<Array3Layout::jstep, false, SRC, DUAL>( o, s.address(i,j,0), u.address(i+1,j,0) - o, u.address(i,j,1) - o,
+                                                                      u(i,j,1), rcoef );
+    u(i,j,2) = u(i,j,2) - dt*rcoef.rhoinv*r[2];
+}
+
+/*--- Stretched grids (istretch = 1, 2): the same node pieces with the grid factors of ---*/
+/*--- the node, taken from the line metrics of its row i and column j                ---*/
+
+inline void stretched_coefficients( int i, int j, ResidualCoefficients& c )
+{
+    /* 
+    Uses global variable(s): xmetric, ymetric
+    To modify: c (the grid factors, for interior node (i,j); the fluid ones stay as set)
+    */
+    const LineMetrics& mx = xmetric[i];
+    const LineMetrics& my = ymetric[j];
+
+    c.r2dx = mx.r2d;
+    c.r2dy = my.r2d;
+    c.rdx2 = mx.rd2;
+    c.rdy2 = my.rd2;
+    c.sdx2 = mx.sd2;
+    c.sdy2 = my.sd2;
+    c.dx3 = mx.h3;
+    c.dy3 = my.h3;
+    c.dx4 = mx.h4;
+    c.dy4 = my.h4;
+    c.dxmin = min(mx.hmin, my.hmin);
+    c.dtvisc = one/(2.0*c.nu*(mx.rh2 + my.rh2));     /* (dx dy)/(4 nu) for dx = dy, also on long cells */
+}
+
+template <bool DUAL, class Real>
+inline void stretched_point_Jacobi_node( Array3R<Real>& u, const Array3R<Real>& uold, int i, int j, double viscx, double viscy,
+                                         double dt, const Array3R<Real>& s, const ResidualCoefficients& c )
+{
+    /* 
+    To modify: u at interior node (i,j) (point_Jacobi_node with the factors c of the node)
+    */
+    const Real* o = uold.address(i,j,0);
+    double beta2 = local_beta2(uold, i, j);
+    double r0, r1, r2;
+
+    residual_stencil<Array3Layout::jstep, true, true, DUAL>( o, s.address(i,j,0), uold.address(i+1,j,0) - o, uold.address(i,j,1) - o,
+                                                 viscx, viscy, c, r0, r1, r2 );
+
+    u(i,j,0) = uold(i,j,0) - beta2*dt*r0;
+    u(i,j,1) = uold(i,j,1) - dt*c.rhoinv*r1;
+    u(i,j,2) = uold(i,j,2) - dt*c.rhoinv*r2;
+}
+
+template <bool DUAL>
+inline void stretched_Gauss_Seidel_node( Array3& u, int i, int j, double viscx, double viscy, double dt, const Array3& s,
+                                         const ResidualCoefficients& c )
+{
+    /* 
+    To modify: u at interior node (i,j) (Gauss_Seidel_node with the factors c of the node)
+    */
+    const double* o = u.address(i,j,0);
+    double beta2 = local_beta2(u, i, j);
+    double r0, r1, r2;
+
+    residual_stencil<Array3Layout::jstep, true, true, DUAL>( o, s.address(i,j,0), u.address(i+1,j,0) - o, u.address(i,j,1) - o,
+                                                 viscx, viscy, c, r0, r1, r2 );
+
+    u(i,j,0) = u(i,j,0) - beta2*dt*r0;
+    u(i,j,1) = u(i,j,1) - dt*c.rhoinv*r1;
+
+    r2 = y_momentum_stencil<Array3Layout::jstep, true, true, DUAL>( o, s.address(i,j,0), u.address(i+1,j,0) - o, u.address(i,j,1) - o,
+                                                                    u(i,j,1), c );
+    u(i,j,2) = u(i,j,2) - dt*c.rhoinv*r2;
+}
+
+/*--- Boundary conditions of a kernel policy -------------------------------------------*/
+
+template <class P, class Real>
+ALWAYS_INLINE void policy_boundary_conditions( boundaryConditionPointerR<Real> set_boundary_conditions, Array3R<Real>& u )
+{
+    /* 
+    To modify: u (walls)
+    The walls of policy P are called directly, so they inline into the iteration; a step
+    given other boundary conditions (bndry_pressure, ilazyp = 1) calls those instead.
+    */
+    if(set_boundary_conditions!=(P::mms ? &bndrymms<Real> : &bndry<Real>))
+        set_boundary_conditions(u);
+    else if(P::mms)
+        bndrymms(u);
+    else
+        bndry(u);
+}
+
+template <class P>
+ALWAYS_INLINE void policy_boundary_row( boundaryRowPointer set_boundary_row, Array3& u, int i, int jlo, int jhi )
+{
+    /* To modify: u (walls of nodes jlo .. jhi-1 of row i, as 'policy_boundary_conditions') */
+    if(set_boundary_row!=(P::mms ? &bndrymms_row<double> : &bndry_row<double>))
+        set_boundary_row(u, i, jlo, jhi);
+    else if(P::mms)
+        bndrymms_row(u, i, jlo, jhi);
+    else
+        bndry_row(u, i, jlo, jhi);
+}
+
+/******************* End Inline Function Declarations ************************/
+
+
+/*--- Variables for file handling ---*/
+/*--- All files are globally accessible ---*/
+  
+  FILE *fp1; /* For output of iterative residual history */
+  FILE *fp2; /* For output of field data (solution) */
+  FILE *fp3; /* For writing the restart file */
+  FILE *fp4; /* For reading the restart file */  
+  FILE *fp5; /* For output of final DE norms (only for MMS)*/  
+  FILE *fp7; /* For output of the physical time step history (idual = 1) */
+//$$$$$$   FILE *fp6; /* For debug: Uncomment for debugging. */  
+
+/*--- Background output writer (see 'write_output') ---*/
+#ifdef ASYNC_OUTPUT
+#define MAXOUTQUEUE 8               /* Largest allowed outqueue */
+
+struct OutputSnapshot
+{
+    Array3 *u;                      /* Copy of the solution */
+    vector<double> x, y;            /* Copy of the node coordinates (sized once, for the grid of u) */
+    OutputGrid grid;                /* Its grid: the writer never reads imax, jmax, xgrid, ygrid */
+    int n;                          /* Iteration number */
+    double rtime;                   /* Simulation time */
+    double dtmin;                   /* Running minimum time step (for the restart file) */
+    double resinit[neq];            /* Initial iterative residuals (for the restart file) */
+};
+
+  OutputSnapshot outsnap[MAXOUTQUEUE];  /* Snapshot pool, used as a ring: outhead is the oldest */
+  int outhead = 0;
+  int outcount = 0;                 /* Snapshots queued or being written */
+  bool outstop = false;             /* Set by finish_output_writer */
+  int outwrites = 0;                /* Snapshots queued */
+  int outwaits = 0;                 /* Times the solver waited for a free snapshot */
+  double outwaittime = 0.0;         /* Time spent waiting (s) */
+  std::thread *outthread = NULL;    /* Writer thread, NULL when output is synchronous */
+  std::mutex outmutex;
+  std::condition_variable outready; /* Writer: a snapshot was queued (or stop) */
+  std::condition_variable outfree;  /* Solver: a snapshot was written */
+#endif
+
+/*--- Live monitor (ilive = 1, see 'start_live_monitor') ---*/
+#define LIVEHIST 1024               /* Residual records kept in 'live.bin' (a ring) */
+
+enum LiveStatus { LIVE_RUNNING = 1, LIVE_DONE = 2, LIVE_ABORTED = 3 };
+
+struct LiveHeader                   /* Start of 'live.bin'; the layout is in the README */
+{
+    char magic[8];                  /* "CAVLIVE1" */
+    int32_t ni, nj, nvar;           /* Downsampled grid, variables (p, u, v) */
+    int32_t status;                 /* LiveStatus */
+    int32_t nhist;                  /* Records in the residual ring (LIVEHIST) */
+    int32_t nrec;                   /* Records written, the newest at (nrec - 1)%nhist */
+    std::atomic<uint64_t> seq;      /* Odd while the monitor thread updates the file */
+    int64_t n;                      /* Iteration of the snapshot */
+    double rtime;                   /* Simulation time */
+    double res[neq];                /* Normalized residuals of the last monitored iteration */
+    double conv;
+    double reserved;
+};
+
+struct LiveSnapshot                 /* Staged by the solver for the monitor thread */
+{
+    float *field;                   /* p, u, v planes of the downsampled grid */
+    int64_t n;
+    double rtime;
+    double res[neq];
+    double conv;
+};
+
+  unsigned char *livemap = NULL;    /* Shared mapping of 'live.bin', NULL when off */
+  size_t livebytes = 0;
+  int liveni = 0;                   /* Downsampled grid */
+  int livenj = 0;
+  int livenext = 0;                 /* Next iteration to publish */
+  int livelast = -1;                /* Last iteration staged */
+  LiveSnapshot livesnap;
+  int livepublished = 0;            /* Snapshots published */
+  int liveskipped = 0;              /* Snapshots dropped because the monitor thread was busy */
+#ifdef ASYNC_OUTPUT
+  std::thread *livethread = NULL;   /* Monitor thread, NULL when publishing is synchronous */
+  std::mutex livemutex;
+  std::condition_variable liveready;    /* Monitor: a snapshot was staged (or stop) */
+  std::condition_variable liveidle;     /* Solver: the staged snapshot was published */
+  bool livepending = false;
+  bool livestop = false;
+#endif
+
+/*--- Hot-path instrumentation (build with -DINSTRUMENT, run with imetrics = 1) ---*/
+/*--- INSTR_TIME(stage, call) times one stage of the main loop with a scoped timer, ---*/
+/*--- INSTR_ITERATION(n) closes a record every nmetrics iterations. Without         ---*/
+/*--- -DINSTRUMENT the macros leave just the call, so production builds pay nothing. ---*/
+#ifdef INSTRUMENT
+#define METRICS_RING 16384          /* Records the ring holds (a power of 2) */
+#define NCOUNTERS 3                 /* Hardware counters: cycles, instructions, last-level cache misses */
+
+enum MetricsStage { STAGE_TIMESTEP, STAGE_ITERATION, STAGE_RESCALE, STAGE_RESIDUAL, STAGE_OUTPUT, NSTAGES };
+
+struct MetricsRecord
+{
+    int n;                          /* Last iteration of the record */
+    int iters;                      /* Iterations in the record */
+    double t[NSTAGES];              /* Time per stage (s) */
+    uint64_t count[NCOUNTERS];      /* Counter increments (0 when the counters are not available) */
+};
+
+  bool metricson = false;           /* Recording (imetrics = 1, set by 'metrics_start') */
+  MetricsRecord metricscur;         /* Record being filled by the solver thread */
+  MetricsRecord metricsring[METRICS_RING];  /* Single-producer (solver) single-consumer (writer) ring */
+  std::atomic<uint64_t> metricshead(0);     /* Records pushed (solver) */
+  std::atomic<uint64_t> metricstail(0);     /* Records written (writer thread, or the solver when synchronous) */
+  std::atomic<bool> metricsreq(false);      /* Ring half full: the writer thread should flush it */
+  uint64_t metricsdrops = 0;        /* Records lost to a full ring */
+  int metricsprev = 0;              /* Iteration of the last INSTR_ITERATION (tiled passes cover several) */
+  int metricsfd[NCOUNTERS] = {-1, -1, -1};  /* perf_event counters, -1 when not open */
+  uint64_t metricslast[NCOUNTERS];  /* Counter values at the start of the record */
+  double metricstotal[NSTAGES];     /* Time per stage over the run (s) */
+  FILE *fpm = NULL;                 /* 'metrics.csv' */
+
+struct ScopedStage
+{
+    int stage;
+    double t0;
+    ScopedStage( int s ) : stage(s), t0(metricson ? wall_time() : 0.0) {}
+    ~ScopedStage() { if(metricson) metricscur.t[stage] += wall_time() - t0; }
+};
+
+#define INSTR_TIME(stage, call) { ScopedStage instr_scope(stage); call; }
+#define INSTR_ITERATION(n)      { if(metricson) metrics_end_iteration(n); }
+#define INSTR_FLUSH()           metrics_flush()
+#else
+#define INSTR_TIME(stage, call) { call; }
+#define INSTR_ITERATION(n)
+#define INSTR_FLUSH()
+#endif
+
+/***********************************************************************************************************/
+/*      NOTE: The Main routine for this C++ code is found at the end                                       */
+/***********************************************************************************************************/
+
+
+/*************************************************************************************************************/
+/*                                                                                                           */
+/*                                                Functions                                                  */
+/*                                                                                                           */
+/**********************************************************************************************************  */
+
+
+void read_inputs( int argc, char *argv[] )
+{
+    /*
+    Uses: argc, argv
+    To modify: params
+    Usage: DrivenCavity [-i inputfile] [--bench] [--sweep casefile] [--verify] [keyword=value ...]
+    The input file is read first, so command line values take precedence.
+    */
+
+    int iarg;
+
+    for(iarg=1; iarg<argc; iarg++)
+    {
+        if( strcmp(argv[iarg],"-h")==0 || strcmp(argv[iarg],"--help")==0 )
+        {
+            printf("Usage: %s [-i inputfile] [--bench] [--sweep casefile] [--verify] [keyword=value ...]\n", argv[0]);
+            printf("Keywords (current defaults):\n");
+            print_inputs();
+            exit (0);
+        }
+        if( strcmp(argv[iarg],"--bench")==0 )
+        {
+            params.ibench = 1;
+        }
+        if( strcmp(argv[iarg],"--verify")==0 )
+        {
+            params.iverify = 1;
+        }
+        if( strcmp(argv[iarg],"-i")==0 || strcmp(argv[iarg],"--input")==0 )
+        {
+            if(iarg+1>=argc)
+            {
+                printf("ERROR: %s needs an input file name!\n", argv[iarg]);
+                exit (EXIT_FAILED);
+            }
+            read_input_file(argv[++iarg]);
+        }
+        if( strcmp(argv[iarg],"--sweep")==0 )
+        {
+            if(iarg+1>=argc)
+            {
+                printf("ERROR: --sweep needs a case file name!\n");
+                exit (EXIT_FAILED);
+            }
+            sweepfile = argv[++iarg];
+        }
+    }
+
+    for(iarg=1; iarg<argc; iarg++)
+    {
+        if( strcmp(argv[iarg],"-i")==0 || strcmp(argv[iarg],"--input")==0 || strcmp(argv[iarg],"--sweep")==0 )
+        {
+            iarg++;     /* Skip the file name, already read */
+            continue;
+        }
+        if( strcmp(argv[iarg],"--bench")==0 || strcmp(argv[iarg],"--verify")==0 )
+        {
+            continue;
+        }
+
+        set_input_assignment(argv[iarg]);
+    }
+
+    check_inputs();
+}
+
+/**************************************************************************/
+
+void check_inputs()
+{
+    /*
+    Uses: params
+    To modify: params (only ifieldzlib and imetrics, when built without zlib or -DINSTRUMENT)
+    Stops with an error message on inputs that are out of range or cannot be combined.
+    */
+    if( params.imax<5 || params.jmax<5 || (params.imax%2)==0 || (params.jmax%2)==0 )
+    {
+        printf("ERROR: imax and jmax must be odd and at least 5 (got %d x %d)!\n", params.imax, params.jmax);
+        exit (EXIT_FAILED);
+    }
+    if( params.nmax<0 || params.iterout<1 || params.residualOut<1 )
+    {
+        printf("ERROR: nmax must not be negative, and iterout and residualOut must be at least 1 (got %d, %d, %d)!\n",
+               params.nmax, params.iterout, params.residualOut);
+        exit (EXIT_FAILED);
+    }
+    int maxthreads = MAXTHREADS;
+#ifdef _OPENMP
+    if(omp_get_thread_limit()<maxthreads) maxthreads = omp_get_thread_limit();
+#endif
+    if( (params.ispec!=0 && params.ispec!=1) || params.nthreads<0 || params.nthreads>maxthreads )
+    {
+        printf("ERROR: ispec must equal 0 or 1, and nthreads must be from 0 (OpenMP default) to %d (got %d)!\n",
+               maxthreads, params.nthreads);
+        exit (EXIT_FAILED);
+    }
+    if( params.mgcycle!=1 && params.mgcycle!=2 )
+    {
+        printf("ERROR: mgcycle must equal 1 (V) or 2 (W)!\n");
+        exit (EXIT_FAILED);
+    }
+    if( params.mgnmin<17 )
+    {
+        printf("ERROR: mgnmin must be at least 17, PJ and SGS diverge on coarser cavity grids (got %d)!\n", params.mgnmin);
+        exit (EXIT_FAILED);
+    }
+    if( params.mglevels<0 || params.mgpre<0 || params.mgpost<0 || params.mgpre+params.mgpost<1 || params.mgcoarse<1 )
+    {
+        printf("ERROR: mglevels, mgpre and mgpost must not be negative, mgpre + mgpost and mgcoarse must be at least 1\n"
+               "       (got %d, %d, %d, %d)!\n", params.mglevels, params.mgpre, params.mgpost, params.mgcoarse);
+        exit (EXIT_FAILED);
+    }
+    if( params.irstrfmt!=0 && params.irstrfmt!=1 )
+    {
+        printf("ERROR: irstrfmt must equal 0 or 1!\n");
+        exit (EXIT_FAILED);
+    }
+    if( params.ifieldfmt!=0 && params.ifieldfmt!=1 )
+    {
+        printf("ERROR: ifieldfmt must equal 0 or 1!\n");
+        exit (EXIT_FAILED);
+    }
+    if( params.inewton!=0 && params.inewton!=1 )
+    {
+        printf("ERROR: inewton must equal 0 or 1!\n");
+        exit (EXIT_FAILED);
+    }
+    if( params.inewton==1 && (params.img!=0 || params.ifused!=0) )
+    {
+        printf("ERROR: inewton requires img = 0 and ifused = 0 (the isgs iteration is the preconditioner)!\n");
+        exit (EXIT_FAILED);
+    }
+    if( params.inewton==1 && (params.nkrylov<1 || params.nkcycles<1 || params.nkprec<0) )
+    {
+        printf("ERROR: inewton needs nkrylov >= 1, nkcycles >= 1 and nkprec >= 0!\n");
+        exit (EXIT_FAILED);
+    }
+    if( params.iresmon!=0 && params.iresmon!=1 )
+    {
+        printf("ERROR: iresmon must equal 0 or 1!\n");
+        exit (EXIT_FAILED);
+    }
+    if( params.iresmon==1 && params.ifused!=0 )
+    {
+        printf("ERROR: iresmon = 1 requires ifused = 0 (the fused sweep computes the (u - uold)/dt residuals)!\n");
+        exit (EXIT_FAILED);
+    }
+    if( params.nmonitor<1 )
+    {
+        printf("ERROR: nmonitor must be at least 1!\n");
+        exit (EXIT_FAILED);
+    }
+    if( params.divgrowth<zero )
+    {
+        printf("ERROR: divgrowth must be positive (or 0 to turn the growth check off)!\n");
+        exit (EXIT_FAILED);
+    }
+    if( params.ktile<1 || params.ktile>MAXKTILE )
+    {
+        printf("ERROR: ktile must be between 1 and %d!\n", MAXKTILE);
+        exit (EXIT_FAILED);
+    }
+    if( params.ktile>1 && params.ifused!=1 )
+    {
+        printf("ERROR: ktile > 1 requires ifused = 1!\n");
+        exit (EXIT_FAILED);
+    }
+    if( params.igpu!=0 && params.igpu!=1 )
+    {
+        printf("ERROR: igpu must equal 0 or 1!\n");
+        exit (EXIT_FAILED);
+    }
+    if( params.igpu==1 && (params.isgs!=0 || params.img!=0 || params.ifused!=0 || params.inewton!=0 ||
+                           params.iresmon!=0 || params.imms!=0) )
+    {
+        printf("ERROR: igpu = 1 needs point Jacobi (isgs = 0, img = 0, ifused = 0, inewton = 0, iresmon = 0) and imms = 0!\n");
+        exit (EXIT_FAILED);
+    }
+    if( params.igpu==1 )
+    {
+        printf("Note: igpu = 1 is experimental, its kernels have only been run on the host fallback, not on a device\n");
+    }
+    if( params.imixed!=0 && params.imixed!=1 )
+    {
+        printf("ERROR: imixed must equal 0 or 1!\n");
+        exit (EXIT_FAILED);
+    }
+    if( params.imixed==1 && (params.img!=0 || params.inewton!=0 || params.igpu!=0 || params.nmixstall<1) )
+    {
+        printf("ERROR: imixed = 1 requires img = 0, inewton = 0, igpu = 0 and nmixstall >= 1!\n");
+        exit (EXIT_FAILED);
+    }
+    if( params.iverify!=0 && params.iverify!=1 )
+    {
+        printf("ERROR: iverify must equal 0 or 1!\n");
+        exit (EXIT_FAILED);
+    }
+    if( params.iverify==1 && (params.imms!=1 || params.irstr!=0 || params.irstrfmt!=1 || params.ibench!=0 || params.igridseq!=0) )
+    {
+        printf("ERROR: iverify = 1 needs imms = 1, irstr = 0, irstrfmt = 1 (the levels pass binary restart files), ibench = 0 and igridseq = 0!\n");
+        exit (EXIT_FAILED);
+    }
+    if( params.iverify==1 && (params.img!=0 || params.inewton!=0 || params.idual!=0 || params.igpu!=0 || params.iaa!=0 ||
+                              params.irsmooth!=0 || params.imixed!=0) )
+    {
+        printf("ERROR: iverify = 1 solves every level with the isgs relaxation alone (as grid sequencing does), so it needs\n"
+               "       img = 0, inewton = 0, idual = 0, igpu = 0, iaa = 0, irsmooth = 0 and imixed = 0!\n");
+        exit (EXIT_FAILED);
+    }
+    if( params.iverify==1 && (params.verifymin<5 || (params.verifymin%2)==0 || params.verifylevels<2 ||
+                              params.verifylevels>MAXVERIFYLEVELS || (params.iverifywarm!=0 && params.iverifywarm!=1)) )
+    {
+        printf("ERROR: iverify = 1 needs an odd verifymin >= 5, verifylevels from 2 to %d and iverifywarm = 0 or 1!\n",
+               MAXVERIFYLEVELS);
+        exit (EXIT_FAILED);
+    }
+    if( params.igridseq!=0 && params.igridseq!=1 )
+    {
+        printf("ERROR: igridseq must equal 0 or 1!\n");
+        exit (EXIT_FAILED);
+    }
+    if( params.igridseq==1 && (params.irstr!=0 || params.img!=0 || params.igpu!=0 || params.seqnmin<5 || !(params.seqtoler>zero)) )
+    {
+        printf("ERROR: igridseq = 1 requires irstr = 0, img = 0 (see ifmg), igpu = 0, seqnmin >= 5 and seqtoler > 0!\n");
+        exit (EXIT_FAILED);
+    }
+    if( params.ilazyp!=0 && params.ilazyp!=1 )
+    {
+        printf("ERROR: ilazyp must equal 0 or 1!\n");
+        exit (EXIT_FAILED);
+    }
+    if( params.ilazyp==1 && (params.img!=0 || params.ifused!=0 || params.inewton!=0 || params.igpu!=0) )
+    {
+        printf("ERROR: ilazyp = 1 requires img = 0, ifused = 0 (the fused sweeps rescale in the sweep already), inewton = 0 and igpu = 0!\n");
+        exit (EXIT_FAILED);
+    }
+    if( params.istretch<0 || params.istretch>2 || params.stretchx<zero || params.stretchy<zero )
+    {
+        printf("ERROR: istretch must equal 0, 1 or 2, and stretchx, stretchy must not be negative!\n");
+        exit (EXIT_FAILED);
+    }
+    if( params.istretch!=0 && (params.isgs==3 || params.img!=0 || params.ifused!=0 || params.inewton!=0 || params.iresmon!=0 ||
+                               params.isimd!=0 || params.igpu!=0 || params.imixed!=0 || params.igridseq!=0 || params.iverify!=0 ||
+                               params.ibench!=0) )
+    {
+        printf("ERROR: istretch = 1, 2 run point Jacobi or SGS only (isgs = 0, 1 or 2, img = 0, ifused = 0, inewton = 0, iresmon = 0,\n"
+               "       isimd = 0, igpu = 0, imixed = 0, igridseq = 0, iverify = 0 and no --bench)!\n");
+        exit (EXIT_FAILED);
+    }
+    if( (params.irsmooth!=0 && params.irsmooth!=1) || params.rseps<zero )
+    {
+        printf("ERROR: irsmooth must equal 0 or 1, and rseps must not be negative!\n");
+        exit (EXIT_FAILED);
+    }
+    if( params.irsmooth==1 && (params.img!=0 || params.inewton!=0 || params.ifused!=0 || params.igpu!=0) )
+    {
+        printf("ERROR: irsmooth = 1 smooths the PJ, SGS or line update (img = 0, inewton = 0, ifused = 0 and igpu = 0)!\n");
+        exit (EXIT_FAILED);
+    }
+    if( (params.iaa!=0 && params.iaa!=1) || params.aadepth<1 || params.aadepth>MAXAADEPTH || params.aasteps<1 ||
+        !(params.aamix>zero) || params.aamix>one || !(params.aagrow>one) )
+    {
+        printf("ERROR: iaa must equal 0 or 1, aadepth must be from 1 to %d, aasteps >= 1, 0 < aamix <= 1 and aagrow > 1!\n", MAXAADEPTH);
+        exit (EXIT_FAILED);
+    }
+    if( params.ilive==1 && params.igpu!=0 )
+    {
+        printf("ERROR: ilive = 1 samples u on the host (igpu = 0)!\n");
+        exit (EXIT_FAILED);
+    }
+    if( params.iaa==1 && (params.ifused!=0 || params.igpu!=0 || params.ilazyp!=0) )
+    {
+        printf("ERROR: iaa = 1 needs ifused = 0, igpu = 0 and ilazyp = 0 (the iterates must carry the rescaled pressure)!\n");
+        exit (EXIT_FAILED);
+    }
+    if( (params.idual!=0 && params.idual!=1) || params.nphys<1 || params.subiters<1 || params.iextrap<0 || params.iextrap>2 ||
+        params.dualout<0 || !(params.dtphys>zero) || !(params.subtol>zero) || !(params.subtol<one) )
+    {
+        printf("ERROR: idual must equal 0 or 1, nphys and subiters must be at least 1, iextrap must equal 0, 1 or 2, dualout\n"
+               "       must not be negative, dtphys must be positive and subtol between 0 and 1!\n");
+        exit (EXIT_FAILED);
+    }
+    if( params.idual==1 && params.irstr!=0 )
+    {
+        printf("ERROR: idual = 1 needs irstr = 0 (restart.out holds no physical step, time or u^n-1 to resume from)!\n");
+        exit (EXIT_FAILED);
+    }
+    if( params.idual==0 && params.lidomega!=zero )
+    {
+        printf("ERROR: an oscillating lid (lidomega) needs dual time stepping (idual = 1)!\n");
+        exit (EXIT_FAILED);
+    }
+    if( params.idual==1 && (params.ifused!=0 || params.igpu!=0 || params.ilazyp!=0 || params.iaa!=0 || params.imixed!=0 ||
+                            params.igridseq!=0 || params.ifmg!=0 || params.iverify!=0) )
+    {
+        printf("ERROR: idual = 1 sub-iterates with the PJ, SGS, line, multigrid or Newton-Krylov step (ifused = 0, igpu = 0,\n"
+               "       ilazyp = 0, iaa = 0, imixed = 0, igridseq = 0, ifmg = 0 and iverify = 0)!\n");
+        exit (EXIT_FAILED);
+    }
+    if( params.idual==1 && params.img==0 && params.inewton==0 )
+    {
+        printf("Note: single-grid sub-iterations can take up to subiters per physical step; img = 1 or inewton = 1 converge them (cavity_dual.in)\n");
+    }
+    if( (params.imetrics!=0 && params.imetrics!=1) || params.nmetrics<1 )
+    {
+        printf("ERROR: imetrics must equal 0 or 1, and nmetrics must be at least 1!\n");
+        exit (EXIT_FAILED);
+    }
+#ifndef INSTRUMENT
+    if( params.imetrics==1 )
+    {
+        printf("Note: built without -DINSTRUMENT, no metrics are recorded (imetrics ignored)\n");
+        params.imetrics = 0;
+    }
+#endif
+#ifndef HAVE_ZLIB
+    if( params.ifieldfmt==1 && params.ifieldzlib==1 )
+    {
+        printf("Note: built without zlib (-DHAVE_ZLIB -lz), VTK field output is not compressed\n");
+        params.ifieldzlib = 0;
+    }
+#endif
+}
+
+/**************************************************************************/
+
+void read_input_file( const char *fname )
+{
+    /*
+    Reads "keyword value" (or "keyword = value") pairs, one per line.
+    Anything after a '#' or '!' is a comment.
+    To modify: params
+    */
+
+    FILE *fpin;
+    char line[256];
+    char key[64];
+    char value[64];
+    int nline = 0;
+
+    fpin = fopen(fname,"r");
+    if (fpin==NULL)
+    {
+        printf("Error opening input file '%s'. Stopping.\n", fname);
+        exit (EXIT_FAILED);
+    }
+
+    while( fgets(line, sizeof(line), fpin)!=NULL )
+    {
+        nline++;
+        line[strcspn(line,"#!\r\n")] = '\0';      /* Strip comments and line ending */
+        for(char *c = line; *c!='\0'; c++)
+        {
+            if(*c=='=') *c = ' ';
+        }
+        int nread = sscanf(line, "%63s %63s", key, value);
+        if(nread<=0) continue;                  /* Blank line */
+        if(nread!=2)
+        {
+            printf("ERROR: %s line %d: keyword '%s' has no value!\n", fname, nline, key);
+            exit (EXIT_FAILED);
+        }
+        set_input_value(key, value);
+    }
+    fclose(fpin);
+}
+
+/**************************************************************************/
+
+void set_input_assignment( const char *arg )
+{
+    /*
+    Sets one "keyword=value" input (command line and sweep case files)
+    To modify: params
+    */
+
+    char key[64];
+    const char *eq = strchr(arg,'=');
+    if( eq==NULL || eq==arg || (size_t)(eq-arg)>=sizeof(key) )
+    {
+        printf("ERROR: argument '%s' is not of the form keyword=value!\n", arg);
+        exit (EXIT_FAILED);
+    }
+    memcpy(key, arg, eq-arg);
+    key[eq-arg] = '\0';
+    set_input_value(key, eq+1);
+}
+
+/**************************************************************************/
+
+void set_input_value( const char *key, const char *value )
+{
+    /*
+    Uses global variable(s): input_keywords, ninput_keywords
+    To modify: params
+    */
+
+    char *end;
+
+    for(int n=0; n<ninput_keywords; n++)
+    {
+        if(strcmp(key, input_keywords[n].name)!=0) continue;
+
+        if(input_keywords[n].ival!=NULL)
+        {
+            long ival = strtol(value, &end, 10);
+            if(*end!='\0')
+            {
+                printf("ERROR: input '%s' needs an integer value (got '%s')!\n", key, value);
+                exit (EXIT_FAILED);
+            }
+            params.*(input_keywords[n].ival) = (int)ival;
+        }
+        else
+        {
+            double dval = strtod(value, &end);
+            if(*end!='\0')
+            {
+                printf("ERROR: input '%s' needs a real value (got '%s')!\n", key, value);
+                exit (EXIT_FAILED);
+            }
+            params.*(input_keywords[n].dval) = dval;
+        }
+        return;
+    }
+
+    printf("ERROR: unknown input keyword '%s'!\n", key);
+    exit (EXIT_FAILED);
+}
+
+/**************************************************************************/
+
+void print_inputs()
+{
+    /* Prints every keyword with its current value (in input file format) */
+
+    for(int n=0; n<ninput_keywords; n++)
+    {
+        if(input_keywords[n].ival!=NULL)
+        {
+            printf("  %-12s %d\n", input_keywords[n].name, params.*(input_keywords[n].ival));
+        }
+        else
+        {
+            printf("  %-12s %g\n", input_keywords[n].name, params.*(input_keywords[n].dval));
+        }
+    }
+}
+
+/**************************************************************************/
+
+void set_derived_inputs()
+{
+    rhoinv = one/rho;                            /* Inverse density, 1/rho (m^3/kg) */
+    rlength = xmax - xmin;                       /* Characteristic length (m) [cavity width] */
+    rmu = rho*uinf*rlength/Re;                   /* Viscosity (N*s/m^2) */
+    vel2ref = uinf*uinf;                         /* Reference velocity squared (m^2/s^2) */
+    rpi = acos(-one);                            /* Pi = 3.14159... */
+    ulid = uinf;                                 /* Lid velocity (changes with time only for idual = 1) */
+    dual.rdt = zero;                             /* Steady until 'dual_start' */
+    set_grid(params.imax, params.jmax);          /* Grid size, dx and dy, residual coefficients (MMS exact solution) */
+    printf("rho,V,L,mu,Re: %f %f %f %f %f\n",rho,uinf,rlength,rmu,Re);
+    printf("imax,jmax: %d %d\n",imax,jmax);
+}
+
+/**************************************************************************/
+
+void set_grid( int ni, int nj )
+{
+    /*
+    Uses global variable(s): xmax, xmin, ymax, ymin, rho, rhoinv, rmu, rkappa, vel2ref, cfl, fsmall, Cx, Cy, imms,
+                             istretch, stretchx, stretchy
+    To modify: imax, jmax, dx, dy, rcoef (rdtphys from dual), xgrid, ygrid, xmetric, ymetric, mmsexact
+    Makes (ni, nj) the grid all the kernels work on (multigrid switches levels with this).
+    */
+    imax = ni;
+    jmax = nj;
+    dx = (xmax - xmin)/(double)(imax - 1);          /* Delta x (m) */
+    dy = (ymax - ymin)/(double)(jmax - 1);          /* Delta y (m) */
+
+    rcoef.r2dx = one/(two*dx);
+    rcoef.r2dy = one/(two*dy);
+    rcoef.rdx2 = one/(dx*dx);
+    rcoef.rdy2 = one/(dy*dy);
+    rcoef.beta2min = rkappa*vel2ref;
+    rcoef.rho = rho;
+    rcoef.rhoinv = rhoinv;
+    rcoef.rmu = rmu;
+    rcoef.nu = rmu/rho;
+    rcoef.dxmin = min(dx,dy);
+    rcoef.dtvisc = (dx*dy)/(4.0*rcoef.nu);
+    rcoef.cfl = cfl;
+    rcoef.fsmall = fsmall;
+    rcoef.Cx = Cx;
+    rcoef.Cy = Cy;
+    rcoef.dx3 = dx*dx*dx;
+    rcoef.dy3 = dy*dy*dy;
+    rcoef.dx4 = dx*dx*dx*dx;
+    rcoef.dy4 = dy*dy*dy*dy;
+    rcoef.sdx2 = zero;
+    rcoef.sdy2 = zero;
+    rcoef.rdtphys = dual.rdt;
+
+    /* Node coordinates, and the line metrics of the stretched-grid kernels */
+    grid_coordinates(imax, xmax - xmin, stretchx, xgrid);
+    grid_coordinates(jmax, ymax - ymin, stretchy, ygrid);
+    if(istretch!=0)
+    {
+        line_metrics(xgrid, xmetric);
+        line_metrics(ygrid, ymetric);
+    }
+
+    if(imms==1)
+    {
+        mmsexact = mms_exact(imax, jmax);
+    }
+}
+
+/**************************************************************************/
+
+template <int N, class P>
+iterationStepPointer specialized_iteration_step()
+{
+    if(isgs==1) return &GS_iteration<N,N,P>;
+    if(isgs==2) return &RBGS_iteration<N,N,P>;
+    if(isgs==3) return &AF_iteration<N,N,P>;
+    return &PJ_iteration<N,N,double,P>;
+}
+
+template <class P>
+iterationStepPointer policy_iteration_step()
+{
+    /* Uses global variable(s): imax, jmax, isgs, ispec (see 'select_iteration_step') */
+    if(ispec==1 && imax==jmax)
+    {
+        switch(imax)
+        {
+            case 65:   return specialized_iteration_step<65,P>();
+            case 129:  return specialized_iteration_step<129,P>();
+            case 257:  return specialized_iteration_step<257,P>();
+            case 513:  return specialized_iteration_step<513,P>();
+            case 1025: return specialized_iteration_step<1025,P>();
+        }
+    }
+    return specialized_iteration_step<0,P>();
+}
+
+iterationStepPointer select_iteration_step( bool forcing )
+{
+    /*
+    Uses global variable(s): imax, jmax, isgs, ispec, imms, idual
+    Returns the PJ, SGS or implicit line relaxation iteration step compiled for this grid size (constant loop bounds)
+    for the common square grids 65, 129, 257, 513 and 1025, the generic one otherwise. The standard cavity
+    step does not read src, so a caller whose src holds a forcing (coarse multigrid levels, the Newton-Krylov
+    preconditioner) asks for one with forcing = true. Dual time stepping (idual = 1) gets the steps with the
+    physical time term (DualPolicy, DualMMSPolicy); the steady ones compile without it.
+    */
+
+    if(isgs<0 || isgs>3)
+    {
+        printf("ERROR: isgs must equal 0, 1, 2 or 3!\n");
+        exit (EXIT_FAILED);  
+    }
+    if(idual==1) return (imms==1) ? policy_iteration_step<DualMMSPolicy>() : policy_iteration_step<DualPolicy>();
+    if(imms==1) return policy_iteration_step<MMSPolicy>();
+    if(forcing) return policy_iteration_step<ForcedPolicy>();
+    return policy_iteration_step<CavityPolicy>();
+}
+
+/**************************************************************************/
+
+template <bool COMBINED>
+timeStepPointer policy_time_step()
+{
+    /* Uses global variable(s): imax, jmax, ispec (see 'select_time_step') */
+    if(ispec==1 && imax==jmax)
+    {
+        switch(imax)
+        {
+            case 65:   return &compute_time_step<65,65,COMBINED>;
+            case 129:  return &compute_time_step<129,129,COMBINED>;
+            case 257:  return &compute_time_step<257,257,COMBINED>;
+            case 513:  return &compute_time_step<513,513,COMBINED>;
+            case 1025: return &compute_time_step<1025,1025,COMBINED>;
+        }
+    }
+    return &compute_time_step<0,0,COMBINED>;
+}
+
+timeStepPointer select_time_step( bool combined )
+{
+    /* Same selection as 'select_iteration_step', for the local time step; combined = true */
+    /* for the multigrid levels (see 'time_step_node')                                     */
+
+    return combined ? policy_time_step<true>() : policy_time_step<false>();
+}
+
+/**************************************************************************/
+
+template <class P>
+fusedStepPointer policy_fused_step()
+{
+    if(ispec==1 && imax==jmax)
+    {
+        switch(imax)
+        {
+            case 65:   return &PJ_fused_iteration<65,65,P>;
+            case 129:  return &PJ_fused_iteration<129,129,P>;
+            case 257:  return &PJ_fused_iteration<257,257,P>;
+            case 513:  return &PJ_fused_iteration<513,513,P>;
+            case 1025: return &PJ_fused_iteration<1025,1025,P>;
+        }
+    }
+    return &PJ_fused_iteration<0,0,P>;
+}
+
+fusedStepPointer select_fused_step()
+{
+    /* Same selection as 'select_iteration_step', for the fused point Jacobi iteration */
+
+    if(ifused!=1 && ifused!=2)
+    {
+        printf("ERROR: ifused must equal 0, 1 or 2!\n");
+        exit (EXIT_FAILED);
+    }
+    if(isgs!=0 || img!=0)
+    {
+        printf("ERROR: ifused requires single grid point Jacobi (isgs = 0 and img = 0)!\n");
+        exit (EXIT_FAILED);
+    }
+    if(imms==1) return policy_fused_step<MMSPolicy>();
+    return policy_fused_step<CavityPolicy>();
+}
+
+/**************************************************************************/
+
+template <class P>
+tiledStepPointer policy_tiled_step()
+{
+    if(ispec==1 && imax==jmax)
+    {
+        switch(imax)
+        {
+            case 65:   return &PJ_tiled_iterations<65,65,P>;
+            case 129:  return &PJ_tiled_iterations<129,129,P>;
+            case 257:  return &PJ_tiled_iterations<257,257,P>;
+            case 513:  return &PJ_tiled_iterations<513,513,P>;
+            case 1025: return &PJ_tiled_iterations<1025,1025,P>;
+        }
+    }
+    return &PJ_tiled_iterations<0,0,P>;
+}
+
+tiledStepPointer select_tiled_step()
+{
+    /* Same selection as 'select_fused_step', for the temporally tiled point Jacobi iterations */
+
+    if(imms==1) return policy_tiled_step<MMSPolicy>();
+    return policy_tiled_step<CavityPolicy>();
+}
+
+/**************************************************************************/
+
+template <int IMAX, int JMAX, class P>
+void GS_iteration( boundaryConditionPointer set_boundary_conditions, Array3& u, Array3& uold, Array3& src, Array2& viscx, Array2& viscy, Array2& dt )
+{
+    /* Copy u to uold (save previous flow values)*/
+    uold.copyData(u);
+
+    /* Artificial Viscosity */
+    Compute_Artificial_Viscosity<IMAX,JMAX>(u, viscx, viscy);
+              
+    /* Symmetric Gauss-Siedel: Forward Sweep */
+    SGS_forward_sweep<IMAX,JMAX,P>(u, viscx, viscy, dt, src);
+          
+    /* Set Boundary Conditions for u */
+    policy_boundary_conditions<P>(set_boundary_conditions, u);
+           
+    /* Artificial Viscosity */
+    Compute_Artificial_Viscosity<IMAX,JMAX>(u, viscx, viscy);
+                 
+    /* Symmetric Gauss-Siedel: Backward Sweep */
+    SGS_backward_sweep<IMAX,JMAX,P>(u, viscx, viscy, dt, src);
+
+    /* Set Boundary Conditions for u */
+    policy_boundary_conditions<P>(set_boundary_conditions, u);
+}
+
+/**************************************************************************/
+
+template <int IMAX, int JMAX, class Real, class P>
+void PJ_iteration( boundaryConditionPointerR<Real> set_boundary_conditions, Array3R<Real>& u, Array3R<Real>& uold, Array3R<Real>& src,
+                   Array2T<Real>& viscx, Array2T<Real>& viscy, Array2T<Real>& dt )
+{
+    /* Swap pointers for u and uold*/
+    uold.swapData(u);
+
+    /* Artificial Viscosity */
+    Compute_Artificial_Viscosity<IMAX,JMAX>(uold, viscx, viscy);
+              
+    /* Point Jacobi: Forward Sweep */
+    if(!point_Jacobi_vector_update<P>(u, uold, viscx, viscy, dt, src))
+        point_Jacobi<IMAX,JMAX,Real,P>(u, uold, viscx, viscy, dt, src);
+           
+    /* Set Boundary Conditions for u */
+    policy_boundary_conditions<P>(set_boundary_conditions, u);
+}
+
+/**************************************************************************/
+
+template <int IMAX, int JMAX, class P>
+void AF_iteration( boundaryConditionPointer set_boundary_conditions, Array3& u, Array3& uold, Array3& src, Array2& viscx, Array2& viscy, Array2& dt )
+{
+    /* Copy u to uold (save previous flow values)*/
+    uold.copyData(u);
+
+    /* Artificial Viscosity */
+    Compute_Artificial_Viscosity<IMAX,JMAX>(u, viscx, viscy);
+
+    /* Implicit line relaxation: x lines, then y lines */
+    AF_line_relaxation<IMAX,JMAX,P>(u, viscx, viscy, dt, src);
+
+    /* Set Boundary Conditions for u */
+    policy_boundary_conditions<P>(set_boundary_conditions, u);
+}
+
+/**************************************************************************/
+
+template <int IMAX, int JMAX, class P>
+void RBGS_iteration( boundaryConditionPointer set_boundary_conditions, Array3& u, Array3& uold, Array3& src, Array2& viscx, Array2& viscy, Array2& dt )
+{
+    /* Same as GS_iteration with red-black ordering: no node of one color depends on */
+    /* another node of the same color, so each half-sweep can run in parallel        */
+
+    /* Copy u to uold (save previous flow values)*/
+    uold.copyData(u);
+
+    /* Artificial Viscosity */
+    Compute_Artificial_Viscosity<IMAX,JMAX>(u, viscx, viscy);
+              
+    /* Red-black Gauss-Siedel: Forward Sweep (red, then black) */
+    SGS_color_sweep<IMAX,JMAX,P>(u, viscx, viscy, dt, src, 0);
+    SGS_color_sweep<IMAX,JMAX,P>(u, viscx, viscy, dt, src, 1);
+          
+    /* Set Boundary Conditions for u */
+    policy_boundary_conditions<P>(set_boundary_conditions, u);
+           
+    /* Artificial Viscosity */
+    Compute_Artificial_Viscosity<IMAX,JMAX>(u, viscx, viscy);
+                 
+    /* Red-black Gauss-Siedel: Backward Sweep (black, then red) */
+    SGS_color_sweep<IMAX,JMAX,P>(u, viscx, viscy, dt, src, 1);
+    SGS_color_sweep<IMAX,JMAX,P>(u, viscx, viscy, dt, src, 0);
+
+    /* Set Boundary Conditions for u */
+    policy_boundary_conditions<P>(set_boundary_conditions, u);
+}
+
+/**************************************************************************/
+
+void output_file_headers()
+{
+  /*
+  Uses global variable(s): imms, ifieldfmt, fp1, fp2
+  */
+  
+  /* Note: The vector of primitive variables is: */
+  /*               u = [p, u, v]^T               */  
+  /* Set up output files (history and solution)  */    
+
+    fp1 = fopen("./history.dat","w");
+    fprintf(fp1,"TITLE = \"Cavity Iterative Residual History\"\n");
+    fprintf(fp1,"variables=\"Iteration\"\"Time(s)\"\"Res1\"\"Res2\"\"Res3\"\n");
+
+    fp2 = NULL;                 /* VTK output (ifieldfmt = 1) opens one file per output step */
+    if(ifieldfmt==0)
+    {
+        fp2 = fopen("./cavity.dat","w");
+        fprintf(fp2,"TITLE = \"Cavity Field Data\"\n");
+        if(imms==1)
+        {
+            fprintf(fp2,"variables=\"x(m)\"\"y(m)\"\"p(N/m^2)\"\"u(m/s)\"\"v(m/s)\"");\
+            fprintf(fp2,"\"p-exact\"\"u-exact\"\"v-exact\"\"DE-p\"\"DE-u\"\"DE-v\"\n");      
+        }
+        else
+        {
+            if(imms==0)
+            {
+                fprintf(fp2,"variables=\"x(m)\"\"y(m)\"\"p(N/m^2)\"\"u(m/s)\"\"v(m/s)\"\n");
+            }      
+            else
+            {
+                printf("ERROR! imms must equal 0 or 1!!!\n");
+                exit (EXIT_FAILED);
+            }       
+        }
+    }
+
+  /* Header for Screen Output */
+  printf("Iter. Time (s)   dt (s)      Continuity    x-Momentum    y-Momentum\n"); 
+}
+
+/**************************************************************************/
+
+void initial(int& ninit, double& rtime, double& dtmin, double resinit[neq], Array3& u, Array3& s)
+{
+    /* 
+    Uses global variable(s): zero, one, irstr, imax, jmax, neq, uinf, pinf, warmfile, warmni, warmnj
+    To modify: ninit, rtime, dtmin (running minimum time step), resinit, u, s
+    */
+    int i;                       /* i index (x direction) */
+    int j;                       /* j index (y direction) */
+    int k;                       /* k index (# of equations) */
+  
+    double x;       /* Temporary variable for x location */
+    double y;       /* Temporary variable for y location */
+
+    /* This subroutine sets inital conditions in the cavity */
+
+    /* Note: The vector of primitive variables is:  */
+    /*              u = [p, u, v]^T               */
+  
+    if(irstr==0)   /* Starting run from scratch*/
+    {  
+        ninit = 1;          /* set initial iteration to one */
+        rtime = zero;       /* set initial time to zero */
+        dtmin = 1.0e99;     /* no time step taken yet */
+        for(k = 0; k<neq; k++)
+        {
+            resinit[k] = one;
+        }
+        for(i = 0; i<imax; i++)
+        {
+            for(j = 0; j<jmax; j++)
+            {
+                u(i,j,0) = pinf;
+                u(i,j,1) = zero;
+                u(i,j,2) = zero;
+
+                s(i,j,0) = zero;
+                s(i,j,1) = zero;
+                s(i,j,2) = zero;
+            }
+            u(i, jmax-1, 1) = uinf; /* Initialize lid (top) to freestream velocity */
+        }
+
+        /* Warm start: interpolate the solution of a coarser grid (iteration count and time start over) */
+        if(warmfile!=NULL)
+        {
+            WorkspaceScope scope;
+            Array3 ucoarse(warmni, warmnj, neq, workspace);
+            int ncoarse;
+            double rtcoarse;
+            double dtcoarse;
+            read_restart( warmfile, warmni, warmnj, ncoarse, rtcoarse, dtcoarse, resinit, ucoarse );
+            prolong_solution( ucoarse, warmni, warmnj, u );
+            printf("Warm start from the %d x %d solution in '%s' (iteration %d)\n", warmni, warmnj, warmfile, ncoarse);
+        }
+    }  
+    else if(irstr==1)  /* Restarting from previous run (file 'restart.in') */
+    {
+        read_restart( "./restart.in", imax, jmax, ninit, rtime, dtmin, resinit, u );    /* Binary or legacy ASCII */
+        ninit += 1;
+        printf("Restarting at iteration %d\n", ninit);
+    }   
+    else
+    {
+        printf("ERROR: irstr must equal 0 or 1!\n");
+        exit (EXIT_FAILED);
+    }
+}
+
+
+/**************************************************************************/
+
+void prolong_solution( const Array3& uc, int nic, int njc, Array3& u )
+{
+    /* 
+    Uses global variable(s): imax, jmax, neq
+    Uses: uc (solution on a nic x njc grid over the same domain)
+    To modify: u (bilinear interpolation of uc at every node of the current grid)
+    */
+    #pragma omp parallel for
+    for(int i=0; i<imax; i++)
+    {
+        double xc = (double)(i*(nic - 1))/(double)(imax - 1);  /* Node i in coarse grid index units */
+        int ic = min((int)xc, nic - 2);
+        double fx = xc - (double)ic;
+        for(int j=0; j<jmax; j++)
+        {
+            double yc = (double)(j*(njc - 1))/(double)(jmax - 1);
+            int jc = min((int)yc, njc - 2);
+            double fy = yc - (double)jc;
+            for(int k=0; k<neq; k++)
+            {
+                u(i,j,k) = (one - fx)*((one - fy)*uc(ic,jc,k)   + fy*uc(ic,jc+1,k))
+                         +        fx*((one - fy)*uc(ic+1,jc,k) + fy*uc(ic+1,jc+1,k));
+            }
+        }
+    }
+}
+
+/**************************************************************************/
+
+template <class Real>
+void bndry( Array3R<Real>& u )
+{
+    /* 
+    Uses global variable(s): imax
+    To modify: u 
+    */
+    int i;                                          //i index (x direction)
+
+    /* This applies the cavity boundary conditions (one row at a time, see 'bndry_row') */
+
+    for( i=0; i<imax; i++)
+    {
+        bndry_row(u, i, 0, jmax);
+    }
+}
+
+/**************************************************************************/
+
+template <class Real>
+void bndry_row( Array3R<Real>& u, int i, int jlo, int jhi )
+{
+    /* 
+    Uses global variable(s): zero, one (not used), two, half, imax, jmax, ulid  
+    To modify: u (boundary nodes of row i in columns jlo .. jhi-1)
+    Part of row i of the cavity boundary conditions. The wall rows i = 0 and imax-1 use
+    interior nodes of rows 1, 2 (imax-2, imax-3), and the nodes j = 0 and jmax-1 nodes 1, 2
+    (jmax-2, jmax-3) of their own row, so once those are known the pieces can be set in any
+    order (the temporally tiled PJ sweep sets them behind its wavefront).
+    */
+    int j;                                          //j index (y direction)
+    const int jfirst = max(jlo, 1);                 //Side wall nodes in the range
+    const int jlast = min(jhi, jmax-1);
+
+    /* !************************************************************** */
+    /* !************ADD CODING HERE FOR INTRO CFD STUDENTS************ */
+    /* !************************************************************** */
+
+    /* Should be complete */
+
+    /* I'm  going to include the corners on the top/bottoms */
+
+    if( i==0 )
+    {
+        for( j=jfirst; j<jlast; j++)
+        {
+            /* Left wall */
+            u(i,j,0) = 2*u(1,j,0) - u(2,j,0); /* Defines pressure gradient at left wall*/
+            u(i,j,1) = 0; /* Defines left wall as 0 u velocity */
+            u(i,j,2) = 0; /* Defines left wall as 0 v velocity */
+        }
+    }
+    else if( i==imax-1 )
+    {
+        for( j=jfirst; j<jlast; j++)
+        {
+            /* Right wall */
+            u(i,j,0) = 2*u(imax-2,j,0) - u(imax-3,j,0); /* Defines pressure gradient at right wall */
+            u(i,j,1) = 0; /* Defines right wall as 0 u velocity */
+            u(i,j,2) = 0; /* Defines right wall as 0 v velocity */
+        }
+    }
+
+    if( jlo==0 )
+    {
+        /* Bottom wall */
+        j = 0;
+        u(i,j,0) = 2*u(i,1,0) - u(i,2,0); /* Defines pressure gradient at bottom */
+        u(i,j,1) = 0; /* Defines bottom row as 0 u velocity */
+        u(i,j,2) = 0; /* Defines bottom row as 0 v velocity */
+    }
+    if( jhi==jmax )
+    {
+        /* Top wall */
+        j = jmax-1;
+        u(i,j,0) = 2*u(i,jmax-2,0) - u(i,jmax-3,0); /* Defines pressure gradient at top */
+        u(i,j,1) = ulid; /* Defines top row u velocity as lid velocity */
+        u(i,j,2) = 0; /* Defines top row as 0 v velocity */
+    }
+}
+
+/**************************************************************************/
+
+template <class Real>
+void bndrymms( Array3R<Real>& u )
+{
+    /* 
+    Uses global variable(s): imax
+    To modify: u
+    */
+    int i;                       /* i index (x direction) */
+
+    /* This applies the cavity boundary conditions for the manufactured solution */
+
+    for( i=0; i<imax; i++)
+    {
+        bndrymms_row(u, i, 0, jmax);
+    }
+}
+
+/**************************************************************************/
+
+template <class Real>
+void bndrymms_row( Array3R<Real>& u, int i, int jlo, int jhi )
+{
+    /* 
+    Uses global variable(s): two, imax, jmax, neq, mmsexact
+    To modify: u (boundary nodes of row i in columns jlo .. jhi-1, as in 'bndry_row')
+    */
+    int j;                       /* j index (y direction) */
+    const int jfirst = max(jlo, 1);     /* Side wall nodes in the range */
+    const int jlast = min(jhi, jmax-1);
+
+    const Array3& iwall = *mmsexact->iwall;     /* Exact solution on the walls (umms) */
+    const Array3& jwall = *mmsexact->jwall;
+
+    /* Side Walls */
+    if( i==0 || i==imax-1 )
+    {
+        const int w = (i==0) ? 0 : 1;
+        for( j = jfirst; j<jlast; j++)
+        {
+            u(i,j,0)  = iwall(w,j,0);
+            u(i,j,1)  = iwall(w,j,1);
+            u(i,j,2)  = iwall(w,j,2);
+
+            if(i==0)
+                u(0,j,0) = two*u(1,j,0) - u(2,j,0);    /* 2nd Order BC */
+            else
+                u(imax-1,j,0) = two*u(imax-2,j,0) - u(imax-3,j,0);   /* 2nd Order BC */
+        }
+    }
+
+    /* Top/Bottom Walls */
+    if( jlo==0 )
+    {
+        j = 0;
+
+        u(i,j,0)  = jwall(0,i,0);
+        u(i,j,1)  = jwall(0,i,1);
+        u(i,j,2)  = jwall(0,i,2);
+
+        u(i,0,0) = two*u(i,1,0) - u(i,2,0);   /* 2nd Order BC */
+    }
+    if( jhi==jmax )
+    {
+        j = jmax-1;
+            
+        u(i,j,0)  = jwall(1,i,0);
+        u(i,j,1)  = jwall(1,i,1);
+        u(i,j,2)  = jwall(1,i,2);
+
+        u(i,jmax-1,0) = two*u(i,jmax-2,0) - u(i,jmax-3,0);   /* 2nd Order BC */
+    }
+}
+
+/**************************************************************************/
+
+template <class Real>
+void bndry_pressure( Array3R<Real>& u )
+{
+    /* 
+    Uses global variable(s): two, imax, jmax
+    To modify: u (wall pressures)
+    The part of 'bndry' and 'bndrymms' that changes: the wall pressures, extrapolated in
+    the same order. The wall velocities are fixed, so with ilazyp = 1 they are set once
+    (in u and uold) and each iteration only calls this.
+    */
+    int i;                       /* i index (x direction) */
+    int j;                       /* j index (y direction) */
+
+    for( i=0; i<imax; i++)
+    {
+        if( i==0 )
+        {
+            for( j=1; j<jmax-1; j++)
+            {
+                u(0,j,0) = two*u(1,j,0) - u(2,j,0);     /* Left wall */
+            }
+        }
+        else if( i==imax-1 )
+        {
+            for( j=1; j<jmax-1; j++)
+            {
+                u(imax-1,j,0) = two*u(imax-2,j,0) - u(imax-3,j,0);     /* Right wall */
+            }
+        }
+        u(i,0,0) = two*u(i,1,0) - u(i,2,0);                     /* Bottom wall */
+        u(i,jmax-1,0) = two*u(i,jmax-2,0) - u(i,jmax-3,0);      /* Top wall */
+    }
+}
+
+/**************************************************************************/
+
+OutputGrid current_output_grid()
+{
+    /* 
+    Uses global variable(s): imax, jmax, xgrid, ygrid, imms, mmsexact
+    Returns: the current grid for the output routines (valid until the next 'set_grid')
+    */
+    OutputGrid g;
+    g.ni = imax;
+    g.nj = jmax;
+    g.x = xgrid.data();
+    g.y = ygrid.data();
+    g.mms = (imms==1) ? mmsexact : NULL;
+    return g;
+}
+
+/**************************************************************************/
+
+void write_output_now(const OutputGrid& g, int n, Array3& u, double resinit[neq], double rtime, double dtmin)
+{
+        /* 
+    Uses global variable(s): imms, ifieldfmt, fp2
+    Uses: g (grid of u), n, u, resinit, rtime, dtmin
+    To modify: <none> 
+    Writes output and restart files.
+    */
+   
+    int i;                       /* i index (x direction) */
+    int j;                       /* j index (y direction) */
+    int k;                       /* k index (# of equations) */
+
+    double x;       /* Temporary variable for x location */
+    double y;       /* Temporary variable for y location */
+    double ue[neq]; /* Exact solution at the node (MMS) */
+
+    /* Field output: binary VTK, or Tecplot ASCII zones appended to 'cavity.dat' */
+    if(ifieldfmt==1)
+    {
+        write_field_vtk( g, n, u, rtime );
+        write_restart( "./restart.out", g, n, u, resinit, rtime, dtmin );
+        return;
+    }
+    fprintf(fp2, "zone T=\"n=%d\"\n",n);
+    fprintf(fp2, "I= %d J= %d\n",g.ni, g.nj);
+    fprintf(fp2, "DATAPACKING=POINT\n");
+
+    if(imms==1) 
+    {
+        const Array3& uexact = *g.mms->u;
+        for(i=0; i<g.ni; i++)
+        {
+            for(j=0; j<g.nj; j++)
+            {
+                x = g.x[i];
+                y = g.y[j];
+                for(k=0; k<neq; k++)
+                {
+                    ue[k] = uexact(i,j,k);
+                }
+                fprintf(fp2,"%e %e %e %e %e %e %e %e %e %e %e\n", x, y, u(i,j,0), u(i,j,1), u(i,j,2), 
+                                               ue[0], ue[1], ue[2], 
+                                                (u(i,j,0)-ue[0]), (u(i,j,1)-ue[1]), (u(i,j,2)-ue[2]));
+            }
+        }    
+    }
+    else if(imms==0)
+    {
+        for(i=0; i<g.ni; i++)
+        {
+            for(j=0; j<g.nj; j++)
+            {
+                x = g.x[i];
+                y = g.y[j];
+                fprintf(fp2,"%e %e %e %e %e\n", x, y, u(i,j,0), u(i,j,1), u(i,j,2));
+            }
+        }
+    }
+    else
+    {
+        printf("ERROR: imms must equal 0 or 1!\n");
+        exit (EXIT_FAILED);
+    }
+
+    /* Restart file: overwrites every 'iterout' iteration */
+    write_restart( "./restart.out", g, n, u, resinit, rtime, dtmin );
+}
+
+/**************************************************************************/
+
+/*--- Binary VTK field output (ifieldfmt = 1) -----------------------------------------*/
+/*--- One RectilinearGrid file 'cavity_<n>.vtr' per output step, each variable one    ---*/
+/*--- contiguous appended block (x index fastest), optionally Float32 and/or zlib     ---*/
+/*--- compressed (-DHAVE_ZLIB -lz). 'cavity.pvd' lists the steps with their times so  ---*/
+/*--- ParaView opens the whole run as one time series.                               ---*/
+
+void vtk_append_block( vector<unsigned char>& out, const void* data, size_t nbytes )
+{
+    /* 
+    Uses global variable(s): ifieldzlib
+    Appends one VTK appended-data block: a UInt64 size header then the bytes
+    (zlib: one compressed block with the vtkZLibDataCompressor header)
+    */
+    uint64_t hdr[4];
+
+#ifdef HAVE_ZLIB
+    if(ifieldzlib==1)
+    {
+        static vector<unsigned char> cbuf;  /* Reused: only one output path writes at a time */
+        uLongf csize = compressBound(nbytes);
+        cbuf.resize(csize);
+        if(compress2(cbuf.data(), &csize, (const Bytef*)data, nbytes, 6)!=Z_OK)
+        {
+            printf("ERROR: zlib compression of the field output failed!\n");
+            exit (EXIT_FAILED);
+        }
+        hdr[0] = 1;                 /* Number of blocks */
+        hdr[1] = nbytes;            /* Uncompressed block size */
+        hdr[2] = 0;                 /* Last block is not partial */
+        hdr[3] = csize;             /* Compressed size of the block */
+        out.insert(out.end(), (unsigned char*)hdr, (unsigned char*)(hdr+4));
+        out.insert(out.end(), cbuf.begin(), cbuf.begin()+csize);
+        return;
+    }
+#endif
+    hdr[0] = nbytes;
+    out.insert(out.end(), (unsigned char*)hdr, (unsigned char*)(hdr+1));
+    out.insert(out.end(), (const unsigned char*)data, (const unsigned char*)data + nbytes);
+}
+
+/**************************************************************************/
+
+void vtk_append_array( vector<unsigned char>& out, const double* vals, size_t nvals, bool single )
+{
+    /* Appends nvals values as Float64, or as Float32 when 'single' */
+    if(single)
+    {
+        static vector<float> f;             /* Reused: only one output path writes at a time */
+        f.assign(vals, vals + nvals);
+        vtk_append_block( out, f.data(), nvals*sizeof(float) );
+    }
+    else
+    {
+        vtk_append_block( out, vals, nvals*sizeof(double) );
+    }
+}
+
+/**************************************************************************/
+
+void write_field_vtk( const OutputGrid& g, int n, Array3& u, double rtime )
+{
+    /* 
+    Uses global variable(s): neq, imms, ifield32, ifieldzlib
+    Uses: g (grid of u), n, u, rtime
+    To modify: <none>
+    Writes 'cavity_<n>.vtr' and rewrites 'cavity.pvd'
+    */
+    static vector<int> pvdstep;         /* Steps written so far (for 'cavity.pvd') */
+    static vector<double> pvdtime;
+    static vector<double> vals;         /* Scratch, reused by every output (one output path writes at a time) */
+    static vector<double> xc, yc, zc;
+    static vector<unsigned char> app;
+    static vector<size_t> offset;
+
+    const char* names[9] = {"p", "u", "v", "p-exact", "u-exact", "v-exact", "DE-p", "DE-u", "DE-v"};
+    const int nvar = (imms==1) ? 3*neq : neq;
+    const size_t npts = (size_t)g.ni*g.nj;
+    const bool single = (ifield32==1);
+    char fname[64];
+    uint16_t one16 = 1;
+    bool little = (*(unsigned char*)&one16==1);
+
+    /* Variables as contiguous blocks in VTK point order (i fastest); exact solution once per node */
+    vals.resize(nvar*npts);
+    xc.resize(g.ni);
+    yc.resize(g.nj);
+    zc.assign(1, zero);
+    for(int i=0; i<g.ni; i++) xc[i] = g.x[i];
+    for(int j=0; j<g.nj; j++) yc[j] = g.y[j];
+    for(int j=0; j<g.nj; j++)
+    {
+        for(int i=0; i<g.ni; i++)
+        {
+            size_t m = i + (size_t)j*g.ni;
+            for(int k=0; k<neq; k++)
+            {
+                vals[k*npts + m] = u(i,j,k);
+                if(imms==1)
+                {
+                    double ue = (*g.mms->u)(i,j,k);
+                    vals[(neq+k)*npts + m] = ue;
+                    vals[(2*neq+k)*npts + m] = u(i,j,k) - ue;
+                }
+            }
+        }
+    }
+
+    /* Encode every array first: the XML header needs their offsets */
+    app.clear();
+    offset.clear();
+    for(int v=0; v<nvar; v++)
+    {
+        offset.push_back(app.size());
+        vtk_append_array( app, &vals[v*npts], npts, single );
+    }
+    size_t xoff = app.size();  vtk_append_array( app, xc.data(), g.ni, false );
+    size_t yoff = app.size();  vtk_append_array( app, yc.data(), g.nj, false );
+    size_t zoff = app.size();  vtk_append_array( app, zc.data(), 1, false );
+
+    snprintf(fname, sizeof(fname), "./cavity_%06d.vtr", n);
+    FILE* fp = fopen(fname, "wb");
+    if(fp==NULL)
+    {
+        printf("ERROR: could not open '%s' for writing!\n", fname);
+        exit (EXIT_FAILED);
+    }
+    fprintf(fp, "<?xml version=\"1.0\"?>\n");
+    fprintf(fp, "<VTKFile type=\"RectilinearGrid\" version=\"1.0\" byte_order=\"%s\" header_type=\"UInt64\"%s>\n",
+            little ? "LittleEndian" : "BigEndian",
+            (ifieldzlib==1) ? " compressor=\"vtkZLibDataCompressor\"" : "");
+    fprintf(fp, "  <RectilinearGrid WholeExtent=\"0 %d 0 %d 0 0\">\n", g.ni-1, g.nj-1);
+    fprintf(fp, "    <FieldData>\n");
+    fprintf(fp, "      <DataArray type=\"Float64\" Name=\"TIME\" NumberOfTuples=\"1\" format=\"ascii\">%.17g</DataArray>\n", rtime);
+    fprintf(fp, "      <DataArray type=\"Int32\" Name=\"CYCLE\" NumberOfTuples=\"1\" format=\"ascii\">%d</DataArray>\n", n);
+    fprintf(fp, "    </FieldData>\n");
+    fprintf(fp, "    <Piece Extent=\"0 %d 0 %d 0 0\">\n", g.ni-1, g.nj-1);
+    fprintf(fp, "      <PointData Scalars=\"p\">\n");
+    for(int v=0; v<nvar; v++)
+    {
+        fprintf(fp, "        <DataArray type=\"%s\" Name=\"%s\" format=\"appended\" offset=\"%lu\"/>\n",
+                single ? "Float32" : "Float64", names[v], (unsigned long)offset[v]);
+    }
+    fprintf(fp, "      </PointData>\n");
+    fprintf(fp, "      <Coordinates>\n");
+    fprintf(fp, "        <DataArray type=\"Float64\" Name=\"x\" format=\"appended\" offset=\"%lu\"/>\n", (unsigned long)xoff);
+    fprintf(fp, "        <DataArray type=\"Float64\" Name=\"y\" format=\"appended\" offset=\"%lu\"/>\n", (unsigned long)yoff);
+    fprintf(fp, "        <DataArray type=\"Float64\" Name=\"z\" format=\"appended\" offset=\"%lu\"/>\n", (unsigned long)zoff);
+    fprintf(fp, "      </Coordinates>\n");
+    fprintf(fp, "    </Piece>\n");
+    fprintf(fp, "  </RectilinearGrid>\n");
+    fprintf(fp, "  <AppendedData encoding=\"raw\">\n_");
+    fwrite(app.data(), 1, app.size(), fp);
+    fprintf(fp, "\n  </AppendedData>\n</VTKFile>\n");
+    fclose(fp);
+
+    /* Time series index (the final output can repeat the last step) */
+    if(!pvdstep.empty() && pvdstep.back()==n)
+    {
+        pvdtime.back() = rtime;
+    }
+    else
+    {
+        pvdstep.push_back(n);
+        pvdtime.push_back(rtime);
+    }
+    fp = fopen("./cavity.pvd", "w");
+    if(fp==NULL)
+    {
+        printf("ERROR: could not open 'cavity.pvd' for writing!\n");
+        exit (EXIT_FAILED);
+    }
+    fprintf(fp, "<?xml version=\"1.0\"?>\n<VTKFile type=\"Collection\" version=\"1.0\">\n  <Collection>\n");
+    for(size_t s=0; s<pvdstep.size(); s++)
+    {
+        fprintf(fp, "    <DataSet timestep=\"%.17g\" file=\"cavity_%06d.vtr\"/>\n", pvdtime[s], pvdstep[s]);
+    }
+    fprintf(fp, "  </Collection>\n</VTKFile>\n");
+    fclose(fp);
+}
+/**************************************************************************/
+
+/*--- Restart files -------------------------------------------------------------------*/
+/*--- Binary (irstrfmt = 1): RestartHeader, then p, u, v for every node in (i, j, k)  ---*/
+/*--- order as native doubles. The checksum covers the header (with checksum = 0)     ---*/
+/*--- and the data. Written to a temporary file and renamed, so a crash while writing ---*/
+/*--- never leaves a partial 'restart.out'. Legacy ASCII (irstrfmt = 0) is the old     ---*/
+/*--- "x y p u v" text. 'read_restart' tells the two apart from the first bytes.      ---*/
+
+#define RESTART_MAGIC   "DCAVRST"   /* 8 bytes with the terminating zero */
+#define RESTART_VERSION 2          /* 2: dtmin in the header */
+
+struct RestartHeader
+{
+    char     magic[8];              /* RESTART_MAGIC */
+    uint32_t version;               /* RESTART_VERSION */
+    uint32_t byteorder;             /* 0x01020304 as written (detects a different endianness) */
+    int32_t  imax, jmax, neqs;      /* Grid size and number of variables */
+    int32_t  n;                     /* Iteration number of the solution */
+    double   rtime;                 /* Simulation time */
+    double   dtmin;                 /* Running minimum time step (rtime advances by it) */
+    double   resinit[neq];          /* Initial iterative residuals (for scaling) */
+    uint64_t checksum;              /* FNV-1a (64-bit words) of header and data */
+};
+
+  double* restartdata = NULL;       /* Packed field of the binary restart file, carved once by 'restart_buffer_setup' */
+  size_t restartsize = 0;           /* Doubles it holds (the largest grid written) */
+
+uint64_t restart_checksum( const RestartHeader& h, const double* data, size_t ndata )
+{
+    /* FNV-1a over 64-bit words: the header with checksum = 0, then the field data */
+    RestartHeader hc = h;
+    uint64_t hash = 14695981039346656037ULL;
+    uint64_t word;
+
+    hc.checksum = 0;
+    const unsigned char* hb = (const unsigned char*)&hc;
+    for(size_t b=0; b<sizeof(hc); b++)
+    {
+        hash = (hash ^ hb[b])*1099511628211ULL;
+    }
+    for(size_t m=0; m<ndata; m++)
+    {
+        memcpy(&word, &data[m], sizeof(word));
+        hash = (hash ^ word)*1099511628211ULL;
+    }
+    return hash;
+}
+
+/**************************************************************************/
+
+size_t restart_buffer_bytes( int ni, int nj )
+{
+    /* Returns: workspace bytes 'restart_buffer_setup' carves for an ni x nj grid */
+    const size_t n = (size_t)ni*nj*neq;
+    return (n*sizeof(double) + ARRAY3_ALIGN - 1)/ARRAY3_ALIGN*ARRAY3_ALIGN;
+}
+
+/**************************************************************************/
+
+void restart_buffer_setup( int ni, int nj )
+{
+    /* 
+    Uses global variable(s): neq
+    To modify: restartdata, restartsize (room for the restart files of grids up to ni x nj)
+    One output path writes restart files at a time (the writer thread, or the main thread
+    when the output is synchronous), so they share the buffer.
+    */
+    restartsize = (size_t)ni*nj*neq;
+    restartdata = (double*)workspace.carve(restartsize*sizeof(double));
+}
+
+/**************************************************************************/
+
+void write_restart( const char* fname, const OutputGrid& g, int n, Array3& u, double resinit[neq], double rtime, double dtmin )
+{
+    /* 
+    Uses global variable(s): neq, irstrfmt, restartdata, restartsize
+    Uses: fname, g (grid of u), n, u, resinit, rtime, dtmin
+    To modify: <none>
+    Writes a restart file, 'restart.out' for the solution output (binary or legacy ASCII, see irstrfmt;
+    the ASCII file has no dtmin)
+    */
+    if(!save_restart( fname, g, n, u, resinit, rtime, dtmin ))
+    {
+        exit (EXIT_FAILED);
+    }
+}
+
+/**************************************************************************/
+
+bool save_restart( const char* fname, const OutputGrid& g, int n, Array3& u, double resinit[neq], double rtime, double dtmin )
+{
+    /* 
+    Uses global variable(s): neq, irstrfmt, restartdata, restartsize
+    Uses: fname, g (grid of u), n, u, resinit, rtime, dtmin
+    To modify: <none>
+    Same as 'write_restart', but a binary file that cannot be written returns false (after the
+    error message) instead of stopping the run, so a verification level can fail on its own.
+    */
+    if(irstrfmt==0)
+    {
+        write_restart_ascii( fname, g, n, u, resinit, rtime );
+        return true;
+    }
+
+    char tmpname[256];
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", fname);
+    size_t ndata = (size_t)g.ni*g.nj*neq;
+    double* data = restartdata;
+    size_t m = 0;
+
+    if(ndata>restartsize)
+    {
+        printf("ERROR: restart buffer for %zu values, %d x %d needs %zu (see 'restart_buffer_setup')!\n", restartsize, g.ni, g.nj, ndata);
+        exit (EXIT_FAILED);
+    }
+
+    for(int i=0; i<g.ni; i++)
+    {
+        for(int j=0; j<g.nj; j++)
+        {
+            for(int k=0; k<neq; k++)
+            {
+                data[m++] = u(i,j,k);
+            }
+        }
+    }
+
+    RestartHeader h;
+    memset(&h, 0, sizeof(h));
+    strcpy(h.magic, RESTART_MAGIC);
+    h.version = RESTART_VERSION;
+    h.byteorder = 0x01020304;
+    h.imax = g.ni;
+    h.jmax = g.nj;
+    h.neqs = neq;
+    h.n = n;
+    h.rtime = rtime;
+    h.dtmin = dtmin;
+    for(int k=0; k<neq; k++)
+    {
+        h.resinit[k] = resinit[k];
+    }
+    h.checksum = restart_checksum(h, data, ndata);
+
+    fp3 = fopen(tmpname,"wb");
+    if(fp3==NULL)
+    {
+        printf("ERROR: could not open '%s' for writing!\n", tmpname);
+        return false;
+    }
+    bool ok = (fwrite(&h, sizeof(h), 1, fp3)==1) && (fwrite(data, sizeof(double), ndata, fp3)==ndata);
+    ok = (fflush(fp3)==0) && ok;
+#ifndef _WIN32
+    ok = (fsync(fileno(fp3))==0) && ok;     /* On disk before the rename replaces the old file */
+#endif
+    ok = (fclose(fp3)==0) && ok;
+    if(!ok)
+    {
+        printf("ERROR: failed writing '%s'!\n", tmpname);
+        return false;
+    }
+#ifdef _WIN32
+    remove(fname);                          /* rename does not replace an existing file on Windows */
+#endif
+    if(rename(tmpname, fname)!=0)
+    {
+        printf("ERROR: could not rename '%s' to '%s'!\n", tmpname, fname);
+        return false;
+    }
+    return true;
+}
+
+/**************************************************************************/
+
+void write_restart_ascii( const char* fname, const OutputGrid& g, int n, Array3& u, double resinit[neq], double rtime )
+{
+    /* 
+    Uses: fname, g (grid of u), n, u, resinit, rtime
+    To modify: <none>
+    Writes a legacy ASCII restart file (overwritten in place)
+    */
+    int i;                       /* i index (x direction) */
+    int j;                       /* j index (y direction) */
+
+    double x;       /* Temporary variable for x location */
+    double y;       /* Temporary variable for y location */
+
+    fp3 = fopen(fname,"w");       
+    fprintf(fp3,"%d %e\n", n, rtime);    
+    fprintf(fp3,"%e %e %e\n", resinit[0], resinit[1], resinit[2]);
+    for(i=0; i<g.ni; i++)
+    {
+        for(j=0; j<g.nj; j++)
+        {
+            x = g.x[i];
+            y = g.y[j];
+            fprintf(fp3,"%e %e %e %e %e\n", x, y, u(i,j,0), u(i,j,1), u(i,j,2));
+        }
+    }
+    fclose(fp3);
+}
+
+/**************************************************************************/
+
+void read_restart( const char* fname, int ni, int nj, int& ninit, double& rtime, double& dtmin, double resinit[neq], Array3& u )
+{
+    /* 
+    Uses global variable(s): neq
+    Uses: fname, ni, nj (grid of u)
+    To modify: ninit, rtime, dtmin, resinit, u
+    Reads a restart file ('restart.in' for irstr = 1): binary (memory-mapped where
+    available, checked against the grid size ni x nj and the checksum) or legacy ASCII.
+    A legacy ASCII file holds no dtmin, so the running minimum starts over (1e99).
+    */
+    char magic[8] = {0};
+
+    fp4 = fopen(fname,"rb"); /* Note: 'restart.in' must exist! */
+    if (fp4==NULL)
+    {
+        printf("Error opening restart file. Stopping.\n");
+        exit (EXIT_FAILED);
+    }
+    size_t nmagic = fread(magic, 1, sizeof(magic), fp4);
+    fclose(fp4);
+    if(nmagic!=sizeof(magic) || memcmp(magic, RESTART_MAGIC, sizeof(magic))!=0)
+    {
+        dtmin = 1.0e99;
+        read_restart_ascii( fname, ni, nj, ninit, rtime, resinit, u );
+        return;
+    }
+
+    /* Map (or read) the whole file */
+    size_t ndata = (size_t)ni*nj*neq;
+    size_t fsize = 0;
+    const char* buf = NULL;
+#ifdef _WIN32
+    char* rbuf = NULL;
+    fp4 = fopen(fname,"rb");
+    fseek(fp4, 0, SEEK_END);
+    fsize = (size_t)ftell(fp4);
+    fseek(fp4, 0, SEEK_SET);
+    rbuf = new char[fsize];
+    if(fread(rbuf, 1, fsize, fp4)!=fsize)
+    {
+        printf("ERROR: could not read '%s'!\n", fname);
+        exit (EXIT_FAILED);
+    }
+    fclose(fp4);
+    buf = rbuf;
+#else
+    int fd = open(fname, O_RDONLY);
+    struct stat st;
+    if(fd<0 || fstat(fd, &st)!=0)
+    {
+        printf("ERROR: could not open '%s'!\n", fname);
+        exit (EXIT_FAILED);
+    }
+    fsize = (size_t)st.st_size;
+    void* map = mmap(NULL, fsize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map==MAP_FAILED)
+    {
+        printf("ERROR: could not map '%s'!\n", fname);
+        exit (EXIT_FAILED);
+    }
+    buf = (const char*)map;
+#endif
+
+    RestartHeader h;
+    if(fsize<sizeof(h))
+    {
+        printf("ERROR: restart file '%s' is truncated!\n", fname);
+        exit (EXIT_FAILED);
+    }
+    memcpy(&h, buf, sizeof(h));
+    if(h.version!=RESTART_VERSION || h.byteorder!=0x01020304)
+    {
+        printf("ERROR: restart file '%s' has version %u / byte order %08x, expected %d / 01020304!\n",
+               fname, (unsigned)h.version, (unsigned)h.byteorder, RESTART_VERSION);
+        exit (EXIT_FAILED);
+    }
+    if(h.imax!=ni || h.jmax!=nj || h.neqs!=neq)
+    {
+        printf("ERROR: restart file '%s' is for a %d x %d grid (%d variables), expected %d x %d!\n",
+               fname, (int)h.imax, (int)h.jmax, (int)h.neqs, ni, nj);
+        exit (EXIT_FAILED);
+    }
+    if(fsize!=sizeof(h) + ndata*sizeof(double))
+    {
+        printf("ERROR: restart file '%s' has the wrong size (truncated?)!\n", fname);
+        exit (EXIT_FAILED);
+    }
+    const double* data = (const double*)(buf + sizeof(h));  /* Map is page aligned, header is 8-byte aligned */
+    if(restart_checksum(h, data, ndata)!=h.checksum)
+    {
+        printf("ERROR: checksum mismatch in restart file '%s'!\n", fname);
+        exit (EXIT_FAILED);
+    }
+
+    ninit = h.n;
+    rtime = h.rtime;
+    dtmin = h.dtmin;
+    for(int k=0; k<neq; k++)
+    {
+        resinit[k] = h.resinit[k];
+    }
+    size_t m = 0;
+    for(int i=0; i<ni; i++)
+    {
+        for(int j=0; j<nj; j++)
+        {
+            for(int k=0; k<neq; k++)
+            {
+                u(i,j,k) = data[m++];
+            }
+        }
+    }
+
+#ifdef _WIN32
+    delete [] rbuf;
+#else
+    munmap(map, fsize);
+#endif
+}
+
+/**************************************************************************/
+
+void read_restart_ascii( const char* fname, int ni, int nj, int& ninit, double& rtime, double resinit[neq], Array3& u )
+{
+    /* 
+    Uses: fname, ni, nj (grid of u)
+    To modify: ninit, rtime, resinit, u
+    Reads a legacy ASCII restart file (6 significant digits per value)
+    */
+    int i;                       /* i index (x direction) */
+    int j;                       /* j index (y direction) */
+
+    double x;       /* Temporary variable for x location */
+    double y;       /* Temporary variable for y location */
+
+    fp4 = fopen(fname,"r");
+    if (fp4==NULL)
+    {
+        printf("Error opening restart file. Stopping.\n");
+        exit (EXIT_FAILED);
+    }      
+    fscanf(fp4, "%d %lf", &ninit, &rtime); /* Need to known current iteration # and time value */
+    fscanf(fp4, "%lf %lf %lf", &resinit[0], &resinit[1], &resinit[2]); /* Needs initial iterative residuals for scaling */
+    for(i=0; i<ni; i++)
+    {
+        for(j=0; j<nj; j++)
+        {
+            fscanf(fp4, "%lf %lf %lf %lf %lf", &x, &y, &u(i,j,0), &u(i,j,1), &u(i,j,2)); 
+        }
+    }
+    fclose(fp4);
+}
+
+/**************************************************************************/
+
+/*--- Background solution output (iasync = 1) --------------------------------------*/
+/*--- write_output calls from main copy u into one of 'outqueue' pooled snapshots   ---*/
+/*--- and return; the writer thread formats and writes them in order. When every    ---*/
+/*--- snapshot is still waiting to be written the solver blocks (back-pressure).    ---*/
+/*--- finish_output_writer drains the queue; it is also registered with atexit, so  ---*/
+/*--- 'exit' on an error still flushes everything queued before it.                ---*/
+
+#ifdef ASYNC_OUTPUT
+void output_writer_loop()
+{
+    /* 
+    Uses global variable(s): outsnap, outhead, outcount, outstop, outqueue, fp2
+    Writer thread: writes the oldest queued snapshot until told to stop and the queue is empty
+    */
+    for(;;)
+    {
+        std::unique_lock<std::mutex> lock(outmutex);
+#ifdef INSTRUMENT
+        outready.wait(lock, []{ return outcount>0 || outstop || metricsreq.load(); });
+        if(metricsreq.exchange(false))
+        {
+            lock.unlock();
+            INSTR_FLUSH();
+            continue;
+        }
+#else
+        outready.wait(lock, []{ return outcount>0 || outstop; });
+#endif
+        if(outcount==0) return;     /* Stopped and drained */
+        OutputSnapshot& snap = outsnap[outhead];
+        lock.unlock();
+
+        write_output_now( snap.grid, snap.n, *snap.u, snap.resinit, snap.rtime, snap.dtmin );
+        if(fp2!=NULL) fflush(fp2);
+        INSTR_FLUSH();
+
+        lock.lock();
+        outhead = (outhead + 1)%outqueue;
+        outcount--;
+        outfree.notify_one();
+    }
+}
+#endif
+
+/**************************************************************************/
+
+void start_output_writer()
+{
+    /* 
+    Uses global variable(s): iasync, outqueue, imax, jmax, neq
+    To modify: outsnap, outthread
+    */
+    if(iasync!=0 && iasync!=1)
+    {
+        printf("ERROR: iasync must equal 0 or 1!\n");
+        exit (EXIT_FAILED);
+    }
+    if(iasync==0) return;
+#ifdef ASYNC_OUTPUT
+    if(outqueue<1 || outqueue>MAXOUTQUEUE)
+    {
+        printf("ERROR: outqueue must be between 1 and %d!\n", MAXOUTQUEUE);
+        exit (EXIT_FAILED);
+    }
+    for(int b=0; b<outqueue; b++)
+    {
+        outsnap[b].u = new Array3(imax, jmax, neq, workspace);
+        outsnap[b].x.reserve(imax);
+        outsnap[b].y.reserve(jmax);
+    }
+    outthread = new std::thread(output_writer_loop);
+    atexit(finish_output_writer);
+#else
+    printf("Note: built without thread support, solution output is synchronous (iasync ignored)\n");
+#endif
+}
+
+/**************************************************************************/
+
+void write_output( int n, Array3& u, double resinit[neq], double rtime, double dtmin )
+{
+    /* 
+    Uses global variable(s): iasync, outqueue, xgrid, ygrid
+    Writes output and restart files now (iasync = 0), or queues a copy of u and its grid for the writer thread
+    */
+#ifdef ASYNC_OUTPUT
+    if(outthread!=NULL)
+    {
+        std::unique_lock<std::mutex> lock(outmutex);
+        if(outcount==outqueue)
+        {
+            /* Writer is behind: wait for a free snapshot */
+            double twait = wall_time();
+            outfree.wait(lock, []{ return outcount<outqueue; });
+            outwaits++;
+            outwaittime += wall_time() - twait;
+        }
+        OutputSnapshot& snap = outsnap[(outhead + outcount)%outqueue];
+        lock.unlock();
+
+        /* Only this thread adds snapshots, so the slot stays ours until outcount++ */
+        snap.u->copyData(u);
+        snap.x.assign(xgrid.begin(), xgrid.end());
+        snap.y.assign(ygrid.begin(), ygrid.end());
+        snap.grid = current_output_grid();
+        snap.grid.x = snap.x.data();
+        snap.grid.y = snap.y.data();
+        snap.n = n;
+        snap.rtime = rtime;
+        snap.dtmin = dtmin;
+        for(int k=0; k<neq; k++)
+        {
+            snap.resinit[k] = resinit[k];
+        }
+
+        lock.lock();
+        outcount++;
+        outwrites++;
+        outready.notify_one();
+        return;
+    }
+#endif
+    write_output_now( current_output_grid(), n, u, resinit, rtime, dtmin );
+}
+
+/**************************************************************************/
+
+void finish_output_writer()
+{
+    /* 
+    Uses global variable(s): outthread
+    Waits until every queued snapshot is written and stops the writer thread (safe to call twice)
+    */
+#ifdef ASYNC_OUTPUT
+    if(outthread==NULL) return;
+    if(std::this_thread::get_id()==outthread->get_id()) return;    /* 'exit' from inside the writer */
+    {
+        std::lock_guard<std::mutex> lock(outmutex);
+        outstop = true;
+    }
+    outready.notify_one();
+    outthread->join();
+    delete outthread;
+    outthread = NULL;
+    printf("Background output: %d snapshots, solver waited %d times (%.3f s) for the writer\n",
+           outwrites, outwaits, outwaittime);
+#endif
+}
+
+/**************************************************************************/
+
+/*--- Live monitor (ilive = 1) ----------------------------------------------------------*/
+/*--- Every liveevery iterations the solver samples u on a livesize x livesize grid     ---*/
+/*--- into a staging buffer and hands it to the monitor thread. That thread copies it,  ---*/
+/*--- with the residuals, into 'live.bin', a file mapped shared, so a viewer mapping    ---*/
+/*--- the same file sees it at once, without any file I/O ('live_monitor.py'). Each     ---*/
+/*--- update is bracketed by the seq counter (odd while writing): a reader copies and   ---*/
+/*--- retries if seq was odd or changed. The solver never waits for the monitor: while  ---*/
+/*--- a snapshot is still staged, the next one is dropped.                              ---*/
+
+size_t live_stage_bytes()
+{
+    /* Uses global variable(s): imax, jmax, livesize. Returns: workspace bytes of the staging buffer */
+    const size_t n = (size_t)neq*min(livesize, imax)*min(livesize, jmax);
+    return (n*sizeof(float) + ARRAY3_ALIGN - 1)/ARRAY3_ALIGN*ARRAY3_ALIGN;
+}
+
+/**************************************************************************/
+
+void live_write( const LiveSnapshot& snap )
+{
+    /* 
+    Uses global variable(s): livemap, liveni, livenj, livepublished
+    Copies snap into 'live.bin' (the monitor thread, or the solver without thread support)
+    */
+#ifndef _WIN32
+    LiveHeader *h = (LiveHeader*)livemap;
+    double *hist = (double*)(livemap + sizeof(LiveHeader));
+    float *field = (float*)(hist + 4*LIVEHIST) + liveni + livenj;
+    const uint64_t seq = h->seq.load(std::memory_order_relaxed);
+
+    h->seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    double *rec = hist + 4*(h->nrec%LIVEHIST);
+    rec[0] = (double)snap.n;
+    for(int k=0; k<neq; k++)
+    {
+        rec[1+k] = snap.res[k];
+        h->res[k] = snap.res[k];
+    }
+    h->nrec++;
+    h->n = snap.n;
+    h->rtime = snap.rtime;
+    h->conv = snap.conv;
+    memcpy(field, snap.field, (size_t)neq*liveni*livenj*sizeof(float));
+
+    h->seq.store(seq + 2, std::memory_order_release);
+    livepublished++;
+#endif
+}
+
+/**************************************************************************/
+
+#ifdef ASYNC_OUTPUT
+void live_monitor_loop()
+{
+    /* 
+    Uses global variable(s): livesnap, livepending, livestop
+    Monitor thread: publishes each staged snapshot until told to stop
+    */
+    for(;;)
+    {
+        std::unique_lock<std::mutex> lock(livemutex);
+        liveready.wait(lock, []{ return livepending || livestop; });
+        if(!livepending) return;    /* Stopped, nothing staged */
+        lock.unlock();
+
+        live_write(livesnap);       /* The solver does not touch livesnap while it is pending */
+
+        lock.lock();
+        livepending = false;
+        liveidle.notify_one();
+    }
+}
+#endif
+
+/**************************************************************************/
+
+void start_live_monitor()
+{
+    /* 
+    Uses global variable(s): ilive, liveevery, livesize, imax, jmax, xgrid, ygrid
+    To modify: livemap, livebytes, liveni, livenj, livenext, livesnap, livethread
+    Creates 'live.bin' in the current directory (one per sweep or verification case)
+    */
+    if(ilive!=0 && ilive!=1)
+    {
+        printf("ERROR: ilive must equal 0 or 1!\n");
+        exit (EXIT_FAILED);
+    }
+    if(ilive==0) return;
+    if(liveevery<1 || livesize<2)
+    {
+        printf("ERROR: ilive = 1 needs liveevery >= 1 and livesize >= 2!\n");
+        exit (EXIT_FAILED);
+    }
+#ifdef _WIN32
+    printf("ERROR: ilive = 1 needs POSIX shared file mappings (not available on Windows builds)!\n");
+    exit (EXIT_FAILED);
+#else
+    liveni = min(livesize, imax);
+    livenj = min(livesize, jmax);
+    livebytes = sizeof(LiveHeader) + 4*LIVEHIST*sizeof(double) + ((size_t)liveni + livenj + (size_t)neq*liveni*livenj)*sizeof(float);
+
+    int fd = open("live.bin", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd<0 || ftruncate(fd, (off_t)livebytes)!=0)
+    {
+        printf("ERROR: could not create the live monitor file 'live.bin'!\n");
+        exit (EXIT_FAILED);
+    }
+    void *p = mmap(NULL, livebytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);                      /* The mapping stays valid */
+    if(p==MAP_FAILED)
+    {
+        printf("ERROR: could not map the live monitor file 'live.bin'!\n");
+        exit (EXIT_FAILED);
+    }
+    livemap = (unsigned char*)p;
+
+    /* Header and the coordinates of the downsampled grid (the file starts zeroed) */
+    LiveHeader *h = (LiveHeader*)livemap;
+    new (&h->seq) std::atomic<uint64_t>(0);
+    memcpy(h->magic, "CAVLIVE1", 8);
+    h->ni = liveni;
+    h->nj = livenj;
+    h->nvar = neq;
+    h->nhist = LIVEHIST;
+    h->status = LIVE_RUNNING;
+    float *coord = (float*)(livemap + sizeof(LiveHeader) + 4*LIVEHIST*sizeof(double));
+    for(int s=0; s<liveni; s++)
+    {
+        coord[s] = (float)(xmin + xgrid[((size_t)s*(imax-1) + (liveni-1)/2)/(liveni-1)]);
+    }
+    for(int t=0; t<livenj; t++)
+    {
+        coord[liveni+t] = (float)(ymin + ygrid[((size_t)t*(jmax-1) + (livenj-1)/2)/(livenj-1)]);
+    }
+
+    livesnap.field = (float*)workspace.carve((size_t)neq*liveni*livenj*sizeof(float));
+    livenext = 0;
+    livelast = -1;
+    livepublished = 0;
+    liveskipped = 0;
+#ifdef ASYNC_OUTPUT
+    livepending = false;
+    livestop = false;
+    livethread = new std::thread(live_monitor_loop);
+#endif
+    atexit(finish_live_monitor);
+    printf("Live monitor: 'live.bin', %d x %d field every %d iterations\n", liveni, livenj, liveevery);
+#endif
+}
+
+/**************************************************************************/
+
+void live_publish( int n, Array3& u, double res[neq], double rtime, double conv, bool wait )
+{
+    /* 
+    Uses global variable(s): imax, jmax, liveevery, liveni, livenj, ilazyp
+    To modify: livesnap, livenext, liveskipped
+    Stages a snapshot of u (sampled at the nearest nodes) and residuals res (normalized, from
+    the last monitored iteration) for the monitor thread. When one is still staged, it is
+    dropped, unless wait is set (the final snapshot).
+    */
+    if(livemap==NULL || n==livelast) return;
+    livenext = n - n%liveevery + liveevery;
+
+#ifdef ASYNC_OUTPUT
+    if(livethread!=NULL)
+    {
+        std::unique_lock<std::mutex> lock(livemutex);
+        if(livepending && !wait)
+        {
+            liveskipped++;
+            return;
+        }
+        liveidle.wait(lock, []{ return !livepending; });
+    }
+#endif
+
+    /* With ilazyp = 1 u carries the pressure level of the iteration: publish the rescaled one */
+    const double dp = (ilazyp==1) ? u((imax-1)/2,(jmax-1)/2,0) - reference_pressure() : zero;
+    for(int s=0; s<liveni; s++)
+    {
+        const int i = (int)(((size_t)s*(imax-1) + (liveni-1)/2)/(liveni-1));
+        for(int t=0; t<livenj; t++)
+        {
+            const int j = (int)(((size_t)t*(jmax-1) + (livenj-1)/2)/(livenj-1));
+            livesnap.field[(size_t)s*livenj + t] = (float)(u(i,j,0) - dp);
+            for(int k=1; k<neq; k++)
+            {
+                livesnap.field[((size_t)k*liveni + s)*livenj + t] = (float)u(i,j,k);
+            }
+        }
+    }
+    livesnap.n = n;
+    livelast = n;
+    livesnap.rtime = rtime;
+    livesnap.conv = conv;
+    for(int k=0; k<neq; k++)
+    {
+        livesnap.res[k] = res[k];
+    }
+
+#ifdef ASYNC_OUTPUT
+    if(livethread!=NULL)
+    {
+        std::lock_guard<std::mutex> lock(livemutex);
+        livepending = true;
+        liveready.notify_one();
+        return;
+    }
+#endif
+    live_write(livesnap);
+}
+
+/**************************************************************************/
+
+void end_live_monitor( int status )
+{
+    /* 
+    Uses global variable(s): livemap, livebytes, livethread
+    Publishes what is staged, stops the monitor thread, and leaves the final status in 'live.bin'
+    (the file stays for the viewer)
+    */
+    if(livemap==NULL) return;
+#ifdef ASYNC_OUTPUT
+    if(livethread!=NULL)
+    {
+        if(std::this_thread::get_id()==livethread->get_id()) return;    /* 'exit' from inside the monitor */
+        {
+            std::lock_guard<std::mutex> lock(livemutex);
+            livestop = true;
+        }
+        liveready.notify_one();
+        livethread->join();
+        delete livethread;
+        livethread = NULL;
+    }
+#endif
+#ifndef _WIN32
+    ((LiveHeader*)livemap)->status = status;
+    munmap(livemap, livebytes);
+#endif
+    livemap = NULL;
+    printf("Live monitor: %d snapshots published, %d dropped (monitor thread busy)\n", livepublished, liveskipped);
+}
+
+/**************************************************************************/
+
+void finish_live_monitor()
+{
+    /* Registered with atexit: a run that exits early (divergence, errors) ends as LIVE_ABORTED */
+    end_live_monitor(LIVE_ABORTED);
+}
+
+/**************************************************************************/
+
+double umms(double x, double y, int k)  
+{
+    /* 
+    Uses global variable(s): one, rpi, rlength
+    Inputs: x, y, k
+    To modify: <none>
+    Returns: umms
+    */
+
+    double ummstmp; /* Define return value for umms as double precision */
+
+    double termx;      /* Temp variable */
+    double termy;      /* Temp variable */
+    double termxy;     /* Temp variable */
+    double argx;       /* Temp variable */
+    double argy;       /* Temp variable */
+    double argxy;      /* Temp variable */  
+  
+    /* This function returns the MMS exact solution */
+  
+    argx = apx[k]*rpi*x/rlength;
+    argy = apy[k]*rpi*y/rlength;
+    argxy = apxy[k]*rpi*x*y/rlength/rlength;
+    termx = phix[k]*(fsinx[k]*sin(argx)+(one-fsinx[k])*cos(argx));
+    termy = phiy[k]*(fsiny[k]*sin(argy)+(one-fsiny[k])*cos(argy));
+    termxy = phixy[k]*(fsinxy[k]*sin(argxy)+(one-fsinxy[k])*cos(argxy));
+  
+    ummstmp = phi0[k] + termx + termy + termxy;
+ 
+    return ummstmp;  
+}
+
+/**************************************************************************/
+
+const MMSExact* mms_exact( int ni, int nj )
+{
+    /* 
+    Uses global variable(s): xmax, xmin, ymax, ymin, stretchx, stretchy, mmsgrid, nmmsgrids
+    To modify: mmsgrid, nmmsgrids (a new entry the first time a grid is used)
+    Returns: umms on the nodes and walls of the ni x nj grid, evaluated once per grid.
+    Entries are added only by the solver thread ('set_grid') and are complete before
+    nmmsgrids counts them, so the output thread can look them up.
+    */
+    const int n = nmmsgrids.load();
+
+    for(int m=0; m<n; m++)
+    {
+        if(mmsgrid[m].ni==ni && mmsgrid[m].nj==nj) return &mmsgrid[m];
+    }
+    if(n==MAXMMSGRIDS)
+    {
+        printf("ERROR: more than %d grids need the MMS exact solution!\n", MAXMMSGRIDS);
+        exit (EXIT_FAILED);
+    }
+
+    MMSExact& e = mmsgrid[n];
+    vector<double> xg;              /* Node coordinates of the grid */
+    vector<double> yg;
+    grid_coordinates(ni, xmax - xmin, stretchx, xg);
+    grid_coordinates(nj, ymax - ymin, stretchy, yg);
+    e.ni = ni;
+    e.nj = nj;
+    e.u = new Array3(ni, nj, neq);
+    e.iwall = new Array3(2, nj, neq);
+    e.jwall = new Array3(2, ni, neq);
+
+    #pragma omp parallel for
+    for(int i=0; i<ni; i++)
+    {
+        const double x = xg[i];
+        for(int j=0; j<nj; j++)
+        {
+            const double y = yg[j];
+            for(int k=0; k<neq; k++)
+            {
+                (*e.u)(i,j,k) = umms(x,y,k);
+            }
+        }
+    }
+    for(int j=0; j<nj; j++)
+    {
+        const double y = yg[j];
+        for(int k=0; k<neq; k++)
+        {
+            (*e.iwall)(0,j,k) = umms(xmin,y,k);
+            (*e.iwall)(1,j,k) = umms(xmax,y,k);
+        }
+    }
+    for(int i=0; i<ni; i++)
+    {
+        const double x = xg[i];
+        for(int k=0; k<neq; k++)
+        {
+            (*e.jwall)(0,i,k) = umms(x,ymin,k);
+            (*e.jwall)(1,i,k) = umms(x,ymax,k);
+        }
+    }
+
+    nmmsgrids.store(n+1);
+    return &e;
+}
+
+/**************************************************************************/
+
+void compute_source_terms( Array3& s )
+{
+    /* 
+    Uses global variable(s): imax, jmax, imms, rlength, xgrid, ygrid
+    To modify: s (source terms)
+    */
+
+    int i;                       /* i index (x direction) */
+    int j;                       /* j index (y direction) */
+    
+    double x;       /* Temporary variable for x location */
+    double y;       /* Temporary variable for y location */
+
+    /* Evaluate Source Terms Once at Beginning (only interior points; will be zero for standard cavity) */
+  
+    for(i=1; i<imax-1; i++)
+    {
+        for(j=1; j<jmax-1; j++)
+        {
+            x = xgrid[i];
+            y = ygrid[j];
+            s(i,j,0) = (double)(imms)*srcmms_mass(x,y);
+            s(i,j,1) = (double)(imms)*srcmms_xmtm(x,y);
+            s(i,j,2) = (double)(imms)*srcmms_ymtm(x,y);
+        }
+    }
+}
+
+/**************************************************************************/
+
+double srcmms_mass(double x, double y)  
+{
+    /* 
+    Uses global variable(s): rho, rpi, rlength
+    Inputs: x, y
+    To modify: <none>
+    Returns: srcmms_mass
+    */
+
+    double srcmasstmp; /* Define return value for srcmms_mass as double precision */
+
+    double dudx;    /* Temp variable: u velocity gradient in x direction */
+    double dvdy;  /* Temp variable: v velocity gradient in y direction */
+  
+    /* This function returns the MMS mass source term */
+
+    dudx = phix[1]*apx[1]*rpi/rlength*cos(apx[1]*rpi*x/rlength) + phixy[1]*apxy[1]*rpi*y/rlength/rlength * cos(apxy[1]*rpi*x*y/rlength/rlength);
+  
+    dvdy = -phiy[2]*apy[2]*rpi/rlength*sin(apy[2]*rpi*y/rlength) - phixy[2]*apxy[2]*rpi*x/rlength/rlength * sin(apxy[2]*rpi*x*y/rlength/rlength);
+
+    srcmasstmp = rho*dudx + rho*dvdy;
+
+    return srcmasstmp;
+} 
+
+/**************************************************************************/
+
+double srcmms_xmtm(double x, double y)  
+{
+    /* 
+    Uses global variable(s): rho, rpi, rmu, rlength
+    Inputs: x, y
+    To modify: <none>
+    Returns: srcmms_xmtm
+    */
+
+    double srcxmtmtmp; /* Define return value for srcmms_xmtm as double precision */
+
+    double dudx;    /* Temp variable: u velocity gradient in x direction */
+    double dudy;  /* Temp variable: u velocity gradient in y direction */
+    double termx;        /* Temp variable */
+    double termy;        /* Temp variable */
+    double termxy;       /* Temp variable */
+    double uvel;         /* Temp variable: u velocity */
+    double vvel;         /* Temp variable: v velocity */
+    double dpdx;         /* Temp variable: pressure gradient in x direction */
+    double d2udx2;       /* Temp variable: 2nd derivative of u velocity in x direction */
+    double d2udy2;       /* Temp variable: 2nd derivative of u velocity in y direction */
+
+    /*This function returns the MMS x-momentum source term */
+
+    termx = phix[1]*sin(apx[1]*rpi*x/rlength);
+    termy = phiy[1]*cos(apy[1]*rpi*y/rlength);
+    termxy = phixy[1]*sin(apxy[1]*rpi*x*y/rlength/rlength);
+    uvel = phi0[1] + termx + termy + termxy;
+  
+    termx = phix[2]*cos(apx[2]*rpi*x/rlength);
+    termy = phiy[2]*cos(apy[2]*rpi*y/rlength);
+    termxy = phixy[2]*cos(apxy[2]*rpi*x*y/rlength/rlength);
+    vvel = phi0[2] + termx + termy + termxy;
+  
+    dudx = phix[1]*apx[1]*rpi/rlength*cos(apx[1]*rpi*x/rlength) + phixy[1]*apxy[1]*rpi*y/rlength/rlength * cos(apxy[1]*rpi*x*y/rlength/rlength);
+  
+    dudy = -phiy[1]*apy[1]*rpi/rlength*sin(apy[1]*rpi*y/rlength) + phixy[1]*apxy[1]*rpi*x/rlength/rlength * cos(apxy[1]*rpi*x*y/rlength/rlength);
+  
+    dpdx = -phix[0]*apx[0]*rpi/rlength*sin(apx[0]*rpi*x/rlength) + phixy[0]*apxy[0]*rpi*y/rlength/rlength * cos(apxy[0]*rpi*x*y/rlength/rlength);
+
+    d2udx2 = -phix[1]*pow((apx[1]*rpi/rlength),2) * sin(apx[1]*rpi*x/rlength) - phixy[1]*pow((apxy[1]*rpi*y/rlength/rlength),2) * sin(apxy[1]*rpi*x*y/rlength/rlength); 
+ 
+    d2udy2 = -phiy[1]*pow((apy[1]*rpi/rlength),2) * cos(apy[1]*rpi*y/rlength) - phixy[1]*pow((apxy[1]*rpi*x/rlength/rlength),2) * sin(apxy[1]*rpi*x*y/rlength/rlength);
+  
+    srcxmtmtmp = rho*uvel*dudx + rho*vvel*dudy + dpdx - rmu*( d2udx2 + d2udy2 );
+
+    return srcxmtmtmp;
+} 
+
+/**************************************************************************/
+
+double srcmms_ymtm(double x, double y)  
+{
+    /* 
+    Uses global variable(s): rho, rpi, rmu, rlength
+    Inputs: x, y
+    To modify: <none>
+    Returns: srcmms_ymtm
+    */
+
+    double srcymtmtmp; /* Define return value for srcmms_ymtm as double precision */
+
+    double dvdx;         /* Temp variable: v velocity gradient in x direction */
+    double dvdy;         /* Temp variable: v velocity gradient in y direction */
+    double termx;        /* Temp variable */
+    double termy;        /* Temp variable */
+    double termxy;       /* Temp variable */
+    double uvel;         /* Temp variable: u velocity */
+    double vvel;         /* Temp variable: v velocity */
+    double dpdy;         /* Temp variable: pressure gradient in y direction */
+    double d2vdx2;       /* Temp variable: 2nd derivative of v velocity in x direction */
+    double d2vdy2;       /* Temp variable: 2nd derivative of v velocity in y direction */
+
+    /* This function returns the MMS y-momentum source term */
+
+    termx = phix[1]*sin(apx[1]*rpi*x/rlength);
+    termy = phiy[1]*cos(apy[1]*rpi*y/rlength);
+    termxy = phixy[1]*sin(apxy[1]*rpi*x*y/rlength/rlength);
+    uvel = phi0[1] + termx + termy + termxy;
+  
+    termx = phix[2]*cos(apx[2]*rpi*x/rlength);
+    termy = phiy[2]*cos(apy[2]*rpi*y/rlength);
+    termxy = phixy[2]*cos(apxy[2]*rpi*x*y/rlength/rlength);
+    vvel = phi0[2] + termx + termy + termxy;
+  
+    dvdx = -phix[2]*apx[2]*rpi/rlength*sin(apx[2]*rpi*x/rlength) - phixy[2]*apxy[2]*rpi*y/rlength/rlength * sin(apxy[2]*rpi*x*y/rlength/rlength);
+  
+    dvdy = -phiy[2]*apy[2]*rpi/rlength*sin(apy[2]*rpi*y/rlength) - phixy[2]*apxy[2]*rpi*x/rlength/rlength * sin(apxy[2]*rpi*x*y/rlength/rlength);
+  
+    dpdy = phiy[0]*apy[0]*rpi/rlength*cos(apy[0]*rpi*y/rlength) + phixy[0]*apxy[0]*rpi*x/rlength/rlength * cos(apxy[0]*rpi*x*y/rlength/rlength);
+  
+    d2vdx2 = -phix[2]*pow((apx[2]*rpi/rlength),2) * cos(apx[2]*rpi*x/rlength) - phixy[2]*pow((apxy[2]*rpi*y/rlength/rlength),2) * cos(apxy[2]*rpi*x*y/rlength/rlength);
+  
+    d2vdy2 = -phiy[2]*pow((apy[2]*rpi/rlength),2) * cos(apy[2]*rpi*y/rlength)   - phixy[2]*pow((apxy[2]*rpi*x/rlength/rlength),2) * cos(apxy[2]*rpi*x*y/rlength/rlength);
+  
+    srcymtmtmp = rho*uvel*dvdx + rho*vvel*dvdy + dpdy - rmu*( d2vdx2 + d2vdy2 );
+  
+    return srcymtmtmp;  
+}
+
+/**************************************************************************/
+
+template <int IMAX, int JMAX, bool COMBINED, class Real>
+void compute_time_step( Array3R<Real>& u, Array2T<Real>& dt, double& dtmin )
+{
+    /* 
+    Uses global variable(s): vel2ref, rmu, rho, dx, dy, cfl, rkappa, imax, jmax
+    Uses: u
+    To Modify: dt, dtmin (COMBINED for the multigrid levels, see time_step_node)
+    */
+    const int imax = (IMAX>0) ? IMAX : ::imax;     /* Compile-time grid size when specialized */
+    const int jmax = (JMAX>0) ? JMAX : ::jmax;
+    int i;                      //i index (x direction)
+    int j;                      //j index (y direction)
+
+    /* Local time step from the viscous, convective and cell Reynolds number limits */
+    /* (see local_time_step)                                                        */
+
+    double dtminloc = dtmin;    /* Local copy for the OpenMP min reduction */
+
+    if(istretch!=0)
+    {
+        /* Stretched grids: the same limits with the spacings of each node */
+        stretched_time_step<COMBINED>(u, dt, dtminloc);
+    }
+    else
+    {
+        #pragma omp parallel for private(j) reduction(min:dtminloc)
+        for( i=1; i<imax-1; i++)
+        {
+            for( j=1; j<jmax-1;j++)
+            {
+                dt(i,j) = local_time_step<COMBINED>(u, i, j);
+                dtminloc = min(dtminloc,(double)dt(i,j));
+            }
+        }
+    }
+    dtmin = dtminloc;
+
+    for (int i=0; i<imax; i++)
+    {
+        dt(i,0)        = dtmin;
+        dt(i,jmax-1)   = dtmin;
+    }
+    for (int j=0; j<jmax; j++)
+    {
+        dt(0,j)        = dtmin;
+        dt(imax-1,j)   = dtmin;
+    }
+}
+
+
+/**************************************************************************/
+
+template <int IMAX, int JMAX, class Real>
+void Compute_Artificial_Viscosity( Array3R<Real>& u, Array2T<Real>& viscx, Array2T<Real>& viscy )
+{
+    /* 
+    Uses global variable(s): imax, jmax, dx, dy, Cx, Cy, vel2ref, rkappa
+    Uses: u
+    To Modify: artviscx, artviscy
+    */
+    const int imax = (IMAX>0) ? IMAX : ::imax;     /* Compile-time grid size when specialized */
+    const int jmax = (JMAX>0) ? JMAX : ::jmax;
+    int i;                  //i index (x direction)
+    int j;                  //j index (y direction)
+
+    /* d4pd_4 equation should be (p(i-2) - 4*p(i-1) + 6*p(i) - 4*(i+1) + p(i+2)) / d_^4 .*/
+    
+    /* visc = (-lambamax*C4*dx^3 / beta2) * (d4pdx4) */
+    /* Equal to visc = -muEffective * d4pdx4*/
+
+    /* Stretched grids: dx^3/dx^4 of the mean spacing at each node */
+    if(istretch!=0)
+    {
+        stretched_artificial_viscosity(u, viscx, viscy);
+        return;
+    }
+
+    #pragma omp parallel for private(j)
+    for(i=1; i<imax-1; i++)
+    {
+        for(j=1; j<jmax-1; j++)
+        {
+            local_artificial_viscosity(u, i, j, imax, jmax, viscx(i,j), viscy(i,j));
+        }
+    }
+}
+
+
+/**************************************************************************/
+
+template <int IMAX, int JMAX, class P>
+void SGS_forward_sweep( Array3& u, Array2& viscx, Array2& viscy, Array2& dt, Array3& s )
+{
+    /* 
+    Uses global variable(s): two, three (not used), six (not used), half
+    Uses global variable(s): imax, jmax, ipgorder (not used), rho, rhoinv, dx, dy, rkappa,
+                        xmax (not used), xmin (not used), ymax (not used), ymin (not used), 
+                        rmu, vel2ref
+    Uses: artviscx, artviscy, dt, s
+    To Modify: u
+    */
+    const int imax = (IMAX>0) ? IMAX : ::imax;     /* Compile-time grid size when specialized */
+    const int jmax = (JMAX>0) ? JMAX : ::jmax;
+    int i;
+    int j;
+
+    
+
+    /* Symmetric Gauss-Siedel: Forward Sweep */
+
+    /* !************************************************************** */
+    /* !************ADD CODING HERE FOR INTRO CFD STUDENTS************ */
+    /* !************************************************************** */
+
+    /* 2dx because of central difference */
+    /* 2nd derivative as -u(i-1) + 2*u(i) - u(i+1) / du^2 */
+
+    /* Add loops */
+
+    if(istretch!=0)
+    {
+        stretched_SGS_sweep<P::dual>(u, viscx, viscy, dt, s, false);
+        return;
+    }
+
+    for( i=1;i<imax-1;i++)
+    {
+        for(j=1;j<jmax-1;j++)
+        {
+            Gauss_Seidel_node<P::source, P::dual>(u, i, j, viscx(i,j), viscy(i,j), dt(i,j), s);
+        }
+    }
+
+
+}
+
+/**************************************************************************/
+
+template <int IMAX, int JMAX, class P>
+void SGS_backward_sweep( Array3& u, Array2& viscx, Array2& viscy, Array2& dt, Array3& s )
+{
+    /* 
+    Uses global variable(s): two, three (not used), six (not used), half
+    Uses global variable(s): imax, jmax, ipgorder (not used), rho, rhoinv, dx, dy, rkappa,
+                        xmax (not used), xmin (not used), ymax (not used), ymin (not used), 
+                        rmu, vel2ref
+    Uses: artviscx, artviscy, dt, s
+    To Modify: u
+    */
+    const int imax = (IMAX>0) ? IMAX : ::imax;     /* Compile-time grid size when specialized */
+    const int jmax = (JMAX>0) ? JMAX : ::jmax;
+ 
+    int i;
+    int j;
+
+
+    /* Symmetric Gauss-Siedel: Backward Sweep  */
+
+
+    /* !************************************************************** */
+    /* !************ADD CODING HERE FOR INTRO CFD STUDENTS************ */
+    /* !************************************************************** */
+
+    /* Same as above but reversed loops?? */
+
+    if(istretch!=0)
+    {
+        stretched_SGS_sweep<P::dual>(u, viscx, viscy, dt, s, true);
+        return;
+    }
+
+    for(i=imax-2; i>0;i--)
+    {
+        for(j=jmax-2;j>0;j--)
+        {
+            Gauss_Seidel_node<P::source, P::dual>(u, i, j, viscx(i,j), viscy(i,j), dt(i,j), s);
+        }
+    }
+
+}
+
+/**************************************************************************/
+
+template <int IMAX, int JMAX, class P>
+void SGS_color_sweep( Array3& u, Array2& viscx, Array2& viscy, Array2& dt, Array3& s, int color )
+{
+    /* 
+    Uses global variable(s): imax, jmax, rho, rhoinv, dx, dy, rkappa, rmu, vel2ref
+    Uses: artviscx, artviscy, dt, s, color
+    To Modify: u
+    Gauss-Seidel update of the nodes with (i+j)%2 == color only (same update as
+    SGS_forward_sweep). Their 5-point neighbours all have the other color, so the
+    i loop is parallel.
+    */
+    const int imax = (IMAX>0) ? IMAX : ::imax;     /* Compile-time grid size when specialized */
+    const int jmax = (JMAX>0) ? JMAX : ::jmax;
+    int i;
+    int j;
+
+    if(istretch!=0)
+    {
+        stretched_SGS_color_sweep<P::dual>(u, viscx, viscy, dt, s, color);
+        return;
+    }
+
+    #pragma omp parallel for private(j)
+    for( i=1;i<imax-1;i++)
+    {
+        for(j=1+(i+1+color)%2;j<jmax-1;j+=2)
+        {
+            Gauss_Seidel_node<P::source, P::dual>(u, i, j, viscx(i,j), viscy(i,j), dt(i,j), s);
+        }
+    }
+}
+
+/**************************************************************************/
+
+template <int IMAX, int JMAX, class Real, class P>
+void point_Jacobi( Array3R<Real>& u, Array3R<Real>& uold, Array2T<Real>& viscx, Array2T<Real>& viscy, Array2T<Real>& dt, Array3R<Real>& s )
+{
+    /* 
+    Uses global variable(s): imax, jmax, rho, rhoinv, dx, dy, rkappa, rmu, vel2ref
+    Uses: uold, artviscx, artviscy, dt, s
+    To Modify: u
+    */
+    const int imax = (IMAX>0) ? IMAX : ::imax;     /* Compile-time grid size when specialized */
+    const int jmax = (JMAX>0) ? JMAX : ::jmax;
+    int i;
+    int j;
+
+    /* Point Jacobi method (the update at each node is in point_Jacobi_node) */
+
+    /* note that uvel2 is at node and is the old value */
+
+    if(istretch!=0)
+    {
+        stretched_point_Jacobi<P::dual>(u, uold, viscx, viscy, dt, s);
+        return;
+    }
+
+    #pragma omp parallel for private(j)
+    for (i=1;i<imax-1;i++)
+    {
+        for (j=1;j<jmax-1;j++)
+        {
+            point_Jacobi_node<P::source, P::dual>(u, uold, i, j, viscx(i,j), viscy(i,j), dt(i,j), s);
+        }
+    }
+}
+
+/**************************************************************************/
+
+/*--- Vectorized point Jacobi update (isimd > 0) -------------------------------------*/
+/*--- Same update as point_Jacobi_node (residual_stencil), on raw row pointers, so   ---*/
+/*--- the j loop vectorizes. The x86 versions are the same source compiled for      ---*/
+/*--- AVX2 / AVX-512 and picked at run time.                                         ---*/
+
+template <int JS, bool SRC = true, bool DUAL = false>
+ALWAYS_INLINE void point_Jacobi_row( int jend, double* __restrict un, const double* __restrict uo, const double* __restrict s,
+                                     const double* __restrict vx, const double* __restrict vy, const double* __restrict dtr,
+                                     ptrdiff_t is, ptrdiff_t ks, const ResidualCoefficients& c )
+{
+    /* 
+    One row i of the point Jacobi update, nodes j = 1 .. jend-1.
+    un, uo, s point at node (i,0) of u, uold, s (j stride JS, variable stride ks, row stride is);
+    vx, vy, dtr at (i,0) of viscx, viscy, dt; s is not read for SRC = false
+    */
+    #pragma omp simd
+    for(int j=1; j<jend; j++)
+    {
+        const double* o = uo + j*JS;
+        const double uvel2 = o[ks]*o[ks] + o[2*ks]*o[2*ks];
+        const double beta2 = (uvel2 > c.beta2min) ? uvel2 : c.beta2min;
+        const double dtj = dtr[j];
+        double r0, r1, r2;
+
+        residual_stencil<JS, false, SRC, DUAL>(o, s + j*JS, is, ks, vx[j], vy[j], c, r0, r1, r2);
+
+        un[j*JS]      = o[0] - beta2*dtj*r0;
+        un[j*JS+ks]   = o[ks] - dtj*c.rhoinv*r1;
+        un[j*JS+2*ks] = o[2*ks] - dtj*c.rhoinv*r2;
+    }
+}
+
+template <bool SRC, bool DUAL>
+ALWAYS_INLINE void point_Jacobi_vector_sweep( Array3& u, Array3& uold, Array2& viscx, Array2& viscy, Array2& dt, Array3& s )
+{
+    /* 
+    Uses global variable(s): imax, jmax, rho, rhoinv, dx, dy, rkappa, rmu, vel2ref
+    Uses: uold, viscx, viscy, dt, s
+    To Modify: u
+    */
+    const ResidualCoefficients c = rcoef;                   /* Local copy: no aliasing with u */
+
+    const ptrdiff_t is = &uold(1,0,0) - &uold(0,0,0);      /* Strides of the Array3 layout */
+    const ptrdiff_t ks = &uold(0,0,1) - &uold(0,0,0);
+
+    #pragma omp parallel for
+    for(int i=1; i<imax-1; i++)
+    {
+        point_Jacobi_row<Array3Layout::jstep, SRC, DUAL>( jmax-1, &u(i,0,0), &uold(i,0,0), &s(i,0,0),
+                                               &viscx(i,0), &viscy(i,0), &dt(i,0), is, ks, c );
+    }
+}
+
+template <bool SRC, bool DUAL>
+void point_Jacobi_vector( Array3& u, Array3& uold, Array2& viscx, Array2& viscy, Array2& dt, Array3& s )
+{
+    /* Built for the ISA of the compile flags */
+    point_Jacobi_vector_sweep<SRC, DUAL>( u, uold, viscx, viscy, dt, s );
+}
+
+#ifdef PJ_SIMD_X86
+template <bool SRC, bool DUAL>
+__attribute__((target("avx2,fma")))
+void point_Jacobi_avx2( Array3& u, Array3& uold, Array2& viscx, Array2& viscy, Array2& dt, Array3& s )
+{
+    point_Jacobi_vector_sweep<SRC, DUAL>( u, uold, viscx, viscy, dt, s );
+}
+
+template <bool SRC, bool DUAL>
+__attribute__((target("avx512f,avx512dq")))
+void point_Jacobi_avx512( Array3& u, Array3& uold, Array2& viscx, Array2& viscy, Array2& dt, Array3& s )
+{
+    point_Jacobi_vector_sweep<SRC, DUAL>( u, uold, viscx, viscy, dt, s );
+}
+#endif
+
+template <bool SRC, bool DUAL>
+pointJacobiPointer vector_point_Jacobi( int isa )
+{
+    /* The vector PJ update for instruction set isa (see 'select_point_Jacobi') */
+#ifdef PJ_SIMD_X86
+    if(isa==4) return &point_Jacobi_avx512<SRC, DUAL>;
+    if(isa==3) return &point_Jacobi_avx2<SRC, DUAL>;
+#endif
+    return &point_Jacobi_vector<SRC, DUAL>;
+}
+
+pointJacobiPointer select_point_Jacobi( bool source, bool dual )
+{
+    /*
+    Uses global variable(s): isimd
+    Returns the vectorized point Jacobi update for isimd = 1 (best ISA of this CPU),
+    2 (compile flags), 3 (AVX2) or 4 (AVX-512); NULL for the scalar point_Jacobi.
+    source = false gives the same update without the source term (CavityPolicy steps),
+    dual = true the one with the physical time term (DualPolicy, DualMMSPolicy steps).
+    */
+    int isa = isimd;
+
+    if(isimd<0 || isimd>4)
+    {
+        printf("ERROR: isimd must equal 0, 1, 2, 3 or 4!\n");
+        exit (EXIT_FAILED);
+    }
+    if(isimd==0) return NULL;
+
+#ifdef PJ_SIMD_X86
+    __builtin_cpu_init();
+    bool has_avx2   = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    bool has_avx512 = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq");
+#else
+    bool has_avx2   = false;
+    bool has_avx512 = false;
+#endif
+    if(isa==1)
+    {
+        isa = has_avx512 ? 4 : (has_avx2 ? 3 : 2);
+    }
+    if((isa==3 && !has_avx2) || (isa==4 && !has_avx512))
+    {
+        printf("ERROR: isimd = %d asks for an instruction set this CPU (or build) does not have!\n", isimd);
+        exit (EXIT_FAILED);
+    }
+
+    if(source && !dual)
+    {
+        printf("Point Jacobi update: %s\n", (isa==4) ? "AVX-512 vector kernel" :
+               ((isa==3) ? "AVX2 vector kernel" : "vector kernel (compile flags ISA)"));
+    }
+    if(dual) return vector_point_Jacobi<true, true>(isa);
+    return source ? vector_point_Jacobi<true, false>(isa) : vector_point_Jacobi<false, false>(isa);
+}
+
+/**************************************************************************/
+
+/**************************************************************************/
+/*        Implicit line relaxation (approximate factorization, isgs = 3)  */
+/*                                                                        */
+/* One iteration solves                                                   */
+/*     (G/dt + Ax) (G/dt)^-1 (G/dt + Ay) du = -(R(u) - s)                 */
+/* with G = diag(1/beta2, rho, rho) the time derivative preconditioner of */
+/* the explicit schemes and Ax, Ay the x and y parts of the Jacobian of   */
+/* the central residual, frozen at the current velocity. The pressure     */
+/* dissipation (4th difference) and an upwind-sized convective            */
+/* dissipation enter Ax, Ay as 2nd differences, which keeps the 3x3       */
+/* block-tridiagonal line systems diagonally dominant at large dt, so the */
+/* scheme runs at cfl = 10-1000. du = 0 on the boundary; the boundary     */
+/* conditions are set after the update, as for PJ and SGS.                */
+/*                                                                        */
+/* All lines of one sweep are solved together: the workspace is stored    */
+/* as [position][coefficient][line] so that the block Thomas algorithm    */
+/* runs with the line index innermost (vectorized), AF_BATCH lines per    */
+/* OpenMP iteration.                                                      */
+/**************************************************************************/
+
+#define AF_NC 30                    /* Workspace entries per node: A, B, C (3x3, row major) and r (3) */
+#define AF_A 0
+#define AF_B 9
+#define AF_C 18
+#define AF_R 27
+#define AF_BATCH 64                 /* Lines per batch (one OpenMP iteration) */
+
+  vector<double> afwork;            /* Line systems of both sweeps, grown to the finest grid */
+
+/**************************************************************************/
+
+inline void af_line_blocks( const Array3& u, int i, int j, double dt, int dir, double* w, int nl, double g[neq] )
+{
+    /* 
+    Uses global variable(s): rho, rmu, dx, dy, Cx, Cy, rkappa, vel2ref
+    To modify: w (A, B, C of node (i,j) on an x-line (dir = 0) or a y-line (dir = 1), stride nl),
+               g (diagonal of G/dt)
+    A and C multiply du at the previous and next node of the line.
+    */
+    const double h  = (dir==0) ? dx : dy;
+    const double Cd = (dir==0) ? Cx : Cy;
+    const int kn = 1 + dir;         /* Velocity component along the line */
+    double uvel2;                   //Velocity squared at node
+    double beta2;                   //Beta squared parameter for time derivative preconditioning
+    double lambda;                  //Max absolute value eigenvalue along the line
+    double eps;                     //Implicit pressure dissipation coefficient
+    double conv;                    //Central convection coefficient
+    double diff;                    //Viscous coefficient
+    double aup;                     //Implicit convective dissipation coefficient
+
+    uvel2 = u(i,j,1)*u(i,j,1) + u(i,j,2)*u(i,j,2);
+    beta2 = max(uvel2,rkappa*vel2ref);
+    lambda = half*(abs(u(i,j,kn)) + sqrt(u(i,j,kn)*u(i,j,kn) + 4*beta2));
+    eps  = four*lambda*Cd/(beta2*h);
+    conv = rho*u(i,j,kn)/(two*h);
+    diff = rmu/(h*h);
+    aup  = rho*abs(u(i,j,kn))/(two*h);
+
+    g[0] = one/(beta2*dt);
+    g[1] = rho/dt;
+    g[2] = rho/dt;
+
+    for(int q=0; q<9; q++)
+    {
+        w[(AF_A+q)*nl] = zero;
+        w[(AF_B+q)*nl] = zero;
+        w[(AF_C+q)*nl] = zero;
+    }
+
+    /* Continuity: rho*d(u_kn)/dx_kn - pressure dissipation */
+    w[(AF_A+kn)*nl]   = -rho/(two*h);
+    w[(AF_C+kn)*nl]   =  rho/(two*h);
+    w[(AF_A  )*nl]    = -eps;
+    w[(AF_C  )*nl]    = -eps;
+    w[(AF_B  )*nl]    = g[0] + two*eps;
+
+    /* Momentum: pressure gradient along the line, convection and diffusion */
+    w[(AF_A+3*kn)*nl] = -one/(two*h);
+    w[(AF_C+3*kn)*nl] =  one/(two*h);
+    w[(AF_A+4)*nl]    = -conv - diff - aup;
+    w[(AF_C+4)*nl]    =  conv - diff - aup;
+    w[(AF_B+4)*nl]    = g[1] + two*diff + two*aup;
+    w[(AF_A+8)*nl]    = -conv - diff - aup;
+    w[(AF_C+8)*nl]    =  conv - diff - aup;
+    w[(AF_B+8)*nl]    = g[2] + two*diff + two*aup;
+}
+
+/**************************************************************************/
+
+void block_tridiagonal_batch( double* W, int nm, int nl, int l0, int l1 )
+{
+    /* 
+    Uses: W (nm positions x AF_NC entries x nl lines)
+    To modify: W (r holds the solution of lines l0..l1-1 on return, C is overwritten)
+    Block Thomas algorithm without pivoting (the blocks are diagonally dominant).
+    */
+
+    /* Forward elimination: C' = (B - A C'_{m-1})^-1 C, r' = (B - A C'_{m-1})^-1 (r - A r'_{m-1}) */
+    for(int m=0; m<nm; m++)
+    {
+        double* w = W + (size_t)m*AF_NC*nl;
+        const double* wp = W + (size_t)(m>0 ? m-1 : 0)*AF_NC*nl;
+        const bool first = (m==0);
+
+        #pragma omp simd
+        for(int l=l0; l<l1; l++)
+        {
+            double a[9], b[9], c[9], r[3], bi[9];
+            for(int q=0; q<9; q++)
+            {
+                a[q] = first ? zero : w[(AF_A+q)*nl+l];
+                b[q] = w[(AF_B+q)*nl+l];
+                c[q] = w[(AF_C+q)*nl+l];
+            }
+            for(int q=0; q<3; q++)
+            {
+                r[q] = w[(AF_R+q)*nl+l];
+            }
+            for(int row=0; row<3; row++)
+            {
+                for(int col=0; col<3; col++)
+                {
+                    b[3*row+col] -= a[3*row  ]*wp[(AF_C  +col)*nl+l]
+                                  + a[3*row+1]*wp[(AF_C+3+col)*nl+l]
+                                  + a[3*row+2]*wp[(AF_C+6+col)*nl+l];
+                }
+                r[row] -= a[3*row  ]*wp[(AF_R  )*nl+l]
+                        + a[3*row+1]*wp[(AF_R+1)*nl+l]
+                        + a[3*row+2]*wp[(AF_R+2)*nl+l];
+            }
+
+            bi[0] = b[4]*b[8] - b[5]*b[7];
+            bi[1] = b[2]*b[7] - b[1]*b[8];
+            bi[2] = b[1]*b[5] - b[2]*b[4];
+            bi[3] = b[5]*b[6] - b[3]*b[8];
+            bi[4] = b[0]*b[8] - b[2]*b[6];
+            bi[5] = b[2]*b[3] - b[0]*b[5];
+            bi[6] = b[3]*b[7] - b[4]*b[6];
+            bi[7] = b[1]*b[6] - b[0]*b[7];
+            bi[8] = b[0]*b[4] - b[1]*b[3];
+            double detinv = one/(b[0]*bi[0] + b[1]*bi[3] + b[2]*bi[6]);
+
+            for(int row=0; row<3; row++)
+            {
+                for(int col=0; col<3; col++)
+                {
+                    w[(AF_C+3*row+col)*nl+l] = detinv*(bi[3*row]*c[col] + bi[3*row+1]*c[3+col] + bi[3*row+2]*c[6+col]);
+                }
+                w[(AF_R+row)*nl+l] = detinv*(bi[3*row]*r[0] + bi[3*row+1]*r[1] + bi[3*row+2]*r[2]);
+            }
+        }
+    }
+
+    /* Back substitution: x_m = r'_m - C'_m x_{m+1} */
+    for(int m=nm-2; m>=0; m--)
+    {
+        double* w = W + (size_t)m*AF_NC*nl;
+        const double* wn = W + (size_t)(m+1)*AF_NC*nl;
+
+        #pragma omp simd
+        for(int l=l0; l<l1; l++)
+        {
+            double x0 = wn[(AF_R  )*nl+l];
+            double x1 = wn[(AF_R+1)*nl+l];
+            double x2 = wn[(AF_R+2)*nl+l];
+            for(int row=0; row<3; row++)
+            {
+                w[(AF_R+row)*nl+l] -= w[(AF_C+3*row)*nl+l]*x0 + w[(AF_C+3*row+1)*nl+l]*x1 + w[(AF_C+3*row+2)*nl+l]*x2;
+            }
+        }
+    }
+}
+
+/**************************************************************************/
+
+void block_tridiagonal_lines( double* W, int nm, int nl )
+{
+    /* Solves all nl line systems of W, AF_BATCH lines per OpenMP iteration */
+
+    int nbatch = (nl + AF_BATCH - 1)/AF_BATCH;
+
+    #pragma omp parallel for schedule(static)
+    for(int ib=0; ib<nbatch; ib++)
+    {
+        block_tridiagonal_batch(W, nm, nl, ib*AF_BATCH, min(nl, (ib+1)*AF_BATCH));
+    }
+}
+
+/**************************************************************************/
+
+template <int IMAX, int JMAX, class P>
+void AF_line_relaxation( Array3& u, Array2& viscx, Array2& viscy, Array2& dt, Array3& s )
+{
+    /* 
+    Uses global variable(s): imax, jmax, afwork
+    Uses: viscx, viscy, dt, s
+    To Modify: u (interior nodes)
+    */
+    const int imax = (IMAX>0) ? IMAX : ::imax;     /* Compile-time grid size when specialized */
+    const int jmax = (JMAX>0) ? JMAX : ::jmax;
+    const int ni = imax - 2;        /* Interior nodes: lines and positions of both sweeps */
+    const int nj = jmax - 2;
+    const size_t nw = (size_t)AF_NC*ni*nj;
+
+    if(afwork.size() < 2*nw)
+    {
+        afwork.resize(2*nw);
+    }
+    double* wx = afwork.data();     /* x-lines: position i-1, line j-1 */
+    double* wy = wx + nw;           /* y-lines: position j-1, line i-1 */
+
+    /* x sweep: (G/dt + Ax) du* = -(R(u) - s) */
+    #pragma omp parallel for
+    for(int i=1; i<imax-1; i++)
+    {
+        for(int j=1; j<jmax-1; j++)
+        {
+            double* w = wx + (size_t)(i-1)*AF_NC*nj + (j-1);
+            double g[neq];
+            double r[neq];
+            af_line_blocks(u, i, j, dt(i,j), 0, w, nj, g);
+            steady_residual_node<P::source, P::dual>(u, i, j, viscx(i,j), viscy(i,j), s, r);
+            for(int k=0; k<neq; k++)
+            {
+                w[(AF_R+k)*nj] = -r[k];
+            }
+        }
+    }
+    block_tridiagonal_lines(wx, ni, nj);
+
+    /* y sweep: (G/dt + Ay) du = (G/dt) du* */
+    #pragma omp parallel for
+    for(int j=1; j<jmax-1; j++)
+    {
+        for(int i=1; i<imax-1; i++)
+        {
+            double* w = wy + (size_t)(j-1)*AF_NC*ni + (i-1);
+            const double* wdx = wx + (size_t)(i-1)*AF_NC*nj + (j-1);
+            double g[neq];
+            af_line_blocks(u, i, j, dt(i,j), 1, w, ni, g);
+            for(int k=0; k<neq; k++)
+            {
+                w[(AF_R+k)*ni] = g[k]*wdx[(AF_R+k)*nj];
+            }
+        }
+    }
+    block_tridiagonal_lines(wy, nj, ni);
+
+    /* Update */
+    #pragma omp parallel for
+    for(int i=1; i<imax-1; i++)
+    {
+        for(int j=1; j<jmax-1; j++)
+        {
+            const double* w = wy + (size_t)(j-1)*AF_NC*ni + (i-1);
+            for(int k=0; k<neq; k++)
+            {
+                u(i,j,k) += w[(AF_R+k)*ni];
+            }
+        }
+    }
+}
+
+/**************************************************************************/
+
+#define FUSED_TILE_I 16             /* Tile size of the fused PJ sweep: rows (x direction) */
+#define FUSED_TILE_J 64             /* Tile size of the fused PJ sweep: nodes per row (y direction) */
+
+template <int IMAX, int JMAX, class P>
+void PJ_fused_iteration( boundaryConditionPointer set_boundary_conditions, Array3& u, Array3& uold, Array3& src, double res[neq], double& dtmin )
+{
+    /* 
+    Uses global variable(s): imax, jmax (and those of the node functions)
+    Uses: src
+    To Modify: u, uold, res (sums of squares, normalized by 'report_iterative_convergence'), dtmin
+    */
+    const int imax = (IMAX>0) ? IMAX : ::imax;     /* Compile-time grid size when specialized */
+    const int jmax = (JMAX>0) ? JMAX : ::jmax;
+    const int iref = (imax-1)/2;                   /* Pressure rescaling point (see pressure_rescaling) */
+    const int jref = (jmax-1)/2;
+
+    double viscx;           /* Artificial viscosity at the node (x and y directions) */
+    double viscy;
+    double dtloc;           /* Local time step at the node */
+    double deltap;          /* delta_pressure for rescaling all values */
+
+    /* One pass over the grid does what compute_time_step, Compute_Artificial_Viscosity, */
+    /* point_Jacobi, pressure_rescaling and check_iterative_convergence do in five, and  */
+    /* dt, viscx and viscy are never stored. Uses the same node functions, so interior  */
+    /* values match PJ_iteration + pressure_rescaling exactly.                           */
+
+    /* Swap pointers for u and uold*/
+    uold.swapData(u);
+
+    /* The rescaling shift needs the new center pressure, so update that node first */
+    local_artificial_viscosity(uold, iref, jref, imax, jmax, viscx, viscy);
+    point_Jacobi_node<P::source, P::dual>(u, uold, iref, jref, viscx, viscy, local_time_step(uold, iref, jref), src);
+    deltap = u(iref,jref,0) - reference_pressure();
+
+    double dtminloc = dtmin;    /* Local copies for the OpenMP reductions */
+    double res0 = zero;
+    double res1 = zero;
+    double res2 = zero;
+
+    #pragma omp parallel for collapse(2) private(viscx, viscy, dtloc) reduction(min:dtminloc) reduction(+:res0,res1,res2)
+    for(int ii=1; ii<imax-1; ii+=FUSED_TILE_I)
+    {
+        for(int jj=1; jj<jmax-1; jj+=FUSED_TILE_J)
+        {
+            const int iend = min(ii+FUSED_TILE_I, imax-1);
+            const int jend = min(jj+FUSED_TILE_J, jmax-1);
+            for(int i=ii; i<iend; i++)
+            {
+                for(int j=jj; j<jend; j++)
+                {
+                    dtloc = local_time_step(uold, i, j);
+                    dtminloc = min(dtminloc, dtloc);
+                    local_artificial_viscosity(uold, i, j, imax, jmax, viscx, viscy);
+                    point_Jacobi_node<P::source, P::dual>(u, uold, i, j, viscx, viscy, dtloc, src);
+                    u(i,j,0) -= deltap;
+
+                    double diff0 = (u(i,j,0)-uold(i,j,0))/dtloc;
+                    double diff1 = (u(i,j,1)-uold(i,j,1))/dtloc;
+                    double diff2 = (u(i,j,2)-uold(i,j,2))/dtloc;
+                    res0 += diff0*diff0;
+                    res1 += diff1*diff1;
+                    res2 += diff2*diff2;
+                }
+            }
+        }
+    }
+    dtmin = dtminloc;
+    res[0] = res0;
+    res[1] = res1;
+    res[2] = res2;
+
+    /* Set Boundary Conditions for u (wall pressure is extrapolated from the rescaled interior) */
+    policy_boundary_conditions<P>(set_boundary_conditions, u);
+}
+
+/**************************************************************************/
+
+/*--- Temporally tiled point Jacobi (ifused = 1, ktile > 1) --------------------------*/
+/*--- One pass over the grid advances nlev PJ iterations. A node needs nodes up to   ---*/
+/*--- 3 away of the iteration before (local_artificial_viscosity next to a wall).    ---*/
+/*--- The grid is cut into strips of columns (j), skewed by TILE_SKEW columns per    ---*/
+/*--- iteration (level), and within a strip a wavefront runs over the rows: at step  ---*/
+/*--- w level t updates row w - TILE_SKEW*t. With a skew of 4 the levels of a step   ---*/
+/*--- are independent, and only about TILE_SKEW*nlev rows of one strip are live, so  ---*/
+/*--- the pass stays in cache (TILE_CACHE). Levels alternate between uold and u, as  ---*/
+/*--- the unfused iterations do, and the boundary conditions are set behind the      ---*/
+/*--- front. The time step, the artificial viscosity, the update and the boundary    ---*/
+/*--- conditions only see pressure differences, so the pressure rescaling of every   ---*/
+/*--- level is done once at the end.                                                 ---*/
+
+#define TILE_SKEW 4                 /* Rows and columns between consecutive levels of the wavefront */
+#define TILE_CACHE 1048576          /* Bytes of u, uold and src a strip may keep live (about half an L2) */
+
+  double* tilerows = NULL;          /* dt, viscx and viscy of one row per thread, carved by 'tile_buffer_setup' */
+  size_t tilerowlen = 0;            /* Doubles per thread (3*jmax, padded to ARRAY3_ALIGN) */
+  int tilethreads = 0;              /* Threads it has room for */
+
+size_t tile_buffer_bytes( int nj )
+{
+    /* Returns: workspace bytes 'tile_buffer_setup' carves for rows of nj nodes */
+    int nthr = 1;
+#ifdef _OPENMP
+    nthr = omp_get_max_threads();
+#endif
+    const size_t len = (3*(size_t)nj*sizeof(double) + ARRAY3_ALIGN - 1)/ARRAY3_ALIGN*ARRAY3_ALIGN;
+    return (size_t)nthr*len;
+}
+
+/**************************************************************************/
+
+void tile_buffer_setup( int nj )
+{
+    /* 
+    To modify: tilerows, tilerowlen, tilethreads (row buffers of every thread for grids up to nj wide)
+    Carved once per grid, so the tiled passes do not allocate.
+    */
+    tilethreads = 1;
+#ifdef _OPENMP
+    tilethreads = omp_get_max_threads();
+#endif
+    tilerowlen = (3*(size_t)nj*sizeof(double) + ARRAY3_ALIGN - 1)/ARRAY3_ALIGN*ARRAY3_ALIGN/sizeof(double);
+    tilerows = (double*)workspace.carve(tile_buffer_bytes(nj));
+}
+
+/**************************************************************************/
+
+template <int IMAX, int JMAX, class P>
+void PJ_tiled_iterations( boundaryRowPointer set_boundary_row, Array3& u, Array3& uold, Array3& src, Array2& dt,
+                          int nlev, double res[neq], double dtlev[] )
+{
+    /* 
+    Uses global variable(s): imax, jmax, rcoef, tilerows (and those of the node functions)
+    Uses: src, nlev (iterations in this pass)
+    To Modify: u (nlev PJ iterations, each with boundary conditions and pressure rescaling),
+               uold (the iteration before, without the rescaling), dt (of the last iteration),
+               res (sums of squares of the last iteration, as 'PJ_fused_iteration'),
+               dtlev (dtlev[t] = min(dtlev[t], smallest time step of iteration t))
+    */
+    const int imax = (IMAX>0) ? IMAX : ::imax;     /* Compile-time grid size when specialized */
+    const int jmax = (JMAX>0) ? JMAX : ::jmax;
+    const int iref = (imax-1)/2;                   /* Pressure rescaling point (see pressure_rescaling) */
+    const int jref = (jmax-1)/2;
+    const int nsteps = (imax-2) + TILE_SKEW*(nlev-1);
+    const ResidualCoefficients c = rcoef;           /* Local copy: no aliasing with u */
+    const ptrdiff_t is = u.address(1,0,0) - u.address(0,0,0);      /* Strides of the Array3 layout */
+    const ptrdiff_t ks = u.address(0,0,1) - u.address(0,0,0);
+
+    /* Strip width: the live rows fit in TILE_CACHE, and the first strip of every level */
+    /* holds columns 1 and 2 (which the j = 0 wall extrapolates from)                   */
+    const int jstrip = max( (int)(TILE_CACHE/((TILE_SKEW*nlev + 7)*3*neq*sizeof(double))), TILE_SKEW*nlev + 2 );
+    const int nstrips = (jmax - 2 + TILE_SKEW*(nlev-1) + jstrip - 1)/jstrip;
+
+    Array3* level[2] = {&uold, &u};     /* Level t is written to level[t%2] from level[(t+1)%2] (u for t = 0) */
+    double dpref;           /* Unrescaled pressure change of the last iteration at the rescaling point */
+    double deltap;          /* delta_pressure for rescaling all values */
+    double res0 = zero;     /* Scalar sums for the OpenMP reduction */
+    double res1 = zero;
+    double res2 = zero;
+
+#ifdef _OPENMP
+    if(omp_get_max_threads()>tilethreads || (size_t)3*jmax>tilerowlen)
+#else
+    if((size_t)3*jmax>tilerowlen)
+#endif
+    {
+        printf("ERROR: tiled row buffers for %d thread(s) of %zu values (see 'tile_buffer_setup')!\n", tilethreads, tilerowlen);
+        exit (EXIT_FAILED);
+    }
+
+    #pragma omp parallel
+    {
+        int tid = 0;
+#ifdef _OPENMP
+        tid = omp_get_thread_num();
+#endif
+        double* dtrow = tilerows + tid*tilerowlen;      /* dt, viscx and viscy of one row */
+        double* vxrow = dtrow + jmax;
+        double* vyrow = vxrow + jmax;
+
+        for(int strip=0; strip<nstrips; strip++)
+        {
+            for(int w=1; w<=nsteps; w++)
+            {
+                /* One thread per level and step, so dtlev[t] needs no reduction */
+                #pragma omp for schedule(static,1)
+                for(int t=0; t<nlev; t++)
+                {
+                    const int i = w - TILE_SKEW*t;
+                    const int jlo = max(1 + strip*jstrip - TILE_SKEW*t, 1);
+                    const int jhi = min(1 + (strip+1)*jstrip - TILE_SKEW*t, jmax-1);
+                    if(i<1 || i>imax-2 || jlo>=jhi) continue;
+
+                    Array3& un = *level[t%2];
+                    const Array3& uo = *level[(t+1)%2];
+                    double dtminrow = dtlev[t];
+
+                    #pragma omp simd reduction(min:dtminrow)
+                    for(int j=jlo; j<jhi; j++)
+                    {
+                        dtrow[j] = local_time_step(uo, i, j);
+                        dtminrow = min(dtminrow, dtrow[j]);
+                        local_artificial_viscosity(uo, i, j, imax, jmax, vxrow[j], vyrow[j]);
+                    }
+                    dtlev[t] = dtminrow;
+
+                    point_Jacobi_row<Array3Layout::jstep, P::source, P::dual>( jhi - jlo + 1, &un(i,jlo-1,0), uo.address(i,jlo-1,0),
+                                                           src.address(i,jlo-1,0), vxrow + jlo-1, vyrow + jlo-1,
+                                                           dtrow + jlo-1, is, ks, c );
+                    if(t==nlev-1)
+                    {
+                        for(int j=jlo; j<jhi; j++)
+                        {
+                            dt(i,j) = dtrow[j];
+                        }
+                    }
+
+                    /* Walls of this piece of the row (j = 0 and jmax-1 with the first and last */
+                    /* pieces), and of the side walls once rows 1, 2 (imax-2, imax-3) are done    */
+                    const int blo = (jlo==1) ? 0 : jlo;
+                    const int bhi = (jhi==jmax-1) ? jmax : jhi;
+                    policy_boundary_row<P>(set_boundary_row, un, i, blo, bhi);
+                    if(i==2)      policy_boundary_row<P>(set_boundary_row, un, 0, blo, bhi);
+                    if(i==imax-2) policy_boundary_row<P>(set_boundary_row, un, imax-1, blo, bhi);
+                }
+            }
+        }
+    }
+
+    /* The last level goes to u */
+    if((nlev-1)%2==0)
+    {
+        u.swapData(uold);
+    }
+
+    /* Residuals of the last iteration, which the rescaling would have shifted by -dpref, */
+    /* and the rescaling itself                                                          */
+    dpref = u(iref,jref,0) - uold(iref,jref,0);
+    deltap = u(iref,jref,0) - reference_pressure();
+
+    #pragma omp parallel for reduction(+:res0,res1,res2)
+    for(int i=0; i<imax; i++)
+    {
+        const bool interior_row = (i>0 && i<imax-1);
+        for(int j=0; j<jmax; j++)
+        {
+            if(interior_row && j>0 && j<jmax-1)
+            {
+                double diff0 = (u(i,j,0) - uold(i,j,0) - dpref)/dt(i,j);
+                double diff1 = (u(i,j,1) - uold(i,j,1))/dt(i,j);
+                double diff2 = (u(i,j,2) - uold(i,j,2))/dt(i,j);
+                res0 += diff0*diff0;
+                res1 += diff1*diff1;
+                res2 += diff2*diff2;
+            }
+            u(i,j,0) -= deltap;
+        }
+    }
+    res[0] = res0;
+    res[1] = res1;
+    res[2] = res2;
+}
+
+/**************************************************************************/
+
+double reference_pressure()
+{
+    /* 
+    Uses global variable(s): imax, jmax, imms, mmsexact, pinf
+    Returns: the pressure that pressure rescaling sets at the center of the cavity
+    */
+
+    int iref;                     /* i index location of pressure rescaling point */
+    int jref;                     /* j index location of pressure rescaling point */
+
+    iref = (imax-1)/2;     /* Set reference pressure to center of cavity */
+    jref = (jmax-1)/2;
+    if(imms==1)
+    {
+        return (*mmsexact->u)(iref,jref,0);     /* Constant in MMS */
+    }
+    return pinf;                /* Reference pressure */
+}
+
+/**************************************************************************/
+
+template <class Real>
+void pressure_rescaling( Array3R<Real>& u )
+{
+    /* 
+    Uses global variable(s): imax, jmax
+    To Modify: u
+    */
+
+    int iref;                     /* i index location of pressure rescaling point */
+    int jref;                     /* j index location of pressure rescaling point */
+
+    double deltap;          /* delta_pressure for rescaling all values */
+
+    iref = (imax-1)/2;     /* Set reference pressure to center of cavity */
+    jref = (jmax-1)/2;
+    deltap = u(iref,jref,0) - reference_pressure();
+
+    #pragma omp parallel for
+    for(int i=0; i<imax; i++)
+    {
+        for(int j=0; j<jmax; j++)
+        {
+            u(i,j,0) -= deltap;
+        }
+    }      
+}  
+
+/**************************************************************************/
+
+template <class Real>
+void check_iterative_convergence(int n, Array3R<Real>& u, Array3R<Real>& uold, Array2T<Real>& dt, double res[neq], double resinit[neq], int ninit, double rtime, double dtmin, double& conv)
+{
+  /* 
+  Uses global variable(s): zero
+  Uses global variable(s): imax, jmax, neq, fsmall (not used), ilazyp
+  Uses: n, u, uold, dt, res, resinit, ninit, rtime, dtmin
+  To modify: conv
+  */
+
+  int i;                       /* i index (x direction) */
+  int j;                       /* j index (y direction) */
+  int k;                       /* k index (# of equations) */
+
+  const int iref = (imax-1)/2;    /* Pressure rescaling point, see pressure_rescaling */
+  const int jref = (jmax-1)/2;
+  double dpref = zero;            /* Change of the pressure level since uold (ilazyp = 1) */
+
+  /* Compute iterative residuals to monitor iterative convergence */
+
+    res[0] = zero;              //Reset to zero (as they are sums)
+    res[1] = zero;
+    res[2] = zero;
+
+    /* !************************************************************** */
+    /* !************ADD CODING HERE FOR INTRO CFD STUDENTS************ */
+    /* !************************************************************** */
+
+    /* Monitor with following eqution*/
+    /* rho*(u(i,j,k)-uold(i,j,k)) / dt */
+    /* Residual = max(Residual, _________ ) */
+    /* "Monitor iterative residuals by plugging into rho* (u(n+1)-n(n)) / dt "*/
+
+
+    /* res: current residual */
+    /* resinit: previous residual*/
+    /* ninit: counter */
+    /* rtime: */
+    /* What to use dtmin for? */
+
+    /* Without the rescaling u carries the pressure level of the iteration, so the residual */
+    /* is that of the rescaled iterates, as the tiled sweep does                            */
+    if(ilazyp==1)
+    {
+        dpref = u(iref,jref,0) - uold(iref,jref,0);
+    }
+    iterative_residual_sums(u, uold, dt, dpref, res);
+
+    report_iterative_convergence(n, res, resinit, ninit, rtime, dtmin, conv);
+}
+
+/**************************************************************************/
+
+template <class Real>
+void iterative_residual_sums( Array3R<Real>& u, Array3R<Real>& uold, Array2T<Real>& dt, double dpref, double res[neq] )
+{
+  /* 
+  Uses global variable(s): imax, jmax
+  Uses: u, uold, dt, dpref (pressure level change taken out of the pressure residual)
+  To modify: res (sums of squares of (u - uold)/dt over the interior)
+  */
+    double res0 = zero;         // Scalar sums for the OpenMP reduction
+    double res1 = zero;
+    double res2 = zero;
+
+    // Only use interior points to avoid potential issues at boundaries
+    #pragma omp parallel for reduction(+:res0,res1,res2)
+    for (int i=1; i<imax-1; i++)
+    {
+        for (int j=1; j<jmax-1; j++)
+        {
+            double diff0 = (u(i,j,0)-uold(i,j,0)-dpref)/dt(i,j);
+            double diff1 = (u(i,j,1)-uold(i,j,1))/dt(i,j);
+            double diff2 = (u(i,j,2)-uold(i,j,2))/dt(i,j);
+            res0 += diff0*diff0;
+            res1 += diff1*diff1;
+            res2 += diff2*diff2;
+        }
+    }
+    res[0] = res0;
+    res[1] = res1;
+    res[2] = res2;
+}
+
+/**************************************************************************/
+
+void steady_residual_sums( Array3& u, Array2& viscx, Array2& viscy, Array2& dt, Array3& s, Array3& res, double sums[neq] )
+{
+  /* 
+  Uses global variable(s): imax, jmax, rcoef, ilazyp
+  Uses: u (boundary conditions applied), dt, s
+  To modify: viscx, viscy (at u), res (R(u) - s, caller-provided work array),
+             sums (sums of squares of G(u) over the interior)
+  True steady residual, scaled like the (u - uold)/dt monitor so both read the same:
+  G = P (R(u) - s) + (deltap/dt) e_p, P = diag(beta2, 1/rho, 1/rho), with deltap the
+  shift the pressure rescaling would apply after a point Jacobi step from u. Pressure
+  enters R only through differences and the discrete continuity equations are not
+  exactly compatible, so it is G, not R - s itself, that goes to zero. With ilazyp = 1
+  u is not rescaled, and the shift is that of the rescaled u.
+  */
+    const int iref = (imax-1)/2;    /* Pressure rescaling point, see pressure_rescaling */
+    const int jref = (jmax-1)/2;
+    double deltap;
+    double res0 = zero;             // Scalar sums for the OpenMP reduction
+    double res1 = zero;
+    double res2 = zero;
+
+    Compute_Artificial_Viscosity<0,0>(u, viscx, viscy);
+    compute_residual<0,0>(u, viscx, viscy, s, res);
+
+    deltap = u(iref,jref,0) - dt(iref,jref)*local_beta2(u, iref, jref)*res(iref,jref,0) - reference_pressure();
+    if(ilazyp==1)
+    {
+        deltap = -dt(iref,jref)*local_beta2(u, iref, jref)*res(iref,jref,0);
+    }
+
+    #pragma omp parallel for reduction(+:res0,res1,res2)
+    for (int i=1; i<imax-1; i++)
+    {
+        for (int j=1; j<jmax-1; j++)
+        {
+            double g0 = local_beta2(u, i, j)*res(i,j,0) + deltap/dt(i,j);
+            double g1 = rcoef.rhoinv*res(i,j,1);
+            double g2 = rcoef.rhoinv*res(i,j,2);
+            res0 += g0*g0;
+            res1 += g1*g1;
+            res2 += g2*g2;
+        }
+    }
+    sums[0] = res0;
+    sums[1] = res1;
+    sums[2] = res2;
+}
+
+/**************************************************************************/
+
+void report_iterative_convergence(int n, double res[neq], double resinit[neq], int ninit, double rtime, double dtmin, double& conv)
+{
+  /* 
+  Uses global variable(s): imax, jmax, neq, residualOut, fp1
+  Uses: n, resinit, ninit, rtime, dtmin
+  To modify: res (from sums of squares to normalized L2 norms), conv
+  */
+
+    for(int k=0; k<neq; k++)
+    {
+        res[k] = sqrt(res[k]/((imax-2)*(jmax-2))); // Normalize by interior count
+        res[k] = res[k]/resinit[k];
+    }
+
+    //comment for commiting purposes
+
+    double first = max(res[0],res[1]);
+    conv = max(first,res[2]);
+    
+
+
+
+    /* Write iterative residuals every "residualOut" iterations */
+    if( ((n%residualOut)==0)||(n==ninit) )
+    {
+        fprintf(fp1, "%d %e %e %e %e\n",n, rtime, res[0], res[1], res[2] );
+        printf("%d   %e   %e   %e   %e   %e\n",n, rtime, dtmin, res[0], res[1], res[2] );    
+
+        /* Write header for iterative residuals every 20 residual printouts */
+        if( ((n%(residualOut*20))==0)||(n==ninit) )
+        {
+            printf("Iter. Time (s)   dt (s)      Continuity    x-Momentum    y-Momentum\n"); 
+        }    
+    }
+     
+}
+
+/**************************************************************************/
+
+void check_divergence(int n, double res[neq], int ninit, double rtime, double conv, double& convmin)
+{
+  /* 
+  Uses global variable(s): residualOut, divgrowth, fp1
+  Uses: n, res (normalized by 'report_iterative_convergence'), ninit, rtime, conv
+  To modify: convmin (smallest conv so far)
+  Stops the run with exit status EXIT_DIVERGED when a residual is NaN or Inf, or when
+  conv has grown by more than divgrowth over convmin. NaN is tested for each equation,
+  since max() in 'report_iterative_convergence' can drop it.
+  */
+
+    bool finite = true;
+    for(int k=0; k<neq; k++)
+    {
+        if(!isfinite(res[k])) finite = false;
+    }
+
+    if( !finite || (divgrowth>zero && conv>divgrowth*convmin) )
+    {
+        /* Keep the last residuals in the history file (MPI: only rank 0 has it) */
+        if( fp1!=NULL && ((n%residualOut)!=0)&&(n!=ninit) )
+        {
+            fprintf(fp1, "%d %e %e %e %e\n",n, rtime, res[0], res[1], res[2] );
+        }
+        if(!finite)
+        {
+            printf("ERROR: solution diverged at iteration %d (residuals %e %e %e are not finite)!\n",
+                   n, res[0], res[1], res[2]);
+        }
+        else
+        {
+            printf("ERROR: solution diverged at iteration %d (residual %e grew by more than divgrowth = %e over %e)!\n",
+                   n, conv, divgrowth, convmin);
+        }
+        exit (EXIT_DIVERGED);
+    }
+    convmin = min(convmin, conv);
+}
+
+/**************************************************************************/
+
+void compare_fused_step( Array3& u, Array3& ufused, double res[neq], double resfused[neq], double resinit[neq], double diffmax[3] )
+{
+    /* 
+    Uses global variable(s): imax, jmax, neq, fsmall, fusedtol
+    Uses: u, res (unfused path, normalized), ufused, resfused (fused path, sums of squares), resinit
+    To modify: diffmax (running max differences: interior u, boundary u, relative residual)
+    */
+
+    double du;
+
+    for(int i=0; i<imax; i++)
+    {
+        for(int j=0; j<jmax; j++)
+        {
+            bool boundary = (i==0 || j==0 || i==imax-1 || j==jmax-1);
+            for(int k=0; k<neq; k++)
+            {
+                du = abs(u(i,j,k) - ufused(i,j,k));
+                if(boundary) diffmax[1] = max(diffmax[1], du);
+                else         diffmax[0] = max(diffmax[0], du);
+            }
+        }
+    }
+    for(int k=0; k<neq; k++)
+    {
+        double resk = sqrt(resfused[k]/((imax-2)*(jmax-2)))/resinit[k];
+        diffmax[2] = max(diffmax[2], abs(resk - res[k])/(abs(res[k]) + fsmall));
+    }
+
+    if(diffmax[0]>fusedtol || diffmax[1]>fusedtol || diffmax[2]>fusedtol)
+    {
+        printf("ERROR: fused and unfused iterations differ: interior %e, boundary %e, residual %e (fusedtol = %e)!\n",
+               diffmax[0], diffmax[1], diffmax[2], fusedtol);
+        exit (EXIT_FAILED);
+    }
+}
+
+/**************************************************************************/
+
+template <int IMAX, int JMAX, bool DUAL>
+void residual_interior( const Array3& u, const Array2& viscx, const Array2& viscy, const Array3& s, Array3& res )
+{
+    /* 
+    Uses global variable(s): imax, jmax, rcoef
+    To Modify: res at the interior nodes (see 'compute_residual')
+    */
+    const int imax = (IMAX>0) ? IMAX : ::imax;     /* Compile-time grid size when specialized */
+    const int jmax = (JMAX>0) ? JMAX : ::jmax;
+    int i;
+    int j;
+    int k;
+
+    #pragma omp parallel for private(j, k)
+    for (i=1;i<imax-1;i++)
+    {
+        for (j=1;j<jmax-1;j++)
+        {
+            double r[neq];      //Residual at one node
+
+            steady_residual_node<true, DUAL>(u, i, j, viscx(i,j), viscy(i,j), s, r);
+            for (k=0;k<neq;k++)
+            {
+                res(i,j,k) = r[k];
+            }
+        }
+    }
+}
+
+template <int IMAX, int JMAX>
+void compute_residual( const Array3& u, const Array2& viscx, const Array2& viscy, const Array3& s, Array3& res )
+{
+    /* 
+    Uses global variable(s): imax, jmax, idual, rcoef
+    Uses: u, artviscx, artviscy, s
+    To Modify: res (caller-provided, same size as u; nothing is allocated here)
+    Steady residual R(u) - s of the same discretization used by every solver
+    (residual_stencil), so that u = u - dt*P*res is one point Jacobi step.
+    With the physical time term for idual = 1. Zero on the boundary.
+    */
+    const int imax = (IMAX>0) ? IMAX : ::imax;     /* Compile-time grid size when specialized */
+    const int jmax = (JMAX>0) ? JMAX : ::jmax;
+    int i;
+    int j;
+    int k;
+
+    for (i=0;i<imax;i++)
+    {
+        for (k=0;k<neq;k++)
+        {
+            res(i,0,k) = zero;
+            res(i,jmax-1,k) = zero;
+        }
+    }
+    for (j=0;j<jmax;j++)
+    {
+        for (k=0;k<neq;k++)
+        {
+            res(0,j,k) = zero;
+            res(imax-1,j,k) = zero;
+        }
+    }
+
+    if(idual==1)
+        residual_interior<IMAX,JMAX,true>(u, viscx, viscy, s, res);
+    else
+        residual_interior<IMAX,JMAX,false>(u, viscx, viscy, s, res);
+}
+
+/**************************************************************************/
+/*                  Multigrid (Full Approximation Scheme)                 */
+/*                                                                        */
+/* Vertex-centered 2:1 coarsening: coarse node (I,J) sits on fine node    */
+/* (2I,2J), so an odd grid gives an odd coarse grid with (n-1)/2+1 points.*/
+/* The coarse-level problem is R_H(u_H) = R_H(I u_h) - I (R_h(u_h) - s_h),*/
+/* with the right-hand side handed to the smoothers through 'src', which  */
+/* they already subtract from the residual.                               */
+/* Cycle counts stay flat with grid size for smooth solutions (MMS). The  */
+/* coarse levels do not resolve the singular lid corners of the cavity,   */
+/* so its cost still grows with refinement (see the README).              */
+/**************************************************************************/
+
+void mg_setup( Array3& u, Array3& uold, Array3& src, Array2& viscx, Array2& viscy, Array2& dt )
+{
+    /*
+    Uses global variable(s): imax, jmax, mglevels, mgnmin, neq
+    To modify: mglevel, nlevels
+    Builds the coarse levels; level 0 uses the fine-grid arrays from main.
+    */
+
+    int l;
+    int maxlev = (mglevels>0) ? min(mglevels, MAXLEVELS) : MAXLEVELS;
+
+    if((isgs==0 && cfl>1.0) || ((isgs==1 || isgs==2) && cfl>1.6))
+    {
+        printf("Warning: the explicit smoothers are usually unstable on the coarse levels above cfl = 1.0 (PJ) or 1.6 (SGS)\n");
+    }
+
+    mglevel[0].ni = imax;
+    mglevel[0].nj = jmax;
+    nlevels = 1;
+    while( nlevels<maxlev )
+    {
+        int ni = (mglevel[nlevels-1].ni - 1)/2 + 1;
+        int nj = (mglevel[nlevels-1].nj - 1)/2 + 1;
+        if( ((mglevel[nlevels-1].ni-1)%2)!=0 || ((mglevel[nlevels-1].nj-1)%2)!=0 ) break;
+        if( ni<mgnmin || nj<mgnmin ) break;
+        mglevel[nlevels].ni = ni;
+        mglevel[nlevels].nj = nj;
+        nlevels++;
+    }
+
+    mglevel[0].u = &u;
+    mglevel[0].uold = &uold;
+    mglevel[0].src = &src;
+    mglevel[0].srcphys = &src;
+    mglevel[0].viscx = &viscx;
+    mglevel[0].viscy = &viscy;
+    mglevel[0].dt = &dt;
+    mglevel[0].u0 = new Array3(imax, jmax, neq, workspace);
+    mglevel[0].res = new Array3(imax, jmax, neq, workspace);
+
+    for(l=0; l<nlevels; l++)
+    {
+        MGLevel& lev = mglevel[l];
+        set_grid(lev.ni, lev.nj);
+        if(l>0)
+        {
+            lev.u = new Array3(lev.ni, lev.nj, neq, workspace);
+            lev.uold = new Array3(lev.ni, lev.nj, neq, workspace);
+            lev.src = new Array3(lev.ni, lev.nj, neq, workspace);
+            lev.srcphys = new Array3(lev.ni, lev.nj, neq, workspace);
+            lev.u0 = new Array3(lev.ni, lev.nj, neq, workspace);
+            lev.res = new Array3(lev.ni, lev.nj, neq, workspace);
+            lev.viscx = new Array2(lev.ni, lev.nj, workspace);
+            lev.viscy = new Array2(lev.ni, lev.nj, workspace);
+            lev.dt = new Array2(lev.ni, lev.nj, workspace);
+            compute_source_terms( *lev.srcphys );
+        }
+        lev.dtmin = 1.0e99;
+        lev.iterationStep = select_iteration_step( l>0 || idual==1 );    /* FAS forcing, or the BDF part of src */
+        lev.timeStep = select_time_step( true );
+        printf("Multigrid level %d: %d x %d\n", l, lev.ni, lev.nj);
+    }
+    set_grid(mglevel[0].ni, mglevel[0].nj);
+}
+
+/**************************************************************************/
+
+void mg_smooth( int l, int nsweeps, boundaryConditionPointer set_boundary_conditions )
+{
+    /* Runs nsweeps PJ or SGS iterations on level l (the active grid must be level l) */
+
+    MGLevel& lev = mglevel[l];
+
+    for(int n=0; n<nsweeps; n++)
+    {
+        lev.timeStep( *lev.u, *lev.dt, lev.dtmin );
+        lev.iterationStep( set_boundary_conditions, *lev.u, *lev.uold, *lev.src, *lev.viscx, *lev.viscy, *lev.dt );
+    }
+    mgwork += (double)(nsweeps)*(double)(lev.ni*lev.nj)/(double)(mglevel[0].ni*mglevel[0].nj);
+}
+
+/**************************************************************************/
+
+void mg_restrict( int l, boundaryConditionPointer set_boundary_conditions )
+{
+    /*
+    Restricts level l to level l+1: injection of the solution, full weighting of the
+    residual, and the FAS forcing src(l+1) = R(u0) - I r(l). Leaves level l+1 active.
+    The continuity equations are not exactly compatible, so a converged PJ smoother
+    leaves a continuity residual w/(beta2 dt), with w the uniform pressure shift of
+    each sweep that the rescaling removes. That component is projected out of r(l)
+    before the restriction, so a converged level gets no coarse-grid correction.
+    */
+
+    MGLevel& fine = mglevel[l];
+    MGLevel& crs = mglevel[l+1];
+    Array3& uf = *fine.u;
+    Array3& rf = *fine.res;
+    Array2& dtf = *fine.dt;
+    Array3& uc = *crs.u;
+    Array3& sc = *crs.src;
+    int i, j, k;
+    double rq = zero;               /* Sums for the projection of the continuity residual on q = 1/(beta2 dt) */
+    double qq = zero;
+
+    /* Fine-grid residual, with the rescaling component of continuity removed */
+    set_grid(fine.ni, fine.nj);
+    Compute_Artificial_Viscosity<0,0>( uf, *fine.viscx, *fine.viscy );
+    compute_residual<0,0>( uf, *fine.viscx, *fine.viscy, *fine.src, rf );
+    fine.timeStep( uf, dtf, fine.dtmin );     /* Also set with mgpre = 0; the smoothers recompute it */
+
+    for(i=1; i<fine.ni-1; i++)
+    {
+        for(j=1; j<fine.nj-1; j++)
+        {
+            double q = one/(local_beta2(uf, i, j)*dtf(i,j));
+            rq += rf(i,j,0)*q;
+            qq += q*q;
+        }
+    }
+    for(i=1; i<fine.ni-1; i++)
+    {
+        for(j=1; j<fine.nj-1; j++)
+        {
+            rf(i,j,0) -= (rq/qq)/(local_beta2(uf, i, j)*dtf(i,j));
+        }
+    }
+
+    /* Solution: injection */
+    for(i=0; i<crs.ni; i++)
+    {
+        for(j=0; j<crs.nj; j++)
+        {
+            for(k=0; k<neq; k++)
+            {
+                uc(i,j,k) = uf(2*i,2*j,k);
+            }
+        }
+    }
+    set_grid(crs.ni, crs.nj);
+    set_boundary_conditions( uc );
+    crs.u0->copyData( uc );
+
+    /* Forcing: R_H(u0) (with zero source, held temporarily in res) minus restricted residual */
+    for(i=0; i<crs.ni; i++)
+    {
+        for(j=0; j<crs.nj; j++)
+        {
+            for(k=0; k<neq; k++)
+            {
+                sc(i,j,k) = zero;
+            }
+        }
+    }
+    Compute_Artificial_Viscosity<0,0>( uc, *crs.viscx, *crs.viscy );
+    compute_residual<0,0>( uc, *crs.viscx, *crs.viscy, sc, *crs.res );
+
+    for(i=1; i<crs.ni-1; i++)
+    {
+        for(j=1; j<crs.nj-1; j++)
+        {
+            for(k=0; k<neq; k++)
+            {
+                double rfw = fourth*rf(2*i,2*j,k)
+                           + 0.125*( rf(2*i-1,2*j,k) + rf(2*i+1,2*j,k) + rf(2*i,2*j-1,k) + rf(2*i,2*j+1,k) )
+                           + 0.0625*( rf(2*i-1,2*j-1,k) + rf(2*i+1,2*j-1,k) + rf(2*i-1,2*j+1,k) + rf(2*i+1,2*j+1,k) );
+                sc(i,j,k) = (*crs.res)(i,j,k) - rfw;
+            }
+        }
+    }
+}
+
+/**************************************************************************/
+
+void mg_prolong_correction( int l, boundaryConditionPointer set_boundary_conditions )
+{
+    /*
+    Adds the bilinear interpolation of the level l+1 correction (u - u0) to level l,
+    then resets the level l boundary conditions. Leaves level l active.
+    */
+
+    MGLevel& fine = mglevel[l];
+    MGLevel& crs = mglevel[l+1];
+    Array3& uf = *fine.u;
+    Array3& uc = *crs.u;
+    Array3& u0 = *crs.u0;
+    int i, j, k;
+
+    for(i=1; i<fine.ni-1; i++)
+    {
+        int ic = i/2;
+        int ip = (i%2==0) ? ic : ic+1;
+        for(j=1; j<fine.nj-1; j++)
+        {
+            int jc = j/2;
+            int jp = (j%2==0) ? jc : jc+1;
+            for(k=0; k<neq; k++)
+            {
+                uf(i,j,k) += fourth*( (uc(ic,jc,k) - u0(ic,jc,k)) + (uc(ip,jc,k) - u0(ip,jc,k))
+                                    + (uc(ic,jp,k) - u0(ic,jp,k)) + (uc(ip,jp,k) - u0(ip,jp,k)) );
+            }
+        }
+    }
+    set_grid(fine.ni, fine.nj);
+    set_boundary_conditions( uf );
+}
+
+/**************************************************************************/
+
+void mg_prolong_solution( int l, boundaryConditionPointer set_boundary_conditions )
+{
+    /* Bilinear interpolation of the full level l+1 solution onto level l (full multigrid start) */
+
+    MGLevel& fine = mglevel[l];
+    MGLevel& crs = mglevel[l+1];
+    Array3& uf = *fine.u;
+    Array3& uc = *crs.u;
+    int i, j, k;
+
+    for(i=0; i<fine.ni; i++)
+    {
+        int ic = i/2;
+        int ip = (i%2==0) ? ic : ic+1;
+        for(j=0; j<fine.nj; j++)
+        {
+            int jc = j/2;
+            int jp = (j%2==0) ? jc : jc+1;
+            for(k=0; k<neq; k++)
+            {
+                uf(i,j,k) = fourth*( uc(ic,jc,k) + uc(ip,jc,k) + uc(ic,jp,k) + uc(ip,jp,k) );
+            }
+        }
+    }
+    set_grid(fine.ni, fine.nj);
+    set_boundary_conditions( uf );
+}
+
+/**************************************************************************/
+
+void mg_cycle( int l, boundaryConditionPointer set_boundary_conditions )
+{
+    /*
+    Uses global variable(s): nlevels, mgcycle, mgpre, mgpost, mgcoarse
+    One V- (mgcycle = 1) or W-cycle (mgcycle = 2) starting on level l.
+    */
+
+    set_grid(mglevel[l].ni, mglevel[l].nj);
+    if(l==nlevels-1)
+    {
+        mg_smooth(l, mgcoarse, set_boundary_conditions);
+        return;
+    }
+
+    mg_smooth(l, mgpre, set_boundary_conditions);
+
+    mg_restrict(l, set_boundary_conditions);
+    for(int c=0; c<mgcycle; c++)
+    {
+        mg_cycle(l+1, set_boundary_conditions);
+    }
+    mg_prolong_correction(l, set_boundary_conditions);
+
+    mg_smooth(l, mgpost, set_boundary_conditions);
+}
+
+/**************************************************************************/
+
+void MG_iteration( boundaryConditionPointer set_boundary_conditions, Array3& u, Array3& uold, Array3&, Array2&, Array2&, Array2& )
+{
+    /*
+    Multigrid iteration step (same interface as PJ_iteration and GS_iteration): one cycle
+    on the fine grid. On return uold holds u from the start of the cycle, so the iterative
+    residual in check_iterative_convergence measures the change over the whole cycle.
+    The source and work arrays are those of level 0 (see 'mg_setup').
+    */
+
+    mglevel[0].u0->copyData(u);
+
+    mg_cycle(0, set_boundary_conditions);
+
+    uold.copyData(*mglevel[0].u0);
+    set_grid(mglevel[0].ni, mglevel[0].nj);
+}
+
+/**************************************************************************/
+
+void mg_full_multigrid_start( boundaryConditionPointer set_boundary_conditions )
+{
+    /*
+    Uses global variable(s): nlevels, mgfmgcycles
+    Full multigrid: the initial condition is injected down to the coarsest level, then each
+    level (coarsest first, with its own physical source) gets mgfmgcycles cycles before its
+    solution is interpolated to the next finer level as that level's initial guess.
+    */
+
+    int l, c, i, j, k;
+
+    for(l=1; l<nlevels; l++)
+    {
+        Array3& uf = *mglevel[l-1].u;
+        Array3& uc = *mglevel[l].u;
+        for(i=0; i<mglevel[l].ni; i++)
+        {
+            for(j=0; j<mglevel[l].nj; j++)
+            {
+                for(k=0; k<neq; k++)
+                {
+                    uc(i,j,k) = uf(2*i,2*j,k);
+                }
+            }
+        }
+    }
+
+    for(l=nlevels-1; l>0; l--)
+    {
+        mglevel[l].src->copyData(*mglevel[l].srcphys);
+        for(c=0; c<mgfmgcycles; c++)
+        {
+            mg_cycle(l, set_boundary_conditions);
+        }
+        set_grid(mglevel[l].ni, mglevel[l].nj);
+        pressure_rescaling(*mglevel[l].u);
+        mg_prolong_solution(l-1, set_boundary_conditions);
+    }
+    set_grid(mglevel[0].ni, mglevel[0].nj);
+    printf("Full multigrid start done: %f work units\n", mgwork);
+}
+
+/**************************************************************************/
+/*              Jacobian-free Newton-Krylov (inewton = 1)                 */
+/*                                                                        */
+/* Each main-loop iteration is one Newton step on G(u) = -(u - uold)/dt  */
+/* of a point Jacobi step from u followed by the pressure rescaling,      */
+/*     G = P F + (deltap/dt) e_p,   P = diag(beta2, 1/rho, 1/rho),        */
+/* with F the steady residual of compute_residual and deltap the shift    */
+/* of the rescaling. Pressure enters F only through differences and the   */
+/* discrete continuity equations are not exactly compatible, so F = 0 has */
+/* no solution; G = 0 is the state the PJ iteration converges to, and the */
+/* continuity defect left in F is the uniform shift the rescaling undoes.  */
+/* The step solves (1/(ptc*dt) + G') du = -G(u), G' v a finite difference */
+/* of G with dt frozen. The 1/(ptc*dt) term is pseudo-                    */
+/* transient continuation, with ptc = ||G0||/||G|| (switched              */
+/* evolution relaxation), so it fades as the residual drops and the      */
+/* steps become plain Newton steps. The linear system is solved by       */
+/* restarted flexible GMRES, preconditioned by nkprec iterations of the   */
+/* isgs smoother (PJ, SGS, red-black SGS or AF) on the problem           */
+/* R(w) = R(u) + sigma P^-1 v, i.e. z = (w - u)/sigma ~ (P J)^-1 v. The   */
+/* sweeps are not exactly linear in v, hence the flexible variant.       */
+/**************************************************************************/
+
+void nk_gather( Array3& a, double* x )
+{
+    /* Interior values of a -> x (neq per node) */
+    const int nj = jmax - 2;
+
+    #pragma omp parallel for
+    for(int i=1; i<imax-1; i++)
+    {
+        for(int j=1; j<jmax-1; j++)
+        {
+            for(int k=0; k<neq; k++)
+            {
+                x[((size_t)(i-1)*nj + (j-1))*neq + k] = a(i,j,k);
+            }
+        }
+    }
+}
+
+/**************************************************************************/
+
+void nk_scatter( const double* x, Array3& a )
+{
+    /* x -> interior values of a (the boundary is left to the boundary conditions) */
+    const int nj = jmax - 2;
+
+    #pragma omp parallel for
+    for(int i=1; i<imax-1; i++)
+    {
+        for(int j=1; j<jmax-1; j++)
+        {
+            for(int k=0; k<neq; k++)
+            {
+                a(i,j,k) = x[((size_t)(i-1)*nj + (j-1))*neq + k];
+            }
+        }
+    }
+}
+
+/**************************************************************************/
+
+double nk_dot( const double* a, const double* b )
+{
+    double sum = zero;
+
+    #pragma omp parallel for reduction(+:sum)
+    for(int m=0; m<nk.n; m++)
+    {
+        sum += a[m]*b[m];
+    }
+    return sum;
+}
+
+/**************************************************************************/
+
+void nk_residual( boundaryConditionPointer set_boundary_conditions, const double* x, Array3& src,
+                  Array2& viscx, Array2& viscy, Array2& dt, double* f )
+{
+    /* 
+    Uses global variable(s): imax, jmax, nk
+    To modify: f = G for the interior values x (boundary conditions applied first),
+               nk.res (R(x) - src)
+    */
+    Array3& w = *nk.w;
+    const int nj = jmax - 2;
+    const int iref = (imax-1)/2;    /* Pressure rescaling point, see pressure_rescaling */
+    const int jref = (jmax-1)/2;
+    const size_t mref = ((size_t)(iref-1)*nj + (jref-1))*neq;
+    double deltap;
+
+    nk_scatter(x, w);
+    set_boundary_conditions(w);
+    Compute_Artificial_Viscosity<0,0>(w, viscx, viscy);
+    compute_residual<0,0>(w, viscx, viscy, src, *nk.res);
+    nk_gather(*nk.res, f);
+
+    #pragma omp parallel for
+    for(int m=0; m<nk.n; m++)
+    {
+        f[m] *= nk.p[m];
+    }
+
+    /* Shift of the pressure rescaling after a PJ step from x */
+    deltap = x[mref] - dt(iref,jref)*f[mref] - reference_pressure();
+    #pragma omp parallel for
+    for(int i=1; i<imax-1; i++)
+    {
+        for(int j=1; j<jmax-1; j++)
+        {
+            f[((size_t)(i-1)*nj + (j-1))*neq] += deltap/dt(i,j);
+        }
+    }
+}
+
+/**************************************************************************/
+
+void nk_matvec( boundaryConditionPointer set_boundary_conditions, Array3& src, Array2& viscx, Array2& viscy,
+                Array2& dt, const double* v, double* av )
+{
+    /* 
+    Uses global variable(s): nk (x, f, dtinv at the current Newton step)
+    To modify: av = (1/(ptc*dt) + G') v, with G' v = (G(x + eps v) - G(x))/eps
+    */
+    double* xp = nk.xp.data();
+    double vnorm = sqrt(nk_dot(v, v)/nk.n);
+    double xnorm = sqrt(nk_dot(nk.x.data(), nk.x.data())/nk.n);
+    double eps = 1.e-7*(one + xnorm)/(vnorm + fsmall);
+
+    #pragma omp parallel for
+    for(int m=0; m<nk.n; m++)
+    {
+        xp[m] = nk.x[m] + eps*v[m];
+    }
+    nk_residual(set_boundary_conditions, xp, src, viscx, viscy, dt, av);
+
+    #pragma omp parallel for
+    for(int m=0; m<nk.n; m++)
+    {
+        av[m] = (av[m] - nk.f[m])/eps + nk.dtinv[m]*v[m];
+    }
+}
+
+/**************************************************************************/
+
+void nk_precondition( boundaryConditionPointer set_boundary_conditions, Array3& src, Array2& viscx, Array2& viscy,
+                      Array2& dt, const double* v, double* z )
+{
+    /* 
+    Uses global variable(s): imax, jmax, nkprec, nk, nkPreconditioner
+    To modify: z ~ (P J)^-1 v from nkprec smoother iterations started at the current state
+    */
+    Array3& w = *nk.w;
+    Array3& srcp = *nk.srcp;
+    const int nj = jmax - 2;
+    double dtsum = zero;
+    double sigma;
+
+    if(nkprec==0)
+    {
+        memcpy(z, v, nk.n*sizeof(double));
+        return;
+    }
+
+    /* Shift of the source: the sweeps move w by about nkprec*sigma*dt*v, keep it ~1e-4 */
+    #pragma omp parallel for reduction(+:dtsum)
+    for(int i=1; i<imax-1; i++)
+    {
+        for(int j=1; j<jmax-1; j++)
+        {
+            dtsum += dt(i,j);
+        }
+    }
+    double vnorm = sqrt(nk_dot(v, v)/nk.n);
+    double xnorm = sqrt(nk_dot(nk.x.data(), nk.x.data())/nk.n);
+    sigma = 1.e-4*(one + xnorm)/(nkprec*(dtsum/nk.n*neq)*vnorm + fsmall);
+
+    /* R(w) - srcp = R(w) - R(u) - sigma P^-1 v, with R(u) = src + rbase */
+    srcp.copyData(src);
+    #pragma omp parallel for
+    for(int i=1; i<imax-1; i++)
+    {
+        for(int j=1; j<jmax-1; j++)
+        {
+            for(int k=0; k<neq; k++)
+            {
+                size_t m = ((size_t)(i-1)*nj + (j-1))*neq + k;
+                srcp(i,j,k) += (*nk.rbase)(i,j,k) + sigma*v[m]/nk.p[m];
+            }
+        }
+    }
+
+    nk_scatter(nk.x.data(), w);
+    set_boundary_conditions(w);
+    for(int n=0; n<nkprec; n++)
+    {
+        nkPreconditioner(set_boundary_conditions, w, *nk.wold, srcp, viscx, viscy, dt);
+    }
+    nk_gather(w, z);
+
+    #pragma omp parallel for
+    for(int m=0; m<nk.n; m++)
+    {
+        z[m] = (z[m] - nk.x[m])/sigma;
+    }
+    nksweeps += nkprec;
+}
+
+/**************************************************************************/
+
+void nk_scaling( Array3& u )
+{
+    /* 
+    Uses global variable(s): imax, jmax, rkappa, vel2ref, rhoinv
+    To modify: nk.p (diagonal of P at u, as in the PJ update)
+    */
+    const int nj = jmax - 2;
+
+    #pragma omp parallel for
+    for(int i=1; i<imax-1; i++)
+    {
+        for(int j=1; j<jmax-1; j++)
+        {
+            size_t m = ((size_t)(i-1)*nj + (j-1))*neq;
+            double uvel2 = u(i,j,1)*u(i,j,1) + u(i,j,2)*u(i,j,2);
+            nk.p[m]   = max(uvel2,rkappa*vel2ref);
+            nk.p[m+1] = rhoinv;
+            nk.p[m+2] = rhoinv;
+        }
+    }
+}
+
+/**************************************************************************/
+
+void nk_setup()
+{
+    /* 
+    Uses global variable(s): imax, jmax, nkrylov
+    To modify: nk (work arrays for the current grid)
+    */
+    nk.n = neq*(imax - 2)*(jmax - 2);
+    nk.w    = new Array3(imax, jmax, neq, workspace);
+    nk.wold = new Array3(imax, jmax, neq, workspace);
+    nk.res  = new Array3(imax, jmax, neq, workspace);
+    nk.srcp = new Array3(imax, jmax, neq, workspace);
+    nk.rbase = new Array3(imax, jmax, neq, workspace);
+    nk.x.resize(nk.n);
+    nk.xp.resize(nk.n);
+    nk.f.resize(nk.n);
+    nk.p.resize(nk.n);
+    nk.dtinv.resize(nk.n);
+    nk.du.resize(nk.n);
+    nk.r.resize(nk.n);
+    nk.v.resize((size_t)(nkrylov + 1)*nk.n);
+    nk.z.resize((size_t)nkrylov*nk.n);
+    nk.h.resize((size_t)(nkrylov + 1)*nkrylov);
+    nk.fnorm0 = -one;
+    nk.eta = -one;
+}
+
+/**************************************************************************/
+
+void NK_iteration( boundaryConditionPointer set_boundary_conditions, Array3& u, Array3& uold, Array3& src, Array2& viscx, Array2& viscy, Array2& dt )
+{
+    /*
+    Uses global variable(s): imax, jmax, nkrylov, nkcycles, nketa, rkappa, vel2ref, rho, nk
+    Newton-Krylov iteration step (same interface as PJ_iteration): one Newton step. On
+    return uold holds u from the start of the step.
+    */
+    const int nj = jmax - 2;
+    const int mk = nkrylov;
+    double* V = nk.v.data();
+    double* Z = nk.z.data();
+    double* H = nk.h.data();            /* H(i,j) = H[j*(mk+1) + i] */
+    vector<double> cs(mk), sn(mk), g(mk+1), y(mk);   /* Givens rotations, residual vector, solution of H y = g */
+    double beta, beta0 = zero;
+    double ptc;
+    double eta;                         /* Linear tolerance of this step */
+
+    uold.copyData(u);
+
+    /* State, scaling and residual at the start of the step */
+    nk_gather(u, nk.x.data());
+    nk_scaling(u);
+    nk_residual(set_boundary_conditions, nk.x.data(), src, viscx, viscy, dt, nk.f.data());
+    nk.rbase->copyData(*nk.res);
+
+    double fnorm = sqrt(nk_dot(nk.f.data(), nk.f.data()));
+    if(nk.fnorm0<zero)
+    {
+        nk.fnorm0 = fnorm;
+    }
+    ptc = nk.fnorm0/(fnorm + fsmall);
+
+    /* Linear tolerance (Eisenstat-Walker): tightens as ||G|| drops quadratically, at most nketa */
+    if(nk.eta<zero)
+    {
+        eta = nketa;
+    }
+    else
+    {
+        eta = 0.9*pow2(fnorm/nk.fnormold);
+        if(0.9*pow2(nk.eta)>0.1)
+        {
+            eta = max(eta, 0.9*pow2(nk.eta));
+        }
+        eta = min(eta, nketa);
+    }
+    nk.eta = eta;
+    nk.fnormold = fnorm;
+    #pragma omp parallel for
+    for(int i=1; i<imax-1; i++)
+    {
+        for(int j=1; j<jmax-1; j++)
+        {
+            for(int k=0; k<neq; k++)
+            {
+                nk.dtinv[((size_t)(i-1)*nj + (j-1))*neq + k] = one/(ptc*dt(i,j));
+            }
+        }
+    }
+
+    /* Restarted flexible GMRES for du, from du = 0 */
+    for(int m=0; m<nk.n; m++)
+    {
+        nk.du[m] = zero;
+        nk.r[m] = -nk.f[m];
+    }
+    for(int c=0; c<nkcycles; c++)
+    {
+        if(c>0)
+        {
+            /* r = -f - A du */
+            nk_matvec(set_boundary_conditions, src, viscx, viscy, dt, nk.du.data(), nk.r.data());
+            for(int m=0; m<nk.n; m++)
+            {
+                nk.r[m] = -nk.f[m] - nk.r[m];
+            }
+        }
+        beta = sqrt(nk_dot(nk.r.data(), nk.r.data()));
+        if(c==0)
+        {
+            beta0 = beta;
+        }
+        if(beta<=eta*beta0 || beta==zero)
+        {
+            break;
+        }
+        for(int m=0; m<nk.n; m++)
+        {
+            V[m] = nk.r[m]/beta;
+        }
+        g[0] = beta;
+
+        int jk;
+        for(jk=0; jk<mk; jk++)
+        {
+            double* vj = V + (size_t)jk*nk.n;
+            double* zj = Z + (size_t)jk*nk.n;
+            double* w  = V + (size_t)(jk+1)*nk.n;
+
+            nk_precondition(set_boundary_conditions, src, viscx, viscy, dt, vj, zj);
+            nk_matvec(set_boundary_conditions, src, viscx, viscy, dt, zj, w);
+            nkiters++;
+
+            /* Modified Gram-Schmidt */
+            for(int i=0; i<=jk; i++)
+            {
+                double* vi = V + (size_t)i*nk.n;
+                double hij = nk_dot(w, vi);
+                H[jk*(mk+1) + i] = hij;
+                #pragma omp parallel for
+                for(int m=0; m<nk.n; m++)
+                {
+                    w[m] -= hij*vi[m];
+                }
+            }
+            double hnext = sqrt(nk_dot(w, w));
+            H[jk*(mk+1) + jk+1] = hnext;
+            if(hnext>zero)
+            {
+                #pragma omp parallel for
+                for(int m=0; m<nk.n; m++)
+                {
+                    w[m] /= hnext;
+                }
+            }
+
+            /* Givens rotations: keep H upper triangular and g the residual vector */
+            for(int i=0; i<jk; i++)
+            {
+                double h1 = H[jk*(mk+1) + i];
+                double h2 = H[jk*(mk+1) + i+1];
+                H[jk*(mk+1) + i]   =  cs[i]*h1 + sn[i]*h2;
+                H[jk*(mk+1) + i+1] = -sn[i]*h1 + cs[i]*h2;
+            }
+            double h1 = H[jk*(mk+1) + jk];
+            double h2 = H[jk*(mk+1) + jk+1];
+            double rr = sqrt(h1*h1 + h2*h2) + fsmall;
+            cs[jk] = h1/rr;
+            sn[jk] = h2/rr;
+            H[jk*(mk+1) + jk] = rr;
+            H[jk*(mk+1) + jk+1] = zero;
+            g[jk+1] = -sn[jk]*g[jk];
+            g[jk]   =  cs[jk]*g[jk];
+
+            if(abs(g[jk+1])<=eta*beta0 || hnext==zero)
+            {
+                jk++;
+                break;
+            }
+        }
+
+        /* du += Z y, with H y = g */
+        for(int i=jk-1; i>=0; i--)
+        {
+            y[i] = g[i];
+            for(int l=i+1; l<jk; l++)
+            {
+                y[i] -= H[l*(mk+1) + i]*y[l];
+            }
+            y[i] /= H[i*(mk+1) + i];
+        }
+        for(int l=0; l<jk; l++)
+        {
+            double* zl = Z + (size_t)l*nk.n;
+            #pragma omp parallel for
+            for(int m=0; m<nk.n; m++)
+            {
+                nk.du[m] += y[l]*zl[m];
+            }
+        }
+        if(abs(g[jk])<=eta*beta0)
+        {
+            break;
+        }
+    }
+
+    /* Newton update */
+    for(int m=0; m<nk.n; m++)
+    {
+        nk.x[m] += nk.du[m];
+    }
+    nk_scatter(nk.x.data(), u);
+    set_boundary_conditions(u);
+}
+
+/**************************************************************************/
+
+void Discretization_Error_Norms( Array3& u, double rL1norm[neq], double rL2norm[neq], double rLinfnorm[neq] ) 
+{
+    /* 
+    Uses global variable(s): zero
+    Uses global variable(s): imax, jmax, neq, imms, mmsexact
+    Uses: u
+    To modify: rL1norm, rL2norm, rLinfnorm 
+    Norms of the discretization error u - umms over the interior nodes (the
+    velocities are exact on the walls), L1 and L2 normalized by the node count.
+    */
+
+    double DE;                      //Discretization error (absolute value)
+
+    for(int k=0; k<neq; k++)
+    {
+        rL1norm[k] = zero;
+        rL2norm[k] = zero;
+        rLinfnorm[k] = zero;
+    }
+
+    /* Only compute discretization error norms for manufactured solution */
+    if(imms==1)
+    {
+        const Array3& uexact = *mmsexact->u;
+        const double rnodes = one/((double)(imax - 2)*(double)(jmax - 2));
+
+        for(int i=1; i<imax-1; i++)
+        {
+            for(int j=1; j<jmax-1; j++)
+            {
+                for(int k=0; k<neq; k++)
+                {
+                    DE = fabs(u(i,j,k) - uexact(i,j,k));
+                    rL1norm[k] += DE;
+                    rL2norm[k] += DE*DE;
+                    rLinfnorm[k] = max(rLinfnorm[k], DE);
+                }
+            }
+        }
+        for(int k=0; k<neq; k++)
+        {
+            rL1norm[k] = rL1norm[k]*rnodes;
+            rL2norm[k] = sqrt(rL2norm[k]*rnodes);
+        }
+    }
+}
+
+/**************************************************************************/
+
+void write_error_norms( double rL1norm[neq], double rL2norm[neq], double rLinfnorm[neq] )
+{
+    /* 
+    Uses global variable(s): imax, jmax, neq, fp5
+    Writes the discretization error norms to the screen and 'DEnorms.dat'
+    */
+    const char* names[neq] = {"p", "u", "v"};
+
+    fp5 = fopen("./DEnorms.dat","w");
+    if(fp5==NULL)
+    {
+        printf("ERROR: could not open 'DEnorms.dat' for writing!\n");
+        exit (EXIT_FAILED);
+    }
+    fprintf(fp5, "# Discretization error norms, %d x %d grid\n", imax, jmax);
+    fprintf(fp5, "# variable  L1  L2  Linf\n");
+    printf("Discretization error norms (%d x %d):   L1            L2            Linf\n", imax, jmax);
+    for(int k=0; k<neq; k++)
+    {
+        fprintf(fp5, "%s %.10e %.10e %.10e\n", names[k], rL1norm[k], rL2norm[k], rLinfnorm[k]);
+        printf("                              %s   %e  %e  %e\n", names[k], rL1norm[k], rL2norm[k], rLinfnorm[k]);
+    }
+    fclose(fp5);
+}
+
+/********************************************************************************************************************/
+/*                                                                                                                  */
+/*                                                End Functions                                                     */
+/*                                                                                                                  */
+/********************************************************************************************************************/
+
+
+
+
+
+
+
+/********************************************************************************************************************/
+/*                                                                                                                  */
+/*                                          Benchmark Mode (--bench)                                                */
+/*                                                                                                                  */
+/********************************************************************************************************************/
+
+/* Runs 'benchiters' iterations of each kernel on square grids 65, 129, ... up to 'benchmax' */
+/* (no output files), and reports time, MLUPS (million interior node updates per second)   */
+/* and effective memory bandwidth per kernel on the screen and in 'bench.json'.            */
+/* Bandwidth uses the compulsory traffic of each kernel: every array it reads or writes    */
+/* moved once per node and iteration (bench_kernel_bytes below, 8 bytes per double). The   */
+/* tiled pass is given the per-iteration traffic of PJ_fused_iteration, so the two compare */
+/* directly; it reuses the rows in cache, so its figure can exceed the memory bandwidth.   */
+
+#define BENCH_KERNELS 12
+
+const char* bench_kernel_name[BENCH_KERNELS] =
+{
+    "compute_time_step", "Compute_Artificial_Viscosity", "point_Jacobi", "SGS_forward_sweep",
+    "SGS_backward_sweep", "SGS_color_sweep", "pressure_rescaling", "check_iterative_convergence",
+    "bndry", "PJ_fused_iteration", "AF_line_relaxation", "PJ_tiled_iterations"
+};
+
+const double bench_kernel_bytes[BENCH_KERNELS] =      /* Bytes moved per interior node */
+{
+    8*(2 + 1),                  /* u, v in; dt out */
+    8*(3 + 2),                  /* p, u, v in; viscx, viscy out */
+    8*(3 + 2 + 1 + 3 + 3),      /* uold, viscx, viscy, dt, s in; u out */
+    8*(3 + 2 + 1 + 3 + 3),      /* same as point_Jacobi, in place */
+    8*(3 + 2 + 1 + 3 + 3),
+    8*(3 + 2 + 1 + 3 + 3),      /* one color: half the nodes per call, two calls per sweep */
+    8*(1 + 1),                  /* p in and out */
+    8*(3 + 3 + 1),              /* u, uold, dt in */
+    0,                          /* boundary only: no per-node model, no GB/s reported */
+    8*(3 + 3 + 3),              /* uold, s in; u out (dt, viscx, viscy are never stored) */
+    8*(3 + 2 + 1 + 3 + 3 + 4*AF_NC), /* u, viscx, viscy, dt, s in; u out; both line systems written and read */
+    8*(3 + 3 + 3)               /* per iteration, as PJ_fused_iteration (effective, see above) */
+};
+
+struct BenchResult
+{
+    int n;                              /* Grid size (n x n) */
+    double t[BENCH_KERNELS];            /* Total time per kernel (s) */
+    int calls[BENCH_KERNELS];           /* Calls per kernel */
+    double tpj, tsgs, trbgs, tfused, taf, ttiled;   /* Whole iteration times (s) */
+};
+
+/**************************************************************************/
+
+template <int IMAX, int JMAX>
+void bench_grid( BenchResult& r, int iters, boundaryConditionPointer bc, Array3& u, Array3& uold, Array3& src,
+                 Array2& viscx, Array2& viscy, Array2& dt )
+{
+    /* 
+    Uses global variable(s): imax, jmax (set by the caller), isimd (through pointJacobiVector)
+    To modify: r, u, uold, viscx, viscy, dt
+    Times each kernel of the PJ, SGS, red-black SGS and implicit line relaxation iterations
+    on the current grid.
+    The kernels run in the order of the real iterations, so they see realistic data.
+    */
+    double res[neq];
+    double resinit[neq] = {one, one, one};
+    double dtmin = 1.0e99;
+    double conv;
+    double t0, t1;
+
+    for(int k=0; k<BENCH_KERNELS; k++)
+    {
+        r.t[k] = zero;
+        r.calls[k] = 0;
+    }
+
+#define BENCH_TIME(kernel, call) { t0 = wall_time(); call; r.t[kernel] += wall_time() - t0; r.calls[kernel]++; }
+
+    /* Point Jacobi: PJ_iteration + pressure_rescaling + check_iterative_convergence */
+    t1 = wall_time();
+    for(int n=0; n<iters; n++)
+    {
+        BENCH_TIME(0, (compute_time_step<IMAX,JMAX>(u, dt, dtmin)));
+        uold.swapData(u);
+        BENCH_TIME(1, (Compute_Artificial_Viscosity<IMAX,JMAX>(uold, viscx, viscy)));
+        if(pointJacobiVector!=NULL)
+            BENCH_TIME(2, (pointJacobiVector(u, uold, viscx, viscy, dt, src)))
+        else
+            BENCH_TIME(2, (point_Jacobi<IMAX,JMAX>(u, uold, viscx, viscy, dt, src)));
+        BENCH_TIME(8, bc(u));
+        BENCH_TIME(6, pressure_rescaling(u));
+        BENCH_TIME(7, (iterative_residual_sums(u, uold, dt, zero, res), conv = res[0]));
+    }
+    r.tpj = wall_time() - t1;
+
+    /* Symmetric Gauss-Seidel: GS_iteration */
+    t1 = wall_time();
+    for(int n=0; n<iters; n++)
+    {
+        BENCH_TIME(0, (compute_time_step<IMAX,JMAX>(u, dt, dtmin)));
+        uold.copyData(u);
+        BENCH_TIME(1, (Compute_Artificial_Viscosity<IMAX,JMAX>(u, viscx, viscy)));
+        BENCH_TIME(3, (SGS_forward_sweep<IMAX,JMAX>(u, viscx, viscy, dt, src)));
+        BENCH_TIME(8, bc(u));
+        BENCH_TIME(1, (Compute_Artificial_Viscosity<IMAX,JMAX>(u, viscx, viscy)));
+        BENCH_TIME(4, (SGS_backward_sweep<IMAX,JMAX>(u, viscx, viscy, dt, src)));
+        BENCH_TIME(8, bc(u));
+        BENCH_TIME(6, pressure_rescaling(u));
+        BENCH_TIME(7, (iterative_residual_sums(u, uold, dt, zero, res), conv = res[0]));
+    }
+    r.tsgs = wall_time() - t1;
+
+    /* Red-black SGS: RBGS_iteration (color sweeps only, the rest is counted above) */
+    t1 = wall_time();
+    for(int n=0; n<iters; n++)
+    {
+        compute_time_step<IMAX,JMAX>(u, dt, dtmin);
+        uold.copyData(u);
+        Compute_Artificial_Viscosity<IMAX,JMAX>(u, viscx, viscy);
+        BENCH_TIME(5, (SGS_color_sweep<IMAX,JMAX>(u, viscx, viscy, dt, src, 0)));
+        BENCH_TIME(5, (SGS_color_sweep<IMAX,JMAX>(u, viscx, viscy, dt, src, 1)));
+        bc(u);
+        Compute_Artificial_Viscosity<IMAX,JMAX>(u, viscx, viscy);
+        BENCH_TIME(5, (SGS_color_sweep<IMAX,JMAX>(u, viscx, viscy, dt, src, 1)));
+        BENCH_TIME(5, (SGS_color_sweep<IMAX,JMAX>(u, viscx, viscy, dt, src, 0)));
+        bc(u);
+        pressure_rescaling(u);
+        iterative_residual_sums(u, uold, dt, zero, res);
+    }
+    r.trbgs = wall_time() - t1;
+
+    /* Fused point Jacobi (one sweep per iteration) */
+    t1 = wall_time();
+    for(int n=0; n<iters; n++)
+    {
+        BENCH_TIME(9, (PJ_fused_iteration<IMAX,JMAX>(bc, u, uold, src, res, dtmin)));
+    }
+    r.tfused = wall_time() - t1;
+
+    /* Implicit line relaxation: AF_iteration + pressure_rescaling + check_iterative_convergence */
+    t1 = wall_time();
+    for(int n=0; n<iters; n++)
+    {
+        BENCH_TIME(0, (compute_time_step<IMAX,JMAX>(u, dt, dtmin)));
+        uold.copyData(u);
+        BENCH_TIME(1, (Compute_Artificial_Viscosity<IMAX,JMAX>(u, viscx, viscy)));
+        BENCH_TIME(10, (AF_line_relaxation<IMAX,JMAX>(u, viscx, viscy, dt, src)));
+        BENCH_TIME(8, bc(u));
+        BENCH_TIME(6, pressure_rescaling(u));
+        BENCH_TIME(7, (iterative_residual_sums(u, uold, dt, zero, res), conv = res[0]));
+    }
+    r.taf = wall_time() - t1;
+
+    /* Temporally tiled point Jacobi: passes of ktile iterations (8 when ktile = 1) */
+    const int nlevb = (ktile>1) ? ktile : 8;
+    double dtlev[MAXKTILE];
+    boundaryRowPointer bcrow = (imms==1) ? &bndrymms_row<double> : &bndry_row<double>;
+    t1 = wall_time();
+    for(int n=0; n<iters; n+=nlevb)
+    {
+        int nlev = min(nlevb, iters - n);
+        for(int t=0; t<nlev; t++)
+        {
+            dtlev[t] = dtmin;
+        }
+        BENCH_TIME(11, (PJ_tiled_iterations<IMAX,JMAX>(bcrow, u, uold, src, dt, nlev, res, dtlev)));
+        r.calls[11] += nlev - 1;            /* Counted per iteration */
+    }
+    r.ttiled = wall_time() - t1;
+
+#undef BENCH_TIME
+    (void)conv;
+    (void)resinit;
+}
+
+/**************************************************************************/
+
+template <int N>
+void bench_grid_fixed( BenchResult& r, int iters, boundaryConditionPointer bc, Array3& u, Array3& uold, Array3& src,
+                       Array2& viscx, Array2& viscy, Array2& dt )
+{
+    bench_grid<N,N>(r, iters, bc, u, uold, src, viscx, viscy, dt);
+}
+
+/**************************************************************************/
+
+void run_benchmark()
+{
+    /* 
+    Uses global variable(s): benchiters, benchmax, ispec, imms, isimd, nthreads
+    To modify: imax, jmax, dx, dy (set_grid for each benchmark grid)
+    Writes 'bench.json'
+    */
+    BenchResult results[8];
+    int nresults = 0;
+    int nthr = 1;
+    const int nlevb = (ktile>1) ? ktile : 8;   /* Iterations per tiled pass (as in 'bench_grid') */
+    int ninit;
+    double rtime;
+    double dtmin;
+    double resinit[neq];
+    boundaryConditionPointer bc = (imms==1) ? &bndrymms<double> : &bndry<double>;
+
+#ifdef _OPENMP
+    nthr = omp_get_max_threads();
+#endif
+    if(benchiters<1 || benchmax<65)
+    {
+        printf("ERROR: --bench needs benchiters >= 1 and benchmax >= 65!\n");
+        exit (EXIT_FAILED);
+    }
+    params.irstr = 0;       /* Always start from the initial profile */
+    int nbig = 65;
+    for(int n=65, k=0; n<=benchmax && k<8; n=2*n-1, k++)
+    {
+        nbig = n;
+    }
+    workspace.reserve( 3*Array3::bytes(nbig, nbig, neq) + 3*Array2::bytes(nbig, nbig) + tile_buffer_bytes(nbig) );
+
+    printf("\nBenchmark: %d iterations per grid and scheme, %d thread(s), %s layout\n", benchiters, nthr, Array3Layout::name());
+    for(int n=65; n<=benchmax && nresults<8; n=2*n-1)
+    {
+        set_grid(n, n);
+        WorkspaceScope scope;       /* The grids reuse the block of the largest one */
+        Array3 u(n, n, neq, workspace), uold(n, n, neq, workspace), src(n, n, neq, workspace);
+        Array2 viscx(n, n, workspace), viscy(n, n, workspace), dt(n, n, workspace);
+        tile_buffer_setup(n);
+
+        initial(ninit, rtime, dtmin, resinit, u, src);
+        bc(u);
+        compute_source_terms(src);
+
+        BenchResult& r = results[nresults++];
+        r.n = n;
+        int warm = (benchiters>10) ? 10 : 1;    /* Untimed warm-up: page in the arrays, spin up the threads */
+        if(ispec==1)
+        {
+            switch(n)
+            {
+                case 65:   bench_grid_fixed<65>(r, warm, bc, u, uold, src, viscx, viscy, dt);
+                           bench_grid_fixed<65>(r, benchiters, bc, u, uold, src, viscx, viscy, dt);   break;
+                case 129:  bench_grid_fixed<129>(r, warm, bc, u, uold, src, viscx, viscy, dt);
+                           bench_grid_fixed<129>(r, benchiters, bc, u, uold, src, viscx, viscy, dt);  break;
+                case 257:  bench_grid_fixed<257>(r, warm, bc, u, uold, src, viscx, viscy, dt);
+                           bench_grid_fixed<257>(r, benchiters, bc, u, uold, src, viscx, viscy, dt);  break;
+                case 513:  bench_grid_fixed<513>(r, warm, bc, u, uold, src, viscx, viscy, dt);
+                           bench_grid_fixed<513>(r, benchiters, bc, u, uold, src, viscx, viscy, dt);  break;
+                case 1025: bench_grid_fixed<1025>(r, warm, bc, u, uold, src, viscx, viscy, dt);
+                           bench_grid_fixed<1025>(r, benchiters, bc, u, uold, src, viscx, viscy, dt); break;
+                default:   bench_grid<0,0>(r, warm, bc, u, uold, src, viscx, viscy, dt);
+                           bench_grid<0,0>(r, benchiters, bc, u, uold, src, viscx, viscy, dt);
+            }
+        }
+        else
+        {
+            bench_grid<0,0>(r, warm, bc, u, uold, src, viscx, viscy, dt);
+            bench_grid<0,0>(r, benchiters, bc, u, uold, src, viscx, viscy, dt);
+        }
+
+        double nodes = (double)(n-2)*(n-2);
+        double mlups = nodes*benchiters*1.e-6;
+        printf("\n%d x %d   PJ %.1f MLUPS   SGS %.1f MLUPS   RB-SGS %.1f MLUPS   fused PJ %.1f MLUPS   AF %.1f MLUPS   tiled PJ %.1f MLUPS\n", n, n,
+               mlups/r.tpj, mlups/r.tsgs, mlups/r.trbgs, mlups/r.tfused, mlups/r.taf, mlups/r.ttiled);
+        printf("   %-30s %10s %8s %10s %8s\n", "kernel", "time (s)", "calls", "ns/node", "GB/s");
+        for(int k=0; k<BENCH_KERNELS; k++)
+        {
+            double nodecalls = nodes*r.calls[k]*((k==5) ? half : one);   /* a color sweep updates half the nodes */
+            double bytes = bench_kernel_bytes[k];
+            printf("   %-30s %10.4f %8d %10.2f ", bench_kernel_name[k], r.t[k], r.calls[k], 1.e9*r.t[k]/nodecalls);
+            if(bytes>zero) printf("%8.2f\n", 1.e-9*bytes*nodecalls/(r.t[k] + fsmall));
+            else           printf("%8s\n", "-");
+        }
+    }
+
+    /* JSON report for tracking between versions */
+    FILE* fp = fopen("./bench.json", "w");
+    if(fp==NULL)
+    {
+        printf("ERROR: could not open 'bench.json' for writing!\n");
+        exit (EXIT_FAILED);
+    }
+    fprintf(fp, "{\n  \"iterations\": %d,\n  \"threads\": %d,\n  \"layout\": \"%s\",\n  \"isimd\": %d,\n  \"ispec\": %d,\n  \"imms\": %d,\n  \"ktile\": %d,\n",
+            benchiters, nthr, Array3Layout::name(), isimd, ispec, imms, nlevb);
+    fprintf(fp, "  \"grids\": [\n");
+    for(int g=0; g<nresults; g++)
+    {
+        BenchResult& r = results[g];
+        double nodes = (double)(r.n-2)*(r.n-2);
+        double mlups = nodes*benchiters*1.e-6;
+        fprintf(fp, "    {\n      \"imax\": %d, \"jmax\": %d,\n", r.n, r.n);
+        fprintf(fp, "      \"iterations\": {\n");
+        fprintf(fp, "        \"PJ\": {\"time_s\": %.6e, \"mlups\": %.4f},\n", r.tpj, mlups/r.tpj);
+        fprintf(fp, "        \"SGS\": {\"time_s\": %.6e, \"mlups\": %.4f},\n", r.tsgs, mlups/r.tsgs);
+        fprintf(fp, "        \"RBSGS\": {\"time_s\": %.6e, \"mlups\": %.4f},\n", r.trbgs, mlups/r.trbgs);
+        fprintf(fp, "        \"PJ_fused\": {\"time_s\": %.6e, \"mlups\": %.4f},\n", r.tfused, mlups/r.tfused);
+        fprintf(fp, "        \"AF\": {\"time_s\": %.6e, \"mlups\": %.4f},\n", r.taf, mlups/r.taf);
+        fprintf(fp, "        \"PJ_tiled\": {\"time_s\": %.6e, \"mlups\": %.4f}\n", r.ttiled, mlups/r.ttiled);
+        fprintf(fp, "      },\n      \"kernels\": {\n");
+        for(int k=0; k<BENCH_KERNELS; k++)
+        {
+            double nodecalls = nodes*r.calls[k]*((k==5) ? half : one);
+            double bytes = bench_kernel_bytes[k];
+            fprintf(fp, "        \"%s\": {\"time_s\": %.6e, \"calls\": %d, \"ns_per_node\": %.4f, ",
+                    bench_kernel_name[k], r.t[k], r.calls[k], 1.e9*r.t[k]/nodecalls);
+            if(bytes>zero) fprintf(fp, "\"bytes_per_node\": %.1f, \"gb_per_s\": %.4f}", bytes, 1.e-9*bytes*nodecalls/(r.t[k] + fsmall));
+            else           fprintf(fp, "\"bytes_per_node\": null, \"gb_per_s\": null}");
+            fprintf(fp, "%s\n", (k<BENCH_KERNELS-1) ? "," : "");
+        }
+        fprintf(fp, "      }\n    }%s\n", (g<nresults-1) ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+    fclose(fp);
+    printf("\nBenchmark results written to 'bench.json'\n");
+}
+
+/********************************************************************************************************************/
+/*                                                                                                                  */
+/*                                        Parameter Sweep (--sweep casefile)                                        */
+/*                                                                                                                  */
+/********************************************************************************************************************/
+
+/* Each line of the case file is one case: a name, which is also its output directory,   */
+/* then "keyword=value" inputs on top of the ones given to the sweep, e.g.                 */
+/*     re1000_129   Re=1000 imax=129 jmax=129 isgs=1                                       */
+/* The solver state (params, grid, coefficients, multigrid and Newton-Krylov storage,      */
+/* output files and writer) is global, so every running case is a forked copy of the       */
+/* driver: one start-up for the whole sweep, and the cases share no state. There is no     */
+/* in-process case context: cases cannot run as threads of one process. The cases run     */
+/* concurrently on 'sweepthreads' cores. Small grids are packed SWEEP_PACK to a core, and  */
+/* larger grids get a thread per SWEEP_NODES_PER_THREAD nodes (or 'nthreads' if a case     */
+/* sets it). Cases start largest first.                                                    */
+
+#define MAXSWEEPCASES 1024
+#define SWEEP_PACK 4                            /* Small cases per core */
+#define SWEEP_SMALL_NODES (129*129)             /* Grids below this are small */
+#define SWEEP_NODES_PER_THREAD (257*257)        /* Nodes per thread for the larger grids */
+
+struct SweepCase
+{
+    char name[64];          /* Case name and output directory */
+    char args[256];         /* "keyword=value" inputs of the case */
+    int imax, jmax;         /* Grid of the case */
+    int threads;            /* OpenMP threads of the case */
+    int cost;               /* Share of the cores it takes, in 1/SWEEP_PACK cores */
+    int pid;                /* Process running the case (0 = not started, -1 = done) */
+    int status;             /* Exit status (0, EXIT_FAILED, EXIT_DIVERGED, or -1 if stopped by a signal) */
+    double start, seconds;  /* Wall clock start and run time */
+};
+
+/**************************************************************************/
+
+void apply_sweep_case( const SweepCase& c )
+{
+    /*
+    Uses: c (the case)
+    To modify: params (the inputs of case c on top of the current ones)
+    */
+
+    char args[sizeof(c.args)];
+    strcpy(args, c.args);
+    for(char *arg = strtok(args, " \t"); arg!=NULL; arg = strtok(NULL, " \t"))
+    {
+        set_input_assignment(arg);
+    }
+    check_inputs();
+}
+
+/**************************************************************************/
+
+int read_sweep_file( const char *fname, SweepCase cases[] )
+{
+    /*
+    Reads one case per line: "name keyword=value ...". Anything after a '#' or '!' is a comment.
+    To modify: cases
+    Returns the number of cases
+    */
+
+    FILE *fpin;
+    char line[320];
+    int nline = 0;
+    int ncases = 0;
+
+    fpin = fopen(fname,"r");
+    if (fpin==NULL)
+    {
+        printf("Error opening sweep case file '%s'. Stopping.\n", fname);
+        exit (EXIT_FAILED);
+    }
+
+    while( fgets(line, sizeof(line), fpin)!=NULL )
+    {
+        nline++;
+        line[strcspn(line,"#!\r\n")] = '\0';      /* Strip comments and line ending */
+        char *name = line + strspn(line, " \t");
+        if(*name=='\0') continue;               /* Blank line */
+        char *args = name + strcspn(name, " \t");
+        if(*args!='\0') *(args++) = '\0';
+
+        if(ncases>=MAXSWEEPCASES)
+        {
+            printf("ERROR: %s has more than %d cases!\n", fname, MAXSWEEPCASES);
+            exit (EXIT_FAILED);
+        }
+        if( strlen(name)>=sizeof(cases[0].name) || strlen(args)>=sizeof(cases[0].args) ||
+            strspn(name, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_.-")!=strlen(name) || name[0]=='.' )
+        {
+            printf("ERROR: %s line %d: case names are letters, digits, '_', '-' and '.' (up to 63), inputs up to 255 characters!\n",
+                   fname, nline);
+            exit (EXIT_FAILED);
+        }
+        for(int k=0; k<ncases; k++)
+        {
+            if(strcmp(cases[k].name, name)==0)
+            {
+                printf("ERROR: %s line %d: case '%s' appears twice!\n", fname, nline, name);
+                exit (EXIT_FAILED);
+            }
+        }
+        SweepCase& c = cases[ncases++];
+        memset(&c, 0, sizeof(c));
+        strcpy(c.name, name);
+        strcpy(c.args, args);
+    }
+    fclose(fpin);
+    return ncases;
+}
+
+/**************************************************************************/
+
+int run_sweep()
+{
+    /* 
+    Uses global variable(s): sweepfile, sweepthreads, params (the inputs shared by all cases)
+    Runs every case of the sweep file in its own directory, output in '<name>/output.log'.
+    Returns the exit status: EXIT_DIVERGED if a case diverged, EXIT_FAILED if one failed, 0 otherwise.
+    */
+
+#ifdef _WIN32
+    printf("ERROR: --sweep needs fork() and is not available on Windows builds!\n");
+    exit (EXIT_FAILED);
+#else
+    static SweepCase cases[MAXSWEEPCASES];
+    int order[MAXSWEEPCASES];           /* Start order: largest cases first */
+    int ncases;
+    int ncores;
+    int capacity;                       /* In 1/SWEEP_PACK cores */
+    int inuse = 0;
+    int running = 0;
+    int ndiverged = 0;
+    int nfailed = 0;
+    const SolverParams base = params;
+    double tsweep = wall_time();
+
+    ncases = read_sweep_file(sweepfile, cases);
+    ncores = (sweepthreads>0) ? sweepthreads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    ncores = max(ncores, 1);
+    capacity = ncores*SWEEP_PACK;
+
+    /* Check every case before starting any, and size them */
+    for(int k=0; k<ncases; k++)
+    {
+        SweepCase& c = cases[k];
+        params = base;
+        apply_sweep_case(c);
+        c.imax = params.imax;
+        c.jmax = params.jmax;
+        if(params.nthreads>0)
+        {
+            c.threads = min(params.nthreads, ncores);
+        }
+        else
+        {
+            c.threads = min(max(c.imax*c.jmax/SWEEP_NODES_PER_THREAD, 1), ncores);
+        }
+        c.cost = (c.threads==1 && c.imax*c.jmax<SWEEP_SMALL_NODES) ? 1 : c.threads*SWEEP_PACK;
+        order[k] = k;
+    }
+    params = base;
+    stable_sort(order, order + ncases, [](int a, int b) { return cases[a].cost > cases[b].cost; });
+
+    printf("Parameter sweep: %d cases from '%s' on %d core(s)\n", ncases, sweepfile, ncores);
+    fflush(stdout);
+
+    while(true)
+    {
+        /* Start every case that fits in the free cores (at least one when nothing runs) */
+        for(int k=0; k<ncases; k++)
+        {
+            SweepCase& c = cases[order[k]];
+            if(c.pid!=0 || (running>0 && inuse + c.cost>capacity)) continue;
+
+            fflush(stdout);
+            c.start = wall_time();
+            pid_t pid = fork();
+            if(pid<0)
+            {
+                printf("ERROR: could not start case '%s' (fork failed)!\n", c.name);
+                exit (EXIT_FAILED);
+            }
+            if(pid==0)
+            {
+                /* The case: its inputs, directory and log, then a normal run */
+                mkdir(c.name, 0777);
+                if( chdir(c.name)!=0 || freopen("output.log", "w", stdout)==NULL )
+                {
+                    printf("ERROR: could not set up directory '%s' for case '%s'!\n", c.name, c.name);
+                    exit (EXIT_FAILED);
+                }
+                apply_sweep_case(c);
+                params.nthreads = c.threads;
+                exit (run_solver());
+            }
+            c.pid = (int)pid;
+            inuse += c.cost;
+            running++;
+            printf("  started  %-24s %5d x %-5d %3d thread(s)\n", c.name, c.imax, c.jmax, c.threads);
+        }
+        if(running==0) break;
+
+        /* Wait for any case to finish */
+        int wstatus;
+        pid_t pid = waitpid(-1, &wstatus, 0);
+        if(pid<0)
+        {
+            printf("ERROR: waitpid failed with %d case(s) running!\n", running);
+            exit (EXIT_FAILED);
+        }
+        for(int k=0; k<ncases; k++)
+        {
+            SweepCase& c = cases[k];
+            if(c.pid!=(int)pid) continue;
+            c.pid = -1;
+            c.seconds = wall_time() - c.start;
+            c.status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : -1;
+            inuse -= c.cost;
+            running--;
+            if(c.status==EXIT_DIVERGED) ndiverged++;
+            else if(c.status!=0) nfailed++;
+            printf("  finished %-24s %8.2f s   %s\n", c.name, c.seconds,
+                   (c.status==0) ? "ok" : (c.status==EXIT_DIVERGED) ? "diverged" : "failed (see output.log)");
+        }
+    }
+
+    printf("Parameter sweep: %d cases in %.2f s, %d diverged, %d failed\n", ncases, wall_time() - tsweep, ndiverged, nfailed);
+    if(nfailed>0) return EXIT_FAILED;
+    return (ndiverged>0) ? EXIT_DIVERGED : 0;
+#endif
+}
+
+/********************************************************************************************************************/
+/*                                                                                                                  */
+/*                               Grid Convergence Verification (--verify, imms = 1)                                 */
+/*                                                                                                                  */
+/********************************************************************************************************************/
+
+/* Solves the MMS case on verifylevels grids: verifymin, 2*verifymin - 1, ... (refinement   */
+/* ratio 2), one after the other in this process, each on all the cores. Every level goes  */
+/* through the grid sequencing level solve ('solve_grid_level') to toler, and writes its   */
+/* solution to 'verify_<n>/restart.out'. With iverifywarm = 1 each level starts from the   */
+/* solution of the level below it, interpolated by 'prolong_solution' in 'initial'. The    */
+/* fine grids then start from a field that is already accurate to the coarse-grid          */
+/* discretization error, instead of spending most of their iterations spreading the lid    */
+/* vortex. With iverifywarm = 0 every level starts flat. The driver then reads back every  */
+/* solution and writes 'verify.dat' with:                                                  */
+/*   - the L1, L2 and Linf error norms of each level (Discretization_Error_Norms),         */
+/*   - the observed order p = ln(E_coarse/E_fine)/ln(2) of each pair of levels,            */
+/*   - Richardson extrapolation of the two finest grids with the formal order 2, at the    */
+/*     nodes they share: the estimated and the true fine-grid error, and the error of the  */
+/*     extrapolated solution.                                                              */
+
+struct VerifyLevel
+{
+    int n;                              /* Grid points in x and y */
+    char dir[32];                       /* Output directory 'verify_<n>' */
+    char ckpt[48];                      /* Solution of the level, 'verify_<n>/restart.out' */
+    int status;                         /* 0, EXIT_FAILED or EXIT_DIVERGED */
+    int iterations;                     /* Iterations run */
+    double seconds;                     /* Run time */
+    double L1[neq], L2[neq], Linf[neq]; /* Discretization error norms */
+};
+
+/**************************************************************************/
+
+int run_verification()
+{
+    /* 
+    Uses global variable(s): params (the inputs shared by all levels), verifymin, verifylevels, iverifywarm, nthreads,
+                             toler
+    To modify: warmfile, warmni, warmnj (the start of each level)
+    Runs the levels and writes 'verify.dat'.
+    Returns the exit status: EXIT_DIVERGED if a level diverged, EXIT_FAILED if one failed, 0 otherwise.
+    */
+
+    static VerifyLevel lev[MAXVERIFYLEVELS];
+    const int nlev = verifylevels;
+    const int nfine = (verifymin - 1)*(1<<(nlev - 1)) + 1;
+    const int ncoarse = (nfine - 1)/2 + 1;
+    const char* names[neq] = {"p", "u", "v"};
+    boundaryConditionPointer set_boundary_conditions = &bndrymms;
+    int ndiverged = 0;
+    int nfailed = 0;
+    double tverify = wall_time();
+
+#ifdef _OPENMP
+    if(nthreads>0)
+    {
+        omp_set_num_threads(nthreads);
+    }
+    printf("OpenMP threads: %d\n", omp_get_max_threads());
+#endif
+    set_derived_inputs();
+    pointJacobiVector = select_point_Jacobi( true, false );
+    pointJacobiVectorNoSource = select_point_Jacobi( false, false );
+
+    /* The finest level, the warm start from the one below it and the restart buffer */
+    workspace.reserve( 3*Array3::bytes(nfine, nfine, neq) + 3*Array2::bytes(nfine, nfine) +
+                       Array3::bytes(ncoarse, ncoarse, neq) + restart_buffer_bytes(nfine, nfine) );
+    restart_buffer_setup( nfine, nfine );
+
+    printf("Grid convergence verification: %d levels, %d x %d to %d x %d, %s\n", nlev, verifymin, verifymin,
+           nfine, nfine, (iverifywarm==1) ? "each level started from the one below" : "flat start on every level");
+    fflush(stdout);
+
+    /* Run the levels in turn, from the coarsest */
+    warmfile = NULL;
+    for(int l=0; l<nlev; l++)
+    {
+        VerifyLevel& v = lev[l];
+        double conv;
+        double tlevel = wall_time();
+
+        memset(&v, 0, sizeof(v));
+        v.n = (verifymin - 1)*(1<<l) + 1;
+        snprintf(v.dir, sizeof(v.dir), "verify_%d", v.n);
+        snprintf(v.ckpt, sizeof(v.ckpt), "./%s/restart.out", v.dir);
+        warmfile = NULL;
+        if(iverifywarm==1 && l>0 && lev[l-1].status==0)
+        {
+            warmfile = lev[l-1].ckpt;
+            warmni = lev[l-1].n;
+            warmnj = lev[l-1].n;
+        }
+
+#ifdef _WIN32
+        _mkdir(v.dir);
+#else
+        mkdir(v.dir, 0777);
+#endif
+        v.status = solve_grid_level( v.n, v.n, toler, v.ckpt, set_boundary_conditions, v.iterations, conv );
+        v.seconds = wall_time() - tlevel;
+        printf("  finished %-16s %5d x %-5d %8d iterations, residual %e, %8.2f s   %s\n", v.dir, v.n, v.n,
+               v.iterations, conv, v.seconds, (v.status==0) ? "ok" : (v.status==EXIT_DIVERGED) ? "diverged" : "failed");
+        fflush(stdout);
+    }
+    warmfile = NULL;
+
+    /* Error norms of every level that finished */
+    Array3* usol[MAXVERIFYLEVELS] = {NULL};
+    for(int l=0; l<nlev; l++)
+    {
+        VerifyLevel& v = lev[l];
+        if(v.status==EXIT_DIVERGED) ndiverged++;
+        else if(v.status!=0) nfailed++;
+        if(v.status!=0) continue;
+
+        int nlast;
+        double rtlast;
+        double dtlast;
+        double resinit[neq];
+        set_grid(v.n, v.n);
+        usol[l] = new Array3(v.n, v.n, neq);
+        read_restart( v.ckpt, v.n, v.n, nlast, rtlast, dtlast, resinit, *usol[l] );
+        Discretization_Error_Norms( *usol[l], v.L1, v.L2, v.Linf );
+    }
+
+    FILE *fpv = fopen("./verify.dat","w");
+    if(fpv==NULL)
+    {
+        printf("ERROR: could not open 'verify.dat' for writing!\n");
+        exit (EXIT_FAILED);
+    }
+    fprintf(fpv, "# MMS grid convergence verification: %d levels, refinement ratio 2, %s\n", nlev,
+            (iverifywarm==1) ? "warm start from the coarser level" : "flat start on every level");
+    fprintf(fpv, "# Discretization error norms over the interior nodes\n");
+    fprintf(fpv, "# n  h(m)  L1(p) L2(p) Linf(p)  L1(u) L2(u) Linf(u)  L1(v) L2(v) Linf(v)  seconds\n");
+    for(int l=0; l<nlev; l++)
+    {
+        VerifyLevel& v = lev[l];
+        if(v.status!=0) continue;
+        fprintf(fpv, "%d %e", v.n, (xmax - xmin)/(double)(v.n - 1));
+        for(int k=0; k<neq; k++)
+        {
+            fprintf(fpv, "  %.10e %.10e %.10e", v.L1[k], v.L2[k], v.Linf[k]);
+        }
+        fprintf(fpv, "  %.3f\n", v.seconds);
+    }
+
+    /* Observed order of each pair of levels */
+    printf("\nObserved order of accuracy (L2 norms):\n");
+    printf("    n        L2(p)        L2(u)        L2(v)      p(p)   p(u)   p(v)\n");
+    fprintf(fpv, "# Observed order p = ln(E(n_coarse)/E(n))/ln(2)\n");
+    fprintf(fpv, "# n  p_L1(p) p_L2(p) p_Linf(p)  p_L1(u) p_L2(u) p_Linf(u)  p_L1(v) p_L2(v) p_Linf(v)\n");
+    for(int l=0; l<nlev; l++)
+    {
+        VerifyLevel& v = lev[l];
+        if(v.status!=0) continue;
+        printf("%5d  %e %e %e", v.n, v.L2[0], v.L2[1], v.L2[2]);
+        if(l>0 && lev[l-1].status==0)
+        {
+            VerifyLevel& c = lev[l-1];
+            fprintf(fpv, "%d", v.n);
+            for(int k=0; k<neq; k++)
+            {
+                fprintf(fpv, "  %.4f %.4f %.4f", log(c.L1[k]/v.L1[k])/log(two), log(c.L2[k]/v.L2[k])/log(two),
+                        log(c.Linf[k]/v.Linf[k])/log(two));
+            }
+            fprintf(fpv, "\n");
+            printf("  %6.3f %6.3f %6.3f", log(c.L2[0]/v.L2[0])/log(two), log(c.L2[1]/v.L2[1])/log(two),
+                   log(c.L2[2]/v.L2[2])/log(two));
+        }
+        printf("\n");
+    }
+
+    /* Richardson extrapolation of the two finest grids (formal order 2) at their common nodes */
+    const int lf = nlev - 1;
+    if(usol[lf]!=NULL && usol[lf-1]!=NULL)
+    {
+        const Array3& uf = *usol[lf];
+        const Array3& uc = *usol[lf-1];
+        const Array3& ue = *mms_exact(lev[lf].n, lev[lf].n)->u;
+        const int nc = lev[lf-1].n;
+        double rest[neq], rtrue[neq], rextr[neq];
+
+        for(int k=0; k<neq; k++)
+        {
+            rest[k] = zero;
+            rtrue[k] = zero;
+            rextr[k] = zero;
+        }
+        for(int i=1; i<nc-1; i++)
+        {
+            for(int j=1; j<nc-1; j++)
+            {
+                for(int k=0; k<neq; k++)
+                {
+                    double ufine = uf(2*i,2*j,k);
+                    double ure = ufine + (ufine - uc(i,j,k))/three;     /* r^p - 1 = 3 */
+                    rest[k]  += (ufine - ure)*(ufine - ure);
+                    rtrue[k] += (ufine - ue(2*i,2*j,k))*(ufine - ue(2*i,2*j,k));
+                    rextr[k] += (ure - ue(2*i,2*j,k))*(ure - ue(2*i,2*j,k));
+                }
+            }
+        }
+        printf("\nRichardson extrapolation of %d x %d and %d x %d (p = 2), L2 norms at the common nodes:\n",
+               nc, nc, lev[lf].n, lev[lf].n);
+        printf("      estimated DE   true DE        extrapolated error\n");
+        fprintf(fpv, "# Richardson extrapolation of n = %d and %d (p = 2), L2 norms at the common interior nodes\n",
+                nc, lev[lf].n);
+        fprintf(fpv, "# variable  estimated-DE  true-DE  extrapolated-error\n");
+        for(int k=0; k<neq; k++)
+        {
+            double rn = one/((double)(nc - 2)*(double)(nc - 2));
+            rest[k] = sqrt(rest[k]*rn);
+            rtrue[k] = sqrt(rtrue[k]*rn);
+            rextr[k] = sqrt(rextr[k]*rn);
+            fprintf(fpv, "%s %.10e %.10e %.10e\n", names[k], rest[k], rtrue[k], rextr[k]);
+            printf("  %s   %e   %e   %e\n", names[k], rest[k], rtrue[k], rextr[k]);
+        }
+    }
+    fclose(fpv);
+    for(int l=0; l<nlev; l++)
+    {
+        delete usol[l];
+    }
+
+    printf("\nGrid convergence verification: %.2f s (finest level %.2f s), %d diverged, %d failed; summary in 'verify.dat'\n",
+           wall_time() - tverify, lev[nlev-1].seconds, ndiverged, nfailed);
+    if(nfailed>0) return EXIT_FAILED;
+    return (ndiverged>0) ? EXIT_DIVERGED : 0;
+}
+
+/********************************************************************************************************************/
+/*                                                                                                                  */
+/*                                  Grid Sequencing Start (igridseq = 1)                                            */
+/*                                                                                                                  */
+/********************************************************************************************************************/
+
+/* A flat start on a fine grid spends most of its explicit iterations moving the lid vortex */
+/* across the cavity, one node per iteration. With igridseq = 1 the run first solves the    */
+/* grids (imax-1)/2^l + 1 (down to seqnmin points, the same coarsening as multigrid) from    */
+/* the coarsest up, each to the loose tolerance seqtoler, with the configured PJ/SGS/line   */
+/* relaxation scheme. Each level writes its solution as a restart file 'restart_<ni>x<nj>   */
+/* .out' and the next level starts from it through the warm start in 'initial' (bilinear    */
+/* 'prolong_solution'), so every level is also a checkpoint. The main loop then starts from */
+/* the prolonged next-to-finest solution and runs to toler as usual. Coarse-level residuals */
+/* go to the screen only, 'history.dat' holds the target grid. The coarsest grids need a    */
+/* smaller cfl than the fine one (17 x 17 diverges at 0.9 for Re = 100), so a level that     */
+/* diverges (NaN/Inf, or growth by divgrowth) is dropped and the next one starts flat.      */
+/* The verification study (--verify) solves its levels with the same 'solve_grid_level'.   */
+
+void grid_sequencing_start( boundaryConditionPointer set_boundary_conditions )
+{
+    /* 
+    Uses global variable(s): imax, jmax, seqnmin, seqtoler (the levels: see 'solve_grid_level')
+    To modify: warmfile, warmni, warmnj (the solution 'initial' starts the target grid from)
+    */
+    static char ckpt[64];           /* Checkpoint of the last level solved (stays the warm start file) */
+    const int nif = imax;
+    const int njf = jmax;
+    int nlev = 1;                   /* Grids in the sequence, the target grid included */
+    double work = zero;             /* Coarse-level iterations in target-grid work units */
+    double tseq = wall_time();
+
+    while( ((nif-1)%(2<<(nlev-1)))==0 && ((njf-1)%(2<<(nlev-1)))==0 &&
+           (nif-1)/(2<<(nlev-1))+1>=seqnmin && (njf-1)/(2<<(nlev-1))+1>=seqnmin )
+    {
+        nlev++;
+    }
+    if(nlev==1)
+    {
+        printf("Note: no grid sequencing, %d x %d has no coarser grid with at least %d points (seqnmin)\n", nif, njf, seqnmin);
+        return;
+    }
+
+    for(int l=nlev-1; l>=1; l--)
+    {
+        const int ni = (nif - 1)/(1<<l) + 1;
+        const int nj = (njf - 1)/(1<<l) + 1;
+        char name[64];              /* Checkpoint of this level (warmfile still names the one below) */
+        int n;
+        double conv;
+
+        snprintf(name, sizeof(name), "./restart_%dx%d.out", ni, nj);
+        const int status = solve_grid_level( ni, nj, seqtoler, name, set_boundary_conditions, n, conv );
+        work += (double)n*(double)(ni*nj)/(double)(nif*njf);
+
+        if(status==EXIT_FAILED)
+        {
+            exit (EXIT_FAILED);
+        }
+        if(status==EXIT_DIVERGED)
+        {
+            printf("Grid sequencing: %5d x %-5d diverged at iteration %d (lower cfl or raise seqnmin), the next grid starts flat\n",
+                   ni, nj, n);
+            warmfile = NULL;
+            continue;
+        }
+        strcpy(ckpt, name);
+        warmfile = ckpt;
+        warmni = ni;
+        warmnj = nj;
+        printf("Grid sequencing: %5d x %-5d %8d iterations, residual %e, checkpoint '%s'\n", ni, nj, n, conv, ckpt);
+    }
+    set_grid(nif, njf);
+
+    printf("Grid sequencing: %d coarser grid(s) in %.2f s, %f work units of the %d x %d grid\n",
+           nlev - 1, wall_time() - tseq, work, nif, njf);
+}
+
+/**************************************************************************/
+
+int solve_grid_level( int ni, int nj, double tol, const char* ckpt, boundaryConditionPointer set_boundary_conditions,
+                      int& n, double& conv )
+{
+    /* 
+    Uses global variable(s): neq, nmax, nmonitor, divgrowth, warmfile, warmni, warmnj (the start, see 'initial')
+    To modify: imax, jmax (the grid is left at ni x nj), n (iterations run), conv (last monitored residual)
+    Solves the ni x nj grid with the PJ/SGS/line relaxation scheme, from the flat start or the warm start,
+    until the residual drops below tol (or nmax iterations), and writes the solution to the restart file ckpt.
+    Returns 0, EXIT_DIVERGED (NaN/Inf, or growth by divgrowth; nothing written) or EXIT_FAILED (ckpt not written).
+    */
+    set_grid(ni, nj);
+
+    WorkspaceScope scope;           /* Each level reuses the memory of the one before */
+    Array3 u    (ni, nj, neq, workspace);
+    Array3 uold (ni, nj, neq, workspace);
+    Array3 src  (ni, nj, neq, workspace);
+    Array2 viscx(ni, nj, workspace);
+    Array2 viscy(ni, nj, workspace);
+    Array2 dt   (ni, nj, workspace);
+    int ninit;
+    double rtime;
+    double resinit[neq];
+    double res[neq];
+    double dtmin = 1.0e99;
+    double convmin = 1.0e99;
+    bool diverged = false;
+
+    /* Flat start, or the prolonged solution of a coarser grid when warmfile is set */
+    initial( ninit, rtime, dtmin, resinit, u, src );
+    set_boundary_conditions( u );
+    compute_source_terms( src );
+    iterationStepPointer iterationStep = select_iteration_step( false );
+    timeStepPointer timeStep = select_time_step( false );
+
+    conv = 1.0e99;
+    for(n=1; n<=nmax; n++)
+    {
+        timeStep( u, dt, dtmin );
+        iterationStep( set_boundary_conditions, u, uold, src, viscx, viscy, dt );
+        pressure_rescaling( u );
+        rtime += dtmin;
+
+        if( (n%nmonitor)==0 || n==nmax )
+        {
+            iterative_residual_sums( u, uold, dt, zero, res );
+            conv = zero;
+            bool finite = true;
+            for(int k=0; k<neq; k++)
+            {
+                res[k] = sqrt(res[k]/((ni-2)*(nj-2)))/resinit[k];
+                conv = max(conv, res[k]);
+                finite = finite && isfinite(res[k]);
+            }
+            convmin = min(convmin, conv);
+            diverged = !finite || (divgrowth>zero && conv>divgrowth*convmin);
+            if(diverged || conv<tol) break;
+        }
+    }
+    n = min(n, nmax);
+
+    if(diverged)
+    {
+        return EXIT_DIVERGED;
+    }
+    if(!save_restart( ckpt, current_output_grid(), n, u, resinit, rtime, dtmin ))
+    {
+        return EXIT_FAILED;
+    }
+    return 0;
+}
+
+/********************************************************************************************************************/
+/*                                                                                                                  */
+/*                                 Instrumentation (-DINSTRUMENT, imetrics = 1)                                     */
+/*                                                                                                                  */
+/********************************************************************************************************************/
+
+/* The main loop times its stages (time step, iteration, pressure rescaling, residuals,    */
+/* output) with INSTR_TIME. Every nmetrics iterations, INSTR_ITERATION reads the hardware  */
+/* counters and pushes one record into a lock-free single-producer ring. The solver never  */
+/* writes the file: once the ring is half full it asks the background writer thread       */
+/* (iasync = 1) to format the records into 'metrics.csv', and the writer also drains the   */
+/* ring after every snapshot. With synchronous output the solver flushes the ring itself   */
+/* when it is half full. If the ring fills up anyway, records are dropped and counted.     */
+/* The counters are perf_event cycles, instructions and last-level cache misses. They are  */
+/* opened before the first parallel region with 'inherit', so they include the OpenMP      */
+/* threads. Bytes moved are estimated as 64 per LLC miss. Where perf_event is missing or   */
+/* not permitted (perf_event_paranoid), the counters stay 0 and only the timers run.       */
+/* Cost: about 2 clock reads per stage and 3 counter reads per record.                     */
+
+#ifdef INSTRUMENT
+void metrics_start()
+{
+    /* 
+    Uses global variable(s): imetrics, ibench
+    To modify: metricson, metricsfd, metricslast, metricscur, metricstotal, fpm
+    */
+    if(imetrics!=1 || ibench==1) return;
+
+    fpm = fopen("./metrics.csv","w");
+    if(fpm==NULL)
+    {
+        printf("ERROR: could not open 'metrics.csv' for writing!\n");
+        exit (EXIT_FAILED);
+    }
+    fprintf(fpm, "iteration,iterations,timestep_s,iteration_s,rescale_s,residual_s,output_s,cycles,instructions,llc_misses,llc_bytes\n");
+
+    int nopen = 0;
+#ifdef HAVE_PERF_EVENT
+    const uint64_t config[NCOUNTERS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES};
+    for(int c=0; c<NCOUNTERS; c++)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = config[c];
+        attr.inherit = 1;               /* Count the threads started from here on */
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        metricsfd[c] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        if(metricsfd[c]>=0) nopen++;
+    }
+#endif
+    for(int c=0; c<NCOUNTERS; c++)
+    {
+        metricslast[c] = 0;
+        if(metricsfd[c]>=0 && read(metricsfd[c], &metricslast[c], sizeof(uint64_t))!=sizeof(uint64_t))
+        {
+            close(metricsfd[c]);
+            metricsfd[c] = -1;
+            nopen--;
+        }
+    }
+    memset(&metricscur, 0, sizeof(metricscur));
+    for(int s=0; s<NSTAGES; s++)
+    {
+        metricstotal[s] = zero;
+    }
+    metricson = true;
+    printf("Metrics: stage timers every %d iteration(s) to 'metrics.csv', %d of %d hardware counters\n", nmetrics, nopen, NCOUNTERS);
+}
+
+/**************************************************************************/
+
+void metrics_end_iteration( int n )
+{
+    /* 
+    Uses global variable(s): nmetrics
+    To modify: metricscur, metricsprev
+    Counts the iterations up to n, and closes the current record every nmetrics iterations (solver thread only)
+    */
+    metricscur.iters += (metricsprev>0) ? n - metricsprev : 1;
+    metricsprev = n;
+    if(metricscur.iters>=nmetrics)
+    {
+        metrics_close_record();
+    }
+}
+
+/**************************************************************************/
+
+void metrics_close_record()
+{
+    /* 
+    Uses global variable(s): metricsfd, metricsprev, outthread
+    To modify: metricscur, metricslast, metricsring, metricshead, metricsdrops, metricsreq
+    Reads the counters and pushes the current record into the ring (solver thread only)
+    */
+    metricscur.n = metricsprev;
+    for(int c=0; c<NCOUNTERS; c++)
+    {
+        uint64_t value;
+        if(metricsfd[c]>=0 && read(metricsfd[c], &value, sizeof(value))==sizeof(value))
+        {
+            metricscur.count[c] = value - metricslast[c];
+            metricslast[c] = value;
+        }
+    }
+
+    uint64_t head = metricshead.load(std::memory_order_relaxed);
+    uint64_t used = head - metricstail.load(std::memory_order_acquire);
+    if(used<METRICS_RING)
+    {
+        metricsring[head%METRICS_RING] = metricscur;
+        metricshead.store(head + 1, std::memory_order_release);
+        used++;
+    }
+    else
+    {
+        metricsdrops++;
+    }
+    memset(&metricscur, 0, sizeof(metricscur));
+
+    /* Half full: hand the records to the writer thread (only one request outstanding), or write them now */
+    if(used==METRICS_RING/2)
+    {
+#ifdef ASYNC_OUTPUT
+        if(outthread!=NULL)
+        {
+            {
+                std::lock_guard<std::mutex> lock(outmutex);
+                metricsreq = true;
+            }
+            outready.notify_one();
+            return;
+        }
+#endif
+        metrics_flush();
+    }
+}
+
+/**************************************************************************/
+
+void metrics_flush()
+{
+    /* 
+    Uses global variable(s): metricsring, metricshead, fpm
+    To modify: metricstail, metricstotal
+    Writes the queued records to 'metrics.csv' (the single consumer: the writer thread,
+    or the solver thread when there is none)
+    */
+    if(fpm==NULL) return;
+    uint64_t head = metricshead.load(std::memory_order_acquire);
+    uint64_t tail = metricstail.load(std::memory_order_relaxed);
+    for(; tail<head; tail++)
+    {
+        const MetricsRecord& r = metricsring[tail%METRICS_RING];
+        fprintf(fpm, "%d,%d", r.n, r.iters);
+        for(int s=0; s<NSTAGES; s++)
+        {
+            fprintf(fpm, ",%.3e", r.t[s]);
+            metricstotal[s] += r.t[s];
+        }
+        fprintf(fpm, ",%llu,%llu,%llu,%llu\n", (unsigned long long)r.count[0], (unsigned long long)r.count[1],
+                (unsigned long long)r.count[2], (unsigned long long)(64*r.count[2]));
+    }
+    metricstail.store(tail, std::memory_order_release);
+}
+
+/**************************************************************************/
+
+void metrics_finish( int n )
+{
+    /* 
+    Uses global variable(s): metricsfd, metricsdrops, metricstotal
+    Uses: n (last iteration of the run; a converged run leaves the loop before INSTR_ITERATION)
+    To modify: metricson, metricsprev, fpm
+    Writes the remaining records and the per-stage totals (after the writer thread stopped)
+    */
+    const char* names[NSTAGES] = {"time step", "iteration", "rescaling", "residuals", "output"};
+    double total = zero;
+
+    if(!metricson) return;
+    if(n>metricsprev)
+    {
+        metricscur.iters += (metricsprev>0) ? n - metricsprev : 1;
+        metricsprev = n;
+    }
+    if(metricscur.iters>0)
+    {
+        metrics_close_record();     /* The last, partial record */
+    }
+    metricson = false;
+    metrics_flush();
+    fclose(fpm);
+    fpm = NULL;
+    for(int c=0; c<NCOUNTERS; c++)
+    {
+        if(metricsfd[c]>=0) close(metricsfd[c]);
+        metricsfd[c] = -1;
+    }
+
+    for(int s=0; s<NSTAGES; s++)
+    {
+        total += metricstotal[s];
+    }
+    printf("Metrics: %llu records (%llu dropped) in 'metrics.csv'; main loop stages:",
+           (unsigned long long)metricshead.load(), (unsigned long long)metricsdrops);
+    for(int s=0; s<NSTAGES; s++)
+    {
+        printf(" %s %.3f s (%.1f%%)%s", names[s], metricstotal[s], 100.0*metricstotal[s]/max(total, 1.0e-30),
+               (s<NSTAGES-1) ? "," : "\n");
+    }
+}
+#endif
+
+/********************************************************************************************************************/
+/*                                                                                                                  */
+/*                                  Stretched Grids (istretch = 1, 2)                                               */
+/*                                                                                                                  */
+/********************************************************************************************************************/
+
+/* A uniform grid fine enough for the lid and wall boundary layers and the corner vortices  */
+/* at high Re is fine everywhere. istretch = 1, 2 cluster the nodes toward the four walls   */
+/* (tensor product: x(i) and y(j) separately), and the kernels use the finite differences   */
+/* of the nonuniform grid: (u(i+1) - u(i-1))/(h- + h+) for first derivatives and the        */
+/* 3-point second difference 2/(h- + h+) ((u(i+1) - u(i))/h+ - (u(i) - u(i-1))/h-), both    */
+/* second order on a smooth stretching. The artificial viscosity scales the 4th difference  */
+/* with the mean spacing of the node, the time step limits with the smaller one (and the   */
+/* viscous limit 1/(2 nu (1/dx^2 + 1/dy^2)) of the long cells near the walls). The          */
+/* factors are computed once per grid ('line_metrics', one LineMetrics per line, stored     */
+/* contiguously) and 'stretched_coefficients' puts those of a node into a local copy of     */
+/* rcoef for the node pieces. The wall boundary conditions keep their 2-point pressure      */
+/* extrapolation, also second order on a smooth stretching.                                 */
+
+void grid_coordinates( int n, double length, double stretch, vector<double>& x )
+{
+    /* 
+    Uses global variable(s): istretch
+    Uses: n, length, stretch (stretchx or stretchy)
+    To modify: x (the n node coordinates, 0 .. length)
+    istretch = 1: x = L/2 (1 + tanh(stretch (2 xi - 1))/tanh(stretch)), xi = i/(n-1)
+    istretch = 2: the spacing grows by the factor 1 + stretch per cell from each wall
+    to the middle. istretch = 0 or stretch = 0 give the uniform grid.
+    */
+    const int m = n - 1;            /* Cells */
+
+    x.resize(n);
+    if(istretch==0 || stretch==zero)
+    {
+        for(int i=0; i<n; i++)
+        {
+            x[i] = length*(double)(i)/(double)(m);
+        }
+    }
+    else if(istretch==1)
+    {
+        for(int i=0; i<n; i++)
+        {
+            x[i] = half*length*(one + tanh(stretch*(two*(double)(i)/(double)(m) - one))/tanh(stretch));
+        }
+    }
+    else
+    {
+        x[0] = zero;
+        for(int i=0; i<m; i++)
+        {
+            x[i+1] = x[i] + pow(one + stretch, (double)min(i, m-1-i));
+        }
+        for(int i=1; i<m; i++)
+        {
+            x[i] *= length/x[m];
+        }
+    }
+    x[m] = length;
+}
+
+/**************************************************************************/
+
+void line_metrics( const vector<double>& x, vector<LineMetrics>& lm )
+{
+    /* 
+    Uses: x (node coordinates of one direction)
+    To modify: lm (factors of the interior lines 1 .. n-2; 0 and n-1 are not used)
+    */
+    const int n = (int)x.size();
+
+    lm.assign(n, LineMetrics());
+    for(int i=1; i<n-1; i++)
+    {
+        const double hm = x[i] - x[i-1];
+        const double hp = x[i+1] - x[i];
+        const double h = half*(hm + hp);
+
+        lm[i].r2d = one/(hm + hp);
+        lm[i].rd2 = one/(hm*hp);
+        lm[i].sd2 = (hm - hp)/(hm*hp*(hm + hp));
+        lm[i].h3 = h*h*h;
+        lm[i].h4 = h*h*h*h;
+        lm[i].hmin = min(hm, hp);
+        lm[i].rh2 = one/(lm[i].hmin*lm[i].hmin);
+    }
+}
+
+/**************************************************************************/
+
+template <bool COMBINED, class Real>
+void stretched_time_step( Array3R<Real>& u, Array2T<Real>& dt, double& dtmin )
+{
+    /* 
+    Uses global variable(s): imax, jmax, rcoef (and xmetric, ymetric)
+    Uses: u
+    To Modify: dt (interior), dtmin (min with the interior time steps)
+    */
+    double dtminloc = dtmin;    /* Local copy for the OpenMP min reduction */
+
+    #pragma omp parallel for reduction(min:dtminloc)
+    for(int i=1; i<imax-1; i++)
+    {
+        ResidualCoefficients c = rcoef;
+        for(int j=1; j<jmax-1; j++)
+        {
+            stretched_coefficients(i, j, c);
+            dt(i,j) = time_step_node<COMBINED>(u(i,j,1), u(i,j,2), c);
+            dtminloc = min(dtminloc,(double)dt(i,j));
+        }
+    }
+    dtmin = dtminloc;
+}
+
+/**************************************************************************/
+
+template <class Real>
+void stretched_artificial_viscosity( Array3R<Real>& u, Array2T<Real>& viscx, Array2T<Real>& viscy )
+{
+    /* 
+    Uses global variable(s): imax, jmax, rcoef (and xmetric, ymetric)
+    Uses: u
+    To Modify: viscx, viscy (interior; centers shifted next to the walls as in local_artificial_viscosity)
+    */
+    const ptrdiff_t is = u.address(1,0,0) - u.address(0,0,0);
+    const ptrdiff_t js = u.address(0,1,0) - u.address(0,0,0);
+
+    #pragma omp parallel for
+    for(int i=1; i<imax-1; i++)
+    {
+        ResidualCoefficients c = rcoef;
+        const int ic = min(max(i,2),imax-3);
+        for(int j=1; j<jmax-1; j++)
+        {
+            const int jc = min(max(j,2),jmax-3);
+            double vx, vy;
+
+            stretched_coefficients(i, j, c);
+            artificial_viscosity_node( u.address(ic,j,0), is, u.address(i,jc,0), js, u(i,j,1), u(i,j,2), c, vx, vy );
+            viscx(i,j) = vx;
+            viscy(i,j) = vy;
+        }
+    }
+}
 
+/**************************************************************************/
 
-void set_derived_inputs()
+template <bool DUAL, class Real>
+void stretched_point_Jacobi( Array3R<Real>& u, Array3R<Real>& uold, Array2T<Real>& viscx, Array2T<Real>& viscy, Array2T<Real>& dt, Array3R<Real>& s )
 {
-    rhoinv = one/rho;                            /* Inverse density, 1/rho (m^3/kg) */
-    rlength = xmax - xmin;                       /* Characteristic length (m) [cavity width] */
-    rmu = rho*uinf*rlength/Re;                   /* Viscosity (N*s/m^2) */
-    vel2ref = uinf*uinf;                         /* Reference velocity squared (m^2/s^2) */
-    dx = (xmax - xmin)/(double)(imax - 1);          /* Delta x (m) */
-    dy = (ymax - ymin)/(double)(jmax - 1);          /* Delta y (m) */
-    rpi = acos(-one);                            /* Pi = 3.14159... */
-    printf("rho,V,L,mu,Re: %f %f %f %f %f\n",rho,uinf,rlength,rmu,Re);
+    /* 
+    Uses global variable(s): imax, jmax, rcoef (and xmetric, ymetric)
+    Uses: uold, viscx, viscy, dt, s
+    To Modify: u
+    */
+    #pragma omp parallel for
+    for(int i=1; i<imax-1; i++)
+    {
+        ResidualCoefficients c = rcoef;
+        for(int j=1; j<jmax-1; j++)
+        {
+            stretched_coefficients(i, j, c);
+            stretched_point_Jacobi_node<DUAL>(u, uold, i, j, viscx(i,j), viscy(i,j), dt(i,j), s, c);
+        }
+    }
 }
 
 /**************************************************************************/
 
-void GS_iteration( boundaryConditionPointer set_boundary_conditions, Array3& u, Array3& uold, Array3& src, Array2& viscx, Array2& viscy, Array2& dt )
+template <bool DUAL>
+void stretched_SGS_sweep( Array3& u, Array2& viscx, Array2& viscy, Array2& dt, Array3& s, bool backward )
 {
-    /* Copy u to uold (save previous flow values)*/
-    uold.copyData(u);
-
-    /* Artificial Viscosity */
-    Compute_Artificial_Viscosity(u, viscx, viscy);
-              
-    /* Symmetric Gauss-Siedel: Forward Sweep */
-    SGS_forward_sweep(u, viscx, viscy, dt, src);
-          
-    /* Set Boundary Conditions for u */
-    set_boundary_conditions(u);
-           
-    /* Artificial Viscosity */
-    Compute_Artificial_Viscosity(u, viscx, viscy);
-                 
-    /* Symmetric Gauss-Siedel: Backward Sweep */
-    SGS_backward_sweep(u, viscx, viscy, dt, src);
+    /* 
+    Uses global variable(s): imax, jmax, rcoef (and xmetric, ymetric)
+    Uses: viscx, viscy, dt, s, backward (= false the forward, = true the backward sweep)
+    To Modify: u
+    */
+    ResidualCoefficients c = rcoef;
 
-    /* Set Boundary Conditions for u */
-    set_boundary_conditions(u);
+    for(int ii=1; ii<imax-1; ii++)
+    {
+        const int i = backward ? imax-1-ii : ii;
+        for(int jj=1; jj<jmax-1; jj++)
+        {
+            const int j = backward ? jmax-1-jj : jj;
+            stretched_coefficients(i, j, c);
+            stretched_Gauss_Seidel_node<DUAL>(u, i, j, viscx(i,j), viscy(i,j), dt(i,j), s, c);
+        }
+    }
 }
 
 /**************************************************************************/
 
-void PJ_iteration( boundaryConditionPointer set_boundary_conditions, Array3& u, Array3& uold, Array3& src, Array2& viscx, Array2& viscy, Array2& dt )
+template <bool DUAL>
+void stretched_SGS_color_sweep( Array3& u, Array2& viscx, Array2& viscy, Array2& dt, Array3& s, int color )
 {
-    /* Swap pointers for u and uold*/
-    uold.swapData(u);
-
-    /* Artificial Viscosity */
-    Compute_Artificial_Viscosity(uold, viscx, viscy);
-              
-    /* Point Jacobi: Forward Sweep */
-    point_Jacobi(u, uold, viscx, viscy, dt, src);
-           
-    /* Set Boundary Conditions for u */
-    set_boundary_conditions(u);
+    /* 
+    Uses global variable(s): imax, jmax, rcoef (and xmetric, ymetric)
+    Uses: viscx, viscy, dt, s, color (as SGS_color_sweep)
+    To Modify: u
+    */
+    #pragma omp parallel for
+    for(int i=1; i<imax-1; i++)
+    {
+        ResidualCoefficients c = rcoef;
+        for(int j=1+(i+1+color)%2; j<jmax-1; j+=2)
+        {
+            stretched_coefficients(i, j, c);
+            stretched_Gauss_Seidel_node<DUAL>(u, i, j, viscx(i,j), viscy(i,j), dt(i,j), s, c);
+        }
+    }
 }
 
 /**************************************************************************/
 
-void output_file_headers()
-{
-  /*
-  Uses global variable(s): imms, fp1, fp2
-  */
-  
-  /* Note: The vector of primitive variables is: */
-  /*               u = [p, u, v]^T               */  
-  /* Set up output files (history and solution)  */    
-
-    fp1 = fopen("./history.dat","w");
-    fprintf(fp1,"TITLE = \"Cavity Iterative Residual History\"\n");
-    fprintf(fp1,"variables=\"Iteration\"\"Time(s)\"\"Res1\"\"Res2\"\"Res3\"\n");
+/********************************************************************************************************************/
+/*                                                                                                                  */
+/*                            Convergence Acceleration (irsmooth = 1, iaa = 1)                                      */
+/*                                                                                                                  */
+/********************************************************************************************************************/
 
-    fp2 = fopen("./cavity.dat","w");
-    fprintf(fp2,"TITLE = \"Cavity Field Data\"\n");
-    if(imms==1)
+/* Two layers with the interface of 'PJ_iteration' that wrap the selected iteration step.  */
+/* RS_iteration (irsmooth = 1) calls it and replaces its update du = u - uold by the       */
+/* implicitly smoothed (1 - eps d_ii)(1 - eps d_jj) dus = du (zero at the walls). That     */
+/* damps the high-frequency part of the update, which sets the stability limit of the      */
+/* explicit schemes, so cfl can go well above 0.9. AA_iteration (iaa = 1) treats aasteps */
+/* steps of the iteration (the one selected, or the smoothed one) with the time step       */
+/* frozen as a fixed-point map G, and returns the Anderson (type II) combination of the    */
+/* last aadepth G(u) that minimizes the combined G(u) - u. If ||G(u) - u|| grows by        */
+/* aagrow over its smallest value since the last restart, the window is dropped and the    */
+/* plain step is taken. Neither changes the discretization: both converge to the fixed     */
+/* point of the underlying iteration.                                                      */
+
+#define RS_CFL0 0.9                 /* Stability limit of the unsmoothed explicit schemes */
+
+void rs_setup()
+{
+    /* 
+    Uses global variable(s): imax, jmax, cfl, rseps
+    To modify: rsepsilon, rsinvx, rsinvy
+    The smoothing operators are the same for every line, so their pivots are set once
+    (Thomas algorithm on -eps, 1 + 2 eps, -eps). rseps = 0 uses the smallest coefficient
+    that lifts the stability limit from RS_CFL0 to cfl, eps = ((cfl/RS_CFL0)^2 - 1)/4.
+    */
+    rsepsilon = rseps;
+    if(rsepsilon==zero)
     {
-        fprintf(fp2,"variables=\"x(m)\"\"y(m)\"\"p(N/m^2)\"\"u(m/s)\"\"v(m/s)\"");\
-        fprintf(fp2,"\"p-exact\"\"u-exact\"\"v-exact\"\"DE-p\"\"DE-u\"\"DE-v\"\n");      
+        rsepsilon = max(zero, fourth*(pow2(cfl/RS_CFL0) - one));
+    }
+    if(rsepsilon>zero)
+    {
+        printf("Residual smoothing: eps = %f\n", rsepsilon);
     }
     else
     {
-        if(imms==0)
-        {
-            fprintf(fp2,"variables=\"x(m)\"\"y(m)\"\"p(N/m^2)\"\"u(m/s)\"\"v(m/s)\"\n");
-        }      
-        else
-        {
-            printf("ERROR! imms must equal 0 or 1!!!\n");
-            exit (0);
-        }       
+        printf("Note: no residual smoothing, eps = 0 at cfl <= %.1f (set rseps)\n", RS_CFL0);
     }
 
-  /* Header for Screen Output */
-  printf("Iter. Time (s)   dt (s)      Continuity    x-Momentum    y-Momentum\n"); 
+    rsinvx.assign(imax, zero);
+    rsinvy.assign(jmax, zero);
+    for(int i=1; i<imax-1; i++)
+    {
+        rsinvx[i] = one/(one + two*rsepsilon - ((i>1) ? rsepsilon*rsepsilon*rsinvx[i-1] : zero));
+    }
+    for(int j=1; j<jmax-1; j++)
+    {
+        rsinvy[j] = one/(one + two*rsepsilon - ((j>1) ? rsepsilon*rsepsilon*rsinvy[j-1] : zero));
+    }
 }
 
 /**************************************************************************/
 
-void initial(int& ninit, double& rtime, double resinit[neq], Array3& u, Array3& s)
+void RS_iteration( boundaryConditionPointer set_boundary_conditions, Array3& u, Array3& uold, Array3& src, Array2& viscx, Array2& viscy, Array2& dt )
 {
-    /* 
-    Uses global variable(s): zero, one, irstr, imax, jmax, neq, uinf, pinf 
-    To modify: ninit, rtime, resinit, u, s
+    /*
+    Uses global variable(s): imax, jmax, rsInner, rsepsilon, rsinvx, rsinvy
+    Iteration step with a smoothed update (same interface as PJ_iteration). On return
+    uold holds u from the start of the step.
     */
-    int i;                       /* i index (x direction) */
-    int j;                       /* j index (y direction) */
-    int k;                       /* k index (# of equations) */
-  
-    double x;       /* Temporary variable for x location */
-    double y;       /* Temporary variable for y location */
-
-    /* This subroutine sets inital conditions in the cavity */
+    const double eps = rsepsilon;
+    const int jblock = 16;          /* Columns per thread chunk of the i-line solves */
+    const int iref = (imax-1)/2;    /* Pressure rescaling point, see pressure_rescaling */
+    const int jref = (jmax-1)/2;
+
+    rsInner(set_boundary_conditions, u, uold, src, viscx, viscy, dt);
+
+    /* Update, in place in the interior of u. The pressure update at the rescaling point is */
+    /* applied unsmoothed everywhere: a uniform shift is what the rescaling removes at the  */
+    /* fixed point of the iteration, so smoothing the rest keeps the same fixed point       */
+    const double dpref = u(iref,jref,0) - uold(iref,jref,0);
+    const double shift[neq] = { dpref, zero, zero };
+    #pragma omp parallel for
+    for(int i=1; i<imax-1; i++)
+    {
+        for(int j=1; j<jmax-1; j++)
+        {
+            for(int k=0; k<neq; k++)
+            {
+                u(i,j,k) -= uold(i,j,k) + shift[k];
+            }
+        }
+    }
 
-    /* Note: The vector of primitive variables is:  */
-    /*              u = [p, u, v]^T               */
-  
-    if(irstr==0)   /* Starting run from scratch*/
-    {  
-        ninit = 1;          /* set initial iteration to one */
-        rtime = zero;       /* set initial time to zero */
-        for(k = 0; k<neq; k++)
+    /* Lines in i: all the rows of a chunk of columns advance together */
+    #pragma omp parallel for schedule(static)
+    for(int jb=1; jb<jmax-1; jb+=jblock)
+    {
+        const int je = min(jb + jblock, jmax - 1);
+        for(int i=1; i<imax-1; i++)
         {
-            resinit[k] = one;
+            const double fac = (i>1) ? eps : zero;
+            for(int j=jb; j<je; j++)
+            {
+                for(int k=0; k<neq; k++)
+                {
+                    u(i,j,k) = (u(i,j,k) + fac*u(i-1,j,k))*rsinvx[i];
+                }
+            }
         }
-        for(i = 0; i<imax; i++)
+        for(int i=imax-3; i>=1; i--)
         {
-            for(j = 0; j<jmax; j++)
+            for(int j=jb; j<je; j++)
             {
-                u(i,j,0) = pinf;
-                u(i,j,1) = zero;
-                u(i,j,2) = zero;
-
-                s(i,j,0) = zero;
-                s(i,j,1) = zero;
-                s(i,j,2) = zero;
+                for(int k=0; k<neq; k++)
+                {
+                    u(i,j,k) += eps*rsinvx[i]*u(i+1,j,k);
+                }
             }
-            u(i, jmax-1, 1) = uinf; /* Initialize lid (top) to freestream velocity */
         }
-    }  
-    else if(irstr==1)  /* Restarting from previous run (file 'restart.in') */
+    }
+
+    /* Lines in j, then u = uold + shift + smoothed update */
+    #pragma omp parallel for
+    for(int i=1; i<imax-1; i++)
     {
-        fp4 = fopen("./restart.in","r"); /* Note: 'restart.in' must exist! */
-        if (fp4==NULL)
+        for(int j=1; j<jmax-1; j++)
         {
-            printf("Error opening restart file. Stopping.\n");
-            exit (0);
-        }      
-        fscanf(fp4, "%d %lf", ninit, rtime); /* Need to known current iteration # and time value */
-        fscanf(fp4, "%lf %lf %lf", &resinit[0], &resinit[1], &resinit[2]); /* Needs initial iterative residuals for scaling */
-        for(i=0; i<imax; i++)
+            const double fac = (j>1) ? eps : zero;
+            for(int k=0; k<neq; k++)
+            {
+                u(i,j,k) = (u(i,j,k) + fac*u(i,j-1,k))*rsinvy[j];
+            }
+        }
+        for(int j=jmax-3; j>=1; j--)
         {
-            for(j=0; j<jmax; j++)
+            for(int k=0; k<neq; k++)
             {
-                fscanf(fp4, "%lf %lf %lf %lf %lf", &x, &y, &u(i,j,0), &u(i,j,1), &u(i,j,2)); 
+                u(i,j,k) += eps*rsinvy[j]*u(i,j+1,k);
+            }
+        }
+        for(int j=1; j<jmax-1; j++)
+        {
+            for(int k=0; k<neq; k++)
+            {
+                u(i,j,k) += uold(i,j,k) + shift[k];
             }
         }
-        ninit += 1;
-        printf("Restarting at iteration %d\n", ninit);
-        fclose(fp4);
-    }   
-    else
-    {
-        printf("ERROR: irstr must equal 0 or 1!\n");
-        exit (0);
     }
+
+    /* Set Boundary Conditions for u */
+    set_boundary_conditions(u);
 }
 
+/**************************************************************************/
+
+size_t aa_workspace_bytes()
+{
+    /* Uses global variable(s): imax, jmax, aadepth. Returns: workspace bytes 'aa_setup' carves */
+    const size_t n = (size_t)neq*(imax - 2)*(jmax - 2);
+    const size_t vec = (n*sizeof(double) + ARRAY3_ALIGN - 1)/ARRAY3_ALIGN*ARRAY3_ALIGN;
+    return (size_t)(2*aadepth + 4)*vec;
+}
 
 /**************************************************************************/
 
-void bndry( Array3& u )
+void aa_setup()
 {
     /* 
-    Uses global variable(s): zero, one (not used), two, half, imax, jmax, uinf  
-    To modify: u 
+    Uses global variable(s): imax, jmax, aadepth
+    To modify: aa (work vectors for the current grid, from the workspace)
     */
-    int i;                                          //i index (x direction)
-    int j;                                          //j index (y direction)
-
-    /* This applies the cavity boundary conditions */
-
-
-    /* !************************************************************** */
-    /* !************ADD CODING HERE FOR INTRO CFD STUDENTS************ */
-    /* !************************************************************** */
-
-    /* Should be complete */
-
-    /* I'm  going to include the corners on the top/bottoms */
-
-    for( j=1; j<jmax-1; j++)
-    {
-        /* Left wall */
-        i = 0;
-        u(i,j,0) = 2*u(1,j,0) - u(2,j,0); /* Defines pressure gradient at left wall*/
-        u(i,j,1) = 0; /* Defines left wall as 0 u velocity */
-        u(i,j,2) = 0; /* Defines left wall as 0 v velocity */
-        /* Right wall */
-        i = imax-1;
-        u(i,j,0) = 2*u(imax-2,j,0) - u(imax-3,j,0); /* Defines pressure gradient at right wall */
-        u(i,j,1) = 0; /* Defines right wall as 0 u velocity */
-        u(i,j,2) = 0; /* Defines right wall as 0 v velocity */
-    }
-    
-    for( i=0; i<imax; i++)
+    const size_t bytes = (size_t)neq*(imax - 2)*(jmax - 2)*sizeof(double);
+
+    aa.n = neq*(imax - 2)*(jmax - 2);
+    aa.f    = (double*)workspace.carve(bytes);
+    aa.g    = (double*)workspace.carve(bytes);
+    aa.fold = (double*)workspace.carve(bytes);
+    aa.gold = (double*)workspace.carve(bytes);
+    for(int b=0; b<aadepth; b++)
     {
-        /* Bottom wall */
-        j = 0;
-        u(i,j,0) = 2*u(i,1,0) - u(i,2,0); /* Defines pressure gradient at bottom */
-        u(i,j,1) = 0; /* Defines bottom row as 0 u velocity */
-        u(i,j,2) = 0; /* Defines bottom row as 0 v velocity */
-        /* Top wall */
-        j = jmax-1;
-        u(i,j,0) = 2*u(i,jmax-2,0) - u(i,jmax-3,0); /* Defines pressure gradient at top */
-        u(i,j,1) = uinf; /* Defines top row u velocity as lid velocity */
-        u(i,j,2) = 0; /* Defines top row as 0 v velocity */
+        aa.df[b] = (double*)workspace.carve(bytes);
+        aa.dg[b] = (double*)workspace.carve(bytes);
     }
-
+    aa.depth = 0;
+    aa.newest = aadepth - 1;
+    aa.started = false;
+    aa.fmin = zero;
 }
 
 /**************************************************************************/
 
-void bndrymms( Array3& u )
+void aa_gather( Array3& a, double* x )
 {
     /* 
-    Uses global variable(s): two, imax, jmax, neq, xmax, xmin, ymax, ymin, rlength  
-    To modify: u
+    Uses global variable(s): imax, jmax, rho, uinf
+    Interior values of a -> x (neq per node), scaled by rho*uinf^2 (pressure) and uinf
+    (velocities), so the least-squares problem weighs the variables alike
     */
-    int i;                       /* i index (x direction) */
-    int j;                       /* j index (y direction) */
-    int k;                       /* k index (# of equations) */
-  
-    double x;       /* Temporary variable for x location */
-    double y;       /* Temporary variable for y location */
-
-    /* This applies the cavity boundary conditions for the manufactured solution */
-
-    /* Side Walls */
-    for( j = 1; j<jmax-1; j++)
-    {
-        y = (ymax - ymin)*(double)(j)/(double)(jmax - 1);
-        i = 0;
-        x = xmin;
-            
-        u(i,j,0)  = umms(x,y,0);
-        u(i,j,1)  = umms(x,y,1);
-        u(i,j,2)  = umms(x,y,2);
-
-        u(0,j,0) = two*u(1,j,0) - u(2,j,0);    /* 2nd Order BC */
+    const int nj = jmax - 2;
+    const double scale[neq] = { one/(rho*uinf*uinf), one/uinf, one/uinf };
 
-        i=imax-1;
-        x = xmax;
-            
-        u(i,j,0)  = umms(x,y,0);
-        u(i,j,1)  = umms(x,y,1);
-        u(i,j,2)  = umms(x,y,2);
-
-        u(imax-1,j,0) = two*u(imax-2,j,0) - u(imax-3,j,0);   /* 2nd Order BC */
-    }
-
-    /* Top/Bottom Walls */
-    for(i=0; i<imax; i++)
+    #pragma omp parallel for
+    for(int i=1; i<imax-1; i++)
     {
-        x = (xmax - xmin)*(double)(i)/(double)(imax - 1);
-        j = 0;
-        y = ymin;
-
-        u(i,j,0)  = umms(x,y,0);
-        u(i,j,1)  = umms(x,y,1);
-        u(i,j,2)  = umms(x,y,2);
-
-        u(i,0,0) = two*u(i,1,0) - u(i,2,0);   /* 2nd Order BC */
-
-        j = jmax-1;
-        y = ymax;
-            
-        u(i,j,0)  = umms(x,y,0);
-        u(i,j,1)  = umms(x,y,1);
-        u(i,j,2)  = umms(x,y,2);
-
-        u(i,jmax-1,0) = two*u(i,jmax-2,0) - u(i,jmax-3,0);   /* 2nd Order BC */
+        for(int j=1; j<jmax-1; j++)
+        {
+            for(int k=0; k<neq; k++)
+            {
+                x[((size_t)(i-1)*nj + (j-1))*neq + k] = scale[k]*a(i,j,k);
+            }
+        }
     }
 }
 
 /**************************************************************************/
 
-void write_output(int n, Array3& u, Array2& dt, double resinit[neq], double rtime)
+void AA_iteration( boundaryConditionPointer set_boundary_conditions, Array3& u, Array3& uold, Array3& src, Array2& viscx, Array2& viscy, Array2& dt )
 {
-        /* 
-    Uses global variable(s): imax, jmax, new, xmax, xmin, ymax, ymin, rlength, imms
-    Uses global variable(s): ninit, u, dt, resinit, rtime
-    To modify: <none> 
-    Writes output and restart files.
+    /*
+    Uses global variable(s): imax, jmax, aadepth, aasteps, aamix, aagrow, rho, uinf, aaInner, aa
+    To modify: aa, aarestarts
+    Anderson-accelerated iteration step (same interface as PJ_iteration). On return uold
+    holds u from the start of the last inner iteration.
     */
-   
-    int i;                       /* i index (x direction) */
-    int j;                       /* j index (y direction) */
-    int k;                       /* k index (# of equations) */
+    const int nj = jmax - 2;
+    const int n = aa.n;
+    const int s = (aa.newest + 1)%aadepth;      /* Slot of the new difference */
+    double fsum = zero;
+
+    /* G: aasteps iterations (time step frozen), with the pressure rescaling the main loop applies after each */
+    aa_gather(u, aa.f);
+    for(int q=0; q<aasteps; q++)
+    {
+        aaInner(set_boundary_conditions, u, uold, src, viscx, viscy, dt);
+        pressure_rescaling(u);
+    }
+    aa_gather(u, aa.g);
 
-    double x;       /* Temporary variable for x location */
-    double y;       /* Temporary variable for y location */
+    /* f = G(u) - u, the differences to the previous step, and ||f|| */
+    #pragma omp parallel for reduction(+:fsum)
+    for(int m=0; m<n; m++)
+    {
+        const double fm = aa.g[m] - aa.f[m];
+        aa.f[m] = fm;
+        if(aa.started)
+        {
+            aa.df[s][m] = fm - aa.fold[m];
+            aa.dg[s][m] = aa.g[m] - aa.gold[m];
+        }
+        aa.fold[m] = fm;
+        aa.gold[m] = aa.g[m];
+        fsum += fm*fm;
+    }
+    const double fnorm = sqrt(fsum);
 
-    /* Field output */
-    fprintf(fp2, "zone T=\"n=%d\"\n",n);
-    fprintf(fp2, "I= %d J= %d\n",imax, jmax);
-    fprintf(fp2, "DATAPACKING=POINT\n");
+    /* Safeguard: drop the window when the combination stops reducing ||f|| */
+    if(!aa.started || fnorm<aa.fmin)
+    {
+        aa.fmin = fnorm;
+    }
+    if(aa.started && fnorm>aagrow*aa.fmin)
+    {
+        aa.depth = 0;
+        aa.fmin = fnorm;
+        aarestarts++;
+    }
+    else if(aa.started)
+    {
+        aa.newest = s;
+        aa.depth = min(aa.depth + 1, aadepth);
+    }
+    aa.started = true;
+    if(aa.depth==0)
+    {
+        return;                 /* Plain step: u = G(u) */
+    }
 
-    if(imms==1) 
+    /* Window slots, newest first, and their dot products with the new difference and with f */
+    const int nd = aa.depth;
+    int slot[MAXAADEPTH];
+    double dots[2*MAXAADEPTH];
+    for(int t=0; t<nd; t++)
     {
-        for(i=0; i<imax; i++)
+        slot[t] = (aa.newest - t + aadepth)%aadepth;
+        dots[t] = zero;
+        dots[nd+t] = zero;
+    }
+    #pragma omp parallel for reduction(+:dots[:2*MAXAADEPTH])
+    for(int m=0; m<n; m++)
+    {
+        const double dfs = aa.df[s][m];
+        for(int t=0; t<nd; t++)
         {
-            for(j=0; j<jmax; j++)
-            {
-                x = (xmax - xmin)*(double)(i)/(double)(imax - 1);
-                y = (ymax - ymin)*(double)(j)/(double)(jmax - 1);
-                fprintf(fp2,"%e %e %e %e %e %e %e %e %e %e %e\n", x, y, u(i,j,0), u(i,j,1), u(i,j,2), 
-                                               umms(x,y,0), umms(x,y,1), umms(x,y,2), 
-                                                (u(i,j,0)-umms(x,y,0)), (u(i,j,1)-umms(x,y,1)), (u(i,j,2)-umms(x,y,2)));
-            }
-        }    
+            const double dft = aa.df[slot[t]][m];
+            dots[t] += dfs*dft;
+            dots[nd+t] += dft*aa.f[m];
+        }
     }
-    else if(imms==0)
+    for(int t=0; t<nd; t++)
+    {
+        aa.gram[s][slot[t]] = dots[t];
+        aa.gram[slot[t]][s] = dots[t];
+    }
+
+    /* Least squares min ||f - dF gamma||: normal equations, slightly regularized, Gaussian elimination */
+    double a[MAXAADEPTH][MAXAADEPTH+1];
+    double gamma[MAXAADEPTH];
+    double trace = zero;
+    for(int t=0; t<nd; t++)
+    {
+        trace += aa.gram[slot[t]][slot[t]];
+    }
+    for(int t=0; t<nd; t++)
+    {
+        for(int r=0; r<nd; r++)
+        {
+            a[t][r] = aa.gram[slot[t]][slot[r]];
+        }
+        a[t][t] += 1.e-12*trace + fsmall;
+        a[t][nd] = dots[nd+t];
+    }
+    for(int c=0; c<nd; c++)
     {
-        for(i=0; i<imax; i++)
+        int piv = c;
+        for(int r=c+1; r<nd; r++)
+        {
+            if(fabs(a[r][c])>fabs(a[piv][c])) piv = r;
+        }
+        for(int r=0; r<=nd; r++)
+        {
+            swap(a[c][r], a[piv][r]);
+        }
+        for(int r=c+1; r<nd; r++)
         {
-            for(j=0; j<jmax; j++)
+            const double l = a[r][c]/a[c][c];
+            for(int q=c; q<=nd; q++)
             {
-                x = (xmax - xmin)*(double)(i)/(double)(imax - 1);
-                y = (ymax - ymin)*(double)(j)/(double)(jmax - 1);
-                fprintf(fp2,"%e %e %e %e %e\n", x, y, u(i,j,0), u(i,j,1), u(i,j,2));
+                a[r][q] -= l*a[c][q];
             }
         }
     }
-    else
+    for(int t=nd-1; t>=0; t--)
     {
-        printf("ERROR: imms must equal 0 or 1!\n");
-        exit (0);
+        gamma[t] = a[t][nd];
+        for(int r=t+1; r<nd; r++)
+        {
+            gamma[t] -= a[t][r]*gamma[r];
+        }
+        gamma[t] /= a[t][t];
     }
 
-    /* Restart file: overwrites every 'iterout' iteration */
-    fp3 = fopen("./restart.out","w");       
-    fprintf(fp3,"%d %e\n", n, rtime);    
-    fprintf(fp3,"%e %e %e\n", resinit[0], resinit[1], resinit[2]);
-    for(i=0; i<imax; i++)
+    /* u = G(u) - dG gamma - (1 - aamix)(f - dF gamma), unscaled into the interior */
+    const double unscale[neq] = { rho*uinf*uinf, uinf, uinf };
+    #pragma omp parallel for
+    for(int i=1; i<imax-1; i++)
     {
-        for(j=0; j<jmax; j++)
+        for(int j=1; j<jmax-1; j++)
         {
-            x = (xmax - xmin)*(double)(i)/(double)(imax - 1);
-            y = (ymax - ymin)*(double)(j)/(double)(jmax - 1);
-            fprintf(fp3,"%e %e %e %e %e\n", x, y, u(i,j,0), u(i,j,1), u(i,j,2));
+            for(int k=0; k<neq; k++)
+            {
+                const size_t m = ((size_t)(i-1)*nj + (j-1))*neq + k;
+                double gm = aa.g[m];
+                double fm = aa.f[m];
+                for(int t=0; t<nd; t++)
+                {
+                    gm -= gamma[t]*aa.dg[slot[t]][m];
+                    fm -= gamma[t]*aa.df[slot[t]][m];
+                }
+                u(i,j,k) = unscale[k]*(gm - (one - aamix)*fm);
+            }
         }
     }
-    fclose(fp3);
+
+    /* Set Boundary Conditions for u */
+    set_boundary_conditions(u);
 }
 
 /**************************************************************************/
 
-double umms(double x, double y, int k)  
+void aa_residual_sums( Array2& dt, double sums[neq] )
 {
     /* 
-    Uses global variable(s): one, rpi, rlength
-    Inputs: x, y, k
-    To modify: <none>
-    Returns: umms
+    Uses global variable(s): imax, jmax, rho, uinf, aasteps, aa
+    Uses: dt (of the last step)
+    To modify: sums (sums of squares of (G(u) - u)/(aasteps dt) over the interior, u at the start
+               of the last step). For aasteps = 1 this is the (u - uold)/dt an unaccelerated step
+               from u would give
     */
+    const int nj = jmax - 2;
+    const double unscale[neq] = { rho*uinf*uinf/aasteps, uinf/aasteps, uinf/aasteps };
+    double res0 = zero;             // Scalar sums for the OpenMP reduction
+    double res1 = zero;
+    double res2 = zero;
+
+    #pragma omp parallel for reduction(+:res0,res1,res2)
+    for(int i=1; i<imax-1; i++)
+    {
+        for(int j=1; j<jmax-1; j++)
+        {
+            const double* f = aa.f + ((size_t)(i-1)*nj + (j-1))*neq;
+            double diff0 = unscale[0]*f[0]/dt(i,j);
+            double diff1 = unscale[1]*f[1]/dt(i,j);
+            double diff2 = unscale[2]*f[2]/dt(i,j);
+            res0 += diff0*diff0;
+            res1 += diff1*diff1;
+            res2 += diff2*diff2;
+        }
+    }
+    sums[0] = res0;
+    sums[1] = res1;
+    sums[2] = res2;
+}
 
-    double ummstmp; /* Define return value for umms as double precision */
+/**************************************************************************/
 
-    double termx;      /* Temp variable */
-    double termy;      /* Temp variable */
-    double termxy;     /* Temp variable */
-    double argx;       /* Temp variable */
-    double argy;       /* Temp variable */
-    double argxy;      /* Temp variable */  
-  
-    /* This function returns the MMS exact solution */
-  
-    argx = apx[k]*rpi*x/rlength;
-    argy = apy[k]*rpi*y/rlength;
-    argxy = apxy[k]*rpi*x*y/rlength/rlength;
-    termx = phix[k]*(fsinx[k]*sin(argx)+(one-fsinx[k])*cos(argx));
-    termy = phiy[k]*(fsiny[k]*sin(argy)+(one-fsiny[k])*cos(argy));
-    termxy = phixy[k]*(fsinxy[k]*sin(argxy)+(one-fsinxy[k])*cos(argxy));
-  
-    ummstmp = phi0[k] + termx + termy + termxy;
- 
-    return ummstmp;  
+/********************************************************************************************************************/
+/*                                                                                                                  */
+/*                                       Dual Time Stepping (idual = 1)                                             */
+/*                                                                                                                  */
+/********************************************************************************************************************/
+
+/* Time-accurate runs. Each physical step solves the BDF2 system (BDF1 for the first step)    */
+/*     rho (c0 u + c1 u^n + c2 u^n-1)/dtphys + R(u) - s = 0     (momentum, continuity as is)  */
+/* with the steady machinery in pseudo time: the main loop iterations are its sub-iterations. */
+/* The implicit part rho c0 u/dtphys is in residual_stencil (rcoef.rdtphys) of the dual policy */
+/* steps, so the PJ, SGS and multigrid steps all see it, on every level; the steady kernels   */
+/* compile without it. The known part goes to src, which                                      */
+/* stays fixed during a step. The local pseudo time step becomes dtau/(1 + rdtphys dtau)      */
+/* (time_step_node), which makes the explicit update point-implicit in the physical time      */
+/* term, so dtphys can be as small as the pseudo time step itself. A step ends when its       */
+/* residual, the largest of the three equations as in the steady check, has dropped by subtol */
+/* from its first sub-iteration (or is below toler, or after subiters). The next one starts   */
+/* from u^n, or from 2 u^n - u^n-1 (iextrap = 1: velocities, 2: all variables). The time     */
+/* levels are two workspace fields swapped by pointer.                                        */
+
+void dual_start( Array3& u, Array3& src, boundaryConditionPointer set_boundary_conditions, double& rtime )
+{
+    /* 
+    Uses global variable(s): imax, jmax, neq, nphys, dtphys
+    Uses: u (the state at t = 0), src (physical source)
+    To modify: dual (time levels from the workspace), fp7, and what 'dual_next_step' sets for step 1
+    */
+    dual.un      = new Array3(imax, jmax, neq, workspace);
+    dual.unm1    = new Array3(imax, jmax, neq, workspace);
+    dual.srcphys = new Array3(imax, jmax, neq, workspace);
+    dual.srcphys->copyData(src);
+    dual.un->copyData(u);           /* Both levels hold u^0 after the first swap */
+    dual.step = 0;
+    dual.finished = 0;
+    dual.subtotal = 0;
+    dual.ncapped = 0;
+    fp7 = fopen("./unsteady.dat","w");
+    fprintf(fp7,"TITLE = \"Cavity Physical Time Step History\"\n");
+    fprintf(fp7,"variables=\"Step\"\"Time(s)\"\"Subiterations\"\"Residual\"\"Lid(m/s)\"\"u-center(m/s)\"\"v-center(m/s)\"\n");
+
+    printf("Dual time stepping: %d physical steps of %e s (BDF2)\n", nphys, dtphys);
+    dual_next_step(u, src, set_boundary_conditions, rtime);
 }
 
 /**************************************************************************/
 
-void compute_source_terms( Array3& s )
+void dual_next_step( Array3& u, Array3& src, boundaryConditionPointer set_boundary_conditions, double& rtime )
 {
     /* 
-    Uses global variable(s): imax, jmax, imms, rlength, xmax, xmin, ymax, ymin
-    To modify: s (source terms)
+    Uses global variable(s): imax, jmax, neq, rho, uinf, dtphys, lidomega, iextrap
+    Uses: u (the converged state of the step before, which becomes u^n)
+    To modify: dual, ulid, rcoef, u (first guess of the next step), src, rtime
     */
+    Array3* oldest = dual.unm1;
+
+    dual.unm1 = dual.un;
+    dual.un = oldest;
+    dual.un->copyData(u);
+    dual.step++;
+    dual.order = (dual.step==1) ? 1 : 2;
+    dual.time = dual.step*dtphys;               /* Not a running sum, so long runs do not drift */
+    dual.subit = 0;
+
+    /* BDF coefficients: (c0 u + c1 u^n + c2 u^n-1)/dtphys */
+    const double c0 = (dual.order==2) ? 1.5 : one;
+    const double c1 = (dual.order==2) ? -two : -one;
+    const double c2 = (dual.order==2) ? half : zero;
+    dual.rdt = c0/dtphys;
+    rcoef.rdtphys = dual.rdt;
+    ulid = uinf*cos(lidomega*dual.time);
+
+    const Array3& un = *dual.un;
+    const Array3& unm1 = *dual.unm1;
+    const Array3& sphys = *dual.srcphys;
+
+    /* First guess: linear extrapolation once there are two levels, of the velocities only */
+    /* (iextrap = 1) or also of the pressure (iextrap = 2). The error of an extrapolated    */
+    /* pressure is smooth: multigrid removes it quickly, the single grid schemes slowly     */
+    const int kfirst = (iextrap==2) ? 0 : 1;
+    if(iextrap>0 && dual.step>1)
+    {
+        #pragma omp parallel for
+        for(int i=0; i<imax; i++)
+        {
+            for(int j=0; j<jmax; j++)
+            {
+                for(int k=kfirst; k<neq; k++)
+                {
+                    u(i,j,k) = two*un(i,j,k) - unm1(i,j,k);
+                }
+            }
+        }
+    }
+    set_boundary_conditions(u);
 
-    int i;                       /* i index (x direction) */
-    int j;                       /* j index (y direction) */
-    
-    double x;       /* Temporary variable for x location */
-    double y;       /* Temporary variable for y location */
-
-    /* Evaluate Source Terms Once at Beginning (only interior points; will be zero for standard cavity) */
-  
-    for(i=1; i<imax-1; i++)
+    /* Known part of the time derivative: src = s - rho (c1 u^n + c2 u^n-1)/dtphys (momentum) */
+    #pragma omp parallel for
+    for(int i=1; i<imax-1; i++)
     {
-        for(j=1; j<jmax-1; j++)
+        for(int j=1; j<jmax-1; j++)
         {
-            x = (xmax - xmin)*(double)(i)/(double)(imax - 1);
-            y = (ymax - ymin)*(double)(j)/(double)(jmax - 1);
-            s(i,j,0) = (double)(imms)*srcmms_mass(x,y);
-            s(i,j,1) = (double)(imms)*srcmms_xmtm(x,y);
-            s(i,j,2) = (double)(imms)*srcmms_ymtm(x,y);
+            src(i,j,0) = sphys(i,j,0);
+            for(int k=1; k<neq; k++)
+            {
+                src(i,j,k) = sphys(i,j,k) - rho*(c1*un(i,j,k) + c2*unm1(i,j,k))/dtphys;
+            }
         }
     }
+    rtime = dual.time;
 }
 
 /**************************************************************************/
 
-double srcmms_mass(double x, double y)  
+bool dual_step_converged( double conv )
 {
     /* 
-    Uses global variable(s): rho, rpi, rlength
-    Inputs: x, y
-    To modify: <none>
-    Returns: srcmms_mass
+    Uses global variable(s): toler, subtol, subiters
+    Uses: conv (of this sub-iteration)
+    To modify: dual (sub-iteration count, reference residual, capped steps)
+    Returns: true when the sub-iterations of the current physical step are done
     */
-
-    double srcmasstmp; /* Define return value for srcmms_mass as double precision */
-
-    double dudx;    /* Temp variable: u velocity gradient in x direction */
-    double dvdy;  /* Temp variable: v velocity gradient in y direction */
-  
-    /* This function returns the MMS mass source term */
-
-    dudx = phix[1]*apx[1]*rpi/rlength*cos(apx[1]*rpi*x/rlength) + phixy[1]*apxy[1]*rpi*y/rlength/rlength * cos(apxy[1]*rpi*x*y/rlength/rlength);
-  
-    dvdy = -phiy[2]*apy[2]*rpi/rlength*sin(apy[2]*rpi*y/rlength) - phixy[2]*apxy[2]*rpi*x/rlength/rlength * sin(apxy[2]*rpi*x*y/rlength/rlength);
-
-    srcmasstmp = rho*dudx + rho*dvdy;
-
-    return srcmasstmp;
-} 
+    dual.subit++;
+    if(dual.subit==1)
+    {
+        dual.resref = conv;         /* The drop is measured on conv itself, all three equations */
+    }
+    if(conv<toler || conv<subtol*dual.resref)
+    {
+        return true;
+    }
+    if(dual.subit>=subiters)
+    {
+        dual.ncapped++;
+        return true;
+    }
+    return false;
+}
 
 /**************************************************************************/
 
-double srcmms_xmtm(double x, double y)  
+void dual_end_step( int n, Array3& u, double conv )
 {
     /* 
-    Uses global variable(s): rho, rpi, rmu, rlength
-    Inputs: x, y
-    To modify: <none>
-    Returns: srcmms_xmtm
+    Uses global variable(s): imax, jmax, ulid, fp7
+    Uses: n, u, conv (of the last sub-iteration)
+    To modify: dual (sub-iteration total)
     */
-
-    double srcxmtmtmp; /* Define return value for srcmms_xmtm as double precision */
-
-    double dudx;    /* Temp variable: u velocity gradient in x direction */
-    double dudy;  /* Temp variable: u velocity gradient in y direction */
-    double termx;        /* Temp variable */
-    double termy;        /* Temp variable */
-    double termxy;       /* Temp variable */
-    double uvel;         /* Temp variable: u velocity */
-    double vvel;         /* Temp variable: v velocity */
-    double dpdx;         /* Temp variable: pressure gradient in x direction */
-    double d2udx2;       /* Temp variable: 2nd derivative of u velocity in x direction */
-    double d2udy2;       /* Temp variable: 2nd derivative of u velocity in y direction */
-
-    /*This function returns the MMS x-momentum source term */
-
-    termx = phix[1]*sin(apx[1]*rpi*x/rlength);
-    termy = phiy[1]*cos(apy[1]*rpi*y/rlength);
-    termxy = phixy[1]*sin(apxy[1]*rpi*x*y/rlength/rlength);
-    uvel = phi0[1] + termx + termy + termxy;
-  
-    termx = phix[2]*cos(apx[2]*rpi*x/rlength);
-    termy = phiy[2]*cos(apy[2]*rpi*y/rlength);
-    termxy = phixy[2]*cos(apxy[2]*rpi*x*y/rlength/rlength);
-    vvel = phi0[2] + termx + termy + termxy;
-  
-    dudx = phix[1]*apx[1]*rpi/rlength*cos(apx[1]*rpi*x/rlength) + phixy[1]*apxy[1]*rpi*y/rlength/rlength * cos(apxy[1]*rpi*x*y/rlength/rlength);
-  
-    dudy = -phiy[1]*apy[1]*rpi/rlength*sin(apy[1]*rpi*y/rlength) + phixy[1]*apxy[1]*rpi*x/rlength/rlength * cos(apxy[1]*rpi*x*y/rlength/rlength);
-  
-    dpdx = -phix[0]*apx[0]*rpi/rlength*sin(apx[0]*rpi*x/rlength) + phixy[0]*apxy[0]*rpi*y/rlength/rlength * cos(apxy[0]*rpi*x*y/rlength/rlength);
-
-    d2udx2 = -phix[1]*pow((apx[1]*rpi/rlength),2) * sin(apx[1]*rpi*x/rlength) - phixy[1]*pow((apxy[1]*rpi*y/rlength/rlength),2) * sin(apxy[1]*rpi*x*y/rlength/rlength); 
- 
-    d2udy2 = -phiy[1]*pow((apy[1]*rpi/rlength),2) * cos(apy[1]*rpi*y/rlength) - phixy[1]*pow((apxy[1]*rpi*x/rlength/rlength),2) * sin(apxy[1]*rpi*x*y/rlength/rlength);
-  
-    srcxmtmtmp = rho*uvel*dudx + rho*vvel*dudy + dpdx - rmu*( d2udx2 + d2udy2 );
-
-    return srcxmtmtmp;
-} 
+    const int ic = (imax-1)/2;
+    const int jc = (jmax-1)/2;
+
+    dual.finished++;
+    dual.subtotal += dual.subit;
+    fprintf(fp7, "%d %e %d %e %e %e %e\n", dual.step, dual.time, dual.subit, conv, ulid, u(ic,jc,1), u(ic,jc,2));
+    printf("Physical step %d at iteration %d: t = %e s, %d sub-iterations, residual %e\n",
+           dual.step, n, dual.time, dual.subit, conv);
+}
 
 /**************************************************************************/
 
-double srcmms_ymtm(double x, double y)  
+void dual_finish( int n )
 {
     /* 
-    Uses global variable(s): rho, rpi, rmu, rlength
-    Inputs: x, y
-    To modify: <none>
-    Returns: srcmms_ymtm
+    Uses global variable(s): nphys, dtphys, subiters, fp7
+    Uses: n (last iteration)
     */
+    const double tdone = dual.finished*dtphys;      /* A run stopped by nmax ends inside a step */
 
-    double srcymtmtmp; /* Define return value for srcmms_ymtm as double precision */
+    printf("Dual time stepping: %d of %d physical steps (t = %e s) in %d iterations, %.1f sub-iterations per step, %d step(s) stopped at subiters = %d\n",
+           dual.finished, nphys, tdone, n, (double)dual.subtotal/(double)max(dual.finished, 1), dual.ncapped, subiters);
+    fclose(fp7);
+}
 
-    double dvdx;         /* Temp variable: v velocity gradient in x direction */
-    double dvdy;         /* Temp variable: v velocity gradient in y direction */
-    double termx;        /* Temp variable */
-    double termy;        /* Temp variable */
-    double termxy;       /* Temp variable */
-    double uvel;         /* Temp variable: u velocity */
-    double vvel;         /* Temp variable: v velocity */
-    double dpdy;         /* Temp variable: pressure gradient in y direction */
-    double d2vdx2;       /* Temp variable: 2nd derivative of v velocity in x direction */
-    double d2vdy2;       /* Temp variable: 2nd derivative of v velocity in y direction */
+/**************************************************************************/
 
-    /* This function returns the MMS y-momentum source term */
+/********************************************************************************************************************/
+/*                                                                                                                  */
+/*                                  Mixed Precision Start (imixed = 1)                                              */
+/*                                                                                                                  */
+/********************************************************************************************************************/
 
-    termx = phix[1]*sin(apx[1]*rpi*x/rlength);
-    termy = phiy[1]*cos(apy[1]*rpi*y/rlength);
-    termxy = phixy[1]*sin(apxy[1]*rpi*x*y/rlength/rlength);
-    uvel = phi0[1] + termx + termy + termxy;
-  
-    termx = phix[2]*cos(apx[2]*rpi*x/rlength);
-    termy = phiy[2]*cos(apy[2]*rpi*y/rlength);
-    termxy = phixy[2]*cos(apxy[2]*rpi*x*y/rlength/rlength);
-    vvel = phi0[2] + termx + termy + termxy;
-  
-    dvdx = -phix[2]*apx[2]*rpi/rlength*sin(apx[2]*rpi*x/rlength) - phixy[2]*apxy[2]*rpi*y/rlength/rlength * sin(apxy[2]*rpi*x*y/rlength/rlength);
-  
-    dvdy = -phiy[2]*apy[2]*rpi/rlength*sin(apy[2]*rpi*y/rlength) - phixy[2]*apxy[2]*rpi*x/rlength/rlength * sin(apxy[2]*rpi*x*y/rlength/rlength);
-  
-    dpdy = phiy[0]*apy[0]*rpi/rlength*cos(apy[0]*rpi*y/rlength) + phixy[0]*apxy[0]*rpi*x/rlength/rlength * cos(apxy[0]*rpi*x*y/rlength/rlength);
-  
-    d2vdx2 = -phix[2]*pow((apx[2]*rpi/rlength),2) * cos(apx[2]*rpi*x/rlength) - phixy[2]*pow((apxy[2]*rpi*y/rlength/rlength),2) * cos(apxy[2]*rpi*x*y/rlength/rlength);
-  
-    d2vdy2 = -phiy[2]*pow((apy[2]*rpi/rlength),2) * cos(apy[2]*rpi*y/rlength)   - phixy[2]*pow((apxy[2]*rpi*x/rlength/rlength),2) * cos(apxy[2]*rpi*x*y/rlength/rlength);
-  
-    srcymtmtmp = rho*uvel*dvdx + rho*vvel*dvdy + dpdy - rmu*( d2vdx2 + d2vdy2 );
-  
-    return srcymtmtmp;  
+/* The point Jacobi iteration is bandwidth bound on large grids, and the early pseudo-time */
+/* iterations do not need double precision. With imixed = 1 they run in float: u, uold,   */
+/* src, dt, viscx and viscy are Array3f / Array2f, and the host PJ kernels (compute_time_  */
+/* step, PJ_iteration, bndry, pressure_rescaling, check_iterative_convergence) are the      */
+/* same templates instantiated for float. The node arithmetic is double where the node    */
+/* functions convert (time step, artificial viscosity, updates), and the residual sums are */
+/* double. Once the normalized residual, after dropping below its first value, has not    */
+/* dropped by MIXED_DROP in nmixstall iterations (float round-off stalls it), or reaches  */
+/* toler, the solution is converted to double and the main loop continues with the        */
+/* configured (double) scheme.                                                            */
+
+#define MIXED_DROP 0.01             /* Relative residual drop that counts as progress */
+
+template <class To, class From>
+void convert_field( Array3R<To>& to, const Array3R<From>& from )
+{
+    /* 
+    Uses global variable(s): imax, jmax
+    To modify: to (from, rounded to the To precision)
+    */
+    #pragma omp parallel for
+    for(int i=0; i<imax; i++)
+    {
+        for(int j=0; j<jmax; j++)
+        {
+            for(int k=0; k<neq; k++)
+            {
+                to(i,j,k) = (To)from(i,j,k);
+            }
+        }
+    }
 }
 
 /**************************************************************************/
 
-void compute_time_step( Array3& u, Array2& dt, double& dtmin )
+int mixed_precision_start( int ninit, double& rtime, double& dtmin, double resinit[neq], double& convmin, Array3& u, Array3& src )
 {
     /* 
-    Uses global variable(s): one (not used), two, four, half, fourth
-    Uses global variable(s): vel2ref, rmu, rho, dx, dy, cfl, rkappa, imax, jmax
-    Uses: u
-    To Modify: dt, dtmin
+    Uses global variable(s): imax, jmax, imms, nmax, nmonitor, residualOut, iterout, toler, nmixstall
+    To modify: rtime, dtmin, resinit (initial residuals, from iteration ninit), convmin, u
+    Runs point Jacobi iterations ninit, ninit+1, ... in float, with the residual history,
+    divergence checks and output of the main loop. Returns the last float iteration; u
+    then holds its solution, and the main loop continues in double.
     */
-    int i;                      //i index (x direction)
-    int j;                      //j index (y direction)
-  
-    double dtvisc;          //Viscous time step stability criteria (constant over domain)
-    double uvel2;           //Local velocity squared
-    double beta2;           //Beta squared parameter for time derivative preconditioning
-    double lambda_x;        //Max absolute value eigenvalue in (x,t)
-    double lambda_y;        //Max absolute value eigenvalue in (y,t)
-    double lambda_max;      //Max absolute value eigenvalue (used in convective time step computation)
-    double dtconv;          //Local convective time step restriction
+    WorkspaceScope scope;           /* The float arrays are released for the double iterations */
+    Array3f uf    (imax, jmax, neq, workspace);
+    Array3f uoldf (imax, jmax, neq, workspace);
+    Array3f srcf  (imax, jmax, neq, workspace);
+    Array2f viscxf(imax, jmax, workspace);
+    Array2f viscyf(imax, jmax, workspace);
+    Array2f dtf   (imax, jmax, workspace);
+
+    boundaryConditionPointerR<float> set_boundary_conditions = (imms==1) ? &bndrymms<float> : &bndry<float>;
+    double res[neq];                /* Iterative residual for each equation */
+    double conv = 1.0e99;
+    double convfirst = 1.0e99;      /* conv of the first float iteration */
+    double convbest = 1.0e99;       /* Smallest conv so far, and when it was reached */
+    int nbest = ninit;
+    bool monitor;
+    bool stop = false;
+    int n;
+
+    convert_field(uf, u);
+    convert_field(srcf, src);
+
+    for(n = ninit; n<=nmax; n++)
+    {
+        monitor = ((n%nmonitor)==0) || ((n%residualOut)==0) || (n==ninit) || (n==nmax);
 
-    /* !************************************************************** */
-    /* !************ADD CODING HERE FOR INTRO CFD STUDENTS************ */
-    /* !************************************************************** */
+        compute_time_step<0,0>( uf, dtf, dtmin );
+        PJ_iteration<0,0>( set_boundary_conditions, uf, uoldf, srcf, viscxf, viscyf, dtf );
+        pressure_rescaling( uf );
+        rtime += dtmin;
 
-    /* Should be done */
+        if(monitor)
+        {
+            check_iterative_convergence(n, uf, uoldf, dtf, res, resinit, ninit, rtime, dtmin, conv);
+            check_divergence(n, res, ninit, rtime, conv, convmin);
 
-    /* Should be nesting j loops inside of i loops in Cpp */
-    double nu = rmu/rho;
+            /* The stall clock starts once the residual is below its first value (it grows at first) */
+            if(n==ninit) convfirst = conv;
+            if(conv<(one - MIXED_DROP)*convbest || conv>=convfirst)
+            {
+                convbest = min(convbest, conv);
+                nbest = n;
+            }
+            stop = (conv<toler) || (n - nbest>=nmixstall);
+        }
 
-    for( i=1; i<imax-1; i++)
-    {
-        for( j=1; j<jmax-1;j++)
+        if( ((n%iterout)==0) )
         {
-            /* double nu = (rmu/rho); */
-            dtvisc = (dx*dy)/(4.0*nu); /* Should I pull this out of the loop? */
-            uvel2 = (u(i,j,1)*u(i,j,1)) + u(i,j,2)*u(i,j,2);
-            beta2 = max((uvel2),(rkappa*vel2ref));
-            lambda_x = (1.0/2.0)*(abs(u(i,j,1)) + sqrt(u(i,j,1)*u(i,j,1) + 4*beta2)); /* Should I be using "half"? */
-            lambda_y = (1.0/2.0)*(abs(u(i,j,2)) + sqrt(u(i,j,2)*u(i,j,2) + 4*beta2));
-            lambda_max = max(lambda_x,lambda_y);
-            dtconv = min(dx,dy)/abs(lambda_max); /* Convective stability limit */
-
-            /* To modify*/
-            //printf("dtvisc: %f, dtconv: %f\n", dtvisc, dtconv);
-            dt(i,j) = cfl*min(dtvisc,dtconv); /* This should be dt_d and dt_c*/
-            //printf("dt: %f\n", dt(i, j));
-            /* (Diffusive and convective)*/
-            /* dtmin = min(dt(i,j),dtmin); */
-            dtmin = min(dtmin,dt(i,j));
-            
+            convert_field(u, uf);
+            write_output(n, u, resinit, rtime, dtmin);
         }
-        
+        if(stop) break;
     }
+    n = min(n, nmax);
 
-    for (int i=0; i<imax; i++)
-    {
-        dt(i,0)        = dtmin;
-        dt(i,jmax-1)   = dtmin;
-    }
-    for (int j=0; j<jmax; j++)
-    {
-        dt(0,j)        = dtmin;
-        dt(imax-1,j)   = dtmin;
-    }
-        
+    convert_field(u, uf);
+    printf("Mixed precision: iterations %d to %d in float (residual %e), double from there on\n", ninit, n, conv);
 
+    return n;
+}
 
-}  
+/********************************************************************************************************************/
+/*                                                                                                                  */
+/*                                  Device Point Jacobi (OpenMP target offload, igpu = 1)                           */
+/*                                                                                                                  */
+/********************************************************************************************************************/
+
+/* igpu = 1 runs the point Jacobi iterations on the default OpenMP offload device: a GPU    */
+/* with g++ -fopenmp -foffload=nvptx-none (or amdgcn-amdhsa), clang++ -fopenmp             */
+/* --offload-arch=sm_80 (gfx90a) or nvc++ -mp=gpu. Without a device, or without -fopenmp,  */
+/* the target regions run on the host. u, uold, src and dt stay on the device for the whole */
+/* run; an iteration is four kernels: time step, artificial viscosity and update in one     */
+/* pass (as in PJ_fused_iteration, with a min reduction for dtmin), the side walls, the top */
+/* and bottom walls, and the pressure rescaling, which also sums the residuals (+          */
+/* reduction) on monitored iterations. Only dtmin, the new reference pressure and the sums  */
+/* come back each iteration; u is copied to the host for the solution and restart output.  */
+/* The kernels call the node functions of the host kernels on raw pointers with the Array3 */
+/* strides, so the iterates are those of PJ_iteration + pressure_rescaling. Point Jacobi    */
+/* only (isgs = 0, img = 0, ifused = 0, inewton = 0, iresmon = 0), cavity boundary          */
+/* conditions (imms = 0). Experimental: only the host fallback has been run (and matches   */
+/* igpu = 0); no offload build has been run on a device yet.                               */
+
+void device_start( Array3& u, Array3& uold, Array3& src, Array2& dt )
+{
+    /* 
+    Uses: u, uold, src (initial solution and source terms), dt
+    Makes the device copies of the arrays the iterations use (until 'device_finish').
+    The pointers and sizes are only read by the target pragmas, hence [[maybe_unused]].
+    */
+    [[maybe_unused]] double *pu = u.block();
+    [[maybe_unused]] double *puold = uold.block();
+    [[maybe_unused]] double *psrc = src.block();
+    [[maybe_unused]] double *pdt = dt.block();
+    [[maybe_unused]] const size_t n3 = u.block_size();
+    [[maybe_unused]] const size_t n2 = dt.block_size();
+
+#ifdef _OPENMP
+    printf("Device point Jacobi: %d offload device(s)%s\n", omp_get_num_devices(),
+           (omp_get_num_devices()>0) ? "" : ", running on the host");
+#else
+    printf("Device point Jacobi: built without OpenMP, running on the host\n");
+#endif
+
+    #pragma omp target enter data map(to: pu[0:n3], puold[0:n3], psrc[0:n3]) map(alloc: pdt[0:n2])
+}
 
 /**************************************************************************/
 
-void Compute_Artificial_Viscosity( Array3& u, Array2& viscx, Array2& viscy )
+void device_finish( Array3& u, Array3& uold, Array3& src, Array2& dt )
 {
     /* 
-    Uses global variable(s): zero (not used), one (not used), two, four, six, half, fourth (not used)
-    Uses global variable(s): imax, jmax, lim (not used), rho, dx, dy, Cx, Cy, Cx2 (not used), Cy2 (not used)
-    , fsmall (not used), vel2ref, rkappa
-    Uses: u
-    To Modify: artviscx, artviscy
+    To modify: u (copied back from the device)
+    Frees the device copies made by 'device_start'.
     */
-    int i;                  //i index (x direction)
-    int j;                  //j index (y direction)
+    [[maybe_unused]] double *pu = u.block();
+    [[maybe_unused]] double *puold = uold.block();
+    [[maybe_unused]] double *psrc = src.block();
+    [[maybe_unused]] double *pdt = dt.block();
+    [[maybe_unused]] const size_t n3 = u.block_size();
+    [[maybe_unused]] const size_t n2 = dt.block_size();
+
+    #pragma omp target exit data map(from: pu[0:n3]) map(delete: puold[0:n3], psrc[0:n3], pdt[0:n2])
+}
 
-    double uvel2;       //Local velocity squared
-    double beta2;       //Beta squared parameter for time derivative preconditioning
-    double lambda_x;    //Max absolute value e-value in (x,t)
-    double lambda_y;    //Max absolute value e-value in (y,t)
-    double d4pdx4;      //4th derivative of pressure w.r.t. x
-    double d4pdy4;      //4th derivative of pressure w.r.t. y
+/**************************************************************************/
 
-    /* !************************************************************** */
-    /* !************ADD CODING HERE FOR INTRO CFD STUDENTS************ */
-    /* !************************************************************** */
+void device_update_host( Array3& u )
+{
+    /* 
+    To modify: u (host copy, from the device)
+    */
+    [[maybe_unused]] double *pu = u.block();
+    [[maybe_unused]] const size_t n3 = u.block_size();
 
+    #pragma omp target update from(pu[0:n3])
+}
 
-    /* Note: This could definitely be done more concisely but I haven't 
-    decided how, yet. */
+/**************************************************************************/
 
-    /* The fourth order equation cannot reach out of bounds */
+void PJ_device_iteration( Array3& u, Array3& uold, Array3& src, Array2& dt, bool monitor, double res[neq], double& dtmin )
+{
+    /* 
+    Uses global variable(s): imax, jmax, rcoef, uinf
+    To Modify: u, uold, dt (device copies), res (sums of squares, normalized by
+               'report_iterative_convergence'; only when monitor), dtmin
+    One iteration of the host loop: compute_time_step, PJ_iteration (bndry), pressure_rescaling
+    and, when monitor, iterative_residual_sums.
+    */
+    const ResidualCoefficients c = rcoef;
+    const ptrdiff_t JS = Array3Layout::jstep;
+    const ptrdiff_t is = u.address(1,0,0) - u.address(0,0,0);
+    const ptrdiff_t ks = u.address(0,0,1) - u.address(0,0,0);
+    const int ni = imax;
+    const int nj = jmax;
+    const int iref = (imax-1)/2;                   /* Pressure rescaling point (see pressure_rescaling) */
+    const int jref = (jmax-1)/2;
+    const double lid = uinf;
+    double dtminloc = dtmin;
+    double pnew = zero;                             /* Reference pressure after the update */
+
+    /* uold is the previous iterate */
+    uold.swapData(u);
 
-    /* 0 is boundary, 1 means that the order cannot be reached, 2 results in 
-    the furthest point being accessed is the boundary points. */
+    const double *uo = uold.address(0,0,0);
+    double *un = u.address(0,0,0);
+    const double *ps = src.address(0,0,0);
+    double *pdt = dt.block();
 
-    /* max is out of bounds, max-1 is boundary, max-2 is first point in bounds 
-    max-3 should be used. */
+    /* Time step, artificial viscosity and update at the interior nodes (uold only) */
+    #pragma omp target teams distribute parallel for collapse(2) reduction(min:dtminloc) map(tofrom: dtminloc, pnew)
+    for(int i=1; i<ni-1; i++)
+    {
+        for(int j=1; j<nj-1; j++)
+        {
+            const int ic = (i<2) ? 2 : ((i>ni-3) ? ni-3 : i);  /* Artificial viscosity centers (see local_artificial_viscosity) */
+            const int jc = (j<2) ? 2 : ((j>nj-3) ? nj-3 : j);
+            const double *o = uo + i*is + j*JS;
+            double *on = un + i*is + j*JS;
+            double viscx, viscy, r0, r1, r2;
+
+            const double dtloc = time_step_node(o[ks], o[2*ks], c);
+            pdt[i*nj + j] = dtloc;
+            dtminloc = (dtloc < dtminloc) ? dtloc : dtminloc;
+
+            artificial_viscosity_node(uo + ic*is + j*JS, is, uo + i*is + jc*JS, JS, o[ks], o[2*ks], c, viscx, viscy);
+            residual_stencil<Array3Layout::jstep>(o, ps + i*is + j*JS, is, ks, viscx, viscy, c, r0, r1, r2);
+
+            const double uvel2 = o[ks]*o[ks] + o[2*ks]*o[2*ks];
+            const double beta2 = (uvel2 < c.beta2min) ? c.beta2min : uvel2;
+            on[0] = o[0] - beta2*dtloc*r0;
+            on[ks] = o[ks] - dtloc*c.rhoinv*r1;
+            on[2*ks] = o[2*ks] - dtloc*c.rhoinv*r2;
+            if(i==iref && j==jref) pnew = on[0];
+        }
+    }
+    dtmin = dtminloc;
 
-    /* d4pd_4 equation should be (p(i-2) - 4*p(i-1) + 6*p(i) - 4*(i+1) + p(i+2)) / d_^4 .*/
-    
-    /* visc = (-lambamax*C4*dx^3 / beta2) * (d4pdx4) */
-    /* Equal to visc = -muEffective * d4pdx4*/
+    /* Side walls (see bndry_row) */
+    #pragma omp target teams distribute parallel for
+    for(int j=1; j<nj-1; j++)
+    {
+        double *l = un + j*JS;
+        double *r = un + (ni-1)*is + j*JS;
+        l[0] = 2*l[is] - l[2*is];
+        l[ks] = 0;
+        l[2*ks] = 0;
+        r[0] = 2*r[-is] - r[-2*is];
+        r[ks] = 0;
+        r[2*ks] = 0;
+    }
 
-    for(i=2; i<imax-3; i++) /* Interior points w/o out of bounds issues */
+    /* Bottom and top walls, with the corners (which need the side walls) */
+    #pragma omp target teams distribute parallel for
+    for(int i=0; i<ni; i++)
     {
-        for(j=2; j<jmax-3;j++)
-        {
-            d4pdx4 = (u(i+2,j,0) - 4*u(i+1,j,0) + 6*u(i,j,0) - 4*u(i-1,j,0) + u(i-2,j,0))/(dx*dx*dx*dx);
-            d4pdy4 = (u(i,j+2,0) - 4*u(i,j+1,0) + 6*u(i,j,0) - 4*u(i,j-1,0) + u(i,j-2,0))/(dy*dy*dy*dy);
+        double *b = un + i*is;
+        double *t = un + i*is + (nj-1)*JS;
+        b[0] = 2*b[JS] - b[2*JS];
+        b[ks] = 0;
+        b[2*ks] = 0;
+        t[0] = 2*t[-JS] - t[-2*JS];
+        t[ks] = lid;
+        t[2*ks] = 0;
+    }
 
-            /* Need to compute d4pdx4*/
-            beta2 = max((uvel2),(rkappa*vel2ref)); /**/
-            lambda_x = (1/2)*(abs(u(i,j,1)) + sqrt(u(i,j,1)*u(i,j,1) + 4*beta2)); 
-            lambda_y = (1/2)*(abs(u(i,j,2)) + sqrt(u(i,j,2)*u(i,j,2) + 4*beta2));
+    /* Pressure rescaling, with the (u - uold)/dt residual sums on monitored iterations */
+    const double deltap = pnew - reference_pressure();
+    if(monitor)
+    {
+        double res0 = zero;
+        double res1 = zero;
+        double res2 = zero;
 
-            viscx(i,j) = (d4pdx4)*(-abs(lambda_x)*Cx*(dx*dx*dx))/beta2;
-            viscy(i,j) = (d4pdy4)*(-abs(lambda_y)*Cy*(dy*dy*dy))/beta2;
+        #pragma omp target teams distribute parallel for collapse(2) reduction(+:res0,res1,res2) map(tofrom: res0, res1, res2)
+        for(int i=0; i<ni; i++)
+        {
+            for(int j=0; j<nj; j++)
+            {
+                double *on = un + i*is + j*JS;
+                on[0] -= deltap;
+                if(i>0 && i<ni-1 && j>0 && j<nj-1)
+                {
+                    const double *o = uo + i*is + j*JS;
+                    const double dtloc = pdt[i*nj + j];
+                    const double diff0 = (on[0] - o[0])/dtloc;
+                    const double diff1 = (on[ks] - o[ks])/dtloc;
+                    const double diff2 = (on[2*ks] - o[2*ks])/dtloc;
+                    res0 += diff0*diff0;
+                    res1 += diff1*diff1;
+                    res2 += diff2*diff2;
+                }
+            }
+        }
+        res[0] = res0;
+        res[1] = res1;
+        res[2] = res2;
+    }
+    else
+    {
+        #pragma omp target teams distribute parallel for collapse(2)
+        for(int i=0; i<ni; i++)
+        {
+            for(int j=0; j<nj; j++)
+            {
+                un[i*is + j*JS] -= deltap;
+            }
         }
-        
     }
-    /* Other conditions needed: 4 corners, left wall & right wall, top & bottom */
+}
 
-    /* For the following all of the derivatives are adjusted to account for inner
-    points only, to avoid reaching out of bounds. */
+/********************************************************************************************************************/
+/*                                                                                                                  */
+/*                                  MPI Domain Decomposition (mpicxx -DUSE_MPI)                                     */
+/*                                                                                                                  */
+/********************************************************************************************************************/
 
-    /* Bottom left */
-    i=1;
-    j=1;
+/* With more than one rank (mpirun -np N), the grid is split into mpipx x mpipy blocks of  */
+/* nodes, one per rank. Each rank stores its block plus MPI_HALO ghost layers on the sides */
+/* it shares with other ranks, as ordinary local nodes: walls stay at local index 0 and    */
+/* imax-1, so the kernels, with imax, jmax set to the local size and dx, dy to the global  */
+/* spacing, run on a block unchanged. They also update the first ghost layer, which the    */
+/* halo exchange then overwrites. Wall boundary conditions are set only by the ranks that  */
+/* own the wall. Per iteration, one 2-value MIN reduction gives dtmin and the pressure     */
+/* rescaling shift (from the rank owning the reference node). The halo exchange runs       */
+/* while the residual sums and the next time step are computed on the owned nodes, and    */
+/* monitored iterations add a sum reduction of the residuals. Rank 0 gathers the field    */
+/* for output and reads the restart file. Point Jacobi only (isgs = 0, img = 0, ifused =  */
+/* 0, inewton = 0), cavity boundary conditions (imms = 0).                                 */
 
-    d4pdx4 = (u(i-1,j,0) - 4*u(i,j,0) + 6*u(i+1,j,0) - 4*u(i+2,j,0) + u(i+3,j,0))/dx;
-    d4pdy4 = (u(i,j-1,0) - 4*u(i,j,0) + 6*u(i,j+1,0) - 4*u(i,j+2,0) + u(i,j+3,0))/dy;
+#ifdef USE_MPI
 
-    viscx(1,1) = (d4pdx4)*(-abs(lambda_x)*Cx*(dx*dx*dx))/beta2;
-    viscy(1,1) = (d4pdy4)*(-abs(lambda_y)*Cy*(dy*dy*dy))/beta2;
+#define MPI_HALO 2                  /* Ghost layers: the artificial viscosity reaches i+-2 and j+-2 */
 
-    /* Top Left */
-    i=1;
-    j=jmax-2;
+struct MPIBlock
+{
+    MPI_Comm comm;                  /* Cartesian communicator of the blocks */
+    int rank, nranks;
+    int np[2];                      /* Ranks in i and j */
+    int coord[2];                   /* Block of this rank */
+    int nbr[2][2];                  /* Neighbour ranks [direction][low, high side] (MPI_PROC_NULL at walls) */
+    int lo[2], hi[2];               /* Owned global nodes lo .. hi-1 in i and j */
+    int off[2];                     /* Global index of local node 0 */
+    int n[2];                       /* Local size: owned nodes and ghost layers */
+    int imaxg, jmaxg;               /* Global grid */
+    vector<double> sendbuf[2][2];   /* Halo buffers [direction][side] */
+    vector<double> recvbuf[2][2];
+    MPI_Request req[8];
+    int nreq;
+    double thalo;                   /* Time spent waiting for halos (s) */
+};
 
-    d4pdx4 = (u(i-1,j,0) - 4*u(i,j,0) + 6*u(i+1,j,0) - 4*u(i+2,j,0) + u(i+3,j,0))/dx;
-    d4pdy4 = (u(i,j-3,0) - 4*u(i,j-2,0) + 6*u(i,j-1,0) - 4*u(i,j,0) + u(i,j+1,0))/dy;
+MPIBlock mpib;
 
-    viscx(1,jmax-2) = (d4pdx4)*(-abs(lambda_x)*Cx*(dx*dx*dx))/beta2;
-    viscy(1,jmax-2) = (d4pdy4)*(-abs(lambda_y)*Cy*(dy*dy*dy))/beta2;
+/**************************************************************************/
 
-    /* Bottom right */
-    i=imax-2;
-    j=1;
+void mpi_finish()
+{
+    /* Registered with atexit by mpi_start, so 'exit' (errors, divergence) also finalizes */
+    int done;
+    MPI_Finalized(&done);
+    if(!done) MPI_Finalize();
+}
 
-    d4pdx4 = (u(i-3,j,0) - 4*u(i-2,j,0) + 6*u(i-1,j,0) - 4*u(i,j,0) + u(i+1,j,0))/dx;
-    d4pdy4 = (u(i,j-1,0) - 4*u(i,j,0) + 6*u(i,j+1,0) - 4*u(i,j+2,0) + u(i,j+3,0))/dy;
+/**************************************************************************/
 
-    viscx(imax-2,1) = (d4pdx4)*(-abs(lambda_x)*Cx*(dx*dx*dx))/beta2;
-    viscy(imax-2,1) = (d4pdy4)*(-abs(lambda_y)*Cy*(dy*dy*dy))/beta2;
+int mpi_start( int *argc, char ***argv )
+{
+    /* 
+    To modify: mpib.rank, mpib.nranks
+    Starts MPI. Only rank 0 writes to the screen (the others' output goes to /dev/null).
+    Returns the number of ranks
+    */
+    MPI_Init(argc, argv);
+    atexit(mpi_finish);
+    MPI_Comm_rank(MPI_COMM_WORLD, &mpib.rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &mpib.nranks);
+    if(mpib.rank>0 && freopen("/dev/null", "w", stdout)==NULL)
+    {
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    return mpib.nranks;
+}
 
-    /* Top right */
+/**************************************************************************/
 
-    i=imax-2;
-    j=jmax-2;
+void mpi_block_range( int nglobal, int np, int p, int& lo, int& hi )
+{
+    /* Owned nodes lo .. hi-1 of block p of np along a grid line of nglobal nodes */
+    lo = (int)((long long)p*nglobal/np);
+    hi = (int)((long long)(p + 1)*nglobal/np);
+}
 
-    d4pdx4 = (u(i-3,j,0) - 4*u(i-2,j,0) + 6*u(i-1,j,0) - 4*u(i,j,0) + u(i+1,j,0))/dx;
-    d4pdy4 = (u(i,j-3,0) - 4*u(i,j-2,0) + 6*u(i,j-1,0) - 4*u(i,j,0) + u(i,j+1,0))/dy;
+/**************************************************************************/
 
-    viscx(imax-2,jmax-2) = (d4pdx4)*(-abs(lambda_x)*Cx*(dx*dx*dx))/beta2;
-    viscy(imax-2,jmax-2) = (d4pdy4)*(-abs(lambda_y)*Cy*(dy*dy*dy))/beta2;
+void mpi_setup()
+{
+    /* 
+    Uses global variable(s): imax, jmax (global grid, from set_derived_inputs), mpipx, mpipy
+    To modify: mpib
+    */
+    int dims[2] = {mpipx, mpipy};
+    int periods[2] = {0, 0};
 
-    for (j=2;j<jmax-1;j++)
+    if( (mpipx>0 && mpib.nranks%mpipx!=0) || (mpipy>0 && mpib.nranks%mpipy!=0) ||
+        (mpipx>0 && mpipy>0 && mpipx*mpipy!=mpib.nranks) || mpipx<0 || mpipy<0 )
     {
-        /* Left wall */
-        i = 2;
-        d4pdx4 = (u(i-1,j,0) - 4*u(i,j,0) + 6*u(i+1,j,0) - 4*u(i+2,j,0) + u(i+3,j,0))/dx;
-        d4pdy4 = (u(i,j-2,0) - 4*u(i,j-1,0) + 6*u(i,j,0) - 4*u(i,j+1,0) + u(i,j+2,0))/dy;
-        /* Right wall */
-        i = imax-2;
-        d4pdx4 = (u(i-3,j,0) - 4*u(i-2,j,0) + 6*u(i-1,j,0) - 4*u(i,j,0) + u(i+1,j,0))/dx;
-        d4pdy4 = (u(i,j-2,0) - 4*u(i,j-1,0) + 6*u(i,j,0) - 4*u(i,j+1,0) + u(i,j+2,0))/dy;
+        printf("ERROR: mpipx x mpipy = %d x %d does not match the %d MPI ranks!\n", mpipx, mpipy, mpib.nranks);
+        exit (EXIT_FAILED);
+    }
+    MPI_Dims_create(mpib.nranks, 2, dims);
+    MPI_Cart_create(MPI_COMM_WORLD, 2, dims, periods, 0, &mpib.comm);
+    MPI_Cart_coords(mpib.comm, mpib.rank, 2, mpib.coord);
 
-        viscx(i,j) = (d4pdx4)*(-abs(lambda_x)*Cx*(dx*dx*dx))/beta2;
-        viscy(i,j) = (d4pdy4)*(-abs(lambda_y)*Cy*(dy*dy*dy))/beta2;
-        /*  VISC HERE */
+    mpib.imaxg = imax;
+    mpib.jmaxg = jmax;
+    for(int d=0; d<2; d++)
+    {
+        int nglobal = (d==0) ? imax : jmax;
+        mpib.np[d] = dims[d];
+        MPI_Cart_shift(mpib.comm, d, 1, &mpib.nbr[d][0], &mpib.nbr[d][1]);
+        mpi_block_range(nglobal, dims[d], mpib.coord[d], mpib.lo[d], mpib.hi[d]);
+        if(nglobal/dims[d]<2*MPI_HALO)
+        {
+            printf("ERROR: %d ranks in the %s direction leave blocks of fewer than %d nodes!\n", dims[d], (d==0) ? "x" : "y", 2*MPI_HALO);
+            exit (EXIT_FAILED);
+        }
+        mpib.off[d] = mpib.lo[d] - ((mpib.coord[d]>0) ? MPI_HALO : 0);
+        mpib.n[d] = mpib.hi[d] + ((mpib.coord[d]<dims[d]-1) ? MPI_HALO : 0) - mpib.off[d];
     }
-    
-    /* Bottom and top wall */
-    for (i=2;i<imax-1;i++)
+    for(int d=0; d<2; d++)
     {
-        /* Bottom wall */
-        j = 2;
-        d4pdx4 = (u(i-2,j,0) - 4*u(i-1,j,0) + 6*u(i,j,0) - 4*u(i+1,j,0) + u(i+2,j,0))/dx;
-        d4pdy4 = (u(i,j-1,0) - 4*u(i,j,0) + 6*u(i,j+1,0) - 4*u(i,j+2,0) + u(i,j+3,0))/dy;
-        /* Top wall */
-        j = jmax-2;
-        d4pdx4 = (u(i-2,j,0) - 4*u(i-1,j,0) + 6*u(i,j,0) - 4*u(i+1,j,0) + u(i+2,j,0))/dx;
-        d4pdy4 = (u(i,j-3,0) - 4*u(i,j-2,0) + 6*u(i,j-1,0) - 4*u(i,j,0) + u(i,j+1,0))/dy;
-
-        viscx(i,j) = (d4pdx4)*(-abs(lambda_x)*Cx*(dx*dx*dx))/beta2;
-        viscy(i,j) = (d4pdy4)*(-abs(lambda_y)*Cy*(dy*dy*dy))/beta2;
-        /* VISC HERE */
+        for(int side=0; side<2; side++)
+        {
+            int other = (d==0) ? mpib.n[1] : mpib.n[0];     /* Whole local width, ghosts included */
+            mpib.sendbuf[d][side].resize((size_t)MPI_HALO*other*neq);
+            mpib.recvbuf[d][side].resize((size_t)MPI_HALO*other*neq);
+        }
     }
+    mpib.thalo = zero;
+    printf("MPI: %d ranks as %d x %d blocks of about %d x %d nodes\n", mpib.nranks, dims[0], dims[1],
+           imax/dims[0], jmax/dims[1]);
+}
+
+/**************************************************************************/
+
+void mpi_use_block_grid()
+{
+    /* Kernels work on this rank's block (local imax, jmax) with the global dx, dy */
+    set_grid(mpib.imaxg, mpib.jmaxg);
+    imax = mpib.n[0];
+    jmax = mpib.n[1];
+}
 
+void mpi_use_global_grid()
+{
+    /* For output, restart and the residual normalization on rank 0 */
+    set_grid(mpib.imaxg, mpib.jmaxg);
 }
 
 /**************************************************************************/
 
-void SGS_forward_sweep( Array3& u, Array2& viscx, Array2& viscy, Array2& dt, Array3& s )
+void mpi_block_bndry( Array3& u )
 {
     /* 
-    Uses global variable(s): two, three (not used), six (not used), half
-    Uses global variable(s): imax, jmax, ipgorder (not used), rho, rhoinv, dx, dy, rkappa,
-                        xmax (not used), xmin (not used), ymax (not used), ymin (not used), 
-                        rmu, vel2ref
-    Uses: artviscx, artviscy, dt, s
-    To Modify: u
+    Uses global variable(s): mpib, imax, jmax (block grid)
+    To modify: u (the wall nodes this rank owns, see 'bndry_row')
+    A local row or column 0 or imax-1 (jmax-1) is always a wall, since walls get no ghosts.
     */
-    int i;
-    int j;
-
-    
-    double dpdx;        //First derivative of pressure w.r.t. x
-    double dudx;        //First derivative of x velocity w.r.t. x
-    double dvdx;        //First derivative of y velocity w.r.t. x
-    double dpdy;        //First derivative of pressure w.r.t. y
-    double dudy;        //First derivative of x velocity w.r.t. y
-    double dvdy;        //First derivative of y velocity w.r.t. y
-    double d2udx2;      //Second derivative of x velocity w.r.t. x
-    double d2vdx2;      //Second derivative of y velocity w.r.t. x
-    double d2udy2;      //Second derivative of x velocity w.r.t. y
-    double d2vdy2;      //Second derivative of y velocity w.r.t. y
-    double uvel2;       //velocity squared at node
-    double beta2;       //Beta squared parameter for time derivative preconditioning
+    const int ilo = mpib.lo[0] - mpib.off[0];
+    const int ihi = mpib.hi[0] - mpib.off[0];
+    const int jlo = mpib.lo[1] - mpib.off[1];
+    const int jhi = mpib.hi[1] - mpib.off[1];
 
-    /* Symmetric Gauss-Siedel: Forward Sweep */
+    for(int i=ilo; i<ihi; i++)
+    {
+        bndry_row(u, i, jlo, jhi);
+    }
+}
 
-    /* !************************************************************** */
-    /* !************ADD CODING HERE FOR INTRO CFD STUDENTS************ */
-    /* !************************************************************** */
+/**************************************************************************/
 
-    /* 2dx because of central difference */
-    /* 2nd derivative as -u(i-1) + 2*u(i) - u(i+1) / du^2 */
+void mpi_halo_pack( Array3& u, int d, int side, bool send )
+{
+    /* 
+    Copies MPI_HALO layers next to side 'side' (0 = low, 1 = high) in direction d between u
+    and the halo buffers: the owned edge layers into sendbuf (send), or recvbuf into the ghosts
+    */
+    int first;      /* First local layer */
+    if(send) first = (side==0) ? mpib.lo[d] - mpib.off[d] : mpib.hi[d] - mpib.off[d] - MPI_HALO;
+    else     first = (side==0) ? mpib.lo[d] - mpib.off[d] - MPI_HALO : mpib.hi[d] - mpib.off[d];
+    const int other = (d==0) ? mpib.n[1] : mpib.n[0];
+    double *buf = send ? mpib.sendbuf[d][side].data() : mpib.recvbuf[d][side].data();
+
+    #pragma omp parallel for
+    for(int l=0; l<MPI_HALO; l++)
+    {
+        for(int m=0; m<other; m++)
+        {
+            const int i = (d==0) ? first + l : m;
+            const int j = (d==0) ? m : first + l;
+            double *b = buf + ((size_t)l*other + m)*neq;
+            for(int k=0; k<neq; k++)
+            {
+                if(send) b[k] = u(i,j,k);
+                else     u(i,j,k) = b[k];
+            }
+        }
+    }
+}
 
-    /* Add loops */
+/**************************************************************************/
 
-    for( i=1;i<imax-1;i++)
+void mpi_halo_start( Array3& u )
+{
+    /* 
+    To modify: mpib (requests)
+    Posts the exchange of the ghost layers of u with the (up to four) neighbours. Messages
+    span the whole local width, so the ghost corners hold recent, if not current, values
+    (no stencil reads them for an owned node).
+    */
+    mpib.nreq = 0;
+    for(int d=0; d<2; d++)
     {
-        for(j=1;j<jmax-1;j++)
+        for(int side=0; side<2; side++)
         {
-            dpdx = (u(i+1,j,0) - u(i-1,j,0)) / (2*dx);
-            dudx = (u(i+1,j,1) - u(i-1,j,1)) / (2*dx);
-            dvdx = (u(i+1,j,2) - u(i-1,j,2)) / (2*dx); 
-            dpdy = (u(i,j+1,0) - u(i,j-1,0)) / (2*dy); 
-            dudy = (u(i,j+1,1) - u(i,j-1,1)) / (2*dy);     
-            dvdy = (u(i,j+1,2) - u(i,j-1,2)) / (2*dy);    
-            d2udx2 = (u(i+1,j,1) - (2*u(i,j,1)) + u(i-1,j,1)) / (dx*dx);      
-            d2vdx2 = (u(i+1,j,2) - (2*u(i,j,2)) + u(i-1,j,2)) / (dx*dx);      
-            d2udy2 = (u(i,j+1,1) - (2*u(i,j,1)) + u(i,j-1,1)) / (dy*dy); 
-            d2vdy2 = (u(i,j+1,2) - (2*u(i,j,2)) + u(i,j-1,2)) / (dy*dy);      
-            uvel2 = (u(i,j,1)*u(i,j,1)) + (u(i,j,2)*u(i,j,2));
-            beta2 = max(uvel2,rkappa*vel2ref);
-
-            u(i,j,0) = u(i,j,0) - (beta2*dt(i,j)*((rho*dudx) + (rho*dvdy) - viscx(i,j) - viscy(i,j) - s(i,j,0)));
-            u(i,j,1) = u(i,j,1) - (dt(i,j)*rhoinv*((rho*u(i,j,1)*dudx) + (rho*u(i,j,2)*dudy) + dpdx-(rmu*d2udx2) - (rmu*d2udy2) - s(i,j,1)));
-            u(i,j,2) = u(i,j,2) - (dt(i,j)*rhoinv*((rho*u(i,j,1)*dvdx) + (rho*u(i,j,2)*dvdy) + dpdy - (rmu*d2vdx2) - (rmu*d2vdy2) - s(i,j,2)));                          
+            const int nbr = mpib.nbr[d][side];
+            if(nbr==MPI_PROC_NULL) continue;
+            const int count = (int)mpib.recvbuf[d][side].size();
+            MPI_Irecv(mpib.recvbuf[d][side].data(), count, MPI_DOUBLE, nbr, 2*d + (1 - side), mpib.comm, &mpib.req[mpib.nreq++]);
+            mpi_halo_pack(u, d, side, true);
+            MPI_Isend(mpib.sendbuf[d][side].data(), count, MPI_DOUBLE, nbr, 2*d + side, mpib.comm, &mpib.req[mpib.nreq++]);
         }
     }
+}
 
+/**************************************************************************/
 
+void mpi_halo_finish( Array3& u )
+{
+    /* 
+    To modify: u (ghost layers), mpib.thalo
+    */
+    double twait = wall_time();
+    MPI_Waitall(mpib.nreq, mpib.req, MPI_STATUSES_IGNORE);
+    mpib.thalo += wall_time() - twait;
+    for(int d=0; d<2; d++)
+    {
+        for(int side=0; side<2; side++)
+        {
+            if(mpib.nbr[d][side]!=MPI_PROC_NULL) mpi_halo_pack(u, d, side, false);
+        }
+    }
 }
 
 /**************************************************************************/
 
-void SGS_backward_sweep( Array3& u, Array2& viscx, Array2& viscy, Array2& dt, Array3& s )
+void mpi_block_time_step( Array3& u, Array2& dt, double& dtloc )
 {
     /* 
-    Uses global variable(s): two, three (not used), six (not used), half
-    Uses global variable(s): imax, jmax, ipgorder (not used), rho, rhoinv, dx, dy, rkappa,
-                        xmax (not used), xmin (not used), ymax (not used), ymin (not used), 
-                        rmu, vel2ref
-    Uses: artviscx, artviscy, dt, s
-    To Modify: u
+    Uses global variable(s): mpib (and those of 'local_time_step')
+    To modify: dt (owned interior nodes), dtloc (their smallest time step)
+    Needs only the node values, so it can run while the ghost layers are in flight.
     */
- 
-    int i;
-    int j;
-
-    double dpdx;        //First derivative of pressure w.r.t. x
-    double dudx;        //First derivative of x velocity w.r.t. x
-    double dvdx;        //First derivative of y velocity w.r.t. x
-    double dpdy;        //First derivative of pressure w.r.t. y
-    double dudy;        //First derivative of x velocity w.r.t. y
-    double dvdy;        //First derivative of y velocity w.r.t. y
-    double d2udx2;      //Second derivative of x velocity w.r.t. x
-    double d2vdx2;      //Second derivative of y velocity w.r.t. x
-    double d2udy2;      //Second derivative of x velocity w.r.t. y
-    double d2vdy2;      //Second derivative of y velocity w.r.t. y
-    double uvel2;       //Velocity squared at node
-    double beta2;       //Beta squared parameter for time derivative preconditioning
+    const int ilo = max(mpib.lo[0], 1) - mpib.off[0];
+    const int ihi = min(mpib.hi[0], mpib.imaxg-1) - mpib.off[0];
+    const int jlo = max(mpib.lo[1], 1) - mpib.off[1];
+    const int jhi = min(mpib.hi[1], mpib.jmaxg-1) - mpib.off[1];
+    double dtminloc = 1.0e99;
+
+    #pragma omp parallel for reduction(min:dtminloc)
+    for(int i=ilo; i<ihi; i++)
+    {
+        for(int j=jlo; j<jhi; j++)
+        {
+            dt(i,j) = local_time_step(u, i, j);
+            dtminloc = min(dtminloc, dt(i,j));
+        }
+    }
+    dtloc = dtminloc;
+}
 
-    /* Symmetric Gauss-Siedel: Backward Sweep  */
+/**************************************************************************/
 
+void mpi_block_residual_sums( Array3& u, Array3& uold, Array2& dt, double res[neq] )
+{
+    /* 
+    Uses global variable(s): mpib
+    To modify: res (sums of squares of (u - uold)/dt over the owned interior nodes)
+    */
+    const int ilo = max(mpib.lo[0], 1) - mpib.off[0];
+    const int ihi = min(mpib.hi[0], mpib.imaxg-1) - mpib.off[0];
+    const int jlo = max(mpib.lo[1], 1) - mpib.off[1];
+    const int jhi = min(mpib.hi[1], mpib.jmaxg-1) - mpib.off[1];
+    double res0 = zero;
+    double res1 = zero;
+    double res2 = zero;
+
+    #pragma omp parallel for reduction(+:res0,res1,res2)
+    for(int i=ilo; i<ihi; i++)
+    {
+        for(int j=jlo; j<jhi; j++)
+        {
+            double diff0 = (u(i,j,0)-uold(i,j,0))/dt(i,j);
+            double diff1 = (u(i,j,1)-uold(i,j,1))/dt(i,j);
+            double diff2 = (u(i,j,2)-uold(i,j,2))/dt(i,j);
+            res0 += diff0*diff0;
+            res1 += diff1*diff1;
+            res2 += diff2*diff2;
+        }
+    }
+    res[0] = res0;
+    res[1] = res1;
+    res[2] = res2;
+}
 
-    /* !************************************************************** */
-    /* !************ADD CODING HERE FOR INTRO CFD STUDENTS************ */
-    /* !************************************************************** */
+/**************************************************************************/
 
-    /* Same as above but reversed loops?? */
+void mpi_transfer_field( Array3& u, Array3& uglob, bool gather )
+{
+    /* 
+    Uses global variable(s): mpib
+    To modify: uglob on rank 0 (gather), or the owned nodes of u (scatter from rank 0)
+    */
+    const int ni = mpib.hi[0] - mpib.lo[0];
+    const int nj = mpib.hi[1] - mpib.lo[1];
+    vector<double> mine((size_t)ni*nj*neq);
+    vector<double> all;
+    vector<int> counts, displs;
 
-    for(i=imax-2; i>0;i--)
+    if(mpib.rank==0)
     {
-        for(j=jmax-2;j>0;j--)
+        counts.resize(mpib.nranks);
+        displs.resize(mpib.nranks);
+        all.resize((size_t)mpib.imaxg*mpib.jmaxg*neq);
+        int pos = 0;
+        for(int r=0; r<mpib.nranks; r++)
         {
-            dpdx = (u(i+1,j,0) - u(i-1,j,0)) / (2*dx);
-            dudx = (u(i+1,j,1) - u(i-1,j,1)) / (2*dx);
-            dvdx = (u(i+1,j,2) - u(i-1,j,2)) / (2*dx); 
-            dpdy = (u(i,j+1,0) - u(i,j-1,0)) / (2*dy); 
-            dudy = (u(i,j+1,1) - u(i,j-1,1)) / (2*dy);     
-            dvdy = (u(i,j+1,2) - u(i,j-1,2)) / (2*dy);    
-            d2udx2 = (u(i+1,j,1) - (2*u(i,j,1)) + u(i-1,j,1)) / (dx*dx);      
-            d2vdx2 = (u(i+1,j,2) - (2*u(i,j,2)) + u(i-1,j,2)) / (dx*dx);      
-            d2udy2 = (u(i,j+1,1) - (2*u(i,j,1)) + u(i,j-1,1)) / (dy*dy); 
-            d2vdy2 = (u(i,j+1,2) - (2*u(i,j,2)) + u(i,j-1,2)) / (dy*dy);      
-            uvel2 = (u(i,j,1)*u(i,j,1)) + (u(i,j,2)*u(i,j,2));
-            beta2 = max(uvel2,rkappa*vel2ref);
+            int c[2], lo[2], hi[2];
+            MPI_Cart_coords(mpib.comm, r, 2, c);
+            for(int d=0; d<2; d++)
+            {
+                mpi_block_range((d==0) ? mpib.imaxg : mpib.jmaxg, mpib.np[d], c[d], lo[d], hi[d]);
+            }
+            counts[r] = (hi[0] - lo[0])*(hi[1] - lo[1])*neq;
+            displs[r] = pos;
+            if(!gather)
+            {
+                /* Block r of the global field, in the order its rank unpacks */
+                double *b = all.data() + pos;
+                for(int i=lo[0]; i<hi[0]; i++)
+                    for(int j=lo[1]; j<hi[1]; j++)
+                        for(int k=0; k<neq; k++)
+                            *(b++) = uglob(i,j,k);
+            }
+            pos += counts[r];
+        }
+    }
+
+    if(gather)
+    {
+        double *b = mine.data();
+        for(int i=mpib.lo[0]; i<mpib.hi[0]; i++)
+            for(int j=mpib.lo[1]; j<mpib.hi[1]; j++)
+                for(int k=0; k<neq; k++)
+                    *(b++) = u(i-mpib.off[0], j-mpib.off[1], k);
+        MPI_Gatherv(mine.data(), (int)mine.size(), MPI_DOUBLE, all.data(), counts.data(), displs.data(), MPI_DOUBLE, 0, mpib.comm);
+    }
+    else
+    {
+        MPI_Scatterv(all.data(), counts.data(), displs.data(), MPI_DOUBLE, mine.data(), (int)mine.size(), MPI_DOUBLE, 0, mpib.comm);
+        const double *b = mine.data();
+        for(int i=mpib.lo[0]; i<mpib.hi[0]; i++)
+            for(int j=mpib.lo[1]; j<mpib.hi[1]; j++)
+                for(int k=0; k<neq; k++)
+                    u(i-mpib.off[0], j-mpib.off[1], k) = *(b++);
+    }
 
-            u(i,j,0) = u(i,j,0) - (beta2*dt(i,j)*((rho*dudx) + (rho*dvdy) - viscx(i,j) - viscy(i,j)-s(i,j,0)));
-            u(i,j,1) = u(i,j,1) - (dt(i,j)*rhoinv*((rho*u(i,j,1)*dudx) + rho*u(i,j,2)*dudy + dpdx - rmu*d2udx2 - rmu*d2udy2 - s(i,j,1)));
-            u(i,j,2) = u(i,j,2) - (dt(i,j)*rhoinv*((rho*u(i,j,1)*dvdx) + rho*u(i,j,2)*dvdy + dpdy - rmu*d2vdx2 - rmu*d2vdy2 - s(i,j,2)));                          
+    if(gather && mpib.rank==0)
+    {
+        int pos = 0;
+        for(int r=0; r<mpib.nranks; r++)
+        {
+            int c[2], lo[2], hi[2];
+            MPI_Cart_coords(mpib.comm, r, 2, c);
+            for(int d=0; d<2; d++)
+            {
+                mpi_block_range((d==0) ? mpib.imaxg : mpib.jmaxg, mpib.np[d], c[d], lo[d], hi[d]);
+            }
+            const double *b = all.data() + pos;
+            for(int i=lo[0]; i<hi[0]; i++)
+                for(int j=lo[1]; j<hi[1]; j++)
+                    for(int k=0; k<neq; k++)
+                        uglob(i,j,k) = *(b++);
+            pos += counts[r];
         }
     }
+}
 
+/**************************************************************************/
+
+void mpi_write_output( int n, Array3& u, Array3& uglob, double resinit[neq], double rtime, double dtmin )
+{
+    /* 
+    Gathers u on rank 0, which writes the solution and restart files (synchronously)
+    */
+    mpi_transfer_field(u, uglob, true);
+    if(mpib.rank==0)
+    {
+        mpi_use_global_grid();
+        write_output_now(current_output_grid(), n, uglob, resinit, rtime, dtmin);
+        if(fp2!=NULL) fflush(fp2);
+        mpi_use_block_grid();
+    }
 }
 
 /**************************************************************************/
 
-void point_Jacobi( Array3& u, Array3& uold, Array2& viscx, Array2& viscy, Array2& dt, Array3& s )
+int run_mpi_solver()
 {
     /* 
-    Uses global variable(s): two, three (not used), six (not used), half
-    Uses global variable(s): imax, jmax, ipgorder (not used), rho, rhoinv, dx, dy, rkappa,
-                        xmax (not used), xmin (not used), ymax (not used), ymin (not used), 
-                        rmu, vel2ref
-    Uses: uold, artviscx, artviscy, dt, s
-    To Modify: u
+    Uses global variable(s): params (all the inputs), mpib
+    Point Jacobi on the decomposed grid; same iterations, history and output files as
+    'run_solver' (residual sums differ only by rounding).
+    Returns the exit status (0; divergence and errors exit directly, with EXIT_DIVERGED or EXIT_FAILED).
     */
- 
-    double dpdx;        //First derivative of pressure w.r.t. x
-    double dudx;        //First derivative of x velocity w.r.t. x
-    double dvdx;        //First derivative of y velocity w.r.t. x
-    double dpdy;        //First derivative of pressure w.r.t. y
-    double dudy;        //First derivative of x velocity w.r.t. y
-    double dvdy;        //First derivative of y velocity w.r.t. y
-    double d2udx2;      //Second derivative of x velocity w.r.t. x
-    double d2vdx2;      //Second derivative of y velocity w.r.t. x
-    double d2udy2;      //Second derivative of x velocity w.r.t. y
-    double d2vdy2;      //Second derivative of y velocity w.r.t. y
-    double uvel2;       //Velocity squared at node
-    double beta2;       //Beta squared parameter for time derivative preconditioning
+    if( isgs!=0 || img!=0 || ifused!=0 || inewton!=0 || iresmon!=0 || imms!=0 || ibench!=0 || igpu!=0 || imixed!=0 || igridseq!=0 || ilazyp!=0 ||
+        istretch!=0 || irsmooth!=0 || iaa!=0 || ilive!=0 || idual!=0 )
+    {
+        printf("ERROR: MPI runs need point Jacobi (isgs = 0, img = 0, ifused = 0, inewton = 0, iresmon = 0), imms = 0, igpu = 0, imixed = 0, igridseq = 0, ilazyp = 0,\n"
+               "       istretch = 0, irsmooth = 0, iaa = 0, ilive = 0, idual = 0 and no --bench!\n");
+        exit (EXIT_FAILED);
+    }
 
-    int i;
-    int j;
-    /* Point Jacobi method */
+#ifdef _OPENMP
+    if(nthreads>0)
+    {
+        omp_set_num_threads(nthreads);
+    }
+    printf("OpenMP threads per rank: %d\n", omp_get_max_threads());
+#endif
 
+    set_derived_inputs();
+    mpi_setup();
+    mpi_use_global_grid();
+    const double pref = reference_pressure();
+    const int iref = (mpib.imaxg-1)/2 - mpib.off[0];        /* Pressure rescaling point, local index */
+    const int jref = (mpib.jmaxg-1)/2 - mpib.off[1];
+    const bool ownref = ((mpib.imaxg-1)/2>=mpib.lo[0] && (mpib.imaxg-1)/2<mpib.hi[0] &&
+                         (mpib.jmaxg-1)/2>=mpib.lo[1] && (mpib.jmaxg-1)/2<mpib.hi[1]);
+    mpi_use_block_grid();
+
+    const int nglob = (mpib.rank==0) ? 1 : 0;
+    workspace.reserve( 3*Array3::bytes(imax, jmax, neq) + 3*Array2::bytes(imax, jmax) +
+                       Array3::bytes(nglob*mpib.imaxg, nglob*mpib.jmaxg, neq) +
+                       restart_buffer_bytes(nglob*mpib.imaxg, nglob*mpib.jmaxg) );
+    WorkspaceScope scope;
+    Array3 u     (imax, jmax, neq, workspace);      /* This rank's block, ghost layers included */
+    Array3 uold  (imax, jmax, neq, workspace);
+    Array3 src   (imax, jmax, neq, workspace);      /* Zero (no MMS) */
+    Array2 viscx (imax, jmax, workspace);
+    Array2 viscy (imax, jmax, workspace);
+    Array2 dt    (imax, jmax, workspace);           /* Zero on the ghosts, so their (discarded) updates stay bounded */
+    Array3 uglob (nglob*mpib.imaxg, nglob*mpib.jmaxg, neq, workspace);     /* Whole field for output (rank 0) */
+    restart_buffer_setup( nglob*mpib.imaxg, nglob*mpib.jmaxg );            /* Restart writes of uglob (rank 0) */
+
+    double conv = 1.0e99;
+    double convmin = 1.0e99;
+    bool monitor;
+    bool converged = false;
+    int n = 0;
+    int ninit = 0;
+    double res[neq];
+    double resinit[neq];
+    double rtime;
+    double dtmin = 1.0e99;
+    double dtloc;                   /* Smallest time step of the owned nodes */
+    double red[2];                  /* MIN reduction: dtloc and the pressure shift (1e99 unless the reference node is ours) */
+    double t0 = wall_time();
+
+    pointJacobiVector = select_point_Jacobi( true, false );
+    pointJacobiVectorNoSource = select_point_Jacobi( false, false );
+
+    /* Initial profile, or the restart file read by rank 0 */
+    if(irstr==0)
+    {
+        initial(ninit, rtime, dtmin, resinit, u, src);
+    }
+    else
+    {
+        if(mpib.rank==0)
+        {
+            mpi_use_global_grid();
+            initial(ninit, rtime, dtmin, resinit, uglob, uglob);
+            mpi_use_block_grid();
+        }
+        MPI_Bcast(&ninit, 1, MPI_INT, 0, mpib.comm);
+        MPI_Bcast(&rtime, 1, MPI_DOUBLE, 0, mpib.comm);
+        MPI_Bcast(resinit, neq, MPI_DOUBLE, 0, mpib.comm);
+        mpi_transfer_field(u, uglob, false);
+    }
+    mpi_block_bndry(u);
+    mpi_halo_start(u);
+    mpi_halo_finish(u);
 
-    /* !************************************************************** */
-    /* !************ADD CODING HERE FOR INTRO CFD STUDENTS************ */
-    /* !************************************************************** */
+    if(mpib.rank==0)
+    {
+        output_file_headers();
+    }
+    mpi_write_output(ninit, u, uglob, resinit, rtime, dtmin);
+    mpi_block_time_step(u, dt, dtloc);
 
-    /* SHOULD BE DONE */
+    /*========== Main Loop ==========*/
+    for (n = ninit; n<= nmax; n++)
+    {
+        monitor = ((n%nmonitor)==0) || ((n%residualOut)==0) || (n==ninit) || (n==nmax);
+
+        /* Point Jacobi iteration on the block (as PJ_iteration), then the walls we own */
+        uold.swapData(u);
+        Compute_Artificial_Viscosity<0,0>(uold, viscx, viscy);
+        if(!point_Jacobi_vector_update<CavityPolicy>(u, uold, viscx, viscy, dt, src))     /* imms = 0: src = 0 */
+            point_Jacobi<0,0,double,CavityPolicy>(u, uold, viscx, viscy, dt, src);
+        mpi_block_bndry(u);
+
+        /* dtmin and the pressure rescaling shift in one reduction */
+        red[0] = dtloc;
+        red[1] = ownref ? u(iref,jref,0) - pref : 1.0e99;
+        MPI_Allreduce(MPI_IN_PLACE, red, 2, MPI_DOUBLE, MPI_MIN, mpib.comm);
+        dtmin = min(dtmin, red[0]);
+        #pragma omp parallel for
+        for(int i=0; i<imax; i++)
+        {
+            for(int j=0; j<jmax; j++)
+            {
+                u(i,j,0) -= red[1];
+            }
+        }
+        rtime += dtmin;
 
-    /* dpdx is definition */
-    /* 2nd deriv equation : */
-    /* note that uvel2 is at node and is the old value */
+        /* Ghost layers in flight while the owned nodes get their residuals and next time step */
+        mpi_halo_start(u);
+        if(monitor)
+        {
+            mpi_block_residual_sums(u, uold, dt, res);
+        }
+        mpi_block_time_step(u, dt, dtloc);
+        mpi_halo_finish(u);
 
-    for (i=1;i<imax-1;i++)
+        if(monitor)
+        {
+            /* Rank 0 normalizes and writes, everyone checks the same numbers */
+            MPI_Reduce((mpib.rank==0) ? MPI_IN_PLACE : res, res, neq, MPI_DOUBLE, MPI_SUM, 0, mpib.comm);
+            if(mpib.rank==0)
+            {
+                mpi_use_global_grid();
+                report_iterative_convergence(n, res, resinit, ninit, rtime, dtmin, conv);
+                mpi_use_block_grid();
+            }
+            MPI_Bcast(res, neq, MPI_DOUBLE, 0, mpib.comm);
+            MPI_Bcast(&conv, 1, MPI_DOUBLE, 0, mpib.comm);
+            check_divergence(n, res, ninit, rtime, conv, convmin);
+
+            if(conv<toler)
+            {
+                if(mpib.rank==0) fprintf(fp1, "%d %e %e %e %e\n",n, rtime, res[0], res[1], res[2]);
+                converged = true;
+                break;
+            }
+        }
+
+        if( ((n%iterout)==0) )
+        {
+            mpi_write_output(n, u, uglob, resinit, rtime, dtmin);
+        }
+    }  /* ========== End Main Loop ========== */
+
+    if(converged)
+    {
+        printf("\nSolver stopped in %d iterations because the convergence criteria was met.\n", n);
+    }
+    else
+    {
+        printf("\nSolver stopped in %d iterations because the specified maximum number of timesteps was exceeded.\n", nmax);
+        n = nmax;
+    }
+    printf("MPI: %.3f s, %.3f s of it waiting for halos (rank 0)\n", wall_time() - t0, mpib.thalo);
+
+    mpi_write_output(n, u, uglob, resinit, rtime, dtmin);
+    if(mpib.rank==0)
     {
-        for (j=1;j<jmax-1;j++)
-        {
-            dpdx = (uold(i+1,j,0) - uold(i-1,j,0)) / (2*dx);
-            dudx = (uold(i+1,j,1) - uold(i-1,j,1)) / (2*dx);
-            dvdx = (uold(i+1,j,2) - uold(i-1,j,2)) / (2*dx);
-            dpdy = (uold(i,j+1,0) - uold(i,j-1,0)) / (2*dy);
-            dudy = (uold(i,j+1,1) - uold(i,j-1,1)) / (2*dy);
-            dvdy = (uold(i,j+1,2) - uold(i,j-1,2)) / (2*dy);
-            d2udx2 = (uold(i+1,j,1)  - 2*uold(i,j,1) + uold(i-1,j,1)) / (dx*dx);
-            d2vdx2 = (uold(i+1,j,2)  - 2*uold(i,j,2) + uold(i-1,j,2)) / (dx*dx);
-            d2udy2 = (uold(i,j+1,1)  - 2*uold(i,j,1) + uold(i,j-1,1)) / (dy*dy);
-            d2vdy2 = (uold(i,j+1,2)  - 2*uold(i,j,2) + uold(i,j-1,2)) / (dy*dy);
-            uvel2 = uold(i,j,1)*uold(i,j,1) + uold(i,j,2)*uold(i,j,2);
-            beta2 = max(uvel2,rkappa*vel2ref);
-
-            u(i,j,0) = uold(i,j,0) - beta2*dt(i,j)*((rho*dudx) + (rho*dvdy) - viscx(i,j) - viscy(i,j) - s(i,j,0));
-            u(i,j,1) = uold(i,j,1) - dt(i,j)*rhoinv*((rho*uold(i,j,1)*dudx) + (rho*uold(i,j,2)*dudy) + dpdx - rmu*d2udx2 - rmu*d2udy2 - s(i,j,1));
-            u(i,j,2) = uold(i,j,2) - dt(i,j)*rhoinv*((rho*uold(i,j,1)*dvdx) + (rho*uold(i,j,2)*dvdy) + dpdy - rmu*d2vdx2 - rmu*d2vdy2 - s(i,j,2));
-        }
-        
+        fclose(fp1);
+        if(fp2!=NULL) fclose(fp2);
     }
-    
+    return 0;
 }
 
-/**************************************************************************/
+#endif
 
-void pressure_rescaling( Array3& u )
+/********************************************************************************************************************/
+/*                                                                                                                  */
+/*                                                Main Function                                                     */
+/*                                                                                                                  */
+/********************************************************************************************************************/
+size_t case_workspace_bytes()
 {
     /* 
-    Uses global variable(s): imax, jmax, imms, xmax, xmin, ymax, ymin, rlength, pinf
-    To Modify: u
+    Uses global variable(s): imax, jmax, neq, ifused, iresmon, ktile, inewton, iasync, outqueue, img, mglevels,
+                             mgnmin, igridseq, seqnmin, imixed, iaa, ilive, idual
+    Returns: the workspace bytes run_solver needs for the case: the main fields and those of
+    the selected modes (multigrid coarse levels are counted down to 5 points, so at most a
+    little more than 'mg_setup' carves)
     */
-
-    int iref;                     /* i index location of pressure rescaling point */
-    int jref;                     /* j index location of pressure rescaling point */
-
-    double x;               /* Temporary variable for x location */
-    double y;               /* Temporary variable for y location */  
-    double deltap;          /* delta_pressure for rescaling all values */
-
-    iref = (imax-1)/2;     /* Set reference pressure to center of cavity */
-    jref = (jmax-1)/2;
-    if(imms==1)
+    const size_t f3 = Array3::bytes(imax, jmax, neq);
+    const size_t f2 = Array2::bytes(imax, jmax);
+    size_t bytes = 3*f3 + 3*f2;                 /* u, uold, src, viscx, viscy, dt */
+    size_t seq = 0;
+
+    bytes += Array3::bytes(0, 0, neq);          /* Unused work arrays are 0 x 0 */
+    if(ifused==2) bytes += 2*f3; else bytes += 2*Array3::bytes(0, 0, neq);
+    if(iresmon==1 || inewton==1) bytes += f3;
+    if(inewton==1) bytes += 5*f3;
+    if(iaa==1) bytes += aa_workspace_bytes();
+    if(ilive==1) bytes += live_stage_bytes();
+    bytes += restart_buffer_bytes(imax, jmax);
+    if(ktile>1) bytes += tile_buffer_bytes(jmax);
+    if(idual==1) bytes += 3*f3;                 /* Time levels u^n, u^n-1 and the physical source */
+#ifdef ASYNC_OUTPUT
+    if(iasync==1) bytes += (size_t)max(outqueue, 0)*f3;
+#endif
+    if(img==1)
     {
-        x = (xmax - xmin)*(double)(iref)/(double)(imax - 1);
-        y = (ymax - ymin)*(double)(jref)/(double)(jmax - 1);
-        deltap = u(iref,jref,0) - umms(x,y,0); /* Constant in MMS */
+        bytes += 2*f3;
+        for(int ni=imax, nj=jmax; (ni-1)%2==0 && (nj-1)%2==0 && ni>=9 && nj>=9; )
+        {
+            ni = (ni - 1)/2 + 1;
+            nj = (nj - 1)/2 + 1;
+            bytes += 6*Array3::bytes(ni, nj, neq) + 3*Array2::bytes(ni, nj);
+        }
     }
-    else
+    if(igridseq==1)
     {
-        deltap = u(iref,jref,0) - pinf; /* Reference pressure */
+        /* Largest coarse level and the warm start from the one below it */
+        const int ni = (imax - 1)/2 + 1;
+        const int nj = (jmax - 1)/2 + 1;
+        seq = 3*Array3::bytes(ni, nj, neq) + 3*Array2::bytes(ni, nj) + Array3::bytes((ni - 1)/2 + 1, (nj - 1)/2 + 1, neq);
     }
-
-    for(int i=0; i<imax; i++)
+    bytes += max(seq, Array3::bytes(imax, jmax, neq));      /* Grid sequencing, or a warm start on this grid */
+    if(imixed==1)
     {
-        for(int j=0; j<jmax; j++)
-        {
-            u(i,j,0) -= deltap;
-        }
-    }      
-}  
+        bytes += 3*Array3f::bytes(imax, jmax, neq) + 3*Array2f::bytes(imax, jmax);
+    }
+    return bytes;
+}
 
 /**************************************************************************/
 
-void check_iterative_convergence(int n, Array3& u, Array3& uold, Array2& dt, double res[neq], double resinit[neq], int ninit, double rtime, double dtmin, double& conv)
+int main(int argc, char *argv[])
 {
-  /* 
-  Uses global variable(s): zero
-  Uses global variable(s): imax, jmax, neq, fsmall (not used)
-  Uses: n, u, uold, dt, res, resinit, ninit, rtime, dtmin
-  To modify: conv
-  */
-
-  int i;                       /* i index (x direction) */
-  int j;                       /* j index (y direction) */
-  int k;                       /* k index (# of equations) */
-
-  /* Compute iterative residuals to monitor iterative convergence */
-
-    res[0] = zero;              //Reset to zero (as they are sums)
-    res[1] = zero;
-    res[2] = zero;
-
-    /* !************************************************************** */
-    /* !************ADD CODING HERE FOR INTRO CFD STUDENTS************ */
-    /* !************************************************************** */
-
-    /* Monitor with following eqution*/
-    /* rho*(u(i,j,k)-uold(i,j,k)) / dt */
-    /* Residual = max(Residual, _________ ) */
-    /* "Monitor iterative residuals by plugging into rho* (u(n+1)-n(n)) / dt "*/
-
-
-    /* res: current residual */
-    /* resinit: previous residual*/
-    /* ninit: counter */
-    /* rtime: */
-    /* What to use dtmin for? */
+    int nranks = 1;     /* MPI ranks (MPI builds) */
+#ifdef USE_MPI
+    nranks = mpi_start(&argc, &argv);
+#endif
 
-    for (int k=0; k<neq; k++)
-        res[k] = 0.0;
+    /* Read user inputs (defaults, then input file, then command line) */
+    read_inputs( argc, argv );
 
-    // Only use interior points to avoid potential issues at boundaries
-    for (int i=1; i<imax-1; i++)
+    /* Grid convergence verification: the MMS case on a family of grids */
+    if(iverify==1)
     {
-        for (int j=1; j<jmax-1; j++)
+        if(nranks>1 || sweepfile!=NULL)
         {
-            for (int k=0; k<neq; k++)
-            {
-                double diff = (u(i,j,k)-uold(i,j,k))/dt(i,j);
-                res[k] += diff*diff;
-            }
+            printf("ERROR: --verify runs on a single MPI rank, without --sweep!\n");
+            exit (EXIT_FAILED);
         }
+        return run_verification();
     }
 
-    for(int k=0; k<neq; k++)
+    /* Parameter sweep: run the cases of the case file, each with these inputs as the defaults */
+    if(sweepfile!=NULL)
     {
-        res[k] = sqrt(res[k]/((imax-2)*(jmax-2))); // Normalize by interior count
-        res[k] = res[k]/resinit[k];
+        if(nranks>1)
+        {
+            printf("ERROR: --sweep runs on a single MPI rank!\n");
+            exit (EXIT_FAILED);
+        }
+        return run_sweep();
     }
 
-    //comment for commiting purposes
-
-    double first = max(res[0],res[1]);
-    conv = max(first,res[2]);
-    
-
-
-
-    /* Write iterative residuals every "residualOut" iterations */
-    if( ((n%residualOut)==0)||(n==ninit) )
+#ifdef USE_MPI
+    /* Domain decomposition over the ranks */
+    if(nranks>1)
     {
-        fprintf(fp1, "%d %e %e %e %e\n",n, rtime, res[0], res[1], res[2] );
-        printf("%d   %e   %e   %e   %e   %e\n",n, rtime, dtmin, res[0], res[1], res[2] );    
-
-        /* Write header for iterative residuals every 20 residual printouts */
-        if( ((n%(residualOut*20))==0)||(n==ninit) )
-        {
-            printf("Iter. Time (s)   dt (s)      Continuity    x-Momentum    y-Momentum\n"); 
-        }    
+        return run_mpi_solver();
     }
-     
+#endif
+
+    return run_solver();
 }
 
 /**************************************************************************/
 
-void Discretization_Error_Norms( Array3& u ) 
+int run_solver()
 {
     /* 
-    Uses global variable(s): zero
-    Uses global variable(s): imax, jmax, neq, imms, xmax, xmin, ymax, ymin, rlength (not used)
-    Uses: u
-    To modify: rL1norm, rL2norm, rLinfnorm 
+    Uses global variable(s): params (all the inputs)
+    Runs the benchmark or solves the case given by params (in the current directory).
+    Returns the exit status (0; divergence and errors exit directly, with EXIT_DIVERGED or EXIT_FAILED).
     */
 
-    double x;                   //Temporary variable for x location
-    double y;                   //Temporary variable for y location
-    double DE;                      //Discretization error (absolute value)
-
-    double rL1norm[neq];
-    double rL2norm[neq]; 
-    double rLinfnorm[neq];
-
-    /* Only compute discretization error norms for manufactured solution */
-    if(imms==1)
+#ifdef INSTRUMENT
+    /* Instrumentation: before the first parallel region, so the counters include the OpenMP threads */
+    metrics_start();
+#endif
+#ifdef _OPENMP
+    if(nthreads>0)
     {
-
-    /* !************************************************************** */
-    /* !************ADD CODING HERE FOR INTRO CFD STUDENTS************ */
-    /* !************************************************************** */
-
-    
-
-
+        omp_set_num_threads(nthreads);
     }
-}
-
-/********************************************************************************************************************/
-/*                                                                                                                  */
-/*                                                End Functions                                                     */
-/*                                                                                                                  */
-/********************************************************************************************************************/
-
-
-
+    printf("OpenMP threads: %d\n", omp_get_max_threads());
+#endif
+    printf("Array3 layout: %s, %d ghost layer(s)\n", Array3Layout::name(), ARRAY3_GHOST);
 
+    /* Set derived input quantities (including the grid size) */
+    set_derived_inputs();
 
+    /* Benchmark mode: time the kernels on a set of grids instead of solving */
+    if(ibench==1)
+    {
+        pointJacobiVector = select_point_Jacobi( true, false );
+        run_benchmark();
+        return 0;
+    }
 
+    //All the fields of the case come from one workspace block, reserved here
+    workspace.reserve( case_workspace_bytes() );
+    WorkspaceScope scope;
 
-/********************************************************************************************************************/
-/*                                                                                                                  */
-/*                                                Main Function                                                     */
-/*                                                                                                                  */
-/********************************************************************************************************************/
-int main()
-{
     //Data class declarations: hold all the data needed across the entire grid
-    Array3 u     (imax, jmax, neq);     //u and uold store the current and previous primitive variable solution on the entire grid
-    Array3 uold  (imax, jmax, neq);
+    Array3 u     (imax, jmax, neq, workspace);     //u and uold store the current and previous primitive variable solution on the entire grid
+    Array3 uold  (imax, jmax, neq, workspace);
 
-    Array3 src   (imax, jmax, neq);     //src stores the source terms over the entire grid (used for MMS)
+    Array3 src   (imax, jmax, neq, workspace);     //src stores the source terms over the entire grid (used for MMS)
 
-    Array2 viscx (imax, jmax);          //Artificial viscosity, x and y directions
-    Array2 viscy (imax, jmax);
+    Array2 viscx (imax, jmax, workspace);          //Artificial viscosity, x and y directions
+    Array2 viscy (imax, jmax, workspace);
 
-    Array2 dt    (imax, jmax);          //Local timestep array
+    Array2 dt    (imax, jmax, workspace);          //Local timestep array
 
+    const int nchk = (ifused==2) ? 1 : 0;   //Copies for checking the fused kernel (ifused = 2 only)
+    const int nres = (iresmon==1 || inewton==1) ? 1 : 0;    //Steady residual work array (true residual monitor only)
+    Array3 rsteady   (nres*imax, nres*jmax, neq, workspace);
+    Array3 ucheck    (nchk*imax, nchk*jmax, neq, workspace);
+    Array3 ucheckold (nchk*imax, nchk*jmax, neq, workspace);
 
 
     /* Minimum of iterative residual norms from three equations */
-    double conv;
+    double conv = 1.0e99;
+    double convmin = 1.0e99;        /* Smallest conv so far (divergence check) */
+    bool monitor;                   /* Residuals and checks at this iteration (every nmonitor iterations) */
     double resTest;
     int n = 0;  //Iteration number
+    int nstart;                     /* First iteration of the main loop (after the float ones when imixed = 1) */
 
                                                       
     /*--------- Solution variables declaration ----------------------*/
       
      int ninit = 0;                 /* Initial iteration number (used for restart file) */
 
-     double res[neq];               /* Iterative residual for each equation */
+     double res[neq] = {zero, zero, zero};  /* Iterative residual for each equation */
      double resinit[neq];           /* Initial iterative residual for each equation (from iteration 1) */
      double rtime;                  /* Variable to estimate simulation time */
      double dtmin = 1.0e99;         /* Minimum time step for a given iteration (initialized large) */
 
+     double rescheck[neq];          /* Fused kernel check (ifused = 2): residual sums of the fused step */
+     double dtcheck;                /* Fused kernel check: minimum time step of the fused step */
+     double diffcheck[3] = {zero, zero, zero};  /* Max differences: interior u, boundary u, residual */
+
+     double rL1norm[neq];           /* Discretization error norms (MMS) */
+     double rL2norm[neq];
+     double rLinfnorm[neq];
+
+     double dtlev[MAXKTILE];        /* Temporal tiling (ktile > 1): dtmin of each iteration of a pass */
+     int nlev;                      /* Temporal tiling: iterations in the current pass */
+
      double x;                      /* Temporary variable for x location */
      double y;                      /* Temporary variable for y location */
 
@@ -1470,34 +9446,46 @@ int main()
     /*-------Set Function Pointers-----------------------------------*/
     
     iterationStepPointer     iterationStep;
+    timeStepPointer          timeStep;
+    fusedStepPointer         fusedStep = NULL;
+    tiledStepPointer         tiledStep = NULL;
+    boundaryRowPointer       set_boundary_row;
     boundaryConditionPointer set_boundary_conditions;
 
-    if(isgs==1)                 /* ==Symmetric Gauss Seidel== */
-    {
-        iterationStep = &GS_iteration;
-    }
-    else if(isgs==0)             /* ==Point Jacobi== */
+    /* ==Symmetric Gauss Seidel or Point Jacobi, specialized for the grid size when possible== */
+    pointJacobiVector = select_point_Jacobi( true, false );
+    pointJacobiVectorNoSource = select_point_Jacobi( false, false );
+    if(idual==1) pointJacobiVectorDual = select_point_Jacobi( true, true );
+    iterationStep = select_iteration_step( inewton==1 || idual==1 );    /* Shifted source of the NK preconditioner, BDF part */
+    timeStep = select_time_step( false );
+
+    /* ==Fused point Jacobi: one sweep per iteration (ifused = 2 also runs the unfused one)== */
+    if(ifused!=0)
     {
-        iterationStep = &PJ_iteration;
+        fusedStep = select_fused_step();
     }
-    else
+
+    /* ==Temporally tiled point Jacobi: ktile fused iterations per pass (ifused = 1)== */
+    if(ktile>1)
     {
-        printf("ERROR: isgs must equal 0 or 1!\n");
-        exit (0);  
+        tiledStep = select_tiled_step();
+        tile_buffer_setup( jmax );
     }
       
     if(imms==0) 
     {
             set_boundary_conditions = &bndry;
+            set_boundary_row = &bndry_row;
     }
     else if(imms==1)
         {
             set_boundary_conditions = &bndrymms;
+            set_boundary_row = &bndrymms_row;
         }
         else
         {
             printf("ERROR: imms must equal 0 or 1!\n");
-            exit (0);
+            exit (EXIT_FAILED);
         }
 
     /*-------End Set Function Pointers-------------------------------*/
@@ -1510,77 +9498,350 @@ int main()
     //$$$$$$ fprintf(fp6, "I= %d J= %d\n",imax, jmax);
     //$$$$$$ fprintf(fp6, "DATAPACKING=POINT\n");
 
-    /* Set derived input quantities */
-    set_derived_inputs();
-
     /* Set up headers for output files */
     output_file_headers();
 
+    /* Background writer for the solution and restart files (iasync = 1) */
+    restart_buffer_setup( imax, jmax );
+    start_output_writer();
+
+    /* Live monitor file and thread (ilive = 1) */
+    start_live_monitor();
+
+    /* Grid sequencing: solve the coarser grids loosely, the run then starts from the prolonged solution */
+    if(igridseq==1)
+    {
+        grid_sequencing_start( set_boundary_conditions );
+    }
+
     /* Set Initial Profile for u vector */
-    initial( ninit, rtime, resinit, u, src );   
+    initial( ninit, rtime, dtmin, resinit, u, src );   
 
-    /* Set Boundary Conditions for u */
-    set_boundary_conditions( u );
+    /* Set Boundary Conditions for u (a restart file already holds them: its wall pressures */
+    /* were extrapolated before the pressure rescaling, so redoing it would not be exact)    */
+    if(irstr==0)
+    {
+        set_boundary_conditions( u );
+    }
 
     /* Write out inital conditions to solution file */
-    write_output(ninit, u, dt, resinit, rtime);
+    write_output(ninit, u, resinit, rtime, dtmin);
      
     /* Evaluate Source Terms Once at Beginning */
     /*(only interior points; will be zero for standard cavity) */
     compute_source_terms( src );
 
+    /* Multigrid: build the coarse levels, and the main loop then does one cycle per iteration */
+    if(img==1)
+    {
+        mg_setup( u, uold, src, viscx, viscy, dt );
+        if(ifmg==1 && irstr==0)
+        {
+            mg_full_multigrid_start( set_boundary_conditions );
+        }
+        iterationStep = &MG_iteration;
+    }
+    else if(img!=0)
+    {
+        printf("ERROR: img must equal 0 or 1!\n");
+        exit (EXIT_FAILED);
+    }
+
+    /* Newton-Krylov: one Newton step per iteration, the isgs iteration becomes the preconditioner */
+    if(inewton==1)
+    {
+        nk_setup();
+        nkPreconditioner = iterationStep;
+        iterationStep = &NK_iteration;
+    }
+
+    /* Residual smoothing: each update of the iteration is smoothed before it is applied */
+    if(irsmooth==1)
+    {
+        rs_setup();
+        if(rsepsilon>zero)
+        {
+            rsInner = iterationStep;
+            iterationStep = &RS_iteration;
+        }
+    }
+
+    /* Anderson acceleration: each iteration is extrapolated from the last aadepth ones */
+    if(iaa==1)
+    {
+        aa_setup();
+        aaInner = iterationStep;
+        iterationStep = &AA_iteration;
+    }
+
+    /* Dual time stepping: the main loop iterations become the sub-iterations of physical steps */
+    if(idual==1)
+    {
+        dual_start( u, src, set_boundary_conditions, rtime );
+    }
+
+    /* Device point Jacobi: the arrays stay on the device until the end of the run */
+    if(igpu==1)
+    {
+        device_start( u, uold, src, dt );
+    }
+
+    /* Mixed precision: float iterations until the residual stalls, then the main loop in double */
+    nstart = ninit;
+    if(imixed==1)
+    {
+        nstart = mixed_precision_start( ninit, rtime, dtmin, resinit, convmin, u, src ) + 1;
+    }
+
+    /* Lazy pressure rescaling: the wall velocities are set once, in both arrays (point   */
+    /* Jacobi swaps them), and each iteration only extrapolates the wall pressures. The   */
+    /* time step, artificial viscosity and update only see pressure differences, so the   */
+    /* pressure level is left to drift and u is rescaled only when it is written          */
+    if(ilazyp==1)
+    {
+        uold.copyData( u );
+        set_boundary_conditions = &bndry_pressure;
+    }
+
     /*========== Main Loop ==========*/
-    for (n = ninit; n<= nmax; n++)
+    for (n = nstart; n<= nmax; n++)
     {
-        /* Calculate time step */  
-        compute_time_step( u, dt, dtmin );
+        /* Residuals, convergence and divergence checks every nmonitor iterations, on residual */
+        /* output iterations, and every iteration when checking the fused kernel or ending   */
+        /* physical steps by their sub-iteration convergence                                  */
+        monitor = ((n%nmonitor)==0) || ((n%residualOut)==0) || (n==ninit) || (n==nmax) || (ifused==2) || (idual==1);
+
+        if(tiledStep!=NULL)
+        {
+            /* Up to ktile iterations in one pass. A pass always ends on an iteration that */
+            /* writes residuals or the solution, and the first iteration is a pass of its own */
+            nlev = min(ktile, nmax - n + 1);
+            nlev = min(nlev, (residualOut - n%residualOut)%residualOut + 1);
+            nlev = min(nlev, (iterout - n%iterout)%iterout + 1);
+            if(n==ninit) nlev = 1;
+
+            for(int t=0; t<nlev; t++)
+            {
+                dtlev[t] = dtmin;
+            }
+            INSTR_TIME(STAGE_ITERATION, tiledStep( set_boundary_row, u, uold, src, dt, nlev, res, dtlev ));
+
+            /* Update the time (dtmin is the running minimum), and skip to the last iteration of the pass */
+            for(int t=0; t<nlev; t++)
+            {
+                dtmin = min(dtmin, dtlev[t]);
+                rtime += dtmin;
+            }
+            n += nlev - 1;
+
+            /* Normalize and write the iterative residuals (of the last iteration), computed by every pass */
+            monitor = true;
+            INSTR_TIME(STAGE_RESIDUAL, report_iterative_convergence(n, res, resinit, ninit, rtime, dtmin, conv));
+        }
+        else if(igpu==1)
+        {
+            /* Time step, iteration, pressure rescaling and residuals on the device */
+            INSTR_TIME(STAGE_ITERATION, PJ_device_iteration( u, uold, src, dt, monitor, res, dtmin ));
+
+            /* Update the time */
+            rtime += dtmin;
+
+            /* Normalize and write the iterative residuals (summed on the device) */
+            if(monitor)
+            {
+                report_iterative_convergence(n, res, resinit, ninit, rtime, dtmin, conv);
+            }
+        }
+        else if(ifused==1)
+        {
+            /* Time step, iteration, pressure rescaling and residuals in one sweep */
+            INSTR_TIME(STAGE_ITERATION, fusedStep( set_boundary_conditions, u, uold, src, res, dtmin ));
+
+            /* Update the time */
+            rtime += dtmin;
+
+            /* Normalize and write the iterative residuals (the sums come with the sweep) */
+            if(monitor)
+            {
+                report_iterative_convergence(n, res, resinit, ninit, rtime, dtmin, conv);
+            }
+        }
+        else
+        {
+            /* Fused kernel check: start the fused step from the same state */
+            if(ifused==2)
+            {
+                ucheck.copyData( u );
+                dtcheck = dtmin;
+            }
+
+            /* Calculate time step */  
+            INSTR_TIME(STAGE_TIMESTEP, timeStep( u, dt, dtmin ));
            
-        /* Perform main iteration step (point jacobi or gauss seidel)*/    
-        iterationStep( set_boundary_conditions, u, uold, src, viscx, viscy, dt ); 
+            /* Perform main iteration step (point jacobi or gauss seidel)*/    
+            INSTR_TIME(STAGE_ITERATION, iterationStep( set_boundary_conditions, u, uold, src, viscx, viscy, dt )); 
 
-        /* Pressure Rescaling (based on center point) */
-        pressure_rescaling( u );
+            /* Pressure Rescaling (based on center point), with ilazyp = 1 only before output */
+            if(ilazyp==0)
+            {
+                INSTR_TIME(STAGE_RESCALE, pressure_rescaling( u ));
+            }
 
-        /* Update the time */
-        rtime += dtmin;
+            /* Update the time (with idual = 1 rtime is the physical time of the step) */
+            if(idual==0) rtime += dtmin;
+
+            /* Check iterative convergence using L2 norms of iterative residuals (skipped between monitor iterations) */
+            if(monitor && (iresmon==1 || inewton==1))
+            {
+                /* True steady residual at u (Newton steps are not pseudo-time steps, so always for NK) */
+                INSTR_TIME(STAGE_RESIDUAL, steady_residual_sums(u, viscx, viscy, dt, src, rsteady, res));
+                report_iterative_convergence(n, res, resinit, ninit, rtime, dtmin, conv);
+            }
+            else if(monitor && iaa==1)
+            {
+                /* The extrapolated step is no residual: (G(u) - u)/dt of the accelerated iteration */
+                INSTR_TIME(STAGE_RESIDUAL, aa_residual_sums(dt, res));
+                report_iterative_convergence(n, res, resinit, ninit, rtime, dtmin, conv);
+            }
+            else if(monitor)
+            {
+                INSTR_TIME(STAGE_RESIDUAL, check_iterative_convergence(n, u, uold, dt, res, resinit, ninit, rtime, dtmin, conv));
+            }
+
+            if(ifused==2)
+            {
+                fusedStep( set_boundary_conditions, ucheck, ucheckold, src, rescheck, dtcheck );
+                if(dtcheck!=dtmin)
+                {
+                    printf("ERROR: fused and unfused time steps differ at iteration %d!\n", n);
+                    exit (EXIT_FAILED);
+                }
+                compare_fused_step( u, ucheck, res, rescheck, resinit, diffcheck );
+            }
+        }
 
-        /* Check iterative convergence using L2 norms of iterative residuals */
-        check_iterative_convergence(n, u, uold, dt, res, resinit, ninit, rtime, dtmin, conv);
+        /* Live monitor: residuals and a downsampled u for the viewer, every liveevery iterations */
+        if(ilive==1 && n>=livenext)
+        {
+            live_publish(n, u, res, rtime, conv, false);
+        }
 
-        if(conv<toler) 
+        if(monitor)
         {
-            fprintf(fp1, "%d %e %e %e %e\n",n, rtime, res[0], res[1], res[2]);
-                goto converged;
+            /* Stop with exit status EXIT_DIVERGED on NaN/Inf or fast growing residuals */
+            check_divergence(n, res, ninit, rtime, conv, convmin);
+
+            if(idual==1)
+            {
+                /* End of a physical step: record it, then stop after the last one or start */
+                /* the next (the divergence check starts over with each step)               */
+                if(dual_step_converged(conv))
+                {
+                    dual_end_step(n, u, conv);
+                    if(dual.step==nphys)
+                    {
+                        fprintf(fp1, "%d %e %e %e %e\n",n, rtime, res[0], res[1], res[2]);
+                        goto converged;
+                    }
+                    if(dualout>0 && (dual.step%dualout)==0)
+                    {
+                        INSTR_TIME(STAGE_OUTPUT, write_output(n, u, resinit, rtime, dtmin));
+                    }
+                    dual_next_step(u, src, set_boundary_conditions, rtime);
+                    convmin = 1.0e99;
+                }
+            }
+            else if(conv<toler) 
+            {
+                fprintf(fp1, "%d %e %e %e %e\n",n, rtime, res[0], res[1], res[2]);
+                    goto converged;
+            }
         }
             
-        /* Output solution and restart file every 'iterout' steps */
-        if( ((n%iterout)==0) ) 
+        /* Output solution and restart file every 'iterout' steps (every dualout physical steps instead if set) */
+        if( ((n%iterout)==0) && (idual==0 || dualout==0) ) 
         {
-                write_output(n, u, dt, resinit, rtime);
+                if(igpu==1) device_update_host( u );
+                if(ilazyp==1) INSTR_TIME(STAGE_RESCALE, pressure_rescaling( u ));
+                INSTR_TIME(STAGE_OUTPUT, write_output(n, u, resinit, rtime, dtmin));
         }
+
+        /* Instrumentation: one metrics record every nmetrics iterations */
+        INSTR_ITERATION(n);
         
     }  /* ========== End Main Loop ========== */
 
     printf("\nSolver stopped in %d iterations because the specified maximum number of timesteps was exceeded.\n", nmax);
+    n = nmax;   /* Last completed iteration (the loop leaves n = nmax+1), so a restart continues at nmax+1 */
         
     goto notconverged;
         
 converged:  /* go here once solution is converged */
 
-    printf("\nSolver stopped in %d iterations because the convergence criteria was met OR because the solution diverged.\n", n);
-    printf("   Solution divergence is indicated by inf or NaN residuals.\n", n);
+    if(idual==1)
+        printf("\nSolver stopped in %d iterations after the last physical step (t = %e s).\n", n, rtime);
+    else
+        printf("\nSolver stopped in %d iterations because the convergence criteria was met.\n", n);
     
 notconverged:
 
+    /* Lazy pressure rescaling: the final solution, its error norms and restart file need the pressure level */
+    if(ilazyp==1)
+    {
+        pressure_rescaling( u );
+    }
+
+    /* Live monitor: the final state, and the run marked as finished */
+    if(ilive==1)
+    {
+        live_publish(n, u, res, rtime, conv, true);
+        end_live_monitor(LIVE_DONE);
+    }
+
+    if(igpu==1)
+    {
+        device_finish( u, uold, src, dt );
+    }
+    if(img==1)
+    {
+        printf("Multigrid: %d levels, %f work units\n", nlevels, mgwork);
+    }
+    if(inewton==1)
+    {
+        printf("Newton-Krylov: %d Krylov iterations, %d preconditioner iterations\n", nkiters, nksweeps);
+    }
+    if(iaa==1)
+    {
+        printf("Anderson acceleration: depth %d, %d iterations per step, %d safeguard restart(s)\n", aadepth, aasteps, aarestarts);
+    }
+    if(idual==1)
+    {
+        dual_finish( n );
+    }
+    if(ifused==2)
+    {
+        printf("Fused kernel check: max difference %e (interior), %e (boundary), %e (residuals)\n",
+               diffcheck[0], diffcheck[1], diffcheck[2]);
+    }
+
     /* Calculate and Write Out Discretization Error Norms (will do this for MMS only) */
-    Discretization_Error_Norms( u );
+    if(imms==1)
+    {
+        Discretization_Error_Norms( u, rL1norm, rL2norm, rLinfnorm );
+        write_error_norms( rL1norm, rL2norm, rLinfnorm );
+    }
 
-    /* Output solution and restart file */
-    write_output(n, u, dt, resinit, rtime);
+    /* Output solution and restart file, and wait until everything is written */
+    write_output(n, u, resinit, rtime, dtmin);
+    finish_output_writer();
+#ifdef INSTRUMENT
+    metrics_finish( n );
+#endif
+    printf("Workspace: %.1f MB peak in %d block(s)\n", (double)workspace.peak_bytes()/1048576.0, workspace.nblocks());
 
     /* Close open files */
     fclose(fp1);
-    fclose(fp2);
+    if(fp2!=NULL) fclose(fp2);
     //$$$$$$   fclose(fp6); /* Uncomment for debug output */
 
     return 0;
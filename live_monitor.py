@@ -0,0 +1,112 @@
+#!/usr/bin/env python3
+"""Live viewer for DrivenCavity runs with ilive=1.
+
+    python3 live_monitor.py [live.bin | run directory] [--plot] [--interval s]
+
+Prints each new residual record of the run, and the largest velocity below
+the lid on the downsampled grid, until the run ends. --plot shows the
+velocity magnitude and the residual history with matplotlib instead. Only
+the standard library is needed for the text mode. The file layout is
+described in the README (Live monitor).
+"""
+
+import argparse
+import mmap
+import os
+import struct
+import sys
+import time
+
+HEADER = struct.Struct("<8s6iQqd3ddd")     # LiveHeader, 96 bytes
+STATUS = {1: "running", 2: "finished", 3: "aborted"}
+
+
+def snapshot(mm):
+    """Consistent copy of the file: retry while the solver's monitor thread is writing."""
+    while True:
+        seq = struct.unpack_from("<Q", mm, 32)[0]
+        if seq % 2 == 0:
+            data = mm[:]
+            if struct.unpack_from("<Q", mm, 32)[0] == seq:
+                return data
+        time.sleep(0.001)
+
+
+def parse(data):
+    (magic, ni, nj, nvar, status, nhist, nrec, seq, n, rtime,
+     r0, r1, r2, conv, _) = HEADER.unpack_from(data, 0)
+    if magic != b"CAVLIVE1":
+        sys.exit("not a live monitor file")
+    off = HEADER.size
+    hist = struct.unpack_from("<%dd" % (4*nhist), data, off)
+    off += 8*4*nhist
+    coord = struct.unpack_from("<%df" % (ni + nj), data, off)
+    off += 4*(ni + nj)
+    field = struct.unpack_from("<%df" % (nvar*ni*nj), data, off)
+    records = [hist[4*(r % nhist):4*(r % nhist) + 4] for r in range(max(0, nrec - nhist), nrec)]
+    return dict(ni=ni, nj=nj, status=status, nrec=nrec, n=n, rtime=rtime,
+                res=(r0, r1, r2), conv=conv, x=coord[:ni], y=coord[ni:],
+                field=field, records=records)
+
+
+def speed(s):
+    """|V| on the downsampled grid, rows j (the last row is the lid)."""
+    ni, nj, f = s["ni"], s["nj"], s["field"]
+    return [[(f[ni*nj + i*nj + j]**2 + f[2*ni*nj + i*nj + j]**2)**0.5 for i in range(ni)] for j in range(nj)]
+
+
+def text_mode(mm, interval):
+    shown = 0
+    while True:
+        s = parse(snapshot(mm))
+        for rec in s["records"][max(0, len(s["records"]) - (s["nrec"] - shown)):]:
+            print("%8d   %e   %e   %e" % (int(rec[0]), rec[1], rec[2], rec[3]))
+        if s["nrec"] > shown:
+            vmax = max(max(row) for row in speed(s)[:-1])
+            print("          iteration %d, t = %e s, max |V| below the lid = %f m/s" % (s["n"], s["rtime"], vmax))
+        shown = s["nrec"]
+        if s["status"] != 1:
+            print("run %s" % STATUS.get(s["status"], "?"))
+            return
+        time.sleep(interval)
+
+
+def plot_mode(mm, interval):
+    import matplotlib.pyplot as plt
+    fig, (ax0, ax1) = plt.subplots(1, 2, figsize=(11, 4.5))
+    while True:
+        s = parse(snapshot(mm))
+        ax0.clear()
+        ax0.pcolormesh(s["x"], s["y"], speed(s), shading="auto")
+        ax0.set_aspect("equal")
+        ax0.set_title("|V|, iteration %d (%s)" % (s["n"], STATUS.get(s["status"], "?")))
+        ax1.clear()
+        if s["records"]:
+            its = [r[0] for r in s["records"]]
+            for k, name in enumerate(("continuity", "x-momentum", "y-momentum")):
+                ax1.semilogy(its, [r[1 + k] for r in s["records"]], label=name)
+            ax1.legend()
+        ax1.set_xlabel("iteration")
+        plt.pause(interval)
+        if s["status"] != 1:
+            plt.show()
+            return
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Live viewer for DrivenCavity runs with ilive=1")
+    parser.add_argument("path", nargs="?", default="live.bin", help="live.bin, or the run directory")
+    parser.add_argument("--plot", action="store_true", help="plot with matplotlib")
+    parser.add_argument("--interval", type=float, default=0.5, help="seconds between refreshes")
+    opt = parser.parse_args()
+    path = os.path.join(opt.path, "live.bin") if os.path.isdir(opt.path) else opt.path
+    with open(path, "rb") as fp:
+        mm = mmap.mmap(fp.fileno(), 0, access=mmap.ACCESS_READ)
+        if opt.plot:
+            plot_mode(mm, opt.interval)
+        else:
+            text_mode(mm, opt.interval)
+
+
+if __name__ == "__main__":
+    main()
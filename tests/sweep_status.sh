@@ -0,0 +1,30 @@
+#!/bin/sh
+# Exit status of --sweep when a case fails:   tests/sweep_status.sh [./DrivenCavity]
+# One case runs normally, the other fails on purpose (irstr = 1 without a restart.in).
+# The sweep must print the failed case and exit with status 1.
+
+exe=$(cd "$(dirname "${1:-./DrivenCavity}")" && pwd)/$(basename "${1:-./DrivenCavity}")
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+cd "$tmp" || exit 1
+
+cat > cases.txt <<EOF
+good     imax=17 jmax=17 nmax=20 iterout=20
+norestart imax=17 jmax=17 nmax=20 irstr=1
+EOF
+
+"$exe" --sweep cases.txt > sweep.log 2>&1
+status=$?
+
+fail=0
+if [ $status -ne 1 ]; then
+    echo "FAIL: sweep exit status $status, expected 1"; fail=1
+fi
+if ! grep -q "finished norestart .*failed" sweep.log; then
+    echo "FAIL: case 'norestart' not reported as failed"; fail=1
+fi
+if ! grep -q "finished good .* ok" sweep.log; then
+    echo "FAIL: case 'good' not reported as ok"; fail=1
+fi
+[ $fail -ne 0 ] && cat sweep.log && exit 1
+echo "sweep_status: ok"
@@ -0,0 +1,27 @@
+#!/bin/sh
+# Exit status of --verify when a level fails:   tests/verify_status.sh [./DrivenCavity]
+# The 33 x 33 level fails on purpose: a directory in place of its restart.out makes the
+# restart write stop with an error. The study must report the failed level, leave it out
+# of verify.dat (and the Richardson extrapolation) and exit with status 1.
+
+exe=$(cd "$(dirname "${1:-./DrivenCavity}")" && pwd)/$(basename "${1:-./DrivenCavity}")
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+cd "$tmp" || exit 1
+
+mkdir -p verify_33/restart.out/keep
+"$exe" --verify imms=1 verifymin=17 verifylevels=2 cfl=0.5 nmax=200 > verify.log 2>&1
+status=$?
+
+fail=0
+if [ $status -ne 1 ]; then
+    echo "FAIL: verification exit status $status, expected 1"; fail=1
+fi
+if ! grep -q 'finished verify_17 .* ok' verify.log || ! grep -q 'finished verify_33 .*failed' verify.log; then
+    echo "FAIL: levels not reported as verify_17 ok, verify_33 failed"; fail=1
+fi
+if grep -q '^33 ' verify.dat || grep -qi 'richardson' verify.dat; then
+    echo "FAIL: the failed level is used in verify.dat"; fail=1
+fi
+[ $fail -ne 0 ] && cat verify.log && exit 1
+echo "verify_status: ok"